@@ -6,6 +6,9 @@ constexpr unsigned int PLATFORM = 0;
 // Screen size:
 constexpr int WIDTH = 1280;
 constexpr int HEIGHT = 720;
+// Simulation grid = screen size / GRID_DOWNSCALE (2 or 4 divide the cost by 4 or 16),
+// the density is upscaled with a bilinear filter to fill the window
+constexpr int GRID_DOWNSCALE = 1;
 // Fluid properties
 constexpr auto DIFF_DENSITY = 0.000001f;
 constexpr auto VISCO = 0.00001f;
@@ -14,5 +17,38 @@ constexpr auto FULLSCREEN = false;
 
 constexpr unsigned int SOLVER_NB_ITERATIONS = 16;
 
+// Tiled diffuse: Jacobi iterations fused in one launch (1 = one launch of "diffuse" per iteration)
+// and size of the work group tiles, the local memory holds 3*(TILE+2*FUSED)^2 floats
+constexpr unsigned int DIFFUSE_FUSED_ITERATIONS = 4;
+constexpr unsigned int DIFFUSE_TILE_WIDTH = 16;
+constexpr unsigned int DIFFUSE_TILE_HEIGHT = 16;
+
+// Fused velocity step: one launch advects u and v and computes their divergence (on DIFFUSE_TILE tiles),
+// one launch subtracts the pressure gradient and advects the density (false = the separate kernels)
+constexpr bool FUSED_VELOCITY_KERNELS = true;
+
+// Sparse tiles (set_sparse_tiles, --sparse): density and velocity below which a DIFFUSE_TILE tile is empty
+// (it is then skipped by the kernels and its cells are reset once its neighbours are empty too)
+constexpr float SPARSE_TILE_THRESHOLD = 1e-4f;
+
+// Sources (add_pressure, add_velocity, add_splat) applied by one launch per step: above SPLAT_BINNING_THRESHOLD
+// splats they are binned by tiles of SPLAT_TILE_SIZE^2 cells, each cell only testing the splats of its tile
+constexpr int SPLAT_BINNING_THRESHOLD = 32;
+constexpr int SPLAT_TILE_SIZE = 16;
+
+// Staging images of the asynchronous frame readback (>= 2), 3 lets the display lag one frame without stalling
+constexpr unsigned int READBACK_SLOTS = 3;
+
+// Threads of the CPU engine (--cpu), 0 = every hardware thread
+constexpr unsigned int CPU_THREADS = 0;
+
+// Simulation thread: fixed time step of the solver and steps run at most between two frames
+// (beyond, the simulated time slows down)
+constexpr float SIMULATION_DT = 1.0f / 60.0f;
+constexpr unsigned int SIMULATION_MAX_SUBSTEPS = 4;
+
+// Work-group tuning (--tune): updates run while the local sizes of their launches are timed
+constexpr unsigned int WORK_GROUP_TUNING_STEPS = 3;
+
 
 #endif
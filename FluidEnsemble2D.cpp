@@ -0,0 +1,348 @@
+#include "FluidEnsemble2D.h"
+#include "Config.h"
+#include "PressureSolver.hpp"
+#include "ProgramCache.hpp"
+#ifdef FLUID_EMBEDDED_KERNELS
+#include "core_cl_2d.h"
+#define CORE_CL_SOURCE core_cl_2d, sizeof(core_cl_2d)
+#else
+#define CORE_CL_SOURCE nullptr, 0
+#endif
+
+#include <algorithm>
+#include <iostream>
+
+using namespace std;
+
+FluidEnsemble2D::FluidEnsemble2D(int width, int height, const std::vector<MemberParameters> & members) :
+	width(width), height(height), nb_members((int)members.size()), member_size((size_t)width*height), parameters(members)
+{
+	origin_work = cl::NDRange(0, 0, 0);
+	region_work = cl::NDRange(width, height, nb_members);
+
+	origin_work_center = cl::NDRange(1, 1, 0);
+	region_work_center = cl::NDRange(width - 2, height - 2, nb_members);
+}
+
+FluidEnsemble2D::~FluidEnsemble2D()
+{
+	queue.finish();
+}
+
+void FluidEnsemble2D::initialization()
+{
+	if (nb_members == 0) {
+		cout << " The ensemble has no member\n";
+		exit(1);
+	}
+	cl_init();
+	program_init();
+}
+
+void FluidEnsemble2D::cl_init()
+{
+	vector<cl::Platform> all_platforms;
+	cl::Platform::get(&all_platforms);
+	if (all_platforms.size() == 0) {
+		cout << " No platforms found. Check OpenCL installation!\n";
+		exit(1);
+	}
+	auto id_platform = PLATFORM;
+	if (id_platform >= all_platforms.size()) {
+		cout << " Warning: Default platform used (Wrong configuration)\n";
+		id_platform = 0;
+	}
+	cl::Platform default_platform = all_platforms[id_platform];
+	vector<cl::Device> all_devices;
+	default_platform.getDevices(CL_DEVICE_TYPE_ALL, &all_devices);
+	if (all_devices.size() == 0) {
+		cout << " No devices found. Check OpenCL installation!\n";
+		exit(1);
+	}
+	default_device = all_devices[0];
+	cout << "Using device: " << default_device.getInfo<CL_DEVICE_NAME>() << " (ensemble of " << nb_members << " members)\n";
+
+	context = cl::Context({ default_device });
+	queue = cl::CommandQueue(context, default_device, profiler.queueProperties());
+
+	// same program and build options as FluidSolver, they share the cache entry
+	const string cl_string = ProgramCache::loadSource(CORE_CL_SOURCE, "core.cl");
+	const string options = "-D DIFFUSE_TILE_W=" + to_string(DIFFUSE_TILE_WIDTH)
+		+ " -D DIFFUSE_TILE_H=" + to_string(DIFFUSE_TILE_HEIGHT)
+		+ " -D DIFFUSE_FUSED=" + to_string(DIFFUSE_FUSED_ITERATIONS) + " -D RELAX_GROUP=" + to_string(RELAX_GROUP);
+	if (!ProgramCache::build(context, default_device, cl_string, options, program)) {
+		exit(1);
+	}
+}
+
+void FluidEnsemble2D::program_init()
+{
+	kernel_coefficients = cl::Kernel(program, "ens_coefficients");
+	kernel_jacobi       = cl::Kernel(program, "ens_jacobi");
+	kernel_advect       = cl::Kernel(program, "ens_advect");
+	kernel_project1     = cl::Kernel(program, "ens_project1");
+	kernel_project2     = cl::Kernel(program, "ens_project2");
+	kernel_splat        = cl::Kernel(program, "ens_splat_sources");
+	kernel_reset        = cl::Kernel(program, "ens_reset");
+	kernel_draw         = cl::Kernel(program, "ens_draw");
+
+	// nominal global memory traffic of a work item
+	profiler.setBytesPerItem("ens_jacobi", 28);
+	profiler.setBytesPerItem("ens_advect", 28);
+	profiler.setBytesPerItem("ens_project1", 20);
+	profiler.setBytesPerItem("ens_project2", 32);
+	profiler.setBytesPerItem("ens_splat_sources", 24);// every cell of the box reads and writes the three fields
+	profiler.setBytesPerItem("ens_reset", 4);
+
+	const size_t field_bytes = member_size*nb_members * sizeof(float);
+	cl::Buffer* fields[] = { &density_in, &density_out, &u_in, &u_out, &v_in, &v_out, &tmp_project1, &tmp_project2, &jacobi_tmp };
+	for (auto field : fields) {
+		*field = cl::Buffer(context, CL_MEM_READ_WRITE, field_bytes);
+		reset_buffer(*field);
+	}
+	const size_t coef_bytes = nb_members * 2 * sizeof(float);
+	buffer_parameters = cl::Buffer(context, CL_MEM_READ_ONLY, coef_bytes);
+	coef_visc = cl::Buffer(context, CL_MEM_READ_WRITE, coef_bytes);
+	coef_diff = cl::Buffer(context, CL_MEM_READ_WRITE, coef_bytes);
+	// the pressure equation 4p - (sum of the 4 neighbours) = div is the same for every member
+	vector<float> poisson(nb_members * 2);
+	for (int m = 0; m < nb_members; ++m) {
+		poisson[2 * m] = 1.0f;
+		poisson[2 * m + 1] = 4.0f;
+	}
+	coef_poisson = cl::Buffer(context, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR, coef_bytes, poisson.data());
+	parameters_changed = true;
+}
+
+void FluidEnsemble2D::reset_buffer(cl::Buffer & buffer)
+{
+	kernel_reset.setArg(0, buffer);
+	profiler.enqueueKernel(queue, kernel_reset, cl::NDRange(0), cl::NDRange(member_size*nb_members), cl::NullRange);
+}
+
+void FluidEnsemble2D::add_source(int member, int x, int y, int radius, float density, float dx, float dy)
+{
+	// same disc as FluidSolver::add_splat, the layers are the members receiving it
+	Splat splat = {};
+	splat.x = (float)x;
+	splat.y = (float)y;
+	splat.reach = (float)radius - 0.5f;
+	splat.x0 = (float)max(1, x - radius);
+	splat.y0 = (float)max(1, y - radius);
+	splat.x1 = (float)min(width, x + radius);
+	splat.y1 = (float)min(height, y + radius);
+	splat.z0 = (member == ALL_MEMBERS) ? 0.0f : (float)member;
+	splat.z1 = (member == ALL_MEMBERS) ? (float)nb_members : (float)(member + 1);
+	splat.density = density;
+	splat.velocity = (dx != 0.0f || dy != 0.0f) ? 1.0f : 0.0f;
+	splat.dx = dx;
+	splat.dy = dy;
+	splats.add(splat);
+}
+
+void FluidEnsemble2D::add_pressure(int member, int x, int y, int radius, float intensity)
+{
+	add_source(member, x, y, radius, intensity, 0.0f, 0.0f);
+}
+
+void FluidEnsemble2D::add_velocity(int member, int x, int y, float dx, float dy, float force, int radius)
+{
+	add_source(member, x, y, radius, 0.0f, dx*force, dy*force);
+}
+
+void FluidEnsemble2D::flush_splats()
+{
+	if (splats.empty()) {
+		return;
+	}
+	const cl::NDRange origin_splats(splats.begin(0), splats.begin(1), splats.begin(2));
+	const cl::NDRange region_splats(splats.end(0) - splats.begin(0), splats.end(1) - splats.begin(1),
+		splats.end(2) - splats.begin(2));
+	splats.upload(context, queue, SPLAT_BINNING_THRESHOLD, SPLAT_TILE_SIZE);
+	profiler.record("writeSplats", splats.uploadEvent(), splats.uploadedSize() * sizeof(Splat));
+	kernel_splat.setArg(0, density_in);
+	kernel_splat.setArg(1, u_in);
+	kernel_splat.setArg(2, v_in);
+	kernel_splat.setArg(3, splats.splatBuffer());
+	kernel_splat.setArg(4, splats.uploadedSize());
+	kernel_splat.setArg(5, splats.offsetBuffer());
+	kernel_splat.setArg(6, splats.indexBuffer());
+	kernel_splat.setArg(7, splats.tileSize());
+	kernel_splat.setArg(8, splats.tilesX());
+	kernel_splat.setArg(9, width);
+	kernel_splat.setArg(10, height);
+	profiler.enqueueKernel(queue, kernel_splat, origin_splats, region_splats, cl::NullRange);
+}
+
+void FluidEnsemble2D::set_parameters(int member, const MemberParameters & member_parameters)
+{
+	parameters[member] = member_parameters;
+	parameters_changed = true;
+}
+
+void FluidEnsemble2D::update(float dt)
+{
+	if (dt > 0.02f) { // clamp update rate else the error is too high
+		dt = 0.02f;
+	}
+	flush_splats();
+	if (parameters_changed) {
+		vector<float> values(nb_members * 2);
+		for (int m = 0; m < nb_members; ++m) {
+			values[2 * m] = parameters[m].viscosity;
+			values[2 * m + 1] = parameters[m].diffusion;
+		}
+		queue.enqueueWriteBuffer(buffer_parameters, CL_TRUE, 0, values.size() * sizeof(float), values.data());
+		parameters_changed = false;
+	}
+	// the coefficients of the density depend on dt: computed on the device for every member
+	kernel_coefficients.setArg(0, buffer_parameters);
+	kernel_coefficients.setArg(1, coef_visc);
+	kernel_coefficients.setArg(2, coef_diff);
+	kernel_coefficients.setArg(3, dt);
+	kernel_coefficients.setArg(4, width);
+	kernel_coefficients.setArg(5, height);
+	profiler.enqueueKernel(queue, kernel_coefficients, cl::NDRange(0), cl::NDRange(nb_members), cl::NullRange);
+
+	// same sequence as FluidSolver::update
+	// velocity -----------------------
+	jacobi(u_out, u_in, coef_visc);
+	jacobi(v_out, v_in, coef_visc);
+
+	project(u_out, v_out, u_in, v_in);
+
+	advect(u_out, u_in, u_in, v_in, dt);
+	advect(v_out, v_in, u_in, v_in, dt);
+
+	project(u_out, v_out, u_in, v_in);
+
+	// density ------------------------
+	jacobi(density_out, density_in, coef_diff);
+	advect(density_in, density_out, u_in, v_in, dt);
+}
+
+void FluidEnsemble2D::jacobi(cl::Buffer & input_output, const cl::Buffer & src, const cl::Buffer & coefs)
+{
+	// the handles are swapped so input_output holds the result at the end
+	kernel_jacobi.setArg(2, src);
+	kernel_jacobi.setArg(3, coefs);
+	kernel_jacobi.setArg(4, width);
+	kernel_jacobi.setArg(5, height);
+	for (unsigned int k = 0; k < SOLVER_NB_ITERATIONS; ++k) {
+		kernel_jacobi.setArg(0, input_output);
+		kernel_jacobi.setArg(1, jacobi_tmp);
+		profiler.enqueueKernel(queue, kernel_jacobi, origin_work, region_work, cl::NullRange);
+		swap(input_output, jacobi_tmp);
+	}
+}
+
+void FluidEnsemble2D::advect(cl::Buffer & dest, const cl::Buffer & src, const cl::Buffer & field_u, const cl::Buffer & field_v, float dt)
+{
+	kernel_advect.setArg(0, src);
+	kernel_advect.setArg(1, dest);
+	kernel_advect.setArg(2, field_u);
+	kernel_advect.setArg(3, field_v);
+	kernel_advect.setArg(4, dt);
+	kernel_advect.setArg(5, width);
+	kernel_advect.setArg(6, height);
+	profiler.enqueueKernel(queue, kernel_advect, origin_work_center, region_work_center, cl::NullRange);
+}
+
+void FluidEnsemble2D::project(const cl::Buffer & field_u, const cl::Buffer & field_v, cl::Buffer & out_u, cl::Buffer & out_v)
+{
+	kernel_project1.setArg(0, tmp_project1);
+	kernel_project1.setArg(1, field_u);
+	kernel_project1.setArg(2, field_v);
+	kernel_project1.setArg(3, 1.0f / width);
+	kernel_project1.setArg(4, 1.0f / height);
+	kernel_project1.setArg(5, width);
+	kernel_project1.setArg(6, height);
+	profiler.enqueueKernel(queue, kernel_project1, origin_work_center, region_work_center, cl::NullRange);
+
+	reset_buffer(tmp_project2);
+	jacobi(tmp_project2, tmp_project1, coef_poisson);
+
+	kernel_project2.setArg(0, tmp_project2);
+	kernel_project2.setArg(1, field_u);
+	kernel_project2.setArg(2, field_v);
+	kernel_project2.setArg(3, out_u);
+	kernel_project2.setArg(4, out_v);
+	kernel_project2.setArg(5, width);
+	kernel_project2.setArg(6, height);
+	profiler.enqueueKernel(queue, kernel_project2, origin_work, region_work, cl::NullRange);
+}
+
+void FluidEnsemble2D::reset()
+{
+	splats.clear();
+	cl::Buffer* fields[] = { &density_in, &density_out, &u_in, &u_out, &v_in, &v_out };
+	for (auto field : fields) {
+		reset_buffer(*field);
+	}
+}
+
+void FluidEnsemble2D::finish()
+{
+	queue.finish();
+}
+
+void FluidEnsemble2D::read_density(int member, std::vector<float> & out)
+{
+	flush_splats();
+	out.resize(member_size);
+	queue.enqueueReadBuffer(density_in, CL_TRUE, member*member_size * sizeof(float), member_size * sizeof(float),
+		out.data(), nullptr, profiler.event());
+	profiler.record("readDensity", member_size * sizeof(float));
+}
+
+void FluidEnsemble2D::read_densities(std::vector<float> & out)
+{
+	flush_splats();
+	out.resize(member_size*nb_members);
+	queue.enqueueReadBuffer(density_in, CL_TRUE, 0, out.size() * sizeof(float), out.data(), nullptr, profiler.event());
+	profiler.record("readDensity", out.size() * sizeof(float));
+}
+
+void FluidEnsemble2D::draw_mosaic(uint8_t* img, int columns)
+{
+	flush_splats();
+	columns = max(1, min(columns, nb_members));
+	const int rows = (nb_members + columns - 1) / columns;
+	const size_t image_width = (size_t)columns*width, image_height = (size_t)rows*height;
+	if (columns != mosaic_columns) {
+		mosaic = cl::Image2D(context, CL_MEM_WRITE_ONLY, { CL_RGBA, CL_UNSIGNED_INT8 }, image_width, image_height, 0);
+		mosaic_columns = columns;
+	}
+	kernel_draw.setArg(0, density_in);
+	kernel_draw.setArg(1, mosaic);
+	kernel_draw.setArg(2, width);
+	kernel_draw.setArg(3, height);
+	kernel_draw.setArg(4, columns);
+	kernel_draw.setArg(5, nb_members);
+	profiler.enqueueKernel(queue, kernel_draw, cl::NDRange(0, 0), cl::NDRange(image_width, image_height), cl::NullRange);
+	cl::size_t<3> origin, region;
+	origin[0] = 0; origin[1] = 0; origin[2] = 0;
+	region[0] = image_width; region[1] = image_height; region[2] = 1;
+	queue.enqueueReadImage(mosaic, CL_TRUE, origin, region, 0, 0, img, nullptr, profiler.event());
+	profiler.record("readImage", image_width*image_height * 4);
+}
+
+int FluidEnsemble2D::get_width() const
+{
+	return width;
+}
+
+int FluidEnsemble2D::get_height() const
+{
+	return height;
+}
+
+int FluidEnsemble2D::get_nb_members() const
+{
+	return nb_members;
+}
+
+KernelProfiler & FluidEnsemble2D::get_profiler()
+{
+	return profiler;
+}
@@ -0,0 +1,114 @@
+#ifndef FLUID_ENSEMBLE_2D_H
+#define FLUID_ENSEMBLE_2D_H
+
+#include <cstdint>
+#include <vector>
+#include <CL/cl.hpp>
+
+#include "KernelProfiler.hpp"
+#include "SplatBatch.hpp"
+
+/** K independent 2D simulations of the same grid advanced together (parameter sweeps)
+* Every field is a buffer [K][height][width] and each step launches the kernels "ens_*" of core.cl once
+* for all the members (the member is the dimension 2 of the NDRange), so small grids still fill the device.
+* The members only differ by their parameters and by the sources added to them, batched like the sources
+* of FluidSolver (the layers of a splat are the members) and applied by one launch at the next update.
+* Same scheme as FluidSolver, with pure Jacobi iterations (like its tiled diffuse), the kernels share
+* their stencils with the ones of FluidSolver. */
+class FluidEnsemble2D
+{
+public:
+	/** Parameters of a member */
+	struct MemberParameters
+	{
+		float viscosity;
+		float diffusion;// of the density
+	};
+	/** Target of add_pressure and add_velocity meaning every member */
+	static constexpr int ALL_MEMBERS = -1;
+
+	FluidEnsemble2D(int width, int height, const std::vector<MemberParameters> & members);
+	~FluidEnsemble2D();
+	/** Create the context, the program and the buffers */
+	void initialization();
+	/** Update every member */
+	void update(float dt);
+	/** Add density "intensity" in the circle of radius "radius" centered at (x,y) of a member (or ALL_MEMBERS) */
+	void add_pressure(int member, int x, int y, int radius, float intensity);
+	/** Add the velocity (dx,dy)*force in the circle of radius "radius" centered at (x,y) of a member (or ALL_MEMBERS) */
+	void add_velocity(int member, int x, int y, float dx, float dy, float force, int radius);
+	/** Change the parameters of a member, used from the next update */
+	void set_parameters(int member, const MemberParameters & parameters);
+	void reset();
+	void finish();
+	/** Copy the density of a member in "out" (width*height floats, row major) */
+	void read_density(int member, std::vector<float> & out);
+	/** Copy the densities of all the members in "out" ([K][height][width] floats) */
+	void read_densities(std::vector<float> & out);
+	/** Draw the density of the members side by side, "columns" members per row,
+	* in "img" (RGBA, columns*width by ceil(K/columns)*height pixels), blocking */
+	void draw_mosaic(uint8_t* img, int columns);
+	int get_width() const;
+	int get_height() const;
+	int get_nb_members() const;
+	/** Device timings of the enqueued commands, enable it before initialization */
+	KernelProfiler & get_profiler();
+protected:
+	void cl_init();
+	void program_init();
+	/** Add a disc source to a member (or ALL_MEMBERS), applied by flush_splats */
+	void add_source(int member, int x, int y, int radius, float density, float dx, float dy);
+	/** Apply the sources added since the last call, one launch over their bounding box and members */
+	void flush_splats();
+	/** SOLVER_NB_ITERATIONS Jacobi iterations, ping-pong between input_output and jacobi_tmp */
+	void jacobi(cl::Buffer & input_output, const cl::Buffer & src, const cl::Buffer & coefs);
+	void advect(cl::Buffer & dest, const cl::Buffer & src, const cl::Buffer & field_u, const cl::Buffer & field_v, float dt);
+	/** Remove the divergence of (field_u, field_v), the result goes to (out_u, out_v) */
+	void project(const cl::Buffer & field_u, const cl::Buffer & field_v, cl::Buffer & out_u, cl::Buffer & out_v);
+	void reset_buffer(cl::Buffer & buffer);
+	// opencl
+	cl::Device default_device;
+	cl::Context context;
+	cl::CommandQueue queue;
+	cl::Program program;
+	KernelProfiler profiler;
+	// sizes
+	int width;
+	int height;
+	int nb_members;
+	size_t member_size;// cells of a member
+	cl::NDRange origin_work;
+	cl::NDRange region_work;
+	cl::NDRange origin_work_center;
+	cl::NDRange region_work_center;
+	// opencl kernels
+	cl::Kernel kernel_coefficients;
+	cl::Kernel kernel_jacobi;
+	cl::Kernel kernel_advect;
+	cl::Kernel kernel_project1;
+	cl::Kernel kernel_project2;
+	cl::Kernel kernel_splat;
+	cl::Kernel kernel_reset;
+	cl::Kernel kernel_draw;
+	cl::Image2D mosaic;
+	int mosaic_columns = 0;// layout of "mosaic", 0 before the first draw_mosaic
+	// gpu memory structures, [K][height][width] floats
+	std::vector<MemberParameters> parameters;
+	cl::Buffer buffer_parameters;// float2 (viscosity, diffusion) per member
+	cl::Buffer coef_visc;// float2 (a, div) per member
+	cl::Buffer coef_diff;
+	cl::Buffer coef_poisson;
+	cl::Buffer density_in;
+	cl::Buffer density_out;
+	cl::Buffer u_in;
+	cl::Buffer u_out;
+	cl::Buffer v_in;
+	cl::Buffer v_out;
+	cl::Buffer tmp_project1;
+	cl::Buffer tmp_project2;
+	cl::Buffer jacobi_tmp;
+	bool parameters_changed = true;
+	SplatBatch splats;// sources not applied yet
+};
+
+#endif
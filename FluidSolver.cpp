@@ -1,25 +1,56 @@
 #include "FluidSolver.h"
 #include "Config.h"
+#include "ProgramCache.hpp"
+#include "StateFile.hpp"
+#ifdef FLUID_EMBEDDED_KERNELS
+#include "core_cl_2d.h"
+#define CORE_CL_SOURCE core_cl_2d, sizeof(core_cl_2d)
+#else
+#define CORE_CL_SOURCE nullptr, 0
+#endif
 
-constexpr int MEM_SIZE = WIDTH*HEIGHT;
+#include <algorithm>
+#include <chrono>
+#include <cmath>
 
 using namespace std;
 
-FluidSolver::FluidSolver()
+FluidSolver::FluidSolver() : FluidSolver(WIDTH / GRID_DOWNSCALE, HEIGHT / GRID_DOWNSCALE)
 {
-	origin[0] = 0; origin[1] = 0; origin[3] = 0;
-	region[0] = WIDTH;
-	region[1] = HEIGHT;
+	set_display_size(WIDTH, HEIGHT);
+}
+
+FluidSolver::FluidSolver(int width, int height) : width(width), height(height)
+{
+	origin[0] = 0; origin[1] = 0; origin[2] = 0;
+	region[0] = width;
+	region[1] = height;
 	region[2] = 1;
 	regionf[0] = region[0] * sizeof(float);
 	regionf[1] = region[1] * sizeof(float);
 	regionf[2] = 1;
 
 	origin_work = cl::NDRange(0, 0);
-	region_work = cl::NDRange(WIDTH, HEIGHT);
+	region_work = cl::NDRange(width, height);
 
 	origin_work_center = cl::NDRange(1, 1);
-	region_work_center = cl::NDRange(WIDTH - 2, HEIGHT - 2);
+	region_work_center = cl::NDRange(width - 2, height - 2);
+
+	region_work_tiled = cl::NDRange((width + DIFFUSE_TILE_WIDTH - 1) / DIFFUSE_TILE_WIDTH * DIFFUSE_TILE_WIDTH,
+		(height + DIFFUSE_TILE_HEIGHT - 1) / DIFFUSE_TILE_HEIGHT * DIFFUSE_TILE_HEIGHT);
+	local_work_tiled = cl::NDRange(DIFFUSE_TILE_WIDTH, DIFFUSE_TILE_HEIGHT);
+
+	set_display_size(width, height);
+}
+
+void FluidSolver::set_display_size(int w, int h)
+{
+	display_width = w;
+	display_height = h;
+	region_display[0] = w;
+	region_display[1] = h;
+	region_display[2] = 1;
+	region_work_display = cl::NDRange(w, h);
 }
 
 FluidSolver::~FluidSolver()
@@ -55,97 +86,610 @@ void FluidSolver::cl_init()
 		cout << " No devices found. Check OpenCL installation!\n";
 		exit(1);
 	}
-	cl::Device default_device = all_devices[0];
+	default_device = all_devices[0];
 	cout << "Using device: " << default_device.getInfo<CL_DEVICE_NAME>() << "\n";
 
 	context = cl::Context({ default_device });
-	queue = cl::CommandQueue(context, default_device);
+	queue = cl::CommandQueue(context, default_device, profiler.queueProperties());
 
-	// load opencl source
-	ifstream cl_file("core.cl");
-	string cl_string(istreambuf_iterator<char>(cl_file), (istreambuf_iterator<char>()));
-	cl::Program::Sources source(1, make_pair(cl_string.c_str(), cl_string.length() + 1));
+	// load opencl source (embedded by CMake, else core.cl in the working directory)
+	const string cl_string = ProgramCache::loadSource(CORE_CL_SOURCE, "core.cl");
 
-	// create program
-	program = cl::Program(context, source);
-	if (program.build({ default_device }) != CL_SUCCESS) {
-		cout << " Error building: " << program.getBuildInfo<CL_PROGRAM_BUILD_LOG>(default_device) << "\n";
+	// create program, the tile sizes are compile time constants of the kernels
+	string options = "-D DIFFUSE_TILE_W=" + to_string(DIFFUSE_TILE_WIDTH)
+		+ " -D DIFFUSE_TILE_H=" + to_string(DIFFUSE_TILE_HEIGHT)
+		+ " -D DIFFUSE_FUSED=" + to_string(DIFFUSE_FUSED_ITERATIONS) + " -D RELAX_GROUP=" + to_string(RELAX_GROUP);
+	if (sparse) {
+		tiles_x = (width + DIFFUSE_TILE_WIDTH - 1) / DIFFUSE_TILE_WIDTH;
+		tiles_y = (height + DIFFUSE_TILE_HEIGHT - 1) / DIFFUSE_TILE_HEIGHT;
+		options += " -D SPARSE_TILES -D TILES_X=" + to_string(tiles_x) + " -D TILES_Y=" + to_string(tiles_y)
+			+ " -D GRID_WIDTH=" + to_string(width) + " -D GRID_HEIGHT=" + to_string(height);
+	}
+	if (!ProgramCache::build(context, default_device, cl_string, options, program)) {
 		exit(1);
 	} else {
 		cout << "Build sucessful" << endl;
 	}
+	tuner.load(default_device);
+	tuner.setOptions(options);
+	// the kernels returning beyond their launch (OUTSIDE in core.cl), the tuner may pad them
+	for (const char* name : { "diffuse", "advect", "advect_correct", "project2_advect", "project1", "project2", "reset",
+		"floatToR", "mg_smooth", "mg_residual", "mg_restrict", "mg_prolongate", "relax_sor", "reset_tiles" }) {
+		tuner.setBounded(name, 2);
+	}
+	tuner.setBounded("relax_residual_rows", 1);
+	tuner.setBounded("sum_squares_rows", 1);
+	profiler.setTuner(&tuner);
+	// the implementations timed by tune_work_groups, else the ones of Config.h
+	const int tiled = tuner.choice("tiled_diffuse", region_work);
+	tiled_diffuse = (tiled < 0) ? DIFFUSE_FUSED_ITERATIONS > 1 : tiled == 1;
+	const int fused = tuner.choice("fused_velocity", region_work);
+	fused_velocity = (fused < 0) ? FUSED_VELOCITY_KERNELS : fused == 1;
 }
 
 void FluidSolver::program_init() {
-	static const cl::ImageFormat format_float1 = { CL_R, CL_FLOAT };
+	field_format = { CL_R, CL_FLOAT };
+	if (storage_precision == StoragePrecision::Half) {
+		vector<cl::ImageFormat> formats;
+		context.getSupportedImageFormats(CL_MEM_READ_WRITE, CL_MEM_OBJECT_IMAGE2D, &formats);
+		const bool supported = any_of(formats.begin(), formats.end(), [](const cl::ImageFormat & format) {
+			return format.image_channel_order == CL_R && format.image_channel_data_type == CL_HALF_FLOAT;
+		});
+		if (supported) {
+			field_format = { CL_R, CL_HALF_FLOAT };
+		} else {
+			cout << "Warning: no CL_R/CL_HALF_FLOAT images on this device, the fields are stored in float\n";
+			storage_precision = StoragePrecision::Float;
+		}
+	}
+	const cl::ImageFormat format_float1 = field_format;
+	const size_t t = (storage_precision == StoragePrecision::Half) ? sizeof(uint16_t) : sizeof(float);
 	kernel_diffuse   = cl::Kernel(program, "diffuse");
+	kernel_diffuse_tiled = cl::Kernel(program, "diffuse_tiled");
 	kernel_advect    = cl::Kernel(program, "advect");
 	kernel_project1  = cl::Kernel(program, "project1");
 	kernel_project2  = cl::Kernel(program, "project2");
+	kernel_advect_velocity_divergence = cl::Kernel(program, "advect_velocity_divergence");
+	kernel_project2_advect = cl::Kernel(program, "project2_advect");
 	kernel_draw_img  = cl::Kernel(program, "floatToR");
 	kernel_reset     = cl::Kernel(program, "reset");
-	kernel_addsource = cl::Kernel(program, "addCircleValue");
+	kernel_splat     = cl::Kernel(program, "splat_sources");
+	kernel_mg_smooth     = cl::Kernel(program, "mg_smooth");
+	kernel_mg_residual   = cl::Kernel(program, "mg_residual");
+	kernel_mg_restrict   = cl::Kernel(program, "mg_restrict");
+	kernel_mg_prolongate = cl::Kernel(program, "mg_prolongate");
+	kernel_sum_squares   = cl::Kernel(program, "sum_squares_rows");
+	kernel_relax_reset    = cl::Kernel(program, "relax_reset");
+	kernel_relax_sor      = cl::Kernel(program, "relax_sor");
+	kernel_relax_residual = cl::Kernel(program, "relax_residual_rows");
+	kernel_relax_check    = cl::Kernel(program, "relax_check");
+
+	// nominal global memory traffic of a work item (reads + writes of texels of t bytes)
+	profiler.setBytesPerItem("diffuse", 7 * t);
+	profiler.setBytesPerItem("diffuse_tiled", 3 * t);
+	profiler.setBytesPerItem("advect", 7 * t);
+	profiler.setBytesPerItem("advect_correct", 11 * t);// BFECC: two samples of 4 texels
+	profiler.setBytesPerItem("project1", 5 * t);
+	profiler.setBytesPerItem("project2", 8 * t);
+	profiler.setBytesPerItem("advect_velocity_divergence", 13 * t);// the one cell halo is advected twice
+	profiler.setBytesPerItem("project2_advect", 13 * t);
+	profiler.setBytesPerItem("reset", t);
+	profiler.setBytesPerItem("splat_sources", 6 * t);// every cell of the box reads and writes the three fields
+	profiler.setBytesPerItem("floatToR", 4 * t + 4);// 4 texels filtered, one pixel written
+	profiler.setBytesPerItem("mg_smooth", 3 * t);// half of the cells are updated by a launch
+	profiler.setBytesPerItem("mg_residual", 7 * t);
+	profiler.setBytesPerItem("mg_restrict", 5 * t);
+	profiler.setBytesPerItem("mg_prolongate", 6 * t);
+	profiler.setBytesPerItem("sum_squares_rows", width * t);
+	profiler.setBytesPerItem("relax_sor", 4 * t);// the cells of the other color are copied
+	profiler.setBytesPerItem("relax_residual_rows", width * 2 * t);
+	profiler.setBytesPerItem("tile_occupancy", DIFFUSE_TILE_WIDTH * DIFFUSE_TILE_HEIGHT * 3 * t);// per tile
+	profiler.setBytesPerItem("tile_dilate", 11);
+	profiler.setBytesPerItem("tile_halo", 11);
+	profiler.setBytesPerItem("tile_activate", 1);
+	profiler.setBytesPerItem("reset_tiles", t);
+
+	density_in =	cl::Image2D(context, CL_MEM_READ_WRITE, format_float1, width, height, 0);
+	density_out =	cl::Image2D(context, CL_MEM_READ_WRITE, format_float1, width, height, 0);
+	u_in =			cl::Image2D(context, CL_MEM_READ_WRITE, format_float1, width, height, 0);
+	v_in =			cl::Image2D(context, CL_MEM_READ_WRITE, format_float1, width, height, 0);
+	u_out =			cl::Image2D(context, CL_MEM_READ_WRITE, format_float1, width, height, 0);
+	v_out =			cl::Image2D(context, CL_MEM_READ_WRITE, format_float1, width, height, 0);
+	image =			cl::Image2D(context, CL_MEM_READ_WRITE, { CL_RGBA, CL_UNSIGNED_INT8 }, display_width, display_height, 0);
+	tmp_project1 =	cl::Image2D(context, CL_MEM_READ_WRITE, format_float1, width, height, 0);
+	tmp_project2 =	cl::Image2D(context, CL_MEM_READ_WRITE, format_float1, width, height, 0);
+	diffuse_tmp =	cl::Image2D(context, CL_MEM_READ_WRITE, format_float1, width, height, 0);
+	relax_state =	cl::Buffer(context, CL_MEM_READ_WRITE, 2 * RELAX_SLOTS * sizeof(int));
+	relax_sums =	cl::Buffer(context, CL_MEM_READ_WRITE, 2 * height * sizeof(float));
+
+	if (sparse) {
+		// the list of the active tiles is the last argument of the main kernels (the solves set the one of their tiles)
+		for (int i = 0; i < TILE_LISTS; ++i) {
+			tile_flags[i] = cl::Buffer(context, CL_MEM_READ_WRITE, get_nb_tiles());
+			tile_lists[i] = cl::Buffer(context, CL_MEM_READ_WRITE, (1 + get_nb_tiles()) * sizeof(cl_int));
+		}
+		tiles_occupied = cl::Buffer(context, CL_MEM_READ_WRITE, get_nb_tiles());
+		pressure_tmp = cl::Image2D(context, CL_MEM_READ_WRITE, format_float1, width, height, 0);
+		const pair<cl::Kernel*, int> listed[] = { { &kernel_diffuse, 5 }, { &kernel_diffuse_tiled, 8 }, { &kernel_advect, 7 },
+			{ &kernel_project1, 5 }, { &kernel_project2, 7 }, { &kernel_advect_velocity_divergence, 10 },
+			{ &kernel_project2_advect, 10 }, { &kernel_relax_sor, 9 } };
+		for (auto & kernel : listed) {
+			kernel.first->setArg(kernel.second, tile_lists[TILES_ACTIVE]);
+		}
+		kernel_tile_occupancy = cl::Kernel(program, "tile_occupancy");
+		kernel_tile_occupancy.setArg(3, tile_flags[TILES_ACTIVE]);
+		kernel_tile_occupancy.setArg(4, tiles_occupied);
+		kernel_tile_occupancy.setArg(5, SPARSE_TILE_THRESHOLD);
+		kernel_tile_dilate = cl::Kernel(program, "tile_dilate");
+		kernel_tile_dilate.setArg(0, tiles_occupied);
+		kernel_tile_dilate.setArg(1, tile_flags[TILES_ACTIVE]);
+		kernel_tile_dilate.setArg(2, tile_flags[TILES_RETIRED]);
+		kernel_tile_halo = cl::Kernel(program, "tile_halo");
+		kernel_tile_halo.setArg(0, tile_flags[TILES_ACTIVE]);
+		kernel_tile_halo.setArg(1, tile_flags[TILES_PRESSURE]);
+		kernel_tile_halo.setArg(2, tile_flags[TILES_RETIRED_PRESSURE]);
+		kernel_tile_activate = cl::Kernel(program, "tile_activate");
+		kernel_list_tiles = cl::Kernel(program, "list_tiles");
+		kernel_reset_tiles = cl::Kernel(program, "reset_tiles");
+		// the images are not initialized: every tile starts active, the empty ones retire at the first update
+		activate_all_tiles();
+	}
 
-	density_in =	cl::Image2D(context, CL_MEM_READ_WRITE, format_float1, WIDTH, HEIGHT, 0);
-	density_out =	cl::Image2D(context, CL_MEM_READ_WRITE, format_float1, WIDTH, HEIGHT, 0);
-	u_in =			cl::Image2D(context, CL_MEM_READ_WRITE, format_float1, WIDTH, HEIGHT, 0);
-	v_in =			cl::Image2D(context, CL_MEM_READ_WRITE, format_float1, WIDTH, HEIGHT, 0);
-	u_out =			cl::Image2D(context, CL_MEM_READ_WRITE, format_float1, WIDTH, HEIGHT, 0);
-	v_out =			cl::Image2D(context, CL_MEM_READ_WRITE, format_float1, WIDTH, HEIGHT, 0);
-	image =			cl::Image2D(context, CL_MEM_READ_WRITE, { CL_RGBA, CL_UNSIGNED_INT8 }, WIDTH, HEIGHT, 0);
-	tmp_project1 =	cl::Image2D(context, CL_MEM_READ_WRITE, format_float1, WIDTH, HEIGHT, 0);
-	tmp_project2 =	cl::Image2D(context, CL_MEM_READ_WRITE, format_float1, WIDTH, HEIGHT, 0);
-	buffer_u =		cl::Buffer(context,  CL_MEM_READ_WRITE, WIDTH*HEIGHT * sizeof(float));
-	buffer_v =		cl::Buffer(context,  CL_MEM_READ_WRITE, WIDTH*HEIGHT * sizeof(float));
+	multigrid_init();
+	if (advection_scheme != AdvectionScheme::SemiLagrangian) {
+		advection_init();
+	}
 }
 
+void FluidSolver::advection_init()
+{
+	kernel_advect_correct = cl::Kernel(program, "advect_correct");
+	if (sparse) {
+		kernel_advect_correct.setArg(10, tile_lists[TILES_ACTIVE]);
+	}
+	advect_ahead = cl::Image2D(context, CL_MEM_READ_WRITE, field_format, width, height, 0);
+	advect_back = cl::Image2D(context, CL_MEM_READ_WRITE, field_format, width, height, 0);
+	// the passes only write the inner cells, the samples next to the borders read these zeros
+	for (auto img : { &advect_ahead, &advect_back }) {
+		kernel_reset.setArg(0, *img);
+		profiler.enqueueKernel(queue, kernel_reset, origin_work, region_work, cl::NullRange);
+	}
+}
 
-void FluidSolver::add_source(cl::Image2D& in_out,int x, int y, int radius, float intensity)
+void FluidSolver::set_advection_scheme(AdvectionScheme scheme)
 {
-	kernel_addsource.setArg(0, in_out);
-	kernel_addsource.setArg(1, in_out);
-	kernel_addsource.setArg(2, x);
-	kernel_addsource.setArg(3, y);
-	kernel_addsource.setArg(4, intensity);
-	kernel_addsource.setArg(5, (float)radius - 0.5f);
-	const int bound_width = (x + radius < WIDTH-1) ? 2 * radius : (WIDTH) - (x - radius);
-	const int bound_height = (y + radius < HEIGHT-1) ? 2 * radius : (HEIGHT) - (y - radius);
-	const int bound_top = (x - radius < 1) ? 1 : x - radius;
-	const int bound_left = (y - radius < 1) ? 1 : y - radius;
-	queue.enqueueNDRangeKernel(kernel_addsource, cl::NDRange(bound_top, bound_left), cl::NDRange(bound_width, bound_height), cl::NullRange);
+	advection_scheme = scheme;
+	// after initialization the images are made on first use
+	if (scheme != AdvectionScheme::SemiLagrangian && density_in() && !advect_ahead()) {
+		advection_init();
+	}
+}
+
+AdvectionScheme FluidSolver::get_advection_scheme() const
+{
+	return advection_scheme;
+}
+
+void FluidSolver::multigrid_init()
+{
+	const cl::ImageFormat format_float1 = field_format;
+	levels.clear();
+	levels.push_back({ width, height, tmp_project2, tmp_project1,
+		cl::Image2D(context, CL_MEM_READ_WRITE, format_float1, width, height, 0) });
+	// halve both dimensions until the smallest one reaches the coarsest size
+	int w = width, h = height;
+	while ((unsigned int)min(w, h) > multigrid.coarsest_size) {
+		w = (w + 1) / 2;
+		h = (h + 1) / 2;
+		levels.push_back({ w, h,
+			cl::Image2D(context, CL_MEM_READ_WRITE, format_float1, w, h, 0),
+			cl::Image2D(context, CL_MEM_READ_WRITE, format_float1, w, h, 0),
+			cl::Image2D(context, CL_MEM_READ_WRITE, format_float1, w, h, 0) });
+	}
+	// project1 only writes the inner cells but the norm reads the whole image
+	kernel_reset.setArg(0, tmp_project1);
+	profiler.enqueueKernel(queue, kernel_reset, origin_work, region_work, cl::NullRange);
+	buffer_sums = cl::Buffer(context, CL_MEM_READ_WRITE, height * sizeof(float));
+	sums.resize(height);
+}
+
+void FluidSolver::set_pressure_solver(PressureSolver solver, const MultigridSettings & settings)
+{
+	const bool rebuild = settings.coarsest_size != multigrid.coarsest_size;
+	if (sparse && !levels.empty() && pressure_solver == PressureSolver::Multigrid && solver == PressureSolver::Jacobi) {
+		// the multigrid solves write the whole grid, the sparse Jacobi solves expect 0 beyond their tiles
+		kernel_reset.setArg(0, tmp_project2);
+		profiler.enqueueKernel(queue, kernel_reset, origin_work, region_work, cl::NullRange);
+	}
+	pressure_solver = solver;
+	multigrid = settings;
+	if (rebuild && !levels.empty()) {
+		multigrid_init();
+	}
+}
+
+void FluidSolver::set_storage_precision(StoragePrecision precision)
+{
+	storage_precision = precision;
+}
+
+StoragePrecision FluidSolver::get_storage_precision() const
+{
+	return storage_precision;
+}
+
+unsigned int FluidSolver::get_pressure_cycles() const
+{
+	return pressure_cycles;
+}
+
+float FluidSolver::get_pressure_residual() const
+{
+	return pressure_residual;
+}
+
+void FluidSolver::set_relaxation(const RelaxationSettings & settings)
+{
+	relaxation = settings;
+	relaxation.check_interval = max(relaxation.check_interval, 1u);
+}
+
+SolverIterations FluidSolver::get_solver_iterations()
+{
+	if (!relaxation.enabled) {
+		SolverIterations fixed;
+		fixed.velocity = 2 * SOLVER_NB_ITERATIONS;
+		fixed.pressure = (pressure_solver == PressureSolver::Jacobi) ? 2 * SOLVER_NB_ITERATIONS : 0;
+		fixed.density = SOLVER_NB_ITERATIONS;
+		return fixed;
+	}
+	poll_iterations(false);
+	return solver_iterations;
+}
+
+void FluidSolver::poll_iterations(bool start)
+{
+	if (relax_reading) {
+		if (relax_read.getInfo<CL_EVENT_COMMAND_EXECUTION_STATUS>() != CL_COMPLETE) {
+			return;// still in flight, relax_counts is busy: this update is not reported
+		}
+		relax_reading = false;
+		solver_iterations.velocity = relax_counts[2 * RELAX_U + 1] + relax_counts[2 * RELAX_V + 1];
+		solver_iterations.pressure = (pressure_solver == PressureSolver::Jacobi)
+			? relax_counts[2 * RELAX_PRESSURE + 1] + relax_counts[2 * RELAX_PRESSURE + 3] : 0;
+		solver_iterations.density = relax_counts[2 * RELAX_DENSITY + 1];
+	}
+	if (start) {
+		queue.enqueueReadBuffer(relax_state, CL_FALSE, 0, sizeof(relax_counts), relax_counts, nullptr, &relax_read);
+		relax_reading = true;
+	}
+}
+
+
+void FluidSolver::add_splat(int x, int y, int radius, float density, float dx, float dy, float falloff)
+{
+	Splat splat = {};
+	splat.x = (float)x;
+	splat.y = (float)y;
+	splat.reach = (float)radius - 0.5f;
+	splat.falloff = falloff;
+	// cells of the first row and column are never touched, the last ones are
+	splat.x0 = (float)max(1, x - radius);
+	splat.y0 = (float)max(1, y - radius);
+	splat.x1 = (float)min(width, x + radius);
+	splat.y1 = (float)min(height, y + radius);
+	splat.z0 = 0.0f;
+	splat.z1 = 1.0f;
+	splat.density = density;
+	splat.velocity = (dx != 0.0f || dy != 0.0f) ? 1.0f : 0.0f;
+	splat.dx = dx;
+	splat.dy = dy;
+	splats.add(splat);
 }
 
 void FluidSolver::add_pressure(int x, int y, int radius, float intensity)
 {
-	add_source(density_in, x, y, radius, intensity);
+	add_splat(x, y, radius, intensity, 0.0f, 0.0f);
 }
 
 void FluidSolver::add_velocity(int x, int y, float dx, float dy, float force, int radius)
 {
-	add_source(u_in, x, y, radius, dx*force);
-	add_source(v_in, x, y, radius, dy*force);
+	add_splat(x, y, radius, 0.0f, dx*force, dy*force);
 }
 
-void FluidSolver::set_data_image(cl_uint8 * img)
+void FluidSolver::flush_splats()
+{
+	if (splats.empty()) {
+		return;
+	}
+	const cl::NDRange origin_splats(splats.begin(0), splats.begin(1));
+	const cl::NDRange region_splats(splats.end(0) - splats.begin(0), splats.end(1) - splats.begin(1));
+	cl::size_t<3> box_origin, box_region;
+	box_origin[0] = splats.begin(0); box_origin[1] = splats.begin(1); box_origin[2] = 0;
+	box_region[0] = splats.end(0) - splats.begin(0); box_region[1] = splats.end(1) - splats.begin(1); box_region[2] = 1;
+	splats.upload(context, queue, SPLAT_BINNING_THRESHOLD, SPLAT_TILE_SIZE);
+	profiler.record("writeSplats", splats.uploadEvent(), splats.uploadedSize() * sizeof(Splat));
+	// the box goes through staging images and is copied back: the "out" images are the initial guesses
+	// of the diffusions of the next update and must keep their values
+	if ((int)box_region[0] > splat_box_width || (int)box_region[1] > splat_box_height) {
+		splat_box_width = max(splat_box_width, (int)box_region[0]);
+		splat_box_height = max(splat_box_height, (int)box_region[1]);
+		for (auto & img : splat_box) {
+			img = cl::Image2D(context, CL_MEM_READ_WRITE, field_format, splat_box_width, splat_box_height, 0);
+		}
+	}
+	cl::Image2D* fields[] = { &density_in, &u_in, &v_in };
+	for (int i = 0; i < 3; ++i) {
+		kernel_splat.setArg(2 * i, *fields[i]);
+		kernel_splat.setArg(2 * i + 1, splat_box[i]);
+	}
+	kernel_splat.setArg(6, splats.splatBuffer());
+	kernel_splat.setArg(7, splats.uploadedSize());
+	kernel_splat.setArg(8, splats.offsetBuffer());
+	kernel_splat.setArg(9, splats.indexBuffer());
+	kernel_splat.setArg(10, splats.tileSize());
+	kernel_splat.setArg(11, splats.tilesX());
+	profiler.enqueueKernel(queue, kernel_splat, origin_splats, region_splats, cl::NullRange);
+	const size_t t = (storage_precision == StoragePrecision::Half) ? sizeof(uint16_t) : sizeof(float);
+	for (int i = 0; i < 3; ++i) {
+		queue.enqueueCopyImage(splat_box[i], *fields[i], origin, box_origin, box_region, nullptr, profiler.event());
+		profiler.record("copyImage", box_region[0] * box_region[1] * 2 * t);
+	}
+	activate_tiles(splats.begin(0), splats.begin(1), splats.end(0), splats.end(1));
+}
+
+void FluidSolver::set_data_image(uint8_t * img)
 {
 	data_image = img;
 }
 
 void FluidSolver::update_image()
 {
+	flush_splats();
 	kernel_draw_img.setArg(0, density_in);
 	kernel_draw_img.setArg(1, image);
-	queue.enqueueNDRangeKernel(kernel_draw_img, origin_work, region_work, cl::NullRange);
-	queue.enqueueReadImage(image, CL_TRUE, origin, region, 0, 0, data_image);
+	kernel_draw_img.setArg(2, (float)width / display_width);
+	kernel_draw_img.setArg(3, (float)height / display_height);
+	profiler.enqueueKernel(queue, kernel_draw_img, origin_work, region_work_display, cl::NullRange);
+	queue.enqueueReadImage(image, CL_TRUE, origin, region_display, 0, 0, data_image, nullptr, profiler.event());
+	profiler.record("readImage", display_width*display_height * 4);
+}
+
+const uint8_t* FluidSolver::latest_image()
+{
+	flush_splats();
+	if (!readback.isInitialized()) {
+		readback.init(context, default_device, display_width, display_height, READBACK_SLOTS);
+	}
+	vector<cl::Event> wait_list;
+	cl::Event drawn;
+	kernel_draw_img.setArg(0, density_in);
+	kernel_draw_img.setArg(1, readback.nextTarget(wait_list));
+	kernel_draw_img.setArg(2, (float)width / display_width);
+	kernel_draw_img.setArg(3, (float)height / display_height);
+	profiler.enqueueKernel(queue, kernel_draw_img, origin_work, region_work_display, cl::NullRange,
+		wait_list.empty() ? nullptr : &wait_list, &drawn);
+	readback.submit(queue, drawn);
+	return readback.latest();
 }
 
 void FluidSolver::reset()
 {
-	cl::Image2D* images[] = { &density_in, &density_out, &u_in, &u_out, &v_in, &v_out, &image };
-	for (int i = 0; i < 7;++i) {
+	splats.clear();
+	cl::Image2D* images[] = { &density_in, &density_out, &u_in, &u_out, &v_in, &v_out };
+	for (int i = 0; i < 6;++i) {
 		kernel_reset.setArg(0, *images[i]);
-		queue.enqueueNDRangeKernel(kernel_reset, cl::NDRange(0, 0), cl::NDRange(WIDTH, HEIGHT), cl::NullRange);
+		profiler.enqueueKernel(queue, kernel_reset, cl::NDRange(0, 0), cl::NDRange(width, height), cl::NullRange);
+	}
+	activate_all_tiles();
+	step = 0;
+}
+
+void FluidSolver::finish()
+{
+	queue.finish();
+}
+
+void FluidSolver::read_density(std::vector<float> & out)
+{
+	flush_splats();
+	out.resize((size_t)width*height);
+	vector<uint16_t> staging;
+	read_field(density_in, out.data(), staging, profiler.event());
+	profiler.record("readDensity", width*height * (staging.empty() ? sizeof(float) : sizeof(uint16_t)));
+	queue.finish();
+	widen_field(out.data(), staging);
+}
+
+void FluidSolver::read_field(const cl::Image2D & field, float* out, std::vector<uint16_t> & staging, cl::Event* event)
+{
+	if (storage_precision == StoragePrecision::Float) {
+		queue.enqueueReadImage(field, CL_FALSE, origin, region, 0, 0, out, nullptr, event);
+		return;
+	}
+	staging.resize((size_t)width*height);
+	queue.enqueueReadImage(field, CL_FALSE, origin, region, 0, 0, staging.data(), nullptr, event);
+}
+
+void FluidSolver::widen_field(float* out, const std::vector<uint16_t> & staging) const
+{
+	if (storage_precision == StoragePrecision::Half) {
+		HalfFloat::toFloats(staging.data(), out, staging.size());
+	}
+}
+
+void FluidSolver::write_field(cl::Image2D & field, const float* in, std::vector<uint16_t> & staging)
+{
+	if (storage_precision == StoragePrecision::Float) {
+		queue.enqueueWriteImage(field, CL_FALSE, origin, region, 0, 0, const_cast<float*>(in));
+		return;
+	}
+	staging.resize((size_t)width*height);
+	HalfFloat::fromFloats(in, staging.data(), staging.size());
+	queue.enqueueWriteImage(field, CL_FALSE, origin, region, 0, 0, staging.data());
+}
+
+KernelProfiler & FluidSolver::get_profiler()
+{
+	return profiler;
+}
+
+WorkGroupTuner & FluidSolver::get_tuner()
+{
+	return tuner;
+}
+
+void FluidSolver::tune_work_groups(unsigned int steps)
+{
+	cout << "Tuning the work-group sizes of the " << width << "x" << height << " grid" << endl;
+	// the candidates run the kernels on the live fields many times: the state is saved first and restored after
+	flush_splats();
+	cl::Image2D* images[] = { &density_in, &density_out, &u_in, &u_out, &v_in, &v_out, &tmp_project1, &tmp_project2 };
+	vector<float> saved[8];
+	vector<uint16_t> staging[8];
+	for (int i = 0; i < 8; ++i) {
+		saved[i].resize((size_t)width*height);
+		read_field(*images[i], saved[i].data(), staging[i]);
+	}
+	queue.finish();
+	for (int i = 0; i < 8; ++i) {
+		widen_field(saved[i].data(), staging[i]);
+	}
+	const unsigned long long saved_step = step;
+
+	tuner.setTuning(true);
+	for (unsigned int i = 0; i < steps; ++i) {
+		// a source on every step, so the launches of an interaction are tuned too
+		add_pressure(width / 2, height / 2, max(2, width / 20), 1.0f);
+		add_velocity(width / 2, height / 2, 1.0f, -1.0f, 0.01f, max(2, width / 20));
+		update(SIMULATION_DT);
+	}
+	// the implementations of the steps, the fastest update is kept (and used by the next initializations)
+	if (!relaxation.enabled) {
+		tiled_diffuse = tuner.tuneChoice("tiled_diffuse", region_work, 2, [this](int tiled) {
+			tiled_diffuse = tiled == 1;
+			update(SIMULATION_DT);
+			queue.finish();
+		}) == 1;
+	}
+	if (advection_scheme == AdvectionScheme::SemiLagrangian) {
+		fused_velocity = tuner.tuneChoice("fused_velocity", region_work, 2, [this](int fused) {
+			fused_velocity = fused == 1;
+			update(SIMULATION_DT);
+			queue.finish();
+		}) == 1;
+	}
+	// the display kernel is tuned on "image" (the launch of latest_image), the readback slots keep their frames
+	kernel_draw_img.setArg(0, density_in);
+	kernel_draw_img.setArg(1, image);
+	kernel_draw_img.setArg(2, (float)width / display_width);
+	kernel_draw_img.setArg(3, (float)height / display_height);
+	profiler.enqueueKernel(queue, kernel_draw_img, origin_work, region_work_display, cl::NullRange);
+	queue.finish();
+	tuner.setTuning(false);
+	tuner.save();
+
+	for (int i = 0; i < 8; ++i) {
+		write_field(*images[i], saved[i].data(), staging[i]);
+	}
+	activate_all_tiles();
+	// "image" shows the restored density again
+	kernel_draw_img.setArg(0, density_in);
+	profiler.enqueueKernel(queue, kernel_draw_img, origin_work, region_work_display, cl::NullRange);
+	queue.finish();
+	step = saved_step;
+}
+
+int FluidSolver::get_width() const
+{
+	return width;
+}
+
+int FluidSolver::get_height() const
+{
+	return height;
+}
+
+/** Fields of a 2D state file, the "out" images and the projection temporaries are the initial guesses of the next step */
+static const char* STATE_FIELDS[] = { "density_in", "density_out", "u_in", "u_out", "v_in", "v_out", "tmp_project1", "tmp_project2" };
+
+/** Parameters saved with a 2D state, a state of other parameters is loaded with a warning */
+static StateFile::Info state_info(int width, int height, unsigned long long step)
+{
+	StateFile::Info info;
+	info.width = width;
+	info.height = height;
+	info.step = step;
+	info.parameters[0] = VISCO;
+	info.parameters[1] = DIFF_DENSITY;
+	info.parameters[2] = (float)SOLVER_NB_ITERATIONS;
+	return info;
+}
+
+bool FluidSolver::save_state(const std::string & filename)
+{
+	flush_splats();
+	cl::Image2D* images[] = { &density_in, &density_out, &u_in, &u_out, &v_in, &v_out, &tmp_project1, &tmp_project2 };
+	vector<pair<string, size_t>> fields;
+	for (auto name : STATE_FIELDS) {
+		fields.push_back({ name, (size_t)width*height * sizeof(float) });
+	}
+	StateFile::Writer writer(state_info(width, height, step), fields);
+	// the state files always hold floats, the halves are widened on the host
+	vector<uint16_t> staging[8];
+	for (size_t i = 0; i < fields.size(); ++i) {
+		read_field(*images[i], static_cast<float*>(writer.field(i)), staging[i]);
+	}
+	queue.finish();
+	for (size_t i = 0; i < fields.size(); ++i) {
+		widen_field(static_cast<float*>(writer.field(i)), staging[i]);
 	}
+	return writer.write(filename);
+}
+
+bool FluidSolver::load_state(const std::string & filename)
+{
+	splats.clear();
+	const auto start = chrono::steady_clock::now();
+	StateFile::Mapping state;
+	if (!state.open(filename)) {
+		return false;
+	}
+	const StateFile::Info expected = state_info(width, height, 0);
+	if (state.info().width != expected.width || state.info().height != expected.height || state.info().depth != 1) {
+		cout << filename << ": state of a " << state.info().width << "x" << state.info().height << "x" << state.info().depth
+			<< " grid, the solver is " << width << "x" << height << endl;
+		return false;
+	}
+	if (memcmp(state.info().parameters, expected.parameters, sizeof(expected.parameters)) != 0) {
+		cout << "Warning: " << filename << " was saved with other fluid parameters" << endl;
+	}
+	cl::Image2D* images[] = { &density_in, &density_out, &u_in, &u_out, &v_in, &v_out, &tmp_project1, &tmp_project2 };
+	const void* data[8];
+	for (int i = 0; i < 8; ++i) {
+		data[i] = state.field(STATE_FIELDS[i], (size_t)width*height * sizeof(float));
+		if (!data[i]) {
+			return false;
+		}
+	}
+	// one upload per field straight from the mapped file (or from a copy in halves),
+	// it must stay mapped until they complete
+	vector<uint16_t> staging[8];
+	for (int i = 0; i < 8; ++i) {
+		write_field(*images[i], static_cast<const float*>(data[i]), staging[i]);
+	}
+	// the loaded fields may cover any tile
+	activate_all_tiles();
+	queue.finish();
+	step = state.info().step;
+	cout << "State loaded (step " << step << ") in "
+		<< chrono::duration<double, milli>(chrono::steady_clock::now() - start).count() << " ms" << endl;
+	return true;
+}
+
+unsigned long long FluidSolver::get_step() const
+{
+	return step;
 }
 
 void FluidSolver::update(float dt)
@@ -154,77 +698,438 @@ void FluidSolver::update(float dt)
 	if (dt > 0.02f) { // clamp update rate else the error is too high
 		dt = 0.02f;
 	}
-	const float a = dt*DIFF_DENSITY*WIDTH*HEIGHT;
+	const float a = dt*DIFF_DENSITY*width*height;
+	pressure_cycles = 0;
+	pressure_solves = 0;
+	flush_splats();
+	if (sparse) {
+		update_tiles();
+	}
+	if (relaxation.enabled) {
+		kernel_relax_reset.setArg(0, relax_state);
+		kernel_relax_reset.setArg(1, (int)relaxation.max_iterations);
+		profiler.enqueueKernel(queue, kernel_relax_reset, cl::NDRange(0), cl::NDRange(RELAX_SLOTS), cl::NullRange);
+	}
+	// every step reads the "in" or the "out" images and writes the other ones: no copy,
+	// the fields of the next update end in the "in" images
 	// velocity -----------------------
-	diffuse(u_out, u_in, VISCO, VISCO_DIV, 1);
-	diffuse(v_out, v_in, VISCO, VISCO_DIV, 2);
+	diffuse(u_out, u_in, VISCO, VISCO_DIV, 1, RELAX_U);
+	diffuse(v_out, v_in, VISCO, VISCO_DIV, 2, RELAX_V);
 
-	project(u_out, v_out);
-	queue.enqueueCopyBufferToImage(buffer_u, u_out, 0, origin, region);
-	queue.enqueueCopyBufferToImage(buffer_v, v_out, 0, origin, region);
-	
+	project(u_out, v_out, u_in, v_in);
 
-	advect(u_in, u_out, u_in, v_in, dt, 1);
-	advect(v_in, v_out, u_in, v_in, dt, 2);
-
-	queue.enqueueCopyImage(u_in, u_out, origin, origin, region);
-	queue.enqueueCopyImage(v_in, v_out, origin, origin, region);
-	project(u_out, v_out);
-	queue.enqueueCopyBufferToImage(buffer_u, u_in, 0, origin, region);
-	queue.enqueueCopyBufferToImage(buffer_v, v_in, 0, origin, region);
+	// the fused kernels only advect with the semi-Lagrangian scheme
+	if (fused_velocity && advection_scheme == AdvectionScheme::SemiLagrangian) {
+		// the second projection is split around the density diffusion, which does not read the velocity:
+		// advection + divergence, pressure, then gradient + advection of the density
+		advect_velocity_divergence(dt);
+		solve_pressure();
+		diffuse(density_out, density_in, a, 1 + 4.0f*a, 0, RELAX_DENSITY);
+		project_advect_density(dt);
+	} else {
+		advect(u_out, u_in, u_in, v_in, dt, 1);
+		advect(v_out, v_in, u_in, v_in, dt, 2);
 
-	// density ------------------------
-	diffuse(density_out, density_in, a, 1 + 4.0f*a, 0);
-	advect(density_in, density_out, u_in, v_in, dt, 0);
+		project(u_out, v_out, u_in, v_in);
 
+		// density ------------------------
+		diffuse(density_out, density_in, a, 1 + 4.0f*a, 0, RELAX_DENSITY);
+		advect(density_in, density_out, u_in, v_in, dt, 0);
+	}
+	++step;
+	if (relaxation.enabled) {
+		poll_iterations(true);
+	}
 }
 
 
-inline void FluidSolver::diffuse(cl::Image2D & input_output, const cl::Image2D & src, float diff, float diff_div, int bound) {
+inline void FluidSolver::diffuse(cl::Image2D & input_output, const cl::Image2D & src, float diff, float diff_div, int bound, int slot) {
 	if (diff_div == 0.0f) diff_div = 0.000000000001f;
-	kernel_diffuse.setArg(0, input_output);
-	kernel_diffuse.setArg(1, input_output);
+	// with sparse tiles the pressure solves also cover the halo of the active tiles
+	const int tiles = (slot == RELAX_PRESSURE || slot == RELAX_PRESSURE + 1) ? TILES_PRESSURE : TILES_ACTIVE;
+	if (relaxation.enabled) {
+		relax(input_output, src, diff, diff_div, slot, tiles);
+		return;
+	}
+	if (tiled_diffuse) {
+		diffuse_tiled(input_output, src, diff, diff_div, tiles);
+		return;
+	}
+	// Jacobi like the tiled diffuse and the CPU engine: a launch reads the previous iterate and writes
+	// diffuse_tmp (reading and writing one image in a launch is undefined), the handles are swapped
 	kernel_diffuse.setArg(2, src);
 	kernel_diffuse.setArg(3, diff);
 	kernel_diffuse.setArg(4, diff_div);
+	if (sparse) {
+		kernel_diffuse.setArg(5, tile_lists[tiles]);
+	}
 	for (unsigned int k = 0; k < SOLVER_NB_ITERATIONS; ++k) {
-		queue.enqueueNDRangeKernel(kernel_diffuse, origin_work, region_work, cl::NullRange);
+		kernel_diffuse.setArg(0, input_output);
+		kernel_diffuse.setArg(1, diffuse_tmp);
+		enqueue_cells(kernel_diffuse, origin_work, region_work, cl::NullRange, tiles);
+		swap(input_output, diffuse_tmp);
+	}
+}
+
+void FluidSolver::diffuse_tiled(cl::Image2D & input_output, const cl::Image2D & src, float diff, float diff_div, int tiles)
+{
+	// unlike the in place "diffuse" the iterations are pure Jacobi: the result goes to the other image,
+	// the handles are swapped so input_output holds the result at the end
+	kernel_diffuse_tiled.setArg(2, src);
+	kernel_diffuse_tiled.setArg(3, diff);
+	kernel_diffuse_tiled.setArg(4, diff_div);
+	kernel_diffuse_tiled.setArg(6, width);
+	kernel_diffuse_tiled.setArg(7, height);
+	if (sparse) {
+		kernel_diffuse_tiled.setArg(8, tile_lists[tiles]);
+	}
+	for (unsigned int k = 0; k < SOLVER_NB_ITERATIONS; k += DIFFUSE_FUSED_ITERATIONS) {
+		const int iterations = (int)min(DIFFUSE_FUSED_ITERATIONS, SOLVER_NB_ITERATIONS - k);
+		kernel_diffuse_tiled.setArg(0, input_output);
+		kernel_diffuse_tiled.setArg(1, diffuse_tmp);
+		kernel_diffuse_tiled.setArg(5, iterations);
+		enqueue_cells(kernel_diffuse_tiled, origin_work, region_work_tiled, local_work_tiled, tiles);
+		swap(input_output, diffuse_tmp);
+	}
+}
+
+void FluidSolver::relax(cl::Image2D & input_output, const cl::Image2D & src, float diff, float diff_div, int slot, int tiles)
+{
+	// every launch is enqueued up front, the checks only set the flag that turns the rest into no-ops
+	kernel_relax_sor.setArg(2, src);
+	kernel_relax_sor.setArg(3, diff);
+	kernel_relax_sor.setArg(4, diff_div);
+	kernel_relax_sor.setArg(5, relaxation.omega);
+	kernel_relax_sor.setArg(7, relax_state);
+	kernel_relax_sor.setArg(8, slot);
+	kernel_relax_residual.setArg(0, input_output);
+	kernel_relax_residual.setArg(1, src);
+	kernel_relax_residual.setArg(2, diff);
+	kernel_relax_residual.setArg(3, diff_div);
+	kernel_relax_residual.setArg(4, relax_sums);
+	kernel_relax_residual.setArg(5, width);
+	kernel_relax_residual.setArg(6, height);
+	kernel_relax_residual.setArg(7, relax_state);
+	kernel_relax_residual.setArg(8, slot);
+	kernel_relax_check.setArg(0, relax_sums);
+	kernel_relax_check.setArg(1, height);
+	kernel_relax_check.setArg(2, relaxation.tolerance);
+	kernel_relax_check.setArg(4, relax_state);
+	kernel_relax_check.setArg(5, slot);
+	if (sparse) {
+		kernel_relax_sor.setArg(9, tile_lists[tiles]);
+		kernel_relax_residual.setArg(9, tile_flags[tiles]);
+	}
+	for (unsigned int k = 1; k <= relaxation.max_iterations; ++k) {
+		// red: input_output -> diffuse_tmp, black: diffuse_tmp -> input_output
+		for (int color = 0; color < 2; ++color) {
+			kernel_relax_sor.setArg(0, color ? diffuse_tmp : input_output);
+			kernel_relax_sor.setArg(1, color ? input_output : diffuse_tmp);
+			kernel_relax_sor.setArg(6, color);
+			enqueue_cells(kernel_relax_sor, origin_work, region_work, cl::NullRange, tiles);
+		}
+		if (k % relaxation.check_interval == 0 && k < relaxation.max_iterations) {
+			profiler.enqueueKernel(queue, kernel_relax_residual, cl::NDRange(0), cl::NDRange(height), cl::NullRange);
+			kernel_relax_check.setArg(3, (int)k);
+			profiler.enqueueKernel(queue, kernel_relax_check, cl::NDRange(0), cl::NDRange(RELAX_GROUP), cl::NDRange(RELAX_GROUP));
+		}
 	}
 }
 
 inline void FluidSolver::advect(cl::Image2D & dest, const cl::Image2D & src, cl::Image2D & img_u, cl::Image2D & img_v, float dt, int bound)
+{
+	if (advection_scheme == AdvectionScheme::SemiLagrangian) {
+		advect_pass(dest, src, img_u, img_v, dt);
+		return;
+	}
+	// forward, back along the same velocity, then the correction from the three fields
+	advect_pass(advect_ahead, src, img_u, img_v, dt);
+	advect_pass(advect_back, advect_ahead, img_u, img_v, -dt);
+	kernel_advect_correct.setArg(0, src);
+	kernel_advect_correct.setArg(1, advect_ahead);
+	kernel_advect_correct.setArg(2, advect_back);
+	kernel_advect_correct.setArg(3, dest);
+	kernel_advect_correct.setArg(4, img_u);
+	kernel_advect_correct.setArg(5, img_v);
+	kernel_advect_correct.setArg(6, dt);
+	kernel_advect_correct.setArg(7, width);
+	kernel_advect_correct.setArg(8, height);
+	kernel_advect_correct.setArg(9, (int)(advection_scheme == AdvectionScheme::BFECC));
+	enqueue_cells(kernel_advect_correct, origin_work_center, region_work_center, cl::NullRange);
+}
+
+inline void FluidSolver::advect_pass(cl::Image2D & dest, const cl::Image2D & src, cl::Image2D & img_u, cl::Image2D & img_v, float dt)
 {
 	kernel_advect.setArg(0, src);
 	kernel_advect.setArg(1, dest);
 	kernel_advect.setArg(2, img_u);
 	kernel_advect.setArg(3, img_v);
 	kernel_advect.setArg(4, dt);
-	kernel_advect.setArg(5, WIDTH);
-	kernel_advect.setArg(6, HEIGHT);
-	queue.enqueueNDRangeKernel(kernel_advect, origin_work_center, region_work_center, cl::NullRange);
+	kernel_advect.setArg(5, width);
+	kernel_advect.setArg(6, height);
+	enqueue_cells(kernel_advect, origin_work_center, region_work_center, cl::NullRange);
+}
+
+void FluidSolver::advect_velocity_divergence(float dt)
+{
+	// the border cells are not advected: the halo reads them in (u_in, v_in), copied from (u_out, v_out) by project2
+	kernel_advect_velocity_divergence.setArg(0, u_in);
+	kernel_advect_velocity_divergence.setArg(1, v_in);
+	kernel_advect_velocity_divergence.setArg(2, u_out);
+	kernel_advect_velocity_divergence.setArg(3, v_out);
+	kernel_advect_velocity_divergence.setArg(4, tmp_project1);
+	kernel_advect_velocity_divergence.setArg(5, dt);
+	kernel_advect_velocity_divergence.setArg(6, width);
+	kernel_advect_velocity_divergence.setArg(7, height);
+	kernel_advect_velocity_divergence.setArg(8, 1.0f / width);
+	kernel_advect_velocity_divergence.setArg(9, 1.0f / height);
+	enqueue_cells(kernel_advect_velocity_divergence, origin_work, region_work_tiled, local_work_tiled);
 }
 
-inline void FluidSolver::project(cl::Image2D & img_u, cl::Image2D & img_v)
+void FluidSolver::project_advect_density(float dt)
 {
-	constexpr float hx = 1.0f / WIDTH, hy = 1.0f / HEIGHT;
+	kernel_project2_advect.setArg(0, tmp_project2);
+	kernel_project2_advect.setArg(1, u_out);
+	kernel_project2_advect.setArg(2, v_out);
+	kernel_project2_advect.setArg(3, u_in);
+	kernel_project2_advect.setArg(4, v_in);
+	kernel_project2_advect.setArg(5, density_out);
+	kernel_project2_advect.setArg(6, density_in);
+	kernel_project2_advect.setArg(7, dt);
+	kernel_project2_advect.setArg(8, width);
+	kernel_project2_advect.setArg(9, height);
+	enqueue_cells(kernel_project2_advect, origin_work, region_work, cl::NullRange);
+}
+
+inline void FluidSolver::project(const cl::Image2D & img_u, const cl::Image2D & img_v, cl::Image2D & out_u, cl::Image2D & out_v)
+{
+	const float hx = 1.0f / width, hy = 1.0f / height;
 
 	kernel_project1.setArg(0, tmp_project1);
 	kernel_project1.setArg(1, img_u);
 	kernel_project1.setArg(2, img_v);
 	kernel_project1.setArg(3, hx);
 	kernel_project1.setArg(4, hy);
-	queue.enqueueNDRangeKernel(kernel_project1, origin_work_center, region_work_center, cl::NullRange);
+	enqueue_cells(kernel_project1, origin_work_center, region_work_center, cl::NullRange);
 
-	kernel_reset.setArg(0, tmp_project2);
-	queue.enqueueNDRangeKernel(kernel_reset, cl::NDRange(0, 0), cl::NDRange(WIDTH, HEIGHT), cl::NullRange);
-	diffuse(tmp_project2, tmp_project1, 1.0f, 4.0f, 0);
+	solve_pressure();
 
 	kernel_project2.setArg(0, tmp_project2);
-	kernel_project2.setArg(1, buffer_u);
-	kernel_project2.setArg(2, buffer_v);
-	kernel_project2.setArg(3, WIDTH);
-	kernel_project2.setArg(4, HEIGHT);
-	queue.enqueueCopyImageToBuffer(img_u, buffer_u, origin, region, 0);
-	queue.enqueueCopyImageToBuffer(img_v, buffer_v, origin, region, 0);
-	queue.enqueueNDRangeKernel(kernel_project2, origin_work_center, region_work_center, cl::NullRange);
-}
\ No newline at end of file
+	kernel_project2.setArg(1, img_u);
+	kernel_project2.setArg(2, img_v);
+	kernel_project2.setArg(3, out_u);
+	kernel_project2.setArg(4, out_v);
+	kernel_project2.setArg(5, width);
+	kernel_project2.setArg(6, height);
+	enqueue_cells(kernel_project2, origin_work, region_work, cl::NullRange);
+}
+
+void FluidSolver::solve_pressure()
+{
+	if (sparse && pressure_solver == PressureSolver::Jacobi) {
+		// only the pressure tiles are reset and solved, tmp_project2 holds 0 beyond them: pressure_tmp stands for
+		// diffuse_tmp during the solve, which keeps the 0 of the inactive tiles of the fields
+		reset_tiles(tmp_project2, TILES_PRESSURE);
+		swap(diffuse_tmp, pressure_tmp);
+		diffuse(tmp_project2, tmp_project1, 1.0f, 4.0f, 0, RELAX_PRESSURE + min(pressure_solves++, 1u));
+		swap(diffuse_tmp, pressure_tmp);
+		return;
+	}
+	kernel_reset.setArg(0, tmp_project2);
+	profiler.enqueueKernel(queue, kernel_reset, cl::NDRange(0, 0), cl::NDRange(width, height), cl::NullRange);
+	if (pressure_solver == PressureSolver::Jacobi) {
+		diffuse(tmp_project2, tmp_project1, 1.0f, 4.0f, 0, RELAX_PRESSURE + min(pressure_solves++, 1u));
+		return;
+	}
+	// the diffusions swap the image handles, level 0 follows them
+	levels[0].p = tmp_project2;
+	levels[0].b = tmp_project1;
+	// the convergence test reads one float per row back: one sync per cycle
+	const float norm_b = sqrt(sum_squares(tmp_project1, width, height));
+	pressure_residual = 0.0f;
+	if (norm_b == 0.0f) {
+		return;
+	}
+	for (unsigned int cycle = 0; cycle < multigrid.max_cycles; ++cycle) {
+		vcycle(0);
+		++pressure_cycles;
+		multigrid_residual(0);
+		pressure_residual = sqrt(sum_squares(levels[0].r, width, height)) / norm_b;
+		if (pressure_residual <= multigrid.tolerance) {
+			break;
+		}
+	}
+}
+
+void FluidSolver::multigrid_smooth(size_t level, unsigned int sweeps)
+{
+	// images are not updated in place: red from p to r, black back to p (r is free outside of the residual)
+	const MultigridLevel & l = levels[level];
+	kernel_mg_smooth.setArg(2, l.b);
+	for (unsigned int k = 0; k < sweeps; ++k) {
+		for (int color = 0; color < 2; ++color) {
+			kernel_mg_smooth.setArg(0, color ? l.r : l.p);
+			kernel_mg_smooth.setArg(1, color ? l.p : l.r);
+			kernel_mg_smooth.setArg(3, color);
+			profiler.enqueueKernel(queue, kernel_mg_smooth, origin_work, cl::NDRange(l.width, l.height), cl::NullRange);
+		}
+	}
+}
+
+void FluidSolver::multigrid_residual(size_t level)
+{
+	const MultigridLevel & l = levels[level];
+	kernel_mg_residual.setArg(0, l.p);
+	kernel_mg_residual.setArg(1, l.b);
+	kernel_mg_residual.setArg(2, l.r);
+	profiler.enqueueKernel(queue, kernel_mg_residual, origin_work, cl::NDRange(l.width, l.height), cl::NullRange);
+}
+
+void FluidSolver::vcycle(size_t level)
+{
+	if (level + 1 == levels.size()) {
+		multigrid_smooth(level, multigrid.coarse_sweeps);
+		return;
+	}
+	const MultigridLevel & fine = levels[level];
+	const MultigridLevel & coarse = levels[level + 1];
+	multigrid_smooth(level, multigrid.pre_smoothing);
+	multigrid_residual(level);
+
+	kernel_mg_restrict.setArg(0, fine.r);
+	kernel_mg_restrict.setArg(1, coarse.b);
+	profiler.enqueueKernel(queue, kernel_mg_restrict, origin_work, cl::NDRange(coarse.width, coarse.height), cl::NullRange);
+	kernel_reset.setArg(0, coarse.p);
+	profiler.enqueueKernel(queue, kernel_reset, origin_work, cl::NDRange(coarse.width, coarse.height), cl::NullRange);
+
+	vcycle(level + 1);
+
+	// corrected solution in r (read by the restriction already), copied back to p
+	kernel_mg_prolongate.setArg(0, coarse.p);
+	kernel_mg_prolongate.setArg(1, fine.p);
+	kernel_mg_prolongate.setArg(2, fine.r);
+	profiler.enqueueKernel(queue, kernel_mg_prolongate, origin_work, cl::NDRange(fine.width, fine.height), cl::NullRange);
+	cl::size_t<3> fine_region;
+	fine_region[0] = fine.width;
+	fine_region[1] = fine.height;
+	fine_region[2] = 1;
+	queue.enqueueCopyImage(fine.r, fine.p, origin, origin, fine_region, nullptr, profiler.event());
+	const size_t t = (storage_precision == StoragePrecision::Half) ? sizeof(uint16_t) : sizeof(float);
+	profiler.record("copyImage", fine.width * fine.height * 2 * t);
+	multigrid_smooth(level, multigrid.post_smoothing);
+}
+
+float FluidSolver::sum_squares(const cl::Image2D & img, int img_width, int img_height)
+{
+	kernel_sum_squares.setArg(0, img);
+	kernel_sum_squares.setArg(1, buffer_sums);
+	kernel_sum_squares.setArg(2, img_width);
+	profiler.enqueueKernel(queue, kernel_sum_squares, cl::NDRange(0), cl::NDRange(img_height), cl::NullRange);
+	queue.enqueueReadBuffer(buffer_sums, CL_TRUE, 0, img_height * sizeof(float), sums.data(), nullptr, profiler.event());
+	profiler.record("readSums", img_height * sizeof(float));
+	double sum = 0.0;
+	for (int y = 0; y < img_height; ++y) {
+		sum += sums[y];
+	}
+	return (float)sum;
+}
+
+void FluidSolver::set_sparse_tiles(bool enabled)
+{
+	sparse = enabled;
+}
+
+unsigned int FluidSolver::get_nb_tiles() const
+{
+	return tiles_x*tiles_y;
+}
+
+unsigned int FluidSolver::count_active_tiles()
+{
+	if (!sparse) {
+		return get_nb_tiles();
+	}
+	vector<uint8_t> flags(get_nb_tiles());
+	queue.enqueueReadBuffer(tile_flags[TILES_ACTIVE], CL_TRUE, 0, flags.size(), flags.data());
+	return (unsigned int)count(flags.begin(), flags.end(), 1);
+}
+
+void FluidSolver::update_tiles()
+{
+	// occupancy of the active tiles, dilation and halo: the tiles leaving the active ones or the pressure solve retire
+	const cl::NDRange all_tiles(tiles_x, tiles_y);
+	kernel_tile_occupancy.setArg(0, density_in);
+	kernel_tile_occupancy.setArg(1, u_in);
+	kernel_tile_occupancy.setArg(2, v_in);
+	profiler.enqueueKernel(queue, kernel_tile_occupancy, origin_work, all_tiles, cl::NullRange);
+	profiler.enqueueKernel(queue, kernel_tile_dilate, origin_work, all_tiles, cl::NullRange);
+	profiler.enqueueKernel(queue, kernel_tile_halo, origin_work, all_tiles, cl::NullRange);
+	// the four lists are built in any order and their numbers are read back (one sync per update, OpenCL 1.2 has
+	// no indirect dispatch); the launches cover a multiple of 1/16 of the tiles, so the tuner only sees a few
+	// global sizes, the work items past the list return
+	const unsigned int granule = max(1u, get_nb_tiles() / 16);
+	static const cl_int zero = 0;
+	for (int i = 0; i < TILE_LISTS; ++i) {
+		queue.enqueueWriteBuffer(tile_lists[i], CL_FALSE, 0, sizeof(cl_int), &zero);
+		kernel_list_tiles.setArg(0, tile_flags[i]);
+		kernel_list_tiles.setArg(1, tile_lists[i]);
+		profiler.enqueueKernel(queue, kernel_list_tiles, cl::NDRange(0), cl::NDRange(get_nb_tiles()), cl::NullRange);
+		queue.enqueueReadBuffer(tile_lists[i], (i + 1 == TILE_LISTS) ? CL_TRUE : CL_FALSE, 0, sizeof(cl_int), &tile_counts[i],
+			nullptr, profiler.event());
+		profiler.record("readTileCount", sizeof(cl_int));
+	}
+	for (int i = 0; i < TILE_LISTS; ++i) {
+		listed_tiles[i] = ((unsigned int)tile_counts[i] + granule - 1) / granule * granule;
+	}
+	// every cell of an inactive tile holds 0 in the fields, what the kernels and the samples reading across its edge
+	// expect, and the pressure images hold 0 beyond the pressure tiles, whose solves only reset their own cells
+	cl::Image2D* fields[] = { &density_in, &density_out, &u_in, &u_out, &v_in, &v_out, &diffuse_tmp, &tmp_project1,
+		&advect_ahead, &advect_back };
+	for (auto img : fields) {
+		if ((*img)()) {
+			reset_tiles(*img, TILES_RETIRED);
+		}
+	}
+	reset_tiles(tmp_project2, TILES_RETIRED_PRESSURE);
+	reset_tiles(pressure_tmp, TILES_RETIRED_PRESSURE);
+}
+
+void FluidSolver::enqueue_cells(cl::Kernel & kernel, const cl::NDRange & offset, const cl::NDRange & global, const cl::NDRange & local,
+	int tiles)
+{
+	if (!sparse) {
+		profiler.enqueueKernel(queue, kernel, offset, global, local);
+	} else if (listed_tiles[tiles] > 0) {
+		profiler.enqueueKernel(queue, kernel, origin_work, cl::NDRange(listed_tiles[tiles] * DIFFUSE_TILE_WIDTH, DIFFUSE_TILE_HEIGHT), local);
+	}
+}
+
+void FluidSolver::reset_tiles(cl::Image2D & img, int tiles)
+{
+	kernel_reset_tiles.setArg(0, img);
+	kernel_reset_tiles.setArg(1, tile_lists[tiles]);
+	enqueue_cells(kernel_reset_tiles, origin_work, region_work, cl::NullRange, tiles);
+}
+
+void FluidSolver::activate_tiles(int x0, int y0, int x1, int y1)
+{
+	if (!sparse || x1 <= x0 || y1 <= y0) {
+		return;
+	}
+	const int tx0 = x0 / (int)DIFFUSE_TILE_WIDTH, ty0 = y0 / (int)DIFFUSE_TILE_HEIGHT;
+	kernel_tile_activate.setArg(0, tile_flags[TILES_ACTIVE]);
+	profiler.enqueueKernel(queue, kernel_tile_activate, cl::NDRange(tx0, ty0),
+		cl::NDRange((x1 - 1) / (int)DIFFUSE_TILE_WIDTH - tx0 + 1, (y1 - 1) / (int)DIFFUSE_TILE_HEIGHT - ty0 + 1), cl::NullRange);
+}
+
+void FluidSolver::activate_all_tiles()
+{
+	if (!sparse) {
+		return;
+	}
+	// the next update retires the empty tiles and resets their cells
+	for (int i : { TILES_ACTIVE, TILES_PRESSURE }) {
+		kernel_tile_activate.setArg(0, tile_flags[i]);
+		profiler.enqueueKernel(queue, kernel_tile_activate, origin_work, cl::NDRange(tiles_x, tiles_y), cl::NullRange);
+	}
+}
@@ -4,36 +4,130 @@
 #include <iostream>
 #include <fstream>
 #include <CL/cl.hpp>
-#include <SFML/Graphics.hpp>
 
-class FluidSolver
+#include "AdvectionScheme.hpp"
+#include "FluidSolverBase.h"
+#include "FrameReadback.hpp"
+#include "HalfFloat.hpp"
+#include "KernelProfiler.hpp"
+#include "PressureSolver.hpp"
+#include "SplatBatch.hpp"
+#include "WorkGroupTuner.hpp"
+
+/** OpenCL implementation of the 2D solver */
+class FluidSolver : public FluidSolverBase
 {
 public:
-	/** Constructor */
+	/** Grid and display of Config.h: the screen size divided by GRID_DOWNSCALE, displayed at the screen size */
 	FluidSolver();
+	/** Grid of width x height cells, independent of the size of the displayed image */
+	FluidSolver(int width, int height);
 	/** Destructor */
 	virtual ~FluidSolver();
-	/** Initialize the gpu and the internal buffer required to the simulation */
-	void initialization();
-	/** Update the simulation */
-	void update(float dt);
-	/** Add density "intensity" of fluid in the circle of radius "radius" centered at (x,y) */
-	void add_pressure(int x, int y, int radius, float intensity);
-	/** Add the velocity (dx,dy) vector to the velocity field in the circle of radius "radius" centered at (x,y) */
-	void add_velocity(int x, int y, float dx, float dy, float force, int radius);
-	/** Used to synchronize the gpu image buffer with any RGBA uint8_t array */
-	void set_data_image(cl_uint8* img);
-	/** Update the array "ptr" passed in the function "set_data_image(ptr)" */
-	void update_image();
-	/** Reset the simulation (the density and velocity fields will be set to 0 everywhere) */
-	void reset();
+	void initialization() override;
+	void update(float dt) override;
+	void add_pressure(int x, int y, int radius, float intensity) override;
+	void add_velocity(int x, int y, float dx, float dy, float force, int radius) override;
+	void set_display_size(int width, int height) override;
+	void set_data_image(uint8_t* img) override;
+	void update_image() override;
+	const uint8_t* latest_image() override;
+	void reset() override;
+	void finish() override;
+	void read_density(std::vector<float> & out) override;
+	int get_width() const override;
+	int get_height() const override;
+	bool save_state(const std::string & filename) override;
+	bool load_state(const std::string & filename) override;
+	unsigned long long get_step() const override;
+	/** Device timings of the enqueued commands, enable it before initialization */
+	KernelProfiler & get_profiler();
+	/** Local sizes of the launches, loaded from the tuning file of the device by initialization */
+	WorkGroupTuner & get_tuner();
+	/** After initialization: time the local sizes of every launch of "steps" updates and of the image, then
+	* the tiled diffuse and the fused velocity kernels against the separate ones, write the tuning file
+	* of the device and restore the fields */
+	void tune_work_groups(unsigned int steps);
+	/** Precision of the field images (float by default), before initialization: CL_HALF_FLOAT images
+	* halve the memory traffic, the kernels still compute in float. Float is kept if the device lacks them */
+	void set_storage_precision(StoragePrecision precision);
+	StoragePrecision get_storage_precision() const;
+	/** Select the solver of the pressure equation (Jacobi by default) */
+	void set_pressure_solver(PressureSolver solver, const MultigridSettings & settings = MultigridSettings());
+	/** Multigrid V-cycles done by the last update (both projections) */
+	unsigned int get_pressure_cycles() const;
+	/** Relative residual |r|/|b| reached by the last multigrid solve */
+	float get_pressure_residual() const;
+	/** Stop the diffusions and the Jacobi pressure solves on their residual (off by default) */
+	void set_relaxation(const RelaxationSettings & settings);
+	/** Sweeps of the solves of the latest update whose counts reached the host: with the relaxation
+	* they are read back without waiting, so they may lag the updates by a step */
+	SolverIterations get_solver_iterations();
+	/** Queue a source applied at the beginning of the next update (or the next readback), with every other
+	* source in a single launch: "density" and the velocity (dx,dy) are added in the circle of radius "radius"
+	* centered at (x,y), scaled by (1 - d^2/r^2)^falloff (0 = the same amount in the whole circle) */
+	void add_splat(int x, int y, int radius, float density, float dx, float dy, float falloff = 0.0f);
+	/** Select the advection scheme (semi-Lagrangian by default); MacCormack and BFECC allocate two images on
+	* first use, run three launches per advected field and replace the fused velocity kernels by the separate ones */
+	void set_advection_scheme(AdvectionScheme scheme);
+	AdvectionScheme get_advection_scheme() const;
+	/** Track the DIFFUSE_TILE tiles holding density or velocity (off by default), before initialization:
+	* the main kernels only run on the active tiles, so the work and the memory traffic follow the occupied area */
+	void set_sparse_tiles(bool enabled);
+	/** Active tiles and number of tiles, blocking */
+	unsigned int count_active_tiles();
+	unsigned int get_nb_tiles() const;
 protected:
 	void cl_init();
 	void program_init();
-	void add_source(cl::Image2D & in_out, int x, int y, int radius, float intensity);
+	/** Apply the queued splats */
+	void flush_splats();
+	/** Advect src to dest with the selected scheme */
 	void advect(cl::Image2D & dest, const cl::Image2D & src, cl::Image2D & img_u, cl::Image2D & img_v, float dt, int bound);
-	void project(cl::Image2D & img_u, cl::Image2D & img_v);
-	void diffuse(cl::Image2D & input_output, const cl::Image2D & src, float diff, float diff_div, int bound);
+	/** One semi-Lagrangian launch */
+	void advect_pass(cl::Image2D & dest, const cl::Image2D & src, cl::Image2D & img_u, cl::Image2D & img_v, float dt);
+	/** Images and kernel of the higher order advections */
+	void advection_init();
+	/** Advect (u_in, v_in) by itself to (u_out, v_out) and write its divergence in tmp_project1, one launch */
+	void advect_velocity_divergence(float dt);
+	/** Subtract the gradient of tmp_project2 from (u_out, v_out) to (u_in, v_in)
+	* and advect density_out to density_in with this velocity, one launch */
+	void project_advect_density(float dt);
+	/** Remove the divergence of (img_u, img_v), the result goes to (out_u, out_v) */
+	void project(const cl::Image2D & img_u, const cl::Image2D & img_v, cl::Image2D & out_u, cl::Image2D & out_v);
+	void diffuse(cl::Image2D & input_output, const cl::Image2D & src, float diff, float diff_div, int bound, int slot);
+	/** DIFFUSE_FUSED_ITERATIONS Jacobi iterations per launch, ping-pong between input_output and diffuse_tmp,
+	* over the TileList "tiles" with sparse tiles */
+	void diffuse_tiled(cl::Image2D & input_output, const cl::Image2D & src, float diff, float diff_div, int tiles);
+	/** Red-black SOR sweeps of diffuse until the residual reaches the tolerance, "slot" is the state of the solve */
+	void relax(cl::Image2D & input_output, const cl::Image2D & src, float diff, float diff_div, int slot, int tiles);
+	/** Copy the counts of a finished read of relax_state in solver_iterations, then start a new read if "start" */
+	void poll_iterations(bool start);
+	/** Solve the pressure equation: tmp_project2 from the divergence in tmp_project1 */
+	void solve_pressure();
+	void multigrid_init();
+	void multigrid_smooth(size_t level, unsigned int sweeps);
+	void multigrid_residual(size_t level);
+	void vcycle(size_t level);
+	/** Enqueue the read of a field image in "out" (width*height floats), "staging" holds the halves
+	* to widen with widen_field once the read completed */
+	void read_field(const cl::Image2D & field, float* out, std::vector<uint16_t> & staging, cl::Event* event = nullptr);
+	void widen_field(float* out, const std::vector<uint16_t> & staging) const;
+	/** Enqueue the upload of a field image, "in" (or "staging" for the halves) must stay valid until it completes */
+	void write_field(cl::Image2D & field, const float* in, std::vector<uint16_t> & staging);
+	/** Sum of the squares of the first "height" rows of an image, blocking */
+	float sum_squares(const cl::Image2D & img, int img_width, int img_height);
+	/** Retire the empty tiles, activate their neighbours and list the tiles, at the beginning of an update */
+	void update_tiles();
+	/** Launch a main kernel over (offset, global), or over the cells of the TileList "tiles" (sparse tiles) */
+	void enqueue_cells(cl::Kernel & kernel, const cl::NDRange & offset, const cl::NDRange & global, const cl::NDRange & local,
+		int tiles = TILES_ACTIVE);
+	/** Reset an image over the cells of the TileList "tiles" */
+	void reset_tiles(cl::Image2D & img, int tiles);
+	/** Activate the tiles of the cells [x0, x1[ x [y0, y1[ (the sources) */
+	void activate_tiles(int x0, int y0, int x1, int y1);
+	/** Activate every tile and put it in the pressure solve, after the fields were written on the whole grid */
+	void activate_all_tiles();
 	// opencl
 	std::vector<cl::Platform> all_platforms;
 	cl::Platform default_platform;
@@ -41,35 +135,115 @@ protected:
 	cl::Context context;
 	cl::CommandQueue queue;
 	cl::Program program;
+	KernelProfiler profiler;
+	FrameReadback readback;// staging images of latest_image
+	SplatBatch splats;// sources added since the last step
+	WorkGroupTuner tuner;
+	// grid and displayed image sizes
+	int width;
+	int height;
+	int display_width;
+	int display_height;
 	// utility variables
 	cl::size_t<3> origin;
 	cl::size_t<3> region;
 	cl::size_t<3> regionf;
+	cl::size_t<3> region_display;
 	cl::NDRange origin_work;
 	cl::NDRange region_work;
 	cl::NDRange origin_work_center;
 	cl::NDRange region_work_center;
+	cl::NDRange region_work_display;
+	cl::NDRange region_work_tiled;// region_work rounded up to whole tiles
+	cl::NDRange local_work_tiled;
 	// opencl kernels
 	cl::Kernel kernel_diffuse;
+	cl::Kernel kernel_diffuse_tiled;
 	cl::Kernel kernel_advect;
+	cl::Kernel kernel_advect_correct;
 	cl::Kernel kernel_project1;
 	cl::Kernel kernel_project2;
+	cl::Kernel kernel_advect_velocity_divergence;
+	cl::Kernel kernel_project2_advect;
 	cl::Kernel kernel_reset;
-	cl::Kernel kernel_addsource;
+	cl::Kernel kernel_splat;
 	cl::Kernel kernel_draw_img;
+	cl::Kernel kernel_mg_smooth;
+	cl::Kernel kernel_mg_residual;
+	cl::Kernel kernel_mg_restrict;
+	cl::Kernel kernel_mg_prolongate;
+	cl::Kernel kernel_sum_squares;
+	cl::Kernel kernel_relax_reset;
+	cl::Kernel kernel_relax_sor;
+	cl::Kernel kernel_relax_residual;
+	cl::Kernel kernel_relax_check;
+	cl::Kernel kernel_tile_occupancy;
+	cl::Kernel kernel_tile_dilate;
+	cl::Kernel kernel_tile_halo;
+	cl::Kernel kernel_tile_activate;
+	cl::Kernel kernel_list_tiles;
+	cl::Kernel kernel_reset_tiles;
 	// gpu memory structures
-	cl_uint8* data_image;// pointer on the sfml image memory
+	StoragePrecision storage_precision = StoragePrecision::Float;
+	cl::ImageFormat field_format;// format of the fields and of the solver temporaries
+	uint8_t* data_image;// pointer on the sfml image memory
 	cl::Image2D density_in;
 	cl::Image2D density_out;
 	cl::Image2D tmp_project1;
 	cl::Image2D tmp_project2;
-	cl::Buffer buffer_u;
-	cl::Buffer buffer_v;
+	cl::Image2D diffuse_tmp;// second image of the diffusions
+	cl::Image2D splat_box[3];// staging of the splat box (density, u, v), grown to the largest box
+	int splat_box_width = 0;
+	int splat_box_height = 0;
+	bool tiled_diffuse = true;// DIFFUSE_FUSED_ITERATIONS iterations per launch, else a launch of "diffuse" per iteration
+	bool fused_velocity = true;// advect_velocity_divergence and project_advect_density
 	cl::Image2D u_in;
 	cl::Image2D u_out;
 	cl::Image2D v_in;
 	cl::Image2D v_out;
 	cl::Image2D image;
+	// passes of the higher order advections, their borders stay at 0 like the borders of the fields
+	AdvectionScheme advection_scheme = AdvectionScheme::SemiLagrangian;
+	cl::Image2D advect_ahead;
+	cl::Image2D advect_back;
+	// multigrid hierarchy, level 0 is (tmp_project2, tmp_project1) at full resolution
+	struct MultigridLevel
+	{
+		int width;
+		int height;
+		cl::Image2D p;// solution
+		cl::Image2D b;// right hand side
+		cl::Image2D r;// residual, also the scratch image of the smoothing and the prolongation
+	};
+	std::vector<MultigridLevel> levels;
+	cl::Buffer buffer_sums;
+	std::vector<float> sums;
+	PressureSolver pressure_solver = PressureSolver::Jacobi;
+	MultigridSettings multigrid;
+	unsigned int pressure_cycles = 0;
+	float pressure_residual = 0.0f;
+	// residual driven solves, one slot of relax_state (converged flag, sweeps) per solve of an update
+	enum RelaxSlot { RELAX_U, RELAX_V, RELAX_PRESSURE, RELAX_DENSITY = RELAX_PRESSURE + 2, RELAX_SLOTS };
+	RelaxationSettings relaxation;
+	cl::Buffer relax_state;
+	cl::Buffer relax_sums;// |r|^2 then |b|^2 of each row
+	int relax_counts[2 * RELAX_SLOTS];// destination of the asynchronous read of relax_state
+	cl::Event relax_read;
+	bool relax_reading = false;
+	unsigned int pressure_solves = 0;// projections of the current update
+	SolverIterations solver_iterations;
+	// sparse tiles, one flag per DIFFUSE_TILE tile: the lists hold a count, then the indices of the tiles
+	enum TileList { TILES_ACTIVE, TILES_PRESSURE, TILES_RETIRED, TILES_RETIRED_PRESSURE, TILE_LISTS };
+	bool sparse = false;
+	int tiles_x = 0;
+	int tiles_y = 0;
+	cl::Buffer tile_flags[TILE_LISTS];// active, active and their halo (pressure solve), leaving each of them
+	cl::Buffer tiles_occupied;
+	cl::Buffer tile_lists[TILE_LISTS];
+	cl_int tile_counts[TILE_LISTS];// read back from the lists
+	unsigned int listed_tiles[TILE_LISTS] = {};// tiles covered by the launches, the listed ones rounded up
+	cl::Image2D pressure_tmp;// diffuse_tmp of the sparse Jacobi pressure solves, 0 beyond the pressure tiles
+	unsigned long long step = 0;
 };
 
 #endif
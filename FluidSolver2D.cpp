@@ -3,15 +3,83 @@
 #include <CL/cl.hpp>
 #include <SFML/Graphics.hpp>
 #include <math.h>
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <memory>
+#include <string>
 
 #include "FluidSolver2D.h"
 #include "FluidSolver.h"
+#include "FluidSolverCPU.h"
+#include "InputTrace.hpp"
+#include "SimulationThread.hpp"
 #include "Config.h"
 
 using namespace std;
 
-/** Entry point of the application*/
-int main() {
+/** Entry point of the application
+* --cpu runs the native engine instead of OpenCL
+* --grid WxH sets the simulation grid (default: the screen size / GRID_DOWNSCALE), the image is upscaled to the window
+* --profile FILE writes the device time of every kernel in FILE (.csv or .json) at exit
+* --state FILE resumes the simulation saved in FILE (S saves the simulation in FILE, L reloads it)
+* --record FILE writes every input in the trace FILE, --replay FILE runs the inputs of a trace (on its grid)
+* --tune times the work-group sizes of the kernels at startup and writes them in the tuning file of the device
+* --advection semi|maccormack|bfecc selects the advection scheme of the OpenCL solver (default semi)
+* The solver runs on its own thread (see SimulationThread.hpp), this thread only handles the window */
+int main(int argc, char** argv) {
+	SolverBackend backend = SolverBackend::OpenCL;
+	int grid_width = WIDTH / GRID_DOWNSCALE;
+	int grid_height = HEIGHT / GRID_DOWNSCALE;
+	string profile_file;
+	string state_file = "fluid.state";
+	bool resume = false;
+	string record_file;
+	string replay_file;
+	bool tune = false;
+	AdvectionScheme advection = AdvectionScheme::SemiLagrangian;
+	for (int i = 1; i < argc; ++i) {
+		if (string(argv[i]) == "--cpu") {
+			backend = SolverBackend::CPU;
+		} else if (string(argv[i]) == "--grid" && i + 1 < argc) {
+			if (sscanf(argv[++i], "%dx%d", &grid_width, &grid_height) != 2 || grid_width < 8 || grid_height < 8) {
+				cout << " Wrong grid size, expected WxH\n";
+				return 1;
+			}
+		} else if (string(argv[i]) == "--profile" && i + 1 < argc) {
+			profile_file = argv[++i];
+		} else if (string(argv[i]) == "--state" && i + 1 < argc) {
+			state_file = argv[++i];
+			resume = true;
+		} else if (string(argv[i]) == "--record" && i + 1 < argc) {
+			record_file = argv[++i];
+		} else if (string(argv[i]) == "--replay" && i + 1 < argc) {
+			replay_file = argv[++i];
+		} else if (string(argv[i]) == "--tune") {
+			tune = true;
+		} else if (string(argv[i]) == "--advection" && i + 1 < argc) {
+			if (!parseAdvectionScheme(argv[++i], advection)) {
+				cout << " Unknown advection scheme, expected semi, maccormack or bfecc\n";
+				return 1;
+			}
+		}
+	}
+	// a replay runs on the grid and with the time step of the recording, the live input is ignored
+	InputTrace::Player player;
+	float simulation_dt = SIMULATION_DT;
+	if (!replay_file.empty()) {
+		if (!player.open(replay_file)) {
+			return 1;
+		}
+		grid_width = (int)player.header().width;
+		grid_height = (int)player.header().height;
+		simulation_dt = player.header().dt;
+	}
+	InputTrace::Recorder recorder;
+	if (!record_file.empty() && !recorder.open(record_file, grid_width, grid_height, 1, simulation_dt)) {
+		return 1;
+	}
+
 	// constants:
 	constexpr float initial_radius = 10.0f;
 	constexpr float velocity_add = 0.01f;
@@ -32,15 +100,99 @@ int main() {
 	sprite.setPosition(0, 0);
 
 	// fluid simulation solver init
-	FluidSolver fluid;
+	unique_ptr<FluidSolverBase> fluid_ptr;
+	FluidSolver* opencl_solver = nullptr;
+	if (backend == SolverBackend::CPU) {
+		fluid_ptr.reset(new FluidSolverCPU(grid_width, grid_height, CPU_THREADS));
+		if (!profile_file.empty()) {
+			cout << " Warning: --profile needs the OpenCL solver\n";
+		}
+		if (advection != AdvectionScheme::SemiLagrangian) {
+			cout << " Warning: --advection needs the OpenCL solver\n";
+		}
+	} else {
+		opencl_solver = new FluidSolver(grid_width, grid_height);
+		opencl_solver->get_profiler().setEnabled(!profile_file.empty());
+		opencl_solver->set_advection_scheme(advection);
+		fluid_ptr.reset(opencl_solver);
+	}
+	FluidSolverBase & fluid = *fluid_ptr;
+	fluid.set_display_size(WIDTH, HEIGHT);
 	fluid.initialization();
-	cl_uint8* pixelData = (cl_uint8*)image.getPixelsPtr();
-	fluid.set_data_image(pixelData);
+	if (tune) {
+		if (opencl_solver) {
+			opencl_solver->tune_work_groups(WORK_GROUP_TUNING_STEPS);
+		} else {
+			cout << " Warning: --tune needs the OpenCL solver\n";
+		}
+	}
+	if (resume) {
+		fluid.load_state(state_file);
+	}
+
+	// from here the solver is only used by the simulation thread
+	unsigned long long steps = 0;// updates run by the simulation thread
+	auto apply = [&](const InputCommand & command) {
+		recorder.record(steps, command);
+		switch (command.type) {
+		case InputCommand::Pressure:
+			fluid.add_pressure(command.x, command.y, command.radius, command.intensity);
+			break;
+		case InputCommand::Velocity:
+			fluid.add_velocity(command.x, command.y, command.dx, command.dy, command.force, command.radius);
+			break;
+		case InputCommand::Reset:
+			fluid.reset();
+			break;
+		case InputCommand::SaveState:
+			fluid.save_state(state_file);
+			break;
+		case InputCommand::LoadState:
+			fluid.load_state(state_file);
+			break;
+		default:
+			break;
+		}
+	};
+	SimulationThread::Callbacks callbacks;
+	callbacks.apply = [&](const InputCommand & command) {
+		if (replay_file.empty()) {
+			apply(command);
+		}
+	};
+	callbacks.step = [&](float dt) {
+		if (!replay_file.empty()) {
+			if (steps == player.header().nb_steps) {
+				cout << " Replay finished (" << steps << " steps)\n";
+			}
+			player.apply(steps, apply);
+		}
+		fluid.update(dt);
+		++steps;
+	};
+	callbacks.draw = [&](uint8_t* pixels) {
+		// the frame is drawn and transferred in the background, the newest completed one is published:
+		// the device queue is not drained (the readback only waits when all its slots are in flight)
+		const uint8_t* frame = fluid.latest_image();
+		if (opencl_solver) {
+			opencl_solver->get_profiler().endFrame();
+		}
+		if (!frame) {
+			return false;
+		}
+		memcpy(pixels, frame, (size_t)WIDTH*HEIGHT * 4);
+		return true;
+	};
+	SimulationThread simulation((size_t)WIDTH*HEIGHT * 4, simulation_dt, SIMULATION_MAX_SUBSTEPS, callbacks);
+	simulation.start();
 
 	// other variables
 	sf::Clock deltaClock;
 	sf::Vector2f pos0; // for the mouse
 	float radius = initial_radius; // mouse radius
+	// the mouse positions are in window pixels, the solver works in grid cells
+	const float to_grid_x = (float)grid_width / WIDTH;
+	const float to_grid_y = (float)grid_height / HEIGHT;
 
 	// main loop
 	while (window.isOpen()){
@@ -58,7 +210,13 @@ int main() {
 					window.close();
 				}
 				if (event.key.code == sf::Keyboard::Space) {
-					fluid.reset();
+					simulation.post({ InputCommand::Reset });
+				}
+				if (event.key.code == sf::Keyboard::S) {
+					simulation.post({ InputCommand::SaveState });
+				}
+				if (event.key.code == sf::Keyboard::L) {
+					simulation.post({ InputCommand::LoadState });
 				}
 			}
 			if (event.type == sf::Event::MouseWheelMoved) {
@@ -68,23 +226,42 @@ int main() {
 				sf::Vector2f pos = window.mapPixelToCoords(sf::Mouse::getPosition(window));
 				sf::Vector2f delta = pos - pos0;
 				if(delta.x < 100.f && delta.y < 100.f) {
-					fluid.add_velocity((int)pos.x, (int)pos.y, delta.x, delta.y, velocity_add, (int)radius);
+					InputCommand command{ InputCommand::Velocity };
+					command.x = (int)(pos.x*to_grid_x);
+					command.y = (int)(pos.y*to_grid_y);
+					command.radius = max(1, (int)(radius*to_grid_x));
+					command.dx = delta.x;
+					command.dy = delta.y;
+					command.force = velocity_add;
+					simulation.post(command);
 				}
 				pos0 = window.mapPixelToCoords(sf::Mouse::getPosition(window));
 			}
 		}
 		if (sf::Mouse::isButtonPressed(sf::Mouse::Left)) {
 			sf::Vector2f pos = window.mapPixelToCoords(sf::Mouse::getPosition(window));
-			fluid.add_pressure((int)pos.x, (int)pos.y, (int)radius, mouse_pressure_increment*dt);
+			InputCommand command{ InputCommand::Pressure };
+			command.x = (int)(pos.x*to_grid_x);
+			command.y = (int)(pos.y*to_grid_y);
+			command.radius = max(1, (int)(radius*to_grid_x));
+			command.intensity = mouse_pressure_increment*dt;
+			simulation.post(command);
 		}
-		// update the simulation
-		fluid.update(dt);
-		fluid.update_image();
+		// newest frame published by the simulation thread, if any since the last display
+		const uint8_t* pixels = simulation.latestFrame();
 		// display 
-		texture.update(image);
+		if (pixels) {
+			texture.update(pixels);
+		}
 		window.clear(sf::Color::Black);
 		window.draw(sprite);
 		window.display();
 	}
+	simulation.stop();
+	recorder.close(steps);
+	if (opencl_solver && !profile_file.empty()) {
+		opencl_solver->get_profiler().print(cout);
+		opencl_solver->get_profiler().write(profile_file);
+	}
 	return 0;
 }
\ No newline at end of file
@@ -1,6 +1,6 @@
 #ifndef FLUID_SOLVER_2D
 #define FLUID_SOLVER_2D
 
-int main();
+int main(int argc, char** argv);
 
 #endif
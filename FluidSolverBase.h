@@ -0,0 +1,53 @@
+#ifndef FLUID_SOLVER_BASE_H
+#define FLUID_SOLVER_BASE_H
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+/** Engines able to run the 2D simulation, selected at startup */
+enum class SolverBackend { OpenCL, CPU };
+
+/** Interface of the 2D solver, implemented by the OpenCL solver (FluidSolver)
+* and by the native multithreaded engine (FluidSolverCPU) */
+class FluidSolverBase
+{
+public:
+	virtual ~FluidSolverBase() {}
+	/** Initialize the engine and the internal buffer required to the simulation */
+	virtual void initialization() = 0;
+	/** Update the simulation */
+	virtual void update(float dt) = 0;
+	/** Add density "intensity" of fluid in the circle of radius "radius" centered at (x,y) */
+	virtual void add_pressure(int x, int y, int radius, float intensity) = 0;
+	/** Add the velocity (dx,dy) vector to the velocity field in the circle of radius "radius" centered at (x,y) */
+	virtual void add_velocity(int x, int y, float dx, float dy, float force, int radius) = 0;
+	/** Size of the displayed image (the grid size by default), the density is upscaled with a bilinear filter.
+	* Must be called before initialization */
+	virtual void set_display_size(int width, int height) = 0;
+	/** Used to synchronize the image with any RGBA uint8_t array of the display size */
+	virtual void set_data_image(uint8_t* img) = 0;
+	/** Update the array "ptr" passed in the function "set_data_image(ptr)" */
+	virtual void update_image() = 0;
+	/** Non-blocking display path: start the conversion of the current density and return the newest
+	* completed frame (display size RGBA pixels), nullptr if no frame completed since the last call.
+	* The pointer stays valid until the next call. */
+	virtual const uint8_t* latest_image() = 0;
+	/** Reset the simulation (the density and velocity fields will be set to 0 everywhere) */
+	virtual void reset() = 0;
+	/** Block until every queued work is completed */
+	virtual void finish() = 0;
+	/** Copy the density field in "out" (width*height floats, row major) */
+	virtual void read_density(std::vector<float> & out) = 0;
+	/** Size of the simulation grid */
+	virtual int get_width() const = 0;
+	virtual int get_height() const = 0;
+	/** Write every field needed to resume the simulation in "filename" (see StateFile.hpp) */
+	virtual bool save_state(const std::string & filename) = 0;
+	/** Resume a simulation written by save_state, false if the file does not match this grid */
+	virtual bool load_state(const std::string & filename) = 0;
+	/** Number of updates since the initialization, restored by load_state */
+	virtual unsigned long long get_step() const = 0;
+};
+
+#endif
@@ -0,0 +1,355 @@
+#include "FluidSolverCPU.h"
+#include "Config.h"
+#include "SimdStencil.hpp"
+#include "StateFile.hpp"
+
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+#include <iostream>
+
+using namespace std;
+
+/** Conversion of the kernel floatToR: the uchar channels saturate like write_imageui */
+static inline uint8_t saturate(int value)
+{
+	return ((unsigned int)value > 255u) ? 255 : (uint8_t)value;
+}
+
+/** Color of a density, conversion of the kernel floatToR */
+static inline void write_pixel(uint8_t* pixel, float value)
+{
+	pixel[0] = saturate((int)(value * 200.0f));
+	pixel[1] = saturate((int)(value * 56.0f));
+	pixel[2] = saturate((int)(value * 10.f));
+	pixel[3] = 255;
+}
+
+FluidSolverCPU::FluidSolverCPU(unsigned int nb_threads) :
+	FluidSolverCPU(WIDTH / GRID_DOWNSCALE, HEIGHT / GRID_DOWNSCALE, nb_threads)
+{
+	set_display_size(WIDTH, HEIGHT);
+}
+
+FluidSolverCPU::FluidSolverCPU(int width, int height, unsigned int nb_threads) :
+	width(width), height(height), stride(width + 2), pool(nb_threads),
+	display_width(width), display_height(height), data_image(nullptr)
+{
+}
+
+FluidSolverCPU::~FluidSolverCPU()
+{
+}
+
+void FluidSolverCPU::initialization()
+{
+	const size_t size = (size_t)stride*(height + 2);
+	Field* fields[] = { &density_in, &density_out, &tmp_project1, &tmp_project2,
+		&u_in, &u_out, &v_in, &v_out, &jacobi };
+	for (auto field : fields) {
+		field->assign(size, 0.0f);
+	}
+	cout << "Using CPU engine: " << pool.size() << " threads, " << SimdStencil::instructionSet() << endl;
+}
+
+void FluidSolverCPU::add_source(Field & in_out, int x, int y, int radius, float intensity)
+{
+	// same region as the OpenCL launch, clipped to the grid
+	const int bound_width = (x + radius < width - 1) ? 2 * radius : width - (x - radius);
+	const int bound_height = (y + radius < height - 1) ? 2 * radius : height - (y - radius);
+	const int bound_top = (x - radius < 1) ? 1 : x - radius;
+	const int bound_left = (y - radius < 1) ? 1 : y - radius;
+	const float r = (float)radius - 0.5f;
+	const int x_end = min(bound_top + bound_width, width);
+	const int y_end = min(bound_left + bound_height, height);
+	for (int j = bound_left; j < y_end; ++j) {
+		for (int i = bound_top; i < x_end; ++i) {
+			const float dx = (float)i - x;
+			const float dy = (float)j - y;
+			if (dx*dx + dy*dy <= r*r) {
+				in_out[at(i, j)] += intensity;
+			}
+		}
+	}
+}
+
+void FluidSolverCPU::add_pressure(int x, int y, int radius, float intensity)
+{
+	add_source(density_in, x, y, radius, intensity);
+}
+
+void FluidSolverCPU::add_velocity(int x, int y, float dx, float dy, float force, int radius)
+{
+	add_source(u_in, x, y, radius, dx*force);
+	add_source(v_in, x, y, radius, dy*force);
+}
+
+void FluidSolverCPU::set_data_image(uint8_t * img)
+{
+	data_image = img;
+}
+
+void FluidSolverCPU::set_display_size(int w, int h)
+{
+	display_width = w;
+	display_height = h;
+}
+
+void FluidSolverCPU::update_image()
+{
+	if (display_width != width || display_height != height) {
+		draw_scaled();
+		return;
+	}
+	pool.parallelFor(0, height, [this](int y_begin, int y_end) {
+		for (int y = y_begin; y < y_end; ++y) {
+			const float* row = &density_in[at(0, y)];
+			uint8_t* pixel = data_image + 4 * (size_t)y*width;
+			for (int x = 0; x < width; ++x, pixel += 4) {
+				write_pixel(pixel, row[x]);
+			}
+		}
+	});
+}
+
+void FluidSolverCPU::draw_scaled()
+{
+	// texel centers at i + 0.5 like the OpenCL sampler, the border texels are repeated (clamp to edge)
+	const float scale_x = (float)width / display_width;
+	const float scale_y = (float)height / display_height;
+	vector<int> x0(display_width), x1(display_width);
+	vector<float> fx(display_width);
+	for (int px = 0; px < display_width; ++px) {
+		const float gx = max((px + 0.5f)*scale_x - 0.5f, 0.0f);
+		x0[px] = min((int)gx, width - 1);
+		x1[px] = min(x0[px] + 1, width - 1);
+		fx[px] = gx - (int)gx;
+	}
+	pool.parallelFor(0, display_height, [&](int y_begin, int y_end) {
+		for (int py = y_begin; py < y_end; ++py) {
+			const float gy = max((py + 0.5f)*scale_y - 0.5f, 0.0f);
+			const int y0 = min((int)gy, height - 1);
+			const float fy = gy - (int)gy;
+			const float* row0 = &density_in[at(0, y0)];
+			const float* row1 = &density_in[at(0, min(y0 + 1, height - 1))];
+			uint8_t* pixel = data_image + 4 * (size_t)py*display_width;
+			for (int px = 0; px < display_width; ++px, pixel += 4) {
+				const float top = row0[x0[px]] + fx[px] * (row0[x1[px]] - row0[x0[px]]);
+				const float bottom = row1[x0[px]] + fx[px] * (row1[x1[px]] - row1[x0[px]]);
+				write_pixel(pixel, top + fy*(bottom - top));
+			}
+		}
+	});
+}
+
+const uint8_t* FluidSolverCPU::latest_image()
+{
+	// the fields are in host memory, the conversion is the only work
+	update_image();
+	return data_image;
+}
+
+void FluidSolverCPU::reset()
+{
+	Field* fields[] = { &density_in, &density_out, &u_in, &u_out, &v_in, &v_out };
+	for (auto field : fields) {
+		fill(field->begin(), field->end(), 0.0f);
+	}
+	step = 0;
+}
+
+void FluidSolverCPU::finish()
+{
+	// every call is synchronous
+}
+
+void FluidSolverCPU::read_density(std::vector<float> & out)
+{
+	out.resize((size_t)width*height);
+	for (int y = 0; y < height; ++y) {
+		copy_n(&density_in[at(0, y)], width, &out[(size_t)y*width]);
+	}
+}
+
+int FluidSolverCPU::get_width() const
+{
+	return width;
+}
+
+int FluidSolverCPU::get_height() const
+{
+	return height;
+}
+
+/** Same file as FluidSolver::save_state, the fields are stored without the ring of zero cells */
+static const char* STATE_FIELDS[] = { "density_in", "density_out", "u_in", "u_out", "v_in", "v_out", "tmp_project1", "tmp_project2" };
+
+static StateFile::Info state_info(int width, int height, unsigned long long step)
+{
+	StateFile::Info info;
+	info.width = width;
+	info.height = height;
+	info.step = step;
+	info.parameters[0] = VISCO;
+	info.parameters[1] = DIFF_DENSITY;
+	info.parameters[2] = (float)SOLVER_NB_ITERATIONS;
+	return info;
+}
+
+bool FluidSolverCPU::save_state(const std::string & filename)
+{
+	const Field* state_fields[] = { &density_in, &density_out, &u_in, &u_out, &v_in, &v_out, &tmp_project1, &tmp_project2 };
+	vector<pair<string, size_t>> fields;
+	for (auto name : STATE_FIELDS) {
+		fields.push_back({ name, (size_t)width*height * sizeof(float) });
+	}
+	StateFile::Writer writer(state_info(width, height, step), fields);
+	for (size_t i = 0; i < fields.size(); ++i) {
+		float* out = static_cast<float*>(writer.field(i));
+		for (int y = 0; y < height; ++y) {
+			copy_n(&(*state_fields[i])[at(0, y)], width, out + (size_t)y*width);
+		}
+	}
+	return writer.write(filename);
+}
+
+bool FluidSolverCPU::load_state(const std::string & filename)
+{
+	const auto start = chrono::steady_clock::now();
+	StateFile::Mapping state;
+	if (!state.open(filename)) {
+		return false;
+	}
+	const StateFile::Info expected = state_info(width, height, 0);
+	if (state.info().width != expected.width || state.info().height != expected.height || state.info().depth != 1) {
+		cout << filename << ": state of a " << state.info().width << "x" << state.info().height << "x" << state.info().depth
+			<< " grid, the solver is " << width << "x" << height << endl;
+		return false;
+	}
+	if (memcmp(state.info().parameters, expected.parameters, sizeof(expected.parameters)) != 0) {
+		cout << "Warning: " << filename << " was saved with other fluid parameters" << endl;
+	}
+	Field* state_fields[] = { &density_in, &density_out, &u_in, &u_out, &v_in, &v_out, &tmp_project1, &tmp_project2 };
+	const float* data[8];
+	for (int i = 0; i < 8; ++i) {
+		data[i] = static_cast<const float*>(state.field(STATE_FIELDS[i], (size_t)width*height * sizeof(float)));
+		if (!data[i]) {
+			return false;
+		}
+	}
+	for (int i = 0; i < 8; ++i) {
+		for (int y = 0; y < height; ++y) {
+			copy_n(data[i] + (size_t)y*width, width, &(*state_fields[i])[at(0, y)]);
+		}
+	}
+	step = state.info().step;
+	cout << "State loaded (step " << step << ") in "
+		<< chrono::duration<double, milli>(chrono::steady_clock::now() - start).count() << " ms" << endl;
+	return true;
+}
+
+unsigned long long FluidSolverCPU::get_step() const
+{
+	return step;
+}
+
+void FluidSolverCPU::update(float dt)
+{
+	// same sequence as FluidSolver::update
+	constexpr auto VISCO_DIV = 1.0f + 4.0f*VISCO;
+	if (dt > 0.02f) { // clamp update rate else the error is too high
+		dt = 0.02f;
+	}
+	const float a = dt*DIFF_DENSITY*width*height;
+	// velocity -----------------------
+	diffuse(u_out, u_in, VISCO, VISCO_DIV);
+	diffuse(v_out, v_in, VISCO, VISCO_DIV);
+
+	project(u_out, v_out, u_in, v_in);
+
+	advect(u_out, u_in, u_in, v_in, dt);
+	advect(v_out, v_in, u_in, v_in, dt);
+
+	project(u_out, v_out, u_in, v_in);
+
+	// density ------------------------
+	diffuse(density_out, density_in, a, 1 + 4.0f*a);
+	advect(density_in, density_out, u_in, v_in, dt);
+	++step;
+}
+
+void FluidSolverCPU::diffuse(Field & input_output, const Field & src, float diff, float diff_div)
+{
+	if (diff_div == 0.0f) diff_div = 0.000000000001f;
+	for (unsigned int k = 0; k < SOLVER_NB_ITERATIONS; ++k) {
+		const Field & in = input_output;
+		pool.parallelFor(0, height, [&](int y_begin, int y_end) {
+			for (int y = y_begin; y < y_end; ++y) {
+				const int i = at(0, y);
+				SimdStencil::jacobi4(&jacobi[i], &src[i], &in[i - 1], &in[i + 1], &in[i - stride], &in[i + stride],
+					width, diff, diff_div);
+			}
+		});
+		// the ring of both buffers stays at zero
+		input_output.swap(jacobi);
+	}
+}
+
+float FluidSolverCPU::sample(const Field & field, int x, int y) const
+{
+	if (x < 0 || y < 0 || x >= width || y >= height) {
+		return 0.0f;
+	}
+	return field[at(x, y)];
+}
+
+void FluidSolverCPU::advect(Field & dest, const Field & src, const Field & field_u, const Field & field_v, float dt)
+{
+	// gather bound: scalar, one row per thread block
+	// a cell only reads its own velocity, so dest may be field_u or field_v like in the kernel
+	const float dt0x = dt*width, dt0y = dt*height;
+	pool.parallelFor(1, height - 1, [&](int y_begin, int y_end) {
+		for (int y = y_begin; y < y_end; ++y) {
+			for (int x = 1; x < width - 1; ++x) {
+				const int i = at(x, y);
+				// the samples are zero farther than one cell outside, the clamp only protects the cast to int
+				const float px = min(max((float)x - dt0x*field_u[i], -2.0f), (float)width + 1.0f);
+				const float py = min(max((float)y - dt0y*field_v[i], -2.0f), (float)height + 1.0f);
+				const int vx = (int)px, vy = (int)py;
+				const float s0 = px - vx, t0 = py - vy;
+				const float s1 = 1 - s0, t1 = 1 - t0;
+				dest[i] = s1*(t1*sample(src, vx, vy) + t0*sample(src, vx, vy + 1))
+					+ s0*(t1*sample(src, vx + 1, vy) + t0*sample(src, vx + 1, vy + 1));
+			}
+		}
+	});
+}
+
+void FluidSolverCPU::project(const Field & field_u, const Field & field_v, Field & out_u, Field & out_v)
+{
+	const float hx = 1.0f / width, hy = 1.0f / height;
+	pool.parallelFor(1, height - 1, [&](int y_begin, int y_end) {
+		for (int y = y_begin; y < y_end; ++y) {
+			const int i = at(1, y);
+			SimdStencil::divergence2(&tmp_project1[i], &field_u[i - 1], &field_u[i + 1], &field_v[i - stride], &field_v[i + stride],
+				width - 2, hx, hy);
+		}
+	});
+
+	fill(tmp_project2.begin(), tmp_project2.end(), 0.0f);
+	diffuse(tmp_project2, tmp_project1, 1.0f, 4.0f);
+
+	// like the kernel: the rows are copied then the gradient is removed inside, the border stays as it is
+	pool.parallelFor(0, height, [&](int y_begin, int y_end) {
+		for (int y = y_begin; y < y_end; ++y) {
+			copy_n(&field_u[at(0, y)], width, &out_u[at(0, y)]);
+			copy_n(&field_v[at(0, y)], width, &out_v[at(0, y)]);
+			if (y == 0 || y == height - 1) {
+				continue;
+			}
+			const int i = at(1, y);
+			SimdStencil::subGradient(&out_u[i], &tmp_project2[i - 1], &tmp_project2[i + 1], width - 2, 0.5f*width);
+			SimdStencil::subGradient(&out_v[i], &tmp_project2[i - stride], &tmp_project2[i + stride], width - 2, 0.5f*height);
+		}
+	});
+}
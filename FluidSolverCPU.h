@@ -0,0 +1,69 @@
+#ifndef FLUID_SOLVER_CPU_H
+#define FLUID_SOLVER_CPU_H
+
+#include <vector>
+
+#include "FluidSolverBase.h"
+#include "ThreadPool.hpp"
+
+/** Native implementation of the 2D solver for the machines without a usable OpenCL driver
+* It follows the kernels of core.cl step by step: the rows are split between the threads of a pool
+* and the stencils are vectorized (see SimdStencil.hpp).
+* The fields are stored with a ring of zero cells around the grid, that ring plays the role
+* of the clamp-to-border sampler used by the OpenCL images. */
+class FluidSolverCPU : public FluidSolverBase
+{
+public:
+	/** Grid and display of Config.h (see FluidSolver()), nb_threads = 0 uses every hardware thread */
+	explicit FluidSolverCPU(unsigned int nb_threads = 0);
+	/** Grid of width x height cells, independent of the size of the displayed image */
+	FluidSolverCPU(int width, int height, unsigned int nb_threads = 0);
+	virtual ~FluidSolverCPU();
+	void initialization() override;
+	void update(float dt) override;
+	void add_pressure(int x, int y, int radius, float intensity) override;
+	void add_velocity(int x, int y, float dx, float dy, float force, int radius) override;
+	void set_display_size(int width, int height) override;
+	void set_data_image(uint8_t* img) override;
+	void update_image() override;
+	const uint8_t* latest_image() override;
+	void reset() override;
+	void finish() override;
+	void read_density(std::vector<float> & out) override;
+	int get_width() const override;
+	int get_height() const override;
+	bool save_state(const std::string & filename) override;
+	bool load_state(const std::string & filename) override;
+	unsigned long long get_step() const override;
+protected:
+	typedef std::vector<float> Field;
+	/** Index of the cell (x,y) in a padded field, x in [-1,width] and y in [-1,height] */
+	int at(int x, int y) const { return (y + 1)*stride + x + 1; }
+	void add_source(Field & in_out, int x, int y, int radius, float intensity);
+	void advect(Field & dest, const Field & src, const Field & field_u, const Field & field_v, float dt);
+	void project(const Field & field_u, const Field & field_v, Field & out_u, Field & out_v);
+	void diffuse(Field & input_output, const Field & src, float diff, float diff_div);
+	float sample(const Field & field, int x, int y) const;
+	/** Bilinear resampling of the density to the display size, like the linear sampler of floatToR */
+	void draw_scaled();
+
+	int width;
+	int height;
+	int stride;
+	ThreadPool pool;
+	int display_width;
+	int display_height;
+	uint8_t* data_image;// pointer on the sfml image memory
+	Field density_in;
+	Field density_out;
+	Field tmp_project1;
+	Field tmp_project2;
+	Field u_in;
+	Field u_out;
+	Field v_in;
+	Field v_out;
+	Field jacobi;// second buffer of the Jacobi iterations
+	unsigned long long step = 0;
+};
+
+#endif
@@ -0,0 +1,38 @@
+#ifndef ADVECTION_SCHEME_H
+#define ADVECTION_SCHEME_H
+
+#include <string>
+
+/** Schemes of the advection step of the OpenCL solvers */
+enum class AdvectionScheme
+{
+	/** One backtrace and a linear interpolation: first order, blurs the details at every step */
+	SemiLagrangian,
+	/** Forward advection corrected by half of the error of the advection back: second order, 3 launches */
+	MacCormack,
+	/** Back and forth error compensation: the field corrected by half of the error of a round trip
+	* is advected again, second order, 3 launches (reads more than MacCormack) */
+	BFECC
+};
+
+/** "semi", "maccormack" or "bfecc", false if the name is unknown */
+inline bool parseAdvectionScheme(const std::string & name, AdvectionScheme & scheme)
+{
+	if (name == "semi") {
+		scheme = AdvectionScheme::SemiLagrangian;
+	} else if (name == "maccormack") {
+		scheme = AdvectionScheme::MacCormack;
+	} else if (name == "bfecc") {
+		scheme = AdvectionScheme::BFECC;
+	} else {
+		return false;
+	}
+	return true;
+}
+
+inline const char* advectionSchemeName(AdvectionScheme scheme)
+{
+	return (scheme == AdvectionScheme::MacCormack) ? "maccormack" : (scheme == AdvectionScheme::BFECC) ? "bfecc" : "semi";
+}
+
+#endif // !ADVECTION_SCHEME_H
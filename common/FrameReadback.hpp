@@ -0,0 +1,199 @@
+#ifndef FRAME_READBACK_H
+#define FRAME_READBACK_H
+
+#include <cstdint>
+#include <cstring>
+#include <iostream>
+#include <vector>
+#include <CL/cl.hpp>
+
+/** Asynchronous readback of the RGBA8 frames drawn by a solver
+* The frames are drawn in a ring of staging images allocated with CL_MEM_ALLOC_HOST_PTR and mapped
+* on a separate transfer queue, so the simulation queue never waits for the host. latest() only polls
+* the events and returns the newest completed frame, usually frame N-1 while frame N is computed.
+* On CPU and unified memory devices the mapping is the image memory itself: no copy at all.
+* Slot life: Free -> Drawing (nextTarget) -> Mapping (submit) -> Ready (event complete) -> Held (latest) -> Free */
+class FrameReadback
+{
+public:
+	~FrameReadback()
+	{
+		if (!initialized) {
+			return;
+		}
+		for (auto & slot : slots) {
+			if (slot.mapped) {
+				transfer.enqueueUnmapMemObject(slot.image, slot.mapped);
+			}
+		}
+		transfer.finish();
+	}
+
+	/** Create nb_slots (>= 2) staging images and the transfer queue */
+	void init(const cl::Context & context, const cl::Device & device, unsigned int w, unsigned int h, unsigned int nb_slots)
+	{
+		width = w;
+		height = h;
+		transfer = cl::CommandQueue(context, device);
+		slots.resize((nb_slots < 2) ? 2 : nb_slots);
+		for (auto & slot : slots) {
+			slot.image = cl::Image2D(context, CL_MEM_WRITE_ONLY | CL_MEM_ALLOC_HOST_PTR | CL_MEM_HOST_READ_ONLY,
+				{ CL_RGBA, CL_UNSIGNED_INT8 }, width, height, 0);
+		}
+		origin[0] = 0; origin[1] = 0; origin[2] = 0;
+		region[0] = width; region[1] = height; region[2] = 1;
+		zero_copy = device.getInfo<CL_DEVICE_TYPE>() == CL_DEVICE_TYPE_CPU || device.getInfo<CL_DEVICE_HOST_UNIFIED_MEMORY>();
+		std::cout << "Frame readback: " << slots.size() << " staging images, " << (zero_copy ? "mapped in place" : "pinned transfers") << std::endl;
+		initialized = true;
+	}
+
+	bool isInitialized() const { return initialized; }
+
+	/** Image in which the next frame must be drawn, the draw command must wait for "wait_list" */
+	const cl::Image2D & nextTarget(std::vector<cl::Event> & wait_list)
+	{
+		int index = findSlot(State::Free);
+		if (index < 0) {
+			// every slot is busy: drop the oldest frame not yet shown, else wait for the oldest transfer
+			index = oldest(State::Ready);
+			if (index < 0) {
+				index = oldest(State::Mapping);
+				slots[index].event.wait();
+			}
+			unmap(slots[index]);
+		}
+		Slot & slot = slots[index];
+		wait_list.clear();
+		if (slot.unmapped) {
+			wait_list.push_back(slot.event);
+		}
+		slot.state = State::Drawing;
+		drawing = index;
+		return slot.image;
+	}
+
+	/** Start the transfer of the frame drawn in the last target, "drawn" is the event of the draw command */
+	void submit(const cl::CommandQueue & producer, const cl::Event & drawn)
+	{
+		Slot & slot = slots[drawing];
+		const std::vector<cl::Event> wait_list(1, drawn);
+		slot.mapped = static_cast<uint8_t*>(transfer.enqueueMapImage(slot.image, CL_FALSE, CL_MAP_READ, origin, region,
+			&slot.pitch, nullptr, &wait_list, &slot.event));
+		slot.unmapped = false;
+		slot.state = State::Mapping;
+		slot.frame = ++submitted;
+		// both queues must reach the device before anybody waits on these events
+		producer.flush();
+		transfer.flush();
+	}
+
+	/** Newest completed frame (width*height RGBA pixels), nullptr if no frame completed since the last call
+	* Never blocks; the pointer stays valid until the next call of latest or wait */
+	const uint8_t* latest()
+	{
+		for (auto & slot : slots) {
+			if (slot.state == State::Mapping
+				&& slot.event.getInfo<CL_EVENT_COMMAND_EXECUTION_STATUS>() == CL_COMPLETE) {
+				slot.state = State::Ready;
+			}
+		}
+		int newest = -1;
+		for (size_t i = 0; i < slots.size(); ++i) {
+			if (slots[i].state == State::Ready && (newest < 0 || slots[i].frame > slots[newest].frame)) {
+				newest = (int)i;
+			}
+		}
+		if (newest < 0) {
+			return nullptr;
+		}
+		// the frame shown before and the older ready frames go back to the pool
+		for (size_t i = 0; i < slots.size(); ++i) {
+			if ((int)i != newest && (slots[i].state == State::Held
+				|| (slots[i].state == State::Ready && slots[i].frame < slots[newest].frame))) {
+				unmap(slots[i]);
+			}
+		}
+		Slot & slot = slots[newest];
+		slot.state = State::Held;
+		if (slot.pitch == (size_t)width * 4) {
+			return slot.mapped;
+		}
+		// padded rows: one host copy to give contiguous pixels
+		contiguous.resize((size_t)width*height * 4);
+		for (unsigned int y = 0; y < height; ++y) {
+			std::memcpy(&contiguous[(size_t)y*width * 4], slot.mapped + y*slot.pitch, (size_t)width * 4);
+		}
+		return contiguous.data();
+	}
+
+	/** Block until the last submitted frame is available and return it */
+	const uint8_t* wait()
+	{
+		for (auto & slot : slots) {
+			if (slot.state == State::Mapping && slot.frame == submitted) {
+				slot.event.wait();
+			}
+		}
+		return latest();
+	}
+
+	/** True if the mapped pointer is the image memory (CPU or unified memory device) */
+	bool isZeroCopy() const { return zero_copy; }
+
+private:
+	enum class State { Free, Drawing, Mapping, Ready, Held };
+	struct Slot
+	{
+		cl::Image2D image;
+		State state = State::Free;
+		cl::Event event;// map event, then unmap event
+		bool unmapped = false;// true when "event" is the unmap the next draw must wait for
+		uint8_t* mapped = nullptr;
+		size_t pitch = 0;
+		unsigned long long frame = 0;
+	};
+
+	int findSlot(State state) const
+	{
+		for (size_t i = 0; i < slots.size(); ++i) {
+			if (slots[i].state == state) {
+				return (int)i;
+			}
+		}
+		return -1;
+	}
+
+	int oldest(State state) const
+	{
+		int index = -1;
+		for (size_t i = 0; i < slots.size(); ++i) {
+			if (slots[i].state == state && (index < 0 || slots[i].frame < slots[index].frame)) {
+				index = (int)i;
+			}
+		}
+		return index;
+	}
+
+	void unmap(Slot & slot)
+	{
+		transfer.enqueueUnmapMemObject(slot.image, slot.mapped, nullptr, &slot.event);
+		transfer.flush();
+		slot.mapped = nullptr;
+		slot.unmapped = true;
+		slot.state = State::Free;
+	}
+
+	bool initialized = false;
+	bool zero_copy = false;
+	unsigned int width = 0;
+	unsigned int height = 0;
+	cl::CommandQueue transfer;
+	cl::size_t<3> origin;
+	cl::size_t<3> region;
+	std::vector<Slot> slots;
+	int drawing = 0;
+	unsigned long long submitted = 0;
+	std::vector<uint8_t> contiguous;
+};
+
+#endif // !FRAME_READBACK_H
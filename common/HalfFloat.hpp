@@ -0,0 +1,104 @@
+#ifndef HALF_FLOAT_H
+#define HALF_FLOAT_H
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+
+/** Precision of the fields stored on the device, the kernels always compute in float */
+enum class StoragePrecision
+{
+	/** 32 bits floats */
+	Float,
+	/** 16 bits IEEE halves: half the memory and the traffic, about 3 significant digits */
+	Half
+};
+
+/** Host conversions between floats and the halves stored on the device (state files, readbacks) */
+namespace HalfFloat
+{
+	/** Nearest half, ties to even, too large values give an infinity */
+	inline uint16_t fromFloat(float value)
+	{
+		uint32_t f;
+		std::memcpy(&f, &value, sizeof(f));
+		const uint32_t sign = (f >> 16) & 0x8000;
+		const uint32_t abs = f & 0x7fffffff;
+		if (abs >= 0x7f800000) {// infinity or NaN
+			return (uint16_t)(sign | 0x7c00 | ((abs > 0x7f800000) ? 0x200 : 0));
+		}
+		if (abs >= 0x477ff000) {// rounds above 65504
+			return (uint16_t)(sign | 0x7c00);
+		}
+		if (abs < 0x33000000) {// below half the smallest subnormal
+			return (uint16_t)sign;
+		}
+		uint32_t half, rest, halfway;
+		if (abs < 0x38800000) {// subnormal half: units of 2^-24
+			const uint32_t mantissa = (abs & 0x7fffff) | 0x800000;
+			const uint32_t shift = 126 - (abs >> 23);
+			half = mantissa >> shift;
+			rest = mantissa & ((1u << shift) - 1);
+			halfway = 1u << (shift - 1);
+		} else {// rebias the exponent, 10 bits of mantissa kept (a carry goes to the exponent)
+			half = (abs - 0x38000000) >> 13;
+			rest = abs & 0x1fff;
+			halfway = 0x1000;
+		}
+		if (rest > halfway || (rest == halfway && (half & 1))) {
+			++half;
+		}
+		return (uint16_t)(sign | half);
+	}
+
+	inline float toFloat(uint16_t half)
+	{
+		const uint32_t sign = (uint32_t)(half & 0x8000) << 16;
+		uint32_t exponent = (half >> 10) & 0x1f;
+		uint32_t mantissa = half & 0x3ff;
+		uint32_t f;
+		if (exponent == 0x1f) {
+			f = sign | 0x7f800000 | (mantissa << 13);
+		} else if (exponent != 0) {
+			f = sign | ((exponent + 112) << 23) | (mantissa << 13);
+		} else if (mantissa == 0) {
+			f = sign;
+		} else {// subnormal, normalized for the float
+			exponent = 113;
+			while (!(mantissa & 0x400)) {
+				mantissa <<= 1;
+				--exponent;
+			}
+			f = sign | (exponent << 23) | ((mantissa & 0x3ff) << 13);
+		}
+		float value;
+		std::memcpy(&value, &f, sizeof(value));
+		return value;
+	}
+
+	inline void toFloats(const uint16_t* in, float* out, size_t count)
+	{
+		for (size_t i = 0; i < count; ++i) {
+			out[i] = toFloat(in[i]);
+		}
+	}
+
+	inline void fromFloats(const float* in, uint16_t* out, size_t count)
+	{
+		for (size_t i = 0; i < count; ++i) {
+			out[i] = fromFloat(in[i]);
+		}
+	}
+
+	/** Widen "count" halves stored at the beginning of "data" to floats, in place (from the end) */
+	inline void widenInPlace(float* data, size_t count)
+	{
+		const uint16_t* halves = reinterpret_cast<const uint16_t*>(data);
+		for (size_t i = count; i-- > 0;) {
+			const uint16_t half = halves[i];
+			data[i] = toFloat(half);
+		}
+	}
+}
+
+#endif // !HALF_FLOAT_H
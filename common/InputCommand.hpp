@@ -0,0 +1,18 @@
+#ifndef INPUT_COMMAND_H
+#define INPUT_COMMAND_H
+
+/** User input given to a solver: forwarded to the simulation thread, recorded and replayed by InputTrace */
+struct InputCommand
+{
+	enum Type { Pressure, Velocity, Reset, SaveState, LoadState, Record };
+	Type type;
+	int x = 0;
+	int y = 0;
+	int radius = 0;
+	float dx = 0.0f;
+	float dy = 0.0f;
+	float force = 0.0f;// velocity added per unit of (dx, dy)
+	float intensity = 0.0f;// density added
+};
+
+#endif // !INPUT_COMMAND_H
@@ -0,0 +1,180 @@
+#ifndef INPUT_TRACE_H
+#define INPUT_TRACE_H
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include "InputCommand.hpp"
+
+/** Record of every input given to a solver, replayed to run exactly the same simulation again
+* File: a header (grid, fixed time step, number of steps and of events) then the events in the order
+* they were applied, each one tagged with the index of the update it precedes. Byte order of the machine. */
+namespace InputTrace
+{
+	constexpr uint32_t VERSION = 1;
+	static const char MAGIC[8] = { 'F', 'L', 'T', 'R', 'A', 'C', 'E', '\0' };
+
+	struct Header
+	{
+		char magic[8];
+		uint32_t version;
+		uint32_t width;
+		uint32_t height;
+		uint32_t depth;
+		float dt;// of every update
+		uint32_t reserved;
+		uint64_t nb_steps;// updates run while recording
+		uint64_t nb_events;
+	};
+
+	struct Event
+	{
+		uint64_t step;// applied before this update
+		int32_t type;// InputCommand::Type
+		int32_t x;
+		int32_t y;
+		int32_t radius;
+		float dx;
+		float dy;
+		float force;
+		float intensity;
+	};
+
+	/** FNV-1a hash of the bytes of a field, equal between two runs only if they are bit exact */
+	inline uint64_t checksum(const std::vector<float> & field)
+	{
+		uint64_t hash = 14695981039346656037ull;
+		const unsigned char* bytes = reinterpret_cast<const unsigned char*>(field.data());
+		for (size_t i = 0; i < field.size()*sizeof(float); ++i) {
+			hash = (hash ^ bytes[i]) * 1099511628211ull;
+		}
+		return hash;
+	}
+
+	/** Append the inputs to a file while the simulation runs, the header is completed by close */
+	class Recorder
+	{
+	public:
+		~Recorder()
+		{
+			close(nb_steps);
+		}
+
+		bool open(const std::string & filename, unsigned int width, unsigned int height, unsigned int depth, float dt)
+		{
+			out.open(filename, std::ios::binary | std::ios::trunc);
+			if (!out.good()) {
+				std::cout << "cannot write the trace " << filename << std::endl;
+				return false;
+			}
+			std::memset(&header, 0, sizeof(header));
+			std::memcpy(header.magic, MAGIC, 8);
+			header.version = VERSION;
+			header.width = width;
+			header.height = height;
+			header.depth = depth;
+			header.dt = dt;
+			out.write(reinterpret_cast<const char*>(&header), sizeof(header));
+			nb_steps = 0;
+			return true;
+		}
+
+		bool isOpen() const
+		{
+			return out.is_open();
+		}
+
+		void record(uint64_t step, const InputCommand & command)
+		{
+			if (!out.is_open()) {
+				return;
+			}
+			Event event = { step, (int32_t)command.type, command.x, command.y, command.radius,
+				command.dx, command.dy, command.force, command.intensity };
+			out.write(reinterpret_cast<const char*>(&event), sizeof(event));
+			++header.nb_events;
+			nb_steps = std::max(nb_steps, step + 1);
+		}
+
+		/** Write the number of updates run in the header and close the file */
+		void close(uint64_t steps)
+		{
+			if (!out.is_open()) {
+				return;
+			}
+			header.nb_steps = steps;
+			out.seekp(0);
+			out.write(reinterpret_cast<const char*>(&header), sizeof(header));
+			out.close();
+			std::cout << "Trace written: " << header.nb_events << " inputs over " << steps << " steps" << std::endl;
+		}
+
+	private:
+		std::ofstream out;
+		Header header;
+		uint64_t nb_steps = 0;// at least the step of the last input
+	};
+
+	/** Read a whole trace and give back its inputs step by step */
+	class Player
+	{
+	public:
+		bool open(const std::string & filename)
+		{
+			std::ifstream in(filename, std::ios::binary);
+			if (!in.good()) {
+				std::cout << "cannot open the trace " << filename << std::endl;
+				return false;
+			}
+			in.read(reinterpret_cast<char*>(&trace_header), sizeof(trace_header));
+			if (!in.good() || std::memcmp(trace_header.magic, MAGIC, 8) != 0 || trace_header.version != VERSION) {
+				std::cout << filename << " is not an input trace (version " << VERSION << ")" << std::endl;
+				return false;
+			}
+			events.resize((size_t)trace_header.nb_events);
+			in.read(reinterpret_cast<char*>(events.data()), events.size()*sizeof(Event));
+			if (!in.good()) {
+				std::cout << "truncated trace " << filename << std::endl;
+				return false;
+			}
+			return true;
+		}
+
+		const Header & header() const
+		{
+			return trace_header;
+		}
+
+		/** Call fn(command) for each input of "step", in the recorded order */
+		template <typename Fn>
+		void apply(uint64_t step, Fn fn) const
+		{
+			// the events are recorded by increasing step
+			auto first = std::lower_bound(events.begin(), events.end(), step,
+				[](const Event & event, uint64_t value) { return event.step < value; });
+			for (auto it = first; it != events.end() && it->step == step; ++it) {
+				const Event & event = *it;
+				InputCommand command{ (InputCommand::Type)event.type };
+				command.x = event.x;
+				command.y = event.y;
+				command.radius = event.radius;
+				command.dx = event.dx;
+				command.dy = event.dy;
+				command.force = event.force;
+				command.intensity = event.intensity;
+				fn(command);
+			}
+		}
+
+	private:
+		Header trace_header = {};
+		std::vector<Event> events;
+	};
+}
+
+#endif // !INPUT_TRACE_H
@@ -0,0 +1,262 @@
+#ifndef KERNEL_PROFILER_H
+#define KERNEL_PROFILER_H
+
+#include <algorithm>
+#include <fstream>
+#include <iostream>
+#include <map>
+#include <string>
+#include <vector>
+#include <CL/cl.hpp>
+
+#include "WorkGroupTuner.hpp"
+
+/** Device side timings of the commands enqueued by a solver, aggregated per kernel name
+* The queue must be created with queueProperties() (CL_QUEUE_PROFILING_ENABLE when enabled).
+* The commands recorded between two calls of endFrame belong to the same frame; endFrame waits
+* for their events, so an enabled profiler serializes the host and the device once per frame.
+* Disabled (the default) it only forwards the enqueue calls.
+* With a tuner, the launches without a local size take the tuned one (and its padded global size). */
+class KernelProfiler
+{
+public:
+	void setEnabled(bool enabled) { this->enabled = enabled; }
+	bool isEnabled() const { return enabled; }
+
+	/** Properties of the command queue to profile */
+	cl_command_queue_properties queueProperties() const { return enabled ? CL_QUEUE_PROFILING_ENABLE : 0; }
+
+	/** Nominal memory traffic of one work item of a kernel, used to report the bytes moved */
+	void setBytesPerItem(const std::string & kernel_name, size_t bytes) { bytes_per_item[kernel_name] = bytes; }
+
+	/** Local sizes of the launches given cl::NullRange (nullptr: the driver chooses) */
+	void setTuner(WorkGroupTuner* tuner) { this->tuner = tuner; }
+
+	/** Enqueue a kernel and record its event under the kernel name */
+	void enqueueKernel(const cl::CommandQueue & queue, const cl::Kernel & kernel,
+		const cl::NDRange & offset, const cl::NDRange & global, const cl::NDRange & local,
+		const std::vector<cl::Event>* wait_list = nullptr, cl::Event* event_out = nullptr)
+	{
+		const WorkGroupTuner::Launch* tuned = (tuner && local.dimensions() == 0)
+			? &tuner->launch(queue, kernel, kernelName(kernel), offset, global) : nullptr;
+		const cl::NDRange & global_size = tuned ? tuned->global : global;
+		const cl::NDRange & local_size = tuned ? tuned->local : local;
+		if (!enabled) {
+			queue.enqueueNDRangeKernel(kernel, offset, global_size, local_size, wait_list, event_out);
+			return;
+		}
+		cl::Event event;
+		queue.enqueueNDRangeKernel(kernel, offset, global_size, local_size, wait_list, &event);
+		if (event_out) {
+			*event_out = event;
+		}
+		const std::string & name = kernelName(kernel);
+		size_t items = 1;
+		for (size_t i = 0; i < global.dimensions(); ++i) {
+			items *= static_cast<const size_t*>(global)[i];
+		}
+		auto traffic = bytes_per_item.find(name);
+		record(name, event, (traffic == bytes_per_item.end()) ? 0 : items*traffic->second);
+	}
+
+	/** Event to give to an enqueue call (copies, readbacks), nullptr when disabled */
+	cl::Event* event() { return enabled ? &last_event : nullptr; }
+
+	/** Record the command enqueued with event() */
+	void record(const std::string & name, size_t bytes) { record(name, last_event, bytes); }
+
+	void record(const std::string & name, const cl::Event & event, size_t bytes)
+	{
+		if (enabled) {
+			pending.push_back({ name, event, bytes });
+		}
+	}
+
+	/** Wait for the commands of the frame and add their durations to the statistics */
+	void endFrame()
+	{
+		if (!enabled) {
+			return;
+		}
+		std::map<std::string, double> frame_ms;
+		for (auto & command : pending) {
+			command.event.wait();
+			const cl_ulong start = command.event.getProfilingInfo<CL_PROFILING_COMMAND_START>();
+			const cl_ulong end = command.event.getProfilingInfo<CL_PROFILING_COMMAND_END>();
+			const double ms = (end - start)*1e-6;
+			Stats & s = stats[command.name];
+			s.call_ms.push_back(ms);
+			s.bytes += command.bytes;
+			frame_ms[command.name] += ms;
+		}
+		for (auto & kernel : frame_ms) {
+			stats[kernel.first].frame_ms.push_back(kernel.second);
+		}
+		pending.clear();
+		++frames;
+	}
+
+	/** Forget every recorded frame */
+	void clear()
+	{
+		pending.clear();
+		stats.clear();
+		frames = 0;
+	}
+
+	/** Write the statistics in "filename", JSON if the name ends with .json else CSV */
+	bool write(const std::string & filename)
+	{
+		endFrameIfPending();
+		std::ofstream out(filename);
+		if (!out.good()) {
+			std::cout << "cannot write " << filename << std::endl;
+			return false;
+		}
+		const bool json = filename.size() >= 5 && filename.compare(filename.size() - 5, 5, ".json") == 0;
+		if (json) {
+			writeJson(out);
+		} else {
+			writeCsv(out);
+		}
+		return true;
+	}
+
+	/** Short table of the kernels sorted by total time */
+	void print(std::ostream & out)
+	{
+		endFrameIfPending();
+		out << "kernel profile over " << frames << " frames (ms per frame, % of the device time)\n";
+		double total = 0.0;
+		for (auto & s : stats) {
+			total += s.second.total();
+		}
+		for (auto & row : sortedRows()) {
+			out << "  " << row.name << ": " << row.frame_mean_ms << " ms (" << row.calls_per_frame << " calls, "
+				<< (total > 0.0 ? 100.0*row.total_ms / total : 0.0) << "%)\n";
+		}
+	}
+
+private:
+	struct Pending
+	{
+		std::string name;
+		cl::Event event;
+		size_t bytes;
+	};
+	struct Stats
+	{
+		std::vector<double> call_ms;
+		std::vector<double> frame_ms;
+		unsigned long long bytes = 0;
+		double total() const
+		{
+			double sum = 0.0;
+			for (double ms : call_ms) {
+				sum += ms;
+			}
+			return sum;
+		}
+	};
+	struct Row
+	{
+		std::string name;
+		size_t calls;
+		double calls_per_frame;
+		double total_ms;
+		double mean_ms;
+		double p99_ms;
+		double max_ms;
+		double frame_mean_ms;
+		double frame_p99_ms;
+		unsigned long long bytes;
+		double gb_per_s;
+	};
+
+	static double percentile(std::vector<double> values, double p)
+	{
+		if (values.empty()) {
+			return 0.0;
+		}
+		std::sort(values.begin(), values.end());
+		const size_t index = (size_t)(p*(values.size() - 1) + 0.5);
+		return values[std::min(index, values.size() - 1)];
+	}
+
+	const std::string & kernelName(const cl::Kernel & kernel)
+	{
+		auto it = names.find(kernel());
+		if (it == names.end()) {
+			// some cl.hpp versions keep the terminating null character in the string
+			const std::string name = kernel.getInfo<CL_KERNEL_FUNCTION_NAME>();
+			it = names.insert({ kernel(), std::string(name.c_str()) }).first;
+		}
+		return it->second;
+	}
+
+	void endFrameIfPending()
+	{
+		if (!pending.empty()) {
+			endFrame();
+		}
+	}
+
+	std::vector<Row> sortedRows() const
+	{
+		std::vector<Row> rows;
+		const double nb_frames = (frames > 0) ? frames : 1;
+		for (auto & s : stats) {
+			Row row;
+			row.name = s.first;
+			row.calls = s.second.call_ms.size();
+			row.calls_per_frame = row.calls / nb_frames;
+			row.total_ms = s.second.total();
+			row.mean_ms = row.calls ? row.total_ms / row.calls : 0.0;
+			row.p99_ms = percentile(s.second.call_ms, 0.99);
+			row.max_ms = row.calls ? *std::max_element(s.second.call_ms.begin(), s.second.call_ms.end()) : 0.0;
+			row.frame_mean_ms = row.total_ms / nb_frames;
+			row.frame_p99_ms = percentile(s.second.frame_ms, 0.99);
+			row.bytes = s.second.bytes;
+			row.gb_per_s = (row.total_ms > 0.0) ? row.bytes / (row.total_ms*1e6) : 0.0;
+			rows.push_back(row);
+		}
+		std::sort(rows.begin(), rows.end(), [](const Row & a, const Row & b) { return a.total_ms > b.total_ms; });
+		return rows;
+	}
+
+	void writeCsv(std::ostream & out) const
+	{
+		out << "kernel,calls,calls_per_frame,total_ms,mean_ms,p99_ms,max_ms,frame_mean_ms,frame_p99_ms,bytes,gb_per_s\n";
+		for (auto & row : sortedRows()) {
+			out << row.name << "," << row.calls << "," << row.calls_per_frame << "," << row.total_ms << ","
+				<< row.mean_ms << "," << row.p99_ms << "," << row.max_ms << "," << row.frame_mean_ms << ","
+				<< row.frame_p99_ms << "," << row.bytes << "," << row.gb_per_s << "\n";
+		}
+	}
+
+	void writeJson(std::ostream & out) const
+	{
+		out << "{\n  \"frames\": " << frames << ",\n  \"kernels\": [";
+		bool first = true;
+		for (auto & row : sortedRows()) {
+			out << (first ? "\n" : ",\n") << "    { \"name\": \"" << row.name << "\", \"calls\": " << row.calls
+				<< ", \"calls_per_frame\": " << row.calls_per_frame << ", \"total_ms\": " << row.total_ms
+				<< ", \"mean_ms\": " << row.mean_ms << ", \"p99_ms\": " << row.p99_ms << ", \"max_ms\": " << row.max_ms
+				<< ", \"frame_mean_ms\": " << row.frame_mean_ms << ", \"frame_p99_ms\": " << row.frame_p99_ms
+				<< ", \"bytes\": " << row.bytes << ", \"gb_per_s\": " << row.gb_per_s << " }";
+			first = false;
+		}
+		out << "\n  ]\n}\n";
+	}
+
+	bool enabled = false;
+	WorkGroupTuner* tuner = nullptr;
+	unsigned int frames = 0;
+	cl::Event last_event;
+	std::vector<Pending> pending;
+	std::map<std::string, Stats> stats;
+	std::map<std::string, size_t> bytes_per_item;
+	std::map<cl_kernel, std::string> names;
+};
+
+#endif // !KERNEL_PROFILER_H
@@ -0,0 +1,58 @@
+#ifndef PRESSURE_SOLVER_H
+#define PRESSURE_SOLVER_H
+
+/** Solvers of the pressure (Poisson) equation of the projection step */
+enum class PressureSolver
+{
+	/** SOLVER_NB_ITERATIONS sweeps of the diffuse kernel */
+	Jacobi,
+	/** Geometric multigrid V-cycles until the residual reaches the tolerance */
+	Multigrid
+};
+
+/** Parameters of the multigrid V-cycle */
+struct MultigridSettings
+{
+	/** Stop when |residual| <= tolerance*|right hand side| */
+	float tolerance = 1e-3f;
+	unsigned int max_cycles = 10;
+	/** Red-black Gauss-Seidel sweeps before and after the coarse correction */
+	unsigned int pre_smoothing = 2;
+	unsigned int post_smoothing = 2;
+	/** Sweeps on the coarsest level */
+	unsigned int coarse_sweeps = 32;
+	/** A dimension is halved while it is larger than this size */
+	unsigned int coarsest_size = 8;
+};
+
+/** Iterative solves (diffusions and Jacobi pressure) stopped on their residual instead of a fixed count:
+* red-black SOR sweeps, the residual is reduced on the device every check_interval sweeps and
+* the remaining launches of a converged solve return at once, the host never waits for the test */
+struct RelaxationSettings
+{
+	/** false: SOLVER_NB_ITERATIONS Jacobi sweeps */
+	bool enabled = false;
+	/** Stop when |residual| <= tolerance*|right hand side| */
+	float tolerance = 1e-3f;
+	/** Sweeps enqueued per solve (the work done when it does not converge) */
+	unsigned int max_iterations = 64;
+	/** Sweeps between two residual checks, a check costs about one sweep */
+	unsigned int check_interval = 4;
+	/** Over-relaxation factor in ]0,2[, 1 is Gauss-Seidel */
+	float omega = 1.7f;
+};
+
+/** Work-group size of the residual check of the relaxation (reqd_work_group_size of the kernel),
+* given to every program as -D RELAX_GROUP so the launches and the kernels agree */
+constexpr unsigned int RELAX_GROUP = 64;
+static_assert((RELAX_GROUP & (RELAX_GROUP - 1)) == 0, "the residual check reduces by halves");
+
+/** Sweeps done by the solves of an update, summed by kind */
+struct SolverIterations
+{
+	unsigned int velocity = 0;// every component
+	unsigned int pressure = 0;// both projections, 0 with the multigrid
+	unsigned int density = 0;
+};
+
+#endif // !PRESSURE_SOLVER_H
@@ -0,0 +1,243 @@
+#ifndef PROGRAM_CACHE_H
+#define PROGRAM_CACHE_H
+
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <CL/cl.hpp>
+#ifdef _WIN32
+#include <direct.h>
+#else
+#include <sys/stat.h>
+#endif
+
+/** Build of the OpenCL programs with a cache of the compiled binaries on disk
+* An entry is keyed by the platform, the device, the driver version, the build options and the source,
+* the full key is stored in the file and checked on load (the file name is only its hash).
+* An entry that does not match or that the driver refuses is rebuilt from the source and replaced.
+* The cache lives in $FLUID_CL_CACHE, else in the user cache directory; FLUID_CL_CACHE=off disables it. */
+namespace ProgramCache
+{
+	/** Source of a kernel file embedded at build time (see cmake_modules/EmbedFile.cmake),
+	* or read from "path" when the executable was built without the generated headers */
+	inline std::string loadSource(const unsigned char* embedded, size_t size, const std::string & path)
+	{
+		if (embedded) {
+			return std::string(reinterpret_cast<const char*>(embedded), size);
+		}
+		std::ifstream cl_file(path);
+		if (!cl_file.good()) {
+			std::cout << path << " not found" << std::endl;
+		}
+		return std::string(std::istreambuf_iterator<char>(cl_file), std::istreambuf_iterator<char>());
+	}
+
+	/** 64 bits FNV-1a */
+	inline uint64_t hash(const std::string & data)
+	{
+		uint64_t h = 14695981039346656037ull;
+		for (unsigned char c : data) {
+			h = (h ^ c) * 1099511628211ull;
+		}
+		return h;
+	}
+
+	inline std::string directory()
+	{
+		const char* dir = std::getenv("FLUID_CL_CACHE");
+		if (dir) {
+			return (std::string(dir) == "off") ? std::string() : std::string(dir);
+		}
+#ifdef _WIN32
+		const char* base = std::getenv("LOCALAPPDATA");
+		return base ? std::string(base) + "\\fluid_solver" : std::string();
+#else
+		const char* xdg = std::getenv("XDG_CACHE_HOME");
+		if (xdg) {
+			return std::string(xdg) + "/fluid_solver";
+		}
+		const char* home = std::getenv("HOME");
+		return home ? std::string(home) + "/.cache/fluid_solver" : std::string();
+#endif
+	}
+
+	/** Create the directory and its parent, return false if it cannot be used */
+	inline bool makeDirectory(const std::string & dir)
+	{
+		const size_t slash = dir.find_last_of("/\\");
+		if (slash != std::string::npos && slash > 0) {
+			makeDirectory(dir.substr(0, slash));
+		}
+#ifdef _WIN32
+		_mkdir(dir.c_str());
+#else
+		mkdir(dir.c_str(), 0755);
+#endif
+		const std::string probe_name = dir + "/.probe";
+		const bool writable = std::ofstream(probe_name).good();
+		std::remove(probe_name.c_str());
+		return writable;
+	}
+
+	/** Identity of the compiler: platform, device and driver */
+	inline std::string deviceKey(const cl::Device & device)
+	{
+		cl::Platform platform(device.getInfo<CL_DEVICE_PLATFORM>());
+		std::ostringstream key;
+		key << platform.getInfo<CL_PLATFORM_NAME>().c_str() << "|" << platform.getInfo<CL_PLATFORM_VERSION>().c_str()
+			<< "|" << device.getInfo<CL_DEVICE_NAME>().c_str() << "|" << device.getInfo<CL_DEVICE_VENDOR>().c_str()
+			<< "|" << device.getInfo<CL_DEVICE_VERSION>().c_str() << "|" << device.getInfo<CL_DRIVER_VERSION>().c_str();
+		return key.str();
+	}
+
+	static const char MAGIC[8] = { 'F', 'L', 'C', 'L', 'B', 'I', 'N', '1' };
+
+	/** Read the binary of an entry, false if missing or written for another key */
+	inline bool readEntry(const std::string & filename, const std::string & key, std::vector<unsigned char> & binary)
+	{
+		std::ifstream in(filename, std::ios::binary);
+		char magic[8];
+		uint64_t key_size = 0, binary_size = 0;
+		if (!in.read(magic, 8) || std::string(magic, 8) != std::string(MAGIC, 8)
+			|| !in.read(reinterpret_cast<char*>(&key_size), sizeof(key_size)) || key_size != key.size()) {
+			return false;
+		}
+		std::string stored(key_size, '\0');
+		if (!in.read(&stored[0], key_size) || stored != key
+			|| !in.read(reinterpret_cast<char*>(&binary_size), sizeof(binary_size)) || binary_size == 0) {
+			return false;
+		}
+		binary.resize(binary_size);
+		return (bool)in.read(reinterpret_cast<char*>(binary.data()), binary_size);
+	}
+
+	/** Write an entry in a temporary file renamed at the end, a concurrent reader never sees half a file */
+	inline bool writeEntry(const std::string & filename, const std::string & key, const std::vector<unsigned char> & binary)
+	{
+		const std::string tmp = filename + ".tmp";
+		{
+			std::ofstream out(tmp, std::ios::binary | std::ios::trunc);
+			const uint64_t key_size = key.size(), binary_size = binary.size();
+			out.write(MAGIC, 8);
+			out.write(reinterpret_cast<const char*>(&key_size), sizeof(key_size));
+			out.write(key.data(), key.size());
+			out.write(reinterpret_cast<const char*>(&binary_size), sizeof(binary_size));
+			out.write(reinterpret_cast<const char*>(binary.data()), binary.size());
+			if (!out.good()) {
+				return false;
+			}
+		}
+		std::remove(filename.c_str());
+		return std::rename(tmp.c_str(), filename.c_str()) == 0;
+	}
+
+	/** Binary of a program for "device", one of the devices of its context (the program of a multi-device
+	* context has a binary per device, the ones it was not built for are empty) */
+	inline bool programBinary(const cl::Program & program, const cl::Device & device, std::vector<unsigned char> & binary)
+	{
+		cl_uint nb_devices = 0;
+		if (clGetProgramInfo(program(), CL_PROGRAM_NUM_DEVICES, sizeof(nb_devices), &nb_devices, nullptr) != CL_SUCCESS
+			|| nb_devices == 0) {
+			return false;
+		}
+		std::vector<cl_device_id> devices(nb_devices);
+		std::vector<size_t> sizes(nb_devices);
+		if (clGetProgramInfo(program(), CL_PROGRAM_DEVICES, nb_devices * sizeof(cl_device_id), devices.data(), nullptr) != CL_SUCCESS
+			|| clGetProgramInfo(program(), CL_PROGRAM_BINARY_SIZES, nb_devices * sizeof(size_t), sizes.data(), nullptr) != CL_SUCCESS) {
+			return false;
+		}
+		size_t index = 0;
+		while (index < nb_devices && devices[index] != device()) {
+			++index;
+		}
+		if (index == nb_devices || sizes[index] == 0) {
+			return false;
+		}
+		// only the binary of "device" is copied, a null pointer skips the others
+		binary.resize(sizes[index]);
+		std::vector<unsigned char*> data(nb_devices, nullptr);
+		data[index] = binary.data();
+		return clGetProgramInfo(program(), CL_PROGRAM_BINARIES, nb_devices * sizeof(unsigned char*), data.data(), nullptr) == CL_SUCCESS;
+	}
+
+	inline bool buildFromBinary(const cl::Context & context, const cl::Device & device, const std::vector<unsigned char> & binary,
+		const std::string & options, cl::Program & program)
+	{
+#ifdef __CL_ENABLE_EXCEPTIONS
+		try {
+#endif
+			cl_int error = CL_SUCCESS;
+			std::vector<cl_int> status;
+			cl::Program::Binaries binaries(1, std::make_pair(static_cast<const void*>(binary.data()), binary.size()));
+			program = cl::Program(context, { device }, binaries, &status, &error);
+			if (error != CL_SUCCESS || status.empty() || status[0] != CL_SUCCESS) {
+				return false;
+			}
+			return program.build({ device }, options.c_str()) == CL_SUCCESS;
+#ifdef __CL_ENABLE_EXCEPTIONS
+		} catch (cl::Error &) {
+			return false;
+		}
+#endif
+	}
+
+	inline bool buildFromSource(const cl::Context & context, const cl::Device & device, const std::string & source,
+		const std::string & options, cl::Program & program)
+	{
+		cl::Program::Sources sources(1, std::make_pair(source.c_str(), source.length() + 1));
+#ifdef __CL_ENABLE_EXCEPTIONS
+		try {
+#endif
+			program = cl::Program(context, sources);
+			if (program.build({ device }, options.c_str()) == CL_SUCCESS) {
+				return true;
+			}
+#ifdef __CL_ENABLE_EXCEPTIONS
+		} catch (cl::Error &) {
+		}
+#endif
+		std::cout << " Error building: " << program.getBuildInfo<CL_PROGRAM_BUILD_LOG>(device) << "\n";
+		return false;
+	}
+
+	/** Build "source" for "device", from the cache when possible. Return false (log printed) if the source does not build */
+	inline bool build(const cl::Context & context, const cl::Device & device, const std::string & source,
+		const std::string & options, cl::Program & program)
+	{
+		const std::string dir = directory();
+		const std::string key = deviceKey(device) + "|" + options + "|" + std::to_string(source.size()) + ":" + std::to_string(hash(source));
+		char name[32];
+		std::snprintf(name, sizeof(name), "%016llx.bin", (unsigned long long)hash(key));
+		const std::string filename = dir + "/" + name;
+
+		std::vector<unsigned char> binary;
+		if (!dir.empty() && readEntry(filename, key, binary)) {
+			if (buildFromBinary(context, device, binary, options, program)) {
+				std::cout << "Program loaded from the cache" << std::endl;
+				return true;
+			}
+			std::cout << "Stale program cache entry, rebuilding" << std::endl;
+		}
+		if (!buildFromSource(context, device, source, options, program)) {
+			return false;
+		}
+		if (dir.empty()) {
+			return true;
+		}
+		if (!makeDirectory(dir)) {
+			std::cout << "Program cache not written: cannot use " << dir << std::endl;
+		} else if (!programBinary(program, device, binary)) {
+			std::cout << "Program cache not written: the driver gives no binary for this device" << std::endl;
+		} else if (!writeEntry(filename, key, binary)) {
+			std::cout << "Program cache not written: cannot write " << filename << std::endl;
+		}
+		return true;
+	}
+}
+
+#endif // !PROGRAM_CACHE_H
@@ -0,0 +1,127 @@
+#ifndef SIMD_STENCIL_H
+#define SIMD_STENCIL_H
+
+#if defined(__AVX512F__) || defined(__AVX2__)
+#include <immintrin.h>
+#endif
+
+/** Vectorized row kernels of the CPU engines
+* Every function processes n consecutive floats of a row, the neighbours are given as
+* pointers already shifted on the same row (x-1, x+1) or on the adjacent rows.
+* The instruction set is chosen at compile time (-mavx2, -mavx512f or -march=native),
+* the scalar loop handles the remainder and the builds without AVX. */
+namespace SimdStencil
+{
+	/** Name of the instruction set used by this build */
+	inline const char* instructionSet()
+	{
+#if defined(__AVX512F__)
+		return "AVX-512";
+#elif defined(__AVX2__)
+		return "AVX2";
+#else
+		return "scalar";
+#endif
+	}
+
+	/** out = (src + a*(n0+n1+n2+n3)) / div */
+	inline void jacobi4(float* out, const float* src, const float* n0, const float* n1, const float* n2, const float* n3,
+		int n, float a, float div)
+	{
+		int i = 0;
+#if defined(__AVX512F__)
+		const __m512 va = _mm512_set1_ps(a), vdiv = _mm512_set1_ps(div);
+		for (; i + 16 <= n; i += 16) {
+			__m512 sum = _mm512_add_ps(_mm512_add_ps(_mm512_loadu_ps(n0 + i), _mm512_loadu_ps(n1 + i)),
+				_mm512_add_ps(_mm512_loadu_ps(n2 + i), _mm512_loadu_ps(n3 + i)));
+			_mm512_storeu_ps(out + i, _mm512_div_ps(_mm512_fmadd_ps(va, sum, _mm512_loadu_ps(src + i)), vdiv));
+		}
+#elif defined(__AVX2__)
+		const __m256 va = _mm256_set1_ps(a), vdiv = _mm256_set1_ps(div);
+		for (; i + 8 <= n; i += 8) {
+			__m256 sum = _mm256_add_ps(_mm256_add_ps(_mm256_loadu_ps(n0 + i), _mm256_loadu_ps(n1 + i)),
+				_mm256_add_ps(_mm256_loadu_ps(n2 + i), _mm256_loadu_ps(n3 + i)));
+			_mm256_storeu_ps(out + i, _mm256_div_ps(_mm256_add_ps(_mm256_mul_ps(va, sum), _mm256_loadu_ps(src + i)), vdiv));
+		}
+#endif
+		for (; i < n; ++i) {
+			out[i] = (src[i] + a*(n0[i] + n1[i] + n2[i] + n3[i])) / div;
+		}
+	}
+
+	/** out = (src + a*(n0+n1+n2+n3+n4+n5)) / div */
+	inline void jacobi6(float* out, const float* src, const float* n0, const float* n1, const float* n2, const float* n3,
+		const float* n4, const float* n5, int n, float a, float div)
+	{
+		int i = 0;
+#if defined(__AVX512F__)
+		const __m512 va = _mm512_set1_ps(a), vdiv = _mm512_set1_ps(div);
+		for (; i + 16 <= n; i += 16) {
+			__m512 sum = _mm512_add_ps(_mm512_add_ps(_mm512_loadu_ps(n0 + i), _mm512_loadu_ps(n1 + i)),
+				_mm512_add_ps(_mm512_loadu_ps(n2 + i), _mm512_loadu_ps(n3 + i)));
+			sum = _mm512_add_ps(sum, _mm512_add_ps(_mm512_loadu_ps(n4 + i), _mm512_loadu_ps(n5 + i)));
+			_mm512_storeu_ps(out + i, _mm512_div_ps(_mm512_fmadd_ps(va, sum, _mm512_loadu_ps(src + i)), vdiv));
+		}
+#elif defined(__AVX2__)
+		const __m256 va = _mm256_set1_ps(a), vdiv = _mm256_set1_ps(div);
+		for (; i + 8 <= n; i += 8) {
+			__m256 sum = _mm256_add_ps(_mm256_add_ps(_mm256_loadu_ps(n0 + i), _mm256_loadu_ps(n1 + i)),
+				_mm256_add_ps(_mm256_loadu_ps(n2 + i), _mm256_loadu_ps(n3 + i)));
+			sum = _mm256_add_ps(sum, _mm256_add_ps(_mm256_loadu_ps(n4 + i), _mm256_loadu_ps(n5 + i)));
+			_mm256_storeu_ps(out + i, _mm256_div_ps(_mm256_add_ps(_mm256_mul_ps(va, sum), _mm256_loadu_ps(src + i)), vdiv));
+		}
+#endif
+		for (; i < n; ++i) {
+			out[i] = (src[i] + a*(n0[i] + n1[i] + n2[i] + n3[i] + n4[i] + n5[i])) / div;
+		}
+	}
+
+	/** out = -0.5*(hx*(right-left) + hy*(down-up)), the 2D divergence of project1 */
+	inline void divergence2(float* out, const float* left, const float* right, const float* up, const float* down,
+		int n, float hx, float hy)
+	{
+		int i = 0;
+#if defined(__AVX512F__)
+		const __m512 vhx = _mm512_set1_ps(-0.5f*hx), vhy = _mm512_set1_ps(-0.5f*hy);
+		for (; i + 16 <= n; i += 16) {
+			__m512 dx = _mm512_sub_ps(_mm512_loadu_ps(right + i), _mm512_loadu_ps(left + i));
+			__m512 dy = _mm512_sub_ps(_mm512_loadu_ps(down + i), _mm512_loadu_ps(up + i));
+			_mm512_storeu_ps(out + i, _mm512_fmadd_ps(vhx, dx, _mm512_mul_ps(vhy, dy)));
+		}
+#elif defined(__AVX2__)
+		const __m256 vhx = _mm256_set1_ps(-0.5f*hx), vhy = _mm256_set1_ps(-0.5f*hy);
+		for (; i + 8 <= n; i += 8) {
+			__m256 dx = _mm256_sub_ps(_mm256_loadu_ps(right + i), _mm256_loadu_ps(left + i));
+			__m256 dy = _mm256_sub_ps(_mm256_loadu_ps(down + i), _mm256_loadu_ps(up + i));
+			_mm256_storeu_ps(out + i, _mm256_add_ps(_mm256_mul_ps(vhx, dx), _mm256_mul_ps(vhy, dy)));
+		}
+#endif
+		for (; i < n; ++i) {
+			out[i] = -0.5f*(hx*(right[i] - left[i]) + hy*(down[i] - up[i]));
+		}
+	}
+
+	/** io -= scale*(plus-minus), the gradient subtraction of project2 */
+	inline void subGradient(float* io, const float* minus, const float* plus, int n, float scale)
+	{
+		int i = 0;
+#if defined(__AVX512F__)
+		const __m512 vs = _mm512_set1_ps(scale);
+		for (; i + 16 <= n; i += 16) {
+			__m512 g = _mm512_sub_ps(_mm512_loadu_ps(plus + i), _mm512_loadu_ps(minus + i));
+			_mm512_storeu_ps(io + i, _mm512_fnmadd_ps(vs, g, _mm512_loadu_ps(io + i)));
+		}
+#elif defined(__AVX2__)
+		const __m256 vs = _mm256_set1_ps(scale);
+		for (; i + 8 <= n; i += 8) {
+			__m256 g = _mm256_sub_ps(_mm256_loadu_ps(plus + i), _mm256_loadu_ps(minus + i));
+			_mm256_storeu_ps(io + i, _mm256_sub_ps(_mm256_loadu_ps(io + i), _mm256_mul_ps(vs, g)));
+		}
+#endif
+		for (; i < n; ++i) {
+			io[i] -= scale*(plus[i] - minus[i]);
+		}
+	}
+}
+
+#endif // !SIMD_STENCIL_H
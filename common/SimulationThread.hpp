@@ -0,0 +1,115 @@
+#ifndef SIMULATION_THREAD_H
+#define SIMULATION_THREAD_H
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <functional>
+#include <thread>
+
+#include "InputCommand.hpp"
+#include "SpscQueue.hpp"
+#include "TripleBuffer.hpp"
+
+/** Runs a solver on its own thread, so the simulation and the presentation overlap
+* The simulation advances by fixed steps of "fixed_dt" seconds following the wall clock (up to "max_substeps"
+* per iteration, slower beyond), the input of the render thread goes through a lock-free queue and is applied
+* before the next steps, and a frame is drawn after each batch of steps and published in a triple buffer.
+* Every call to the solver happens on the simulation thread, through the callbacks. */
+class SimulationThread
+{
+public:
+	struct Callbacks
+	{
+		/** Apply an input command to the solver */
+		std::function<void(const InputCommand &)> apply;
+		/** Advance the solver by dt seconds */
+		std::function<void(float)> step;
+		/** Draw the current state in the RGBA pixels given, false if no frame is available */
+		std::function<bool(uint8_t*)> draw;
+	};
+
+	SimulationThread(size_t frame_bytes, float fixed_dt, unsigned int max_substeps, const Callbacks & callbacks)
+		: frames(frame_bytes), fixed_dt(fixed_dt), max_substeps(std::max(1u, max_substeps)), callbacks(callbacks)
+	{
+	}
+
+	~SimulationThread()
+	{
+		stop();
+	}
+
+	SimulationThread(const SimulationThread &) = delete;
+	SimulationThread & operator=(const SimulationThread &) = delete;
+
+	void start()
+	{
+		if (thread.joinable()) {
+			return;
+		}
+		running = true;
+		thread = std::thread(&SimulationThread::run, this);
+	}
+
+	/** Wait for the end of the current batch of steps, the solver can be used again by the caller */
+	void stop()
+	{
+		running = false;
+		if (thread.joinable()) {
+			thread.join();
+		}
+	}
+
+	/** Render thread: queue an input, false if the queue is full (the input is dropped) */
+	bool post(const InputCommand & command)
+	{
+		return commands.push(command);
+	}
+
+	/** Render thread: newest published frame, nullptr if none since the last call (valid until the next call) */
+	const uint8_t* latestFrame()
+	{
+		return frames.latest();
+	}
+
+private:
+	void run()
+	{
+		using clock = std::chrono::steady_clock;
+		auto last = clock::now();
+		double accumulator = 0.0;
+		while (running) {
+			InputCommand command;
+			while (commands.pop(command)) {
+				callbacks.apply(command);
+			}
+			const auto now = clock::now();
+			accumulator += std::chrono::duration<double>(now - last).count();
+			last = now;
+			// when the solver cannot keep up the simulated time slows down instead of piling up steps
+			accumulator = std::min(accumulator, (double)max_substeps*fixed_dt);
+			unsigned int substeps = 0;
+			while (accumulator >= fixed_dt) {
+				callbacks.step(fixed_dt);
+				accumulator -= fixed_dt;
+				++substeps;
+			}
+			if (substeps == 0) {
+				std::this_thread::sleep_for(std::chrono::duration<double>(fixed_dt - accumulator));
+			} else if (callbacks.draw(frames.backBuffer())) {
+				frames.publish();
+			}
+		}
+	}
+
+	SpscQueue<InputCommand, 256> commands;
+	TripleBuffer frames;
+	const float fixed_dt;
+	const unsigned int max_substeps;
+	Callbacks callbacks;
+	std::atomic<bool> running{ false };
+	std::thread thread;
+};
+
+#endif // !SIMULATION_THREAD_H
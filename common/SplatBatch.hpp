@@ -0,0 +1,188 @@
+#ifndef SPLAT_BATCH_H
+#define SPLAT_BATCH_H
+
+#include <algorithm>
+#include <cstdint>
+#include <vector>
+#include <CL/cl.hpp>
+
+/** Source added to the fields, laid out like the 4 float4 read by the splat kernels */
+struct Splat
+{
+	float x, y;// center of the disc
+	float reach;// cells at a distance <= reach from the center are touched (radius - 0.5)
+	float falloff;// 0: the same amount everywhere, else scaled by (1 - d^2/reach^2)^falloff
+	float x0, y0, x1, y1;// box of the cells touched [x0, x1[ x [y0, y1[
+	float z0, z1;// layers touched [z0, z1[ (3D solver, members of FluidEnsemble2D)
+	float density;// added to the density
+	float velocity;// 1 if (dx, dy) is added to the velocity
+	float dx, dy;
+	float padding[2];
+};
+
+/** Splats accumulated on the host between two steps and applied by a single kernel launch
+* add() only appends to an array; upload() sends the whole batch in one write and, above a threshold,
+* bins the splats by square tiles of the bounding box so a cell only loops over the splats of its tile.
+* The uploads alternate between two sets of staging arrays and device buffers: a batch only waits for
+* the upload made two batches before, which completed long ago unless the device is far behind. */
+class SplatBatch
+{
+public:
+	void add(const Splat & splat)
+	{
+		if (splat.x1 <= splat.x0 || splat.y1 <= splat.y0 || splat.z1 <= splat.z0) {
+			return;
+		}
+		if (splats.empty()) {
+			box[0] = (int)splat.x0; box[1] = (int)splat.y0; box[2] = (int)splat.z0;
+			box[3] = (int)splat.x1; box[4] = (int)splat.y1; box[5] = (int)splat.z1;
+		} else {
+			box[0] = std::min(box[0], (int)splat.x0); box[1] = std::min(box[1], (int)splat.y0); box[2] = std::min(box[2], (int)splat.z0);
+			box[3] = std::max(box[3], (int)splat.x1); box[4] = std::max(box[4], (int)splat.y1); box[5] = std::max(box[5], (int)splat.z1);
+		}
+		splats.push_back(splat);
+	}
+
+	bool empty() const
+	{
+		return splats.empty();
+	}
+
+	int size() const
+	{
+		return (int)splats.size();
+	}
+
+	/** Bounding box of the batch: [begin(axis), end(axis)[ for the axis x = 0, y = 1, z = 2 */
+	int begin(int axis) const { return box[axis]; }
+	int end(int axis) const { return box[3 + axis]; }
+
+	/** Drop the splats not uploaded yet */
+	void clear()
+	{
+		splats.clear();
+	}
+
+	/** Enqueue the upload of the batch (and of its tiles if it holds more than "binning_threshold" splats),
+	* then clear it. tileSize() is 0 when the splats are not binned */
+	void upload(const cl::Context & context, const cl::CommandQueue & queue, int binning_threshold, int tile)
+	{
+		current ^= 1;
+		Slot & slot = slots[current];
+		if (slot.uploading()) {
+			// the staging arrays of this slot are still read by the driver
+			slot.last_upload.wait();
+		}
+		slot.splats.swap(splats);
+		splats.clear();
+		const size_t bytes = slot.splats.size() * sizeof(Splat);
+		if (bytes > slot.buffer_bytes) {
+			slot.buffer_bytes = std::max(bytes, 2 * slot.buffer_bytes);
+			slot.buffer = cl::Buffer(context, CL_MEM_READ_ONLY, slot.buffer_bytes);
+		}
+		queue.enqueueWriteBuffer(slot.buffer, CL_FALSE, 0, bytes, slot.splats.data(), nullptr, &slot.last_upload);
+		slot.tile_size = ((int)slot.splats.size() > binning_threshold) ? tile : 0;
+		if (slot.tile_size == 0) {
+			slot.tiles_x = 0;
+			// the kernels take no buffer argument of size 0
+			if (!slot.offsets_bytes) {
+				slot.offsets_bytes = slot.indices_bytes = sizeof(uint32_t);
+				slot.offsets = cl::Buffer(context, CL_MEM_READ_ONLY, slot.offsets_bytes);
+				slot.indices = cl::Buffer(context, CL_MEM_READ_ONLY, slot.indices_bytes);
+			}
+			return;
+		}
+		bin(slot);
+		if (slot.tile_offsets.size() * sizeof(uint32_t) > slot.offsets_bytes) {
+			slot.offsets_bytes = std::max(slot.tile_offsets.size() * sizeof(uint32_t), 2 * slot.offsets_bytes);
+			slot.offsets = cl::Buffer(context, CL_MEM_READ_ONLY, slot.offsets_bytes);
+		}
+		if (slot.tile_splats.size() * sizeof(uint32_t) > slot.indices_bytes) {
+			slot.indices_bytes = std::max(slot.tile_splats.size() * sizeof(uint32_t), 2 * slot.indices_bytes);
+			slot.indices = cl::Buffer(context, CL_MEM_READ_ONLY, slot.indices_bytes);
+		}
+		queue.enqueueWriteBuffer(slot.offsets, CL_FALSE, 0, slot.tile_offsets.size() * sizeof(uint32_t), slot.tile_offsets.data());
+		queue.enqueueWriteBuffer(slot.indices, CL_FALSE, 0, slot.tile_splats.size() * sizeof(uint32_t), slot.tile_splats.data(),
+			nullptr, &slot.last_upload);
+	}
+
+	/** Device copy of the last upload: the splats, the first splat of every tile (plus the end) and the splats of the tiles */
+	const cl::Buffer & splatBuffer() const { return slots[current].buffer; }
+	const cl::Buffer & offsetBuffer() const { return slots[current].offsets; }
+	const cl::Buffer & indexBuffer() const { return slots[current].indices; }
+	int uploadedSize() const { return (int)slots[current].splats.size(); }
+	/** Event of the last write of the upload */
+	const cl::Event & uploadEvent() const { return slots[current].last_upload; }
+	int tileSize() const { return slots[current].tile_size; }
+	int tilesX() const { return slots[current].tiles_x; }
+
+private:
+	/** Staging arrays and device buffers of an upload */
+	struct Slot
+	{
+		std::vector<Splat> splats;
+		std::vector<uint32_t> tile_offsets;
+		std::vector<uint32_t> tile_splats;
+		int tile_size = 0;
+		int tiles_x = 0;
+		cl::Event last_upload;
+		cl::Buffer buffer;
+		cl::Buffer offsets;
+		cl::Buffer indices;
+		size_t buffer_bytes = 0;
+		size_t offsets_bytes = 0;
+		size_t indices_bytes = 0;
+
+		bool uploading() const
+		{
+			return last_upload() && last_upload.getInfo<CL_EVENT_COMMAND_EXECUTION_STATUS>() != CL_COMPLETE;
+		}
+	};
+
+	/** Counting sort of the splats of a slot by the tiles of the bounding box they overlap */
+	void bin(Slot & slot)
+	{
+		const int tile_size = slot.tile_size;
+		slot.tiles_x = (box[3] - box[0] + tile_size - 1) / tile_size;
+		const int tiles_x = slot.tiles_x;
+		const int tiles_y = (box[4] - box[1] + tile_size - 1) / tile_size;
+		std::vector<uint32_t> & tile_offsets = slot.tile_offsets;
+		tile_offsets.assign((size_t)tiles_x*tiles_y + 1, 0);
+		auto tiles_of = [&](const Splat & s, int & tx0, int & ty0, int & tx1, int & ty1) {
+			tx0 = ((int)s.x0 - box[0]) / tile_size;
+			ty0 = ((int)s.y0 - box[1]) / tile_size;
+			tx1 = ((int)s.x1 - 1 - box[0]) / tile_size;
+			ty1 = ((int)s.y1 - 1 - box[1]) / tile_size;
+		};
+		int tx0, ty0, tx1, ty1;
+		for (const Splat & s : slot.splats) {
+			tiles_of(s, tx0, ty0, tx1, ty1);
+			for (int ty = ty0; ty <= ty1; ++ty) {
+				for (int tx = tx0; tx <= tx1; ++tx) {
+					++tile_offsets[tx + ty*tiles_x + 1];
+				}
+			}
+		}
+		for (size_t t = 1; t < tile_offsets.size(); ++t) {
+			tile_offsets[t] += tile_offsets[t - 1];
+		}
+		slot.tile_splats.resize(tile_offsets.back());
+		std::vector<uint32_t> fill(tile_offsets.begin(), tile_offsets.end() - 1);
+		// the splats keep their order in every tile: the additions of a cell happen in the order of the calls
+		for (uint32_t i = 0; i < (uint32_t)slot.splats.size(); ++i) {
+			tiles_of(slot.splats[i], tx0, ty0, tx1, ty1);
+			for (int ty = ty0; ty <= ty1; ++ty) {
+				for (int tx = tx0; tx <= tx1; ++tx) {
+					slot.tile_splats[fill[tx + ty*tiles_x]++] = i;
+				}
+			}
+		}
+	}
+
+	std::vector<Splat> splats;// added since the last upload
+	int box[6] = { 0, 0, 0, 0, 0, 0 };
+	Slot slots[2];
+	int current = 1;// slot of the last upload, the first upload goes to slot 0
+};
+
+#endif // !SPLAT_BATCH_H
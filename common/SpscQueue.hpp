@@ -0,0 +1,46 @@
+#ifndef SPSC_QUEUE_H
+#define SPSC_QUEUE_H
+
+#include <array>
+#include <atomic>
+#include <cstddef>
+
+/** Lock-free bounded queue between exactly one producer thread and one consumer thread
+* A ring of Capacity slots (a power of 2) with a head written by the consumer and a tail written by the producer,
+* each on its own cache line; push and pop never block, they fail when the queue is full or empty */
+template <typename T, size_t Capacity>
+class SpscQueue
+{
+	static_assert(Capacity >= 2 && (Capacity & (Capacity - 1)) == 0, "the capacity must be a power of 2");
+public:
+	/** Producer side, false if the queue is full (the value is dropped) */
+	bool push(const T & value)
+	{
+		const size_t tail = tail_index.load(std::memory_order_relaxed);
+		if (tail - head_index.load(std::memory_order_acquire) == Capacity) {
+			return false;
+		}
+		slots[tail & (Capacity - 1)] = value;
+		tail_index.store(tail + 1, std::memory_order_release);
+		return true;
+	}
+
+	/** Consumer side, false if the queue is empty */
+	bool pop(T & value)
+	{
+		const size_t head = head_index.load(std::memory_order_relaxed);
+		if (head == tail_index.load(std::memory_order_acquire)) {
+			return false;
+		}
+		value = slots[head & (Capacity - 1)];
+		head_index.store(head + 1, std::memory_order_release);
+		return true;
+	}
+
+private:
+	std::array<T, Capacity> slots;
+	alignas(64) std::atomic<size_t> head_index{ 0 };// next slot read
+	alignas(64) std::atomic<size_t> tail_index{ 0 };// next slot written
+};
+
+#endif // !SPSC_QUEUE_H
@@ -0,0 +1,211 @@
+#ifndef STATE_FILE_H
+#define STATE_FILE_H
+
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <string>
+#include <vector>
+#ifdef _WIN32
+#include <iterator>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+/** Checkpoint of a simulation: every field needed to resume it exactly
+* File: a header (dimensions, parameters, step), a table of the fields, then the fields themselves,
+* each one starting on a page boundary so a mapped file can be given as is to an OpenCL write.
+* The fields are stored without padding, row major (x first), in the byte order of the machine. */
+namespace StateFile
+{
+	constexpr uint32_t VERSION = 1;
+	constexpr uint64_t ALIGNMENT = 4096;
+	constexpr uint32_t NB_PARAMETERS = 8;
+	static const char MAGIC[8] = { 'F', 'L', 'S', 'T', 'A', 'T', 'E', '\0' };
+
+	/** Description of the simulation saved with the fields */
+	struct Info
+	{
+		uint32_t width = 0;
+		uint32_t height = 0;
+		uint32_t depth = 1;
+		uint64_t step = 0;
+		float parameters[NB_PARAMETERS] = {};// solver dependent (viscosity, diffusion...)
+	};
+
+	struct Header
+	{
+		char magic[8];
+		uint32_t version;
+		uint32_t nb_fields;
+		Info info;
+	};
+
+	struct FieldEntry
+	{
+		char name[24];
+		uint64_t offset;// from the beginning of the file, multiple of ALIGNMENT
+		uint64_t size;// in bytes
+	};
+
+	inline uint64_t alignUp(uint64_t value)
+	{
+		return (value + ALIGNMENT - 1) / ALIGNMENT * ALIGNMENT;
+	}
+
+	/** Build a state file in memory: the caller copies each field at field(i), then write() */
+	class Writer
+	{
+	public:
+		Writer(const Info & info, const std::vector<std::pair<std::string, size_t>> & fields)
+		{
+			Header header;
+			std::memcpy(header.magic, MAGIC, 8);
+			header.version = VERSION;
+			header.nb_fields = (uint32_t)fields.size();
+			header.info = info;
+			uint64_t offset = alignUp(sizeof(Header) + fields.size()*sizeof(FieldEntry));
+			for (auto & field : fields) {
+				FieldEntry entry = {};
+				std::strncpy(entry.name, field.first.c_str(), sizeof(entry.name) - 1);
+				entry.offset = offset;
+				entry.size = field.second;
+				entries.push_back(entry);
+				offset = alignUp(offset + field.second);
+			}
+			data.assign(offset, 0);
+			std::memcpy(data.data(), &header, sizeof(header));
+			std::memcpy(data.data() + sizeof(header), entries.data(), entries.size()*sizeof(FieldEntry));
+		}
+
+		/** Destination of the field "index" in the order given to the constructor */
+		void* field(size_t index) { return data.data() + entries[index].offset; }
+
+		bool write(const std::string & filename) const
+		{
+			std::ofstream out(filename, std::ios::binary | std::ios::trunc);
+			out.write(reinterpret_cast<const char*>(data.data()), data.size());
+			if (!out.good()) {
+				std::cout << "cannot write " << filename << std::endl;
+				return false;
+			}
+			return true;
+		}
+
+	private:
+		std::vector<FieldEntry> entries;
+		std::vector<uint8_t> data;
+	};
+
+	/** Read only view of a state file, mapped in memory (read at once on Windows) */
+	class Mapping
+	{
+	public:
+		Mapping() {}
+		Mapping(const Mapping &) = delete;
+		Mapping & operator=(const Mapping &) = delete;
+
+		~Mapping()
+		{
+#ifndef _WIN32
+			if (base) {
+				munmap(base, length);
+			}
+#endif
+		}
+
+		/** Map "filename" and check its header, false (message printed) if it is not a usable state file */
+		bool open(const std::string & filename)
+		{
+#ifdef _WIN32
+			std::ifstream in(filename, std::ios::binary);
+			if (!in.good()) {
+				std::cout << "cannot open " << filename << std::endl;
+				return false;
+			}
+			copy.assign(std::istreambuf_iterator<char>(in), std::istreambuf_iterator<char>());
+			bytes = copy.data();
+			length = copy.size();
+#else
+			const int fd = ::open(filename.c_str(), O_RDONLY);
+			struct stat st;
+			if (fd < 0 || fstat(fd, &st) != 0 || st.st_size == 0) {
+				std::cout << "cannot open " << filename << std::endl;
+				if (fd >= 0) {
+					close(fd);
+				}
+				return false;
+			}
+			length = (size_t)st.st_size;
+			base = mmap(nullptr, length, PROT_READ, MAP_PRIVATE, fd, 0);
+			close(fd);
+			if (base == MAP_FAILED) {
+				base = nullptr;
+				std::cout << "cannot map " << filename << std::endl;
+				return false;
+			}
+			bytes = static_cast<const char*>(base);
+#endif
+			Header header;
+			if (length < sizeof(Header)) {
+				return invalid(filename);
+			}
+			std::memcpy(&header, bytes, sizeof(header));
+			if (std::memcmp(header.magic, MAGIC, 8) != 0 || header.version != VERSION
+				|| length < sizeof(Header) + (uint64_t)header.nb_fields*sizeof(FieldEntry)) {
+				return invalid(filename);
+			}
+			entries.resize(header.nb_fields);
+			std::memcpy(entries.data(), bytes + sizeof(Header), entries.size()*sizeof(FieldEntry));
+			for (auto & entry : entries) {
+				entry.name[sizeof(entry.name) - 1] = '\0';
+				if (entry.offset + entry.size > length) {
+					return invalid(filename);
+				}
+			}
+			file_info = header.info;
+			return true;
+		}
+
+		const Info & info() const { return file_info; }
+
+		/** Content of the field "name", nullptr (message printed) if it is missing or does not have "size" bytes */
+		const void* field(const std::string & name, size_t size) const
+		{
+			for (auto & entry : entries) {
+				if (name == entry.name) {
+					if (entry.size != size) {
+						break;
+					}
+					return bytes + entry.offset;
+				}
+			}
+			std::cout << "state file: field " << name << " missing or of the wrong size" << std::endl;
+			return nullptr;
+		}
+
+	private:
+		bool invalid(const std::string & filename)
+		{
+			std::cout << filename << " is not a state file of this version" << std::endl;
+			return false;
+		}
+
+		const char* bytes = nullptr;
+		size_t length = 0;
+#ifdef _WIN32
+		std::vector<char> copy;
+#else
+		void* base = nullptr;
+#endif
+		std::vector<FieldEntry> entries;
+		Info file_info;
+	};
+}
+
+#endif // !STATE_FILE_H
@@ -0,0 +1,121 @@
+#ifndef THREAD_POOL_H
+#define THREAD_POOL_H
+
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+/** Fixed set of worker threads used by the CPU engines
+* parallelFor splits a range of rows (or slabs) in one contiguous block per thread,
+* the calling thread works on the first block and returns when every block is done */
+class ThreadPool
+{
+public:
+	/** nb_threads = 0 uses every hardware thread */
+	explicit ThreadPool(unsigned int nb_threads = 0)
+	{
+		if (nb_threads == 0) {
+			nb_threads = std::thread::hardware_concurrency();
+		}
+		nb_workers = (nb_threads == 0) ? 1 : nb_threads;
+		for (unsigned int id = 1; id < nb_workers; ++id) {
+			threads.emplace_back(&ThreadPool::worker, this, id);
+		}
+	}
+
+	~ThreadPool()
+	{
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			stop = true;
+		}
+		wake.notify_all();
+		for (auto & thread : threads) {
+			thread.join();
+		}
+	}
+
+	ThreadPool(const ThreadPool &) = delete;
+	ThreadPool & operator=(const ThreadPool &) = delete;
+
+	/** Number of threads working on a parallelFor (the caller included) */
+	unsigned int size() const
+	{
+		return nb_workers;
+	}
+
+	/** Call fn(block_begin, block_end) on disjoint blocks covering [begin, end[ */
+	void parallelFor(int begin, int end, const std::function<void(int, int)> & fn)
+	{
+		if (end <= begin) {
+			return;
+		}
+		if (nb_workers == 1 || end - begin < (int)nb_workers) {
+			fn(begin, end);
+			return;
+		}
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			task = &fn;
+			task_begin = begin;
+			task_end = end;
+			pending = nb_workers - 1;
+			++generation;
+		}
+		wake.notify_all();
+		runBlock(0, fn, begin, end);
+		std::unique_lock<std::mutex> lock(mutex);
+		done.wait(lock, [this] { return pending == 0; });
+		task = nullptr;
+	}
+
+private:
+	void runBlock(unsigned int id, const std::function<void(int, int)> & fn, int begin, int end) const
+	{
+		const long long length = end - begin;
+		const int block_begin = begin + (int)(length*id / nb_workers);
+		const int block_end = begin + (int)(length*(id + 1) / nb_workers);
+		if (block_begin < block_end) {
+			fn(block_begin, block_end);
+		}
+	}
+
+	void worker(unsigned int id)
+	{
+		unsigned int seen = 0;
+		for (;;) {
+			std::unique_lock<std::mutex> lock(mutex);
+			wake.wait(lock, [this, seen] { return stop || generation != seen; });
+			if (stop) {
+				return;
+			}
+			seen = generation;
+			const auto & fn = *task;
+			const int begin = task_begin, end = task_end;
+			lock.unlock();
+
+			runBlock(id, fn, begin, end);
+
+			lock.lock();
+			if (--pending == 0) {
+				done.notify_one();
+			}
+		}
+	}
+
+	unsigned int nb_workers;
+	std::vector<std::thread> threads;
+	std::mutex mutex;
+	std::condition_variable wake;
+	std::condition_variable done;
+	const std::function<void(int, int)>* task = nullptr;
+	int task_begin = 0;
+	int task_end = 0;
+	unsigned int pending = 0;
+	unsigned int generation = 0;
+	bool stop = false;
+};
+
+#endif // !THREAD_POOL_H
@@ -0,0 +1,60 @@
+#ifndef TRIPLE_BUFFER_H
+#define TRIPLE_BUFFER_H
+
+#include <atomic>
+#include <cstdint>
+#include <vector>
+
+/** Frames handed from one writer thread to one reader thread without locks nor copies
+* The writer fills its back buffer and publishes it by swapping it with the middle one, the reader takes
+* the middle one when it is newer than its front buffer: neither side ever waits, the reader always gets
+* the newest published frame and the frames it had no time to display are overwritten */
+class TripleBuffer
+{
+public:
+	explicit TripleBuffer(size_t frame_bytes = 0)
+	{
+		resize(frame_bytes);
+	}
+
+	/** Not thread safe, before the threads start */
+	void resize(size_t frame_bytes)
+	{
+		for (auto & buffer : buffers) {
+			buffer.assign(frame_bytes, 0);
+		}
+	}
+
+	/** Writer side: the buffer to fill, valid until publish */
+	uint8_t* backBuffer()
+	{
+		return buffers[back].data();
+	}
+
+	/** Writer side: make the back buffer the newest frame */
+	void publish()
+	{
+		back = middle.exchange(back | FRESH, std::memory_order_acq_rel) & INDEX;
+	}
+
+	/** Reader side: the newest published frame, nullptr if none was published since the last call.
+	* The pointer stays valid until the next call */
+	const uint8_t* latest()
+	{
+		if (!(middle.load(std::memory_order_relaxed) & FRESH)) {
+			return nullptr;
+		}
+		front = middle.exchange(front, std::memory_order_acq_rel) & INDEX;
+		return buffers[front].data();
+	}
+
+private:
+	static constexpr int INDEX = 3;
+	static constexpr int FRESH = 4;// flag of a middle buffer not read yet
+	std::vector<uint8_t> buffers[3];
+	int back = 0;// writer only
+	int front = 1;// reader only
+	std::atomic<int> middle{ 2 };
+};
+
+#endif // !TRIPLE_BUFFER_H
@@ -0,0 +1,362 @@
+#ifndef WORK_GROUP_TUNER_H
+#define WORK_GROUP_TUNER_H
+
+#include <algorithm>
+#include <array>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <fstream>
+#include <functional>
+#include <iostream>
+#include <limits>
+#include <map>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <CL/cl.hpp>
+
+#include "ProgramCache.hpp"
+
+/** Local work sizes of the kernels measured on a device and kept in a tuning file
+* A launch is identified by the kernel name, the build options of its program and its global size (so the
+* resolution); its entry holds the fastest local size, or none when the choice of the driver won.
+* The kernels registered with setBounded return beyond the end of their launch: their global size is rounded up
+* to a multiple of the local size, so any local size is a candidate, not only the divisors of the grid.
+* In tuning mode the first launch of an unknown entry times every candidate (the kernel runs several times,
+* so the fields of the solver are meaningless afterwards), the other launches only look the entry up.
+* The file also keeps the choices between the implementations of a step (tiled kernels or not, layouts...),
+* as entries of 0 dimensions holding the index of the fastest one and independent of the build options.
+* The file lives next to the program cache (ProgramCache::directory), one per device and driver. */
+class WorkGroupTuner
+{
+public:
+	/** Read the tuning file of "device" (again to get the entries another tuner wrote meanwhile) */
+	void load(const cl::Device & device)
+	{
+		this->device = device;
+		resolved.clear();
+		entries.clear();
+		const std::string key = ProgramCache::deviceKey(device);
+		const std::string dir = ProgramCache::directory();
+		char name[40];
+		std::snprintf(name, sizeof(name), "tuning-%016llx.txt", (unsigned long long)ProgramCache::hash(key));
+		filename = dir.empty() ? std::string() : dir + "/" + name;
+		device_key = key;
+
+		std::ifstream in(filename);
+		std::string line;
+		if (!std::getline(in, line) || line != "# " + key) {
+			return;
+		}
+		while (std::getline(in, line)) {
+			std::istringstream fields(line);
+			Key k;
+			Entry e;
+			if (fields >> k.name >> std::hex >> k.variant >> std::dec >> k.dims >> k.global[0] >> k.global[1] >> k.global[2]
+				>> e.local[0] >> e.local[1] >> e.local[2] >> e.ms) {
+				entries[k] = e;
+			}
+		}
+		if (!entries.empty()) {
+			std::cout << "Work-group sizes loaded: " << entries.size() << " tuned launches" << std::endl;
+		}
+	}
+
+	/** The next launches belong to the program built with "options", they use its entries */
+	void setOptions(const std::string & options)
+	{
+		variant = ProgramCache::hash(options);
+		resolved.clear();
+	}
+
+	/** Write every entry (the loaded ones included), false if the file cannot be written */
+	bool save() const
+	{
+		if (filename.empty() || !ProgramCache::makeDirectory(ProgramCache::directory())) {
+			std::cout << "no directory for the tuning file (FLUID_CL_CACHE)" << std::endl;
+			return false;
+		}
+		const std::string tmp = filename + ".tmp";
+		{
+			std::ofstream out(tmp, std::ios::trunc);
+			out << "# " << device_key << "\n";
+			for (auto & entry : entries) {
+				const Key & k = entry.first;
+				const Entry & e = entry.second;
+				out << k.name << " " << std::hex << k.variant << std::dec << " " << k.dims << " " << k.global[0] << " "
+					<< k.global[1] << " " << k.global[2] << " " << e.local[0] << " " << e.local[1] << " " << e.local[2]
+					<< " " << e.ms << "\n";
+			}
+			if (!out.good()) {
+				std::cout << "cannot write " << tmp << std::endl;
+				return false;
+			}
+		}
+		std::remove(filename.c_str());
+		std::rename(tmp.c_str(), filename.c_str());
+		std::cout << "Work-group sizes written in " << filename << std::endl;
+		return true;
+	}
+
+	/** Time the unknown launches (on) or only use the tuned entries (off, the default) */
+	void setTuning(bool enabled) { tuning = enabled; }
+	bool isTuning() const { return tuning; }
+
+	/** Launches of each candidate timed, after one warm-up launch */
+	void setRepetitions(unsigned int count) { repetitions = std::max(1u, count); }
+
+	/** The work items of "kernel_name" beyond the end of the launch (offset + global) return in its first "dims"
+	* dimensions, its global size may be padded there */
+	void setBounded(const std::string & kernel_name, unsigned int dims = 3) { bounded[kernel_name] = dims; }
+
+	/** Global and local sizes of an enqueue */
+	struct Launch
+	{
+		cl::NDRange global;
+		cl::NDRange local;
+	};
+
+	/** Sizes to give to a launch of "kernel" over "global": the tuned local size (the global size rounded up to it
+	* for a bounded kernel), NullRange if unknown or if the driver choice was the fastest. In tuning mode an unknown
+	* launch is timed first */
+	const Launch & launch(const cl::CommandQueue & queue, const cl::Kernel & kernel, const std::string & name,
+		const cl::NDRange & offset, const cl::NDRange & global)
+	{
+		std::pair<cl_kernel, std::array<size_t, 3>> handle(kernel(), sizes(global));
+		auto it = resolved.find(handle);
+		if (it != resolved.end()) {
+			return it->second;
+		}
+		Key k;
+		k.name = name;
+		k.variant = variant;
+		k.dims = (int)global.dimensions();
+		std::copy(handle.second.begin(), handle.second.end(), k.global);
+		auto entry = entries.find(k);
+		if (entry == entries.end()) {
+			if (!tuning || fixedLocalSize(kernel)) {
+				return resolved.insert({ handle, { global, cl::NullRange } }).first->second;
+			}
+			entry = entries.insert({ k, tune(queue, kernel, name, offset, global) }).first;
+		}
+		const cl::NDRange local = range(k.dims, entry->second.local);
+		return resolved.insert({ handle, { padded(global, local), local } }).first->second;
+	}
+
+	/** Index of the fastest implementation of the step "name" over "global", -1 if it was never timed */
+	int choice(const std::string & name, const cl::NDRange & global) const
+	{
+		auto entry = entries.find(choiceKey(name, global));
+		return (entry == entries.end()) ? -1 : (int)entry->second.local[0];
+	}
+
+	/** Keep "index" as the implementation of the step "name" over "global", "ms" long */
+	void setChoice(const std::string & name, const cl::NDRange & global, int index, double ms)
+	{
+		Entry & entry = entries[choiceKey(name, global)];
+		entry.local[0] = (size_t)index;
+		entry.ms = ms;
+	}
+
+	/** Time "count" implementations of the step "name" over "global" and keep the fastest: run(i) runs the
+	* implementation i until it completes, once to warm up (in tuning mode its launches are tuned then) */
+	int tuneChoice(const std::string & name, const cl::NDRange & global, int count, const std::function<void(int)> & run)
+	{
+		int best = 0;
+		double best_ms = std::numeric_limits<double>::infinity();
+		std::cout << "  " << name << ":";
+		for (int i = 0; i < count; ++i) {
+			run(i);
+			const auto start = std::chrono::steady_clock::now();
+			for (unsigned int k = 0; k < repetitions; ++k) {
+				run(i);
+			}
+			const double ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count() / repetitions;
+			std::cout << " " << i << " " << ms << " ms";
+			if (ms < best_ms) {
+				best = i;
+				best_ms = ms;
+			}
+		}
+		std::cout << ", " << best << " kept" << std::endl;
+		setChoice(name, global, best, best_ms);
+		return best;
+	}
+
+	/** Number of tuned launches and choices */
+	size_t size() const { return entries.size(); }
+
+private:
+	struct Key
+	{
+		std::string name;
+		uint64_t variant = 0;
+		int dims = 0;
+		size_t global[3] = { 1, 1, 1 };
+		bool operator<(const Key & other) const
+		{
+			if (name != other.name) return name < other.name;
+			if (variant != other.variant) return variant < other.variant;
+			if (dims != other.dims) return dims < other.dims;
+			return std::lexicographical_compare(global, global + 3, other.global, other.global + 3);
+		}
+	};
+	struct Entry
+	{
+		size_t local[3] = { 0, 0, 0 };// 0: NullRange
+		double ms = 0.0;// of a launch
+	};
+
+	static std::array<size_t, 3> sizes(const cl::NDRange & range)
+	{
+		std::array<size_t, 3> s = { 1, 1, 1 };
+		for (size_t i = 0; i < range.dimensions(); ++i) {
+			s[i] = static_cast<const size_t*>(range)[i];
+		}
+		return s;
+	}
+
+	static cl::NDRange range(int dims, const size_t* local)
+	{
+		if (local[0] == 0) {
+			return cl::NullRange;
+		}
+		return (dims == 1) ? cl::NDRange(local[0]) : (dims == 2) ? cl::NDRange(local[0], local[1])
+			: cl::NDRange(local[0], local[1], local[2]);
+	}
+
+	static Key choiceKey(const std::string & name, const cl::NDRange & global)
+	{
+		Key k;
+		k.name = name;
+		const std::array<size_t, 3> g = sizes(global);
+		std::copy(g.begin(), g.end(), k.global);
+		return k;
+	}
+
+	/** "global" rounded up to a multiple of "local" (unchanged for the divisors and the driver choice) */
+	static cl::NDRange padded(const cl::NDRange & global, const cl::NDRange & local)
+	{
+		if (local.dimensions() == 0) {
+			return global;
+		}
+		std::array<size_t, 3> g = sizes(global);
+		const std::array<size_t, 3> l = sizes(local);
+		for (size_t i = 0; i < 3; ++i) {
+			g[i] = (g[i] + l[i] - 1) / l[i] * l[i];
+		}
+		return range((int)global.dimensions(), g.data());
+	}
+
+	/** Kernels declaring reqd_work_group_size are always launched with it */
+	bool fixedLocalSize(const cl::Kernel & kernel) const
+	{
+		const auto compiled = kernel.getWorkGroupInfo<CL_KERNEL_COMPILE_WORK_GROUP_SIZE>(device);
+		return compiled[0] != 0;
+	}
+
+	/** Local sizes dividing the global size (OpenCL 1.2 has no partial work-groups), and the powers of 2 in the
+	* dimensions where the kernel checks its bounds (padded launch), within the limits of the device and the kernel.
+	* The local sizes padding the grid by more than a quarter are not timed */
+	std::vector<std::array<size_t, 3>> candidates(const cl::Kernel & kernel, const std::string & name,
+		const cl::NDRange & global) const
+	{
+		const size_t max_group = std::min(kernel.getWorkGroupInfo<CL_KERNEL_WORK_GROUP_SIZE>(device),
+			device.getInfo<CL_DEVICE_MAX_WORK_GROUP_SIZE>());
+		const std::vector<size_t> max_items = device.getInfo<CL_DEVICE_MAX_WORK_ITEM_SIZES>();
+		const size_t multiple = kernel.getWorkGroupInfo<CL_KERNEL_PREFERRED_WORK_GROUP_SIZE_MULTIPLE>(device);
+		auto checked = bounded.find(name);
+		const size_t padded_dims = (checked == bounded.end()) ? 0 : checked->second;
+		const std::array<size_t, 3> g = sizes(global);
+		std::vector<size_t> lengths[3];
+		for (size_t i = 0; i < 3; ++i) {
+			const size_t limit = (i < global.dimensions()) ? std::min(max_group, max_items[i]) : 1;
+			for (size_t d = 1; d <= std::min(limit, g[i]); ++d) {
+				if (g[i] % d == 0 || (i < padded_dims && (d & (d - 1)) == 0)) {
+					lengths[i].push_back(d);
+				}
+			}
+		}
+		// groups smaller than a SIMD width waste lanes, unless the grid itself is smaller
+		const size_t items = g[0] * g[1] * g[2];
+		const size_t min_group = std::min(multiple, items);
+		std::vector<std::array<size_t, 3>> result;
+		for (size_t x : lengths[0]) {
+			for (size_t y : lengths[1]) {
+				for (size_t z : lengths[2]) {
+					const size_t group = x*y*z;
+					const size_t padded_items = (g[0] + x - 1) / x*x * ((g[1] + y - 1) / y*y) * ((g[2] + z - 1) / z*z);
+					if (group <= max_group && group >= min_group && padded_items <= items + items / 4) {
+						result.push_back({ x, y, z });
+					}
+				}
+			}
+		}
+		return result;
+	}
+
+	/** Mean duration of a launch in ms, infinity if the local size is refused */
+	double time(const cl::CommandQueue & queue, const cl::Kernel & kernel, const cl::NDRange & offset,
+		const cl::NDRange & global, const cl::NDRange & local) const
+	{
+#ifdef __CL_ENABLE_EXCEPTIONS
+		try {
+#endif
+			if (queue.enqueueNDRangeKernel(kernel, offset, global, local) != CL_SUCCESS) {
+				return std::numeric_limits<double>::infinity();
+			}
+			queue.finish();
+			const auto start = std::chrono::steady_clock::now();
+			for (unsigned int i = 0; i < repetitions; ++i) {
+				queue.enqueueNDRangeKernel(kernel, offset, global, local);
+			}
+			queue.finish();
+			return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count() / repetitions;
+#ifdef __CL_ENABLE_EXCEPTIONS
+		} catch (cl::Error &) {
+			return std::numeric_limits<double>::infinity();
+		}
+#endif
+	}
+
+	Entry tune(const cl::CommandQueue & queue, const cl::Kernel & kernel, const std::string & name,
+		const cl::NDRange & offset, const cl::NDRange & global)
+	{
+		queue.finish();
+		Entry best;
+		best.ms = time(queue, kernel, offset, global, cl::NullRange);
+		const double driver_ms = best.ms;
+		const auto all = candidates(kernel, name, global);
+		for (auto & local : all) {
+			const cl::NDRange local_range = range((int)global.dimensions(), local.data());
+			const double ms = time(queue, kernel, offset, padded(global, local_range), local_range);
+			if (ms < best.ms) {
+				best.ms = ms;
+				std::copy(local.begin(), local.end(), best.local);
+			}
+		}
+		const std::array<size_t, 3> g = sizes(global);
+		std::cout << "  " << name << " " << g[0] << "x" << g[1] << "x" << g[2] << ": ";
+		if (best.local[0] == 0) {
+			std::cout << "driver choice (" << driver_ms << " ms, " << all.size() << " candidates)" << std::endl;
+		} else {
+			const bool pads = g[0] % best.local[0] != 0 || g[1] % best.local[1] != 0 || g[2] % best.local[2] != 0;
+			std::cout << best.local[0] << "x" << best.local[1] << "x" << best.local[2] << (pads ? " padded " : " ") << best.ms
+				<< " ms (driver " << driver_ms << " ms, " << all.size() << " candidates)" << std::endl;
+		}
+		return best;
+	}
+
+	cl::Device device;
+	std::string device_key;
+	std::string filename;
+	uint64_t variant = 0;
+	bool tuning = false;
+	unsigned int repetitions = 10;
+	std::map<Key, Entry> entries;
+	std::map<std::string, unsigned int> bounded;// kernel name: dimensions checking their bounds
+	std::map<std::pair<cl_kernel, std::array<size_t, 3>>, Launch> resolved;
+};
+
+#endif // !WORK_GROUP_TUNER_H
@@ -1,47 +1,320 @@
 
 const sampler_t samplerA = CLK_NORMALIZED_COORDS_FALSE | CLK_ADDRESS_CLAMP | CLK_FILTER_NEAREST;
 const sampler_t samplerB = CLK_NORMALIZED_COORDS_TRUE | CLK_ADDRESS_REPEAT | CLK_FILTER_LINEAR;
+const sampler_t samplerLinear = CLK_NORMALIZED_COORDS_FALSE | CLK_ADDRESS_CLAMP_TO_EDGE | CLK_FILTER_LINEAR;
+
+// The tuner may round the launches of the kernels checking OUTSIDE up to a multiple of their work-group size
+// (WorkGroupTuner::setBounded): the work items at or beyond "end" return, "end" is the size of the image written
+// for a launch over the whole image, minus 1 for a launch over the inner cells
+#define OUTSIDE(pos, end) ((pos).x >= (end).x || (pos).y >= (end).y)
+
+// Tiles of the tiled kernels and of the sparse tiles, the sizes are given as build options by FluidSolver (see Config.h)
+#ifndef DIFFUSE_TILE_W
+#define DIFFUSE_TILE_W 16
+#endif
+#ifndef DIFFUSE_TILE_H
+#define DIFFUSE_TILE_H 16
+#endif
+#ifndef DIFFUSE_FUSED
+#define DIFFUSE_FUSED 4
+#endif
+
+// Sparse tiles, chosen by FluidSolver::set_sparse_tiles with -D SPARSE_TILES -D TILES_X/Y -D GRID_WIDTH/HEIGHT:
+// the main kernels take the list of the active tiles (list_tiles) as last argument and are launched over
+// (listed tiles * DIFFUSE_TILE_W, DIFFUSE_TILE_H) work items, the work items i*DIFFUSE_TILE_W to
+// (i + 1)*DIFFUSE_TILE_W - 1 of dimension 0 covering the tile tile_list[1 + i]. The cells of an inactive tile
+// hold 0 and get no work item. Without SPARSE_TILES, CELL_POS is the global id and TILE_ORIGIN the corner of the
+// work group of the tiled kernels
+#ifdef SPARSE_TILES
+#define SPARSE_PARAM , __global const int* tile_list
+#define SPARSE_FLAGS_PARAM , __global const uchar* tile_flags
+#define SPARSE_INACTIVE(x, y) (!tile_flags[(x)/DIFFUSE_TILE_W + ((y)/DIFFUSE_TILE_H)*TILES_X])
+#define CELL_POS() tile_cell(tile_list)
+#define INNER_POS() tile_inner(tile_cell(tile_list))
+#define TILE_ORIGIN() tile_origin(tile_list)
+
+// corner of the tile of the work item (tile_list[0] tiles are listed), (GRID_WIDTH, GRID_HEIGHT) past the list
+inline int2 tile_origin(__global const int* tile_list) {
+	const int slot = get_global_id(0)/DIFFUSE_TILE_W;
+	if (slot >= tile_list[0]) {
+		return (int2)(GRID_WIDTH, GRID_HEIGHT);
+	}
+	const int tile = tile_list[1 + slot];
+	return (int2)((tile % TILES_X)*DIFFUSE_TILE_W, (tile / TILES_X)*DIFFUSE_TILE_H);
+}
+
+// cell of the work item, beyond the grid past the list or in the rows the tuner pads the launch with
+inline int2 tile_cell(__global const int* tile_list) {
+	if (get_global_id(1) >= DIFFUSE_TILE_H) {
+		return (int2)(GRID_WIDTH, GRID_HEIGHT);
+	}
+	return tile_origin(tile_list) + (int2)(get_global_id(0) % DIFFUSE_TILE_W, get_global_id(1));
+}
+
+// the kernels of the inner cells, whose dense launches start at (1, 1)
+inline int2 tile_inner(int2 pos) {
+	return (pos.x < 1 || pos.y < 1) ? (int2)(GRID_WIDTH, GRID_HEIGHT) : pos;
+}
+#else
+#define SPARSE_PARAM
+#define SPARSE_FLAGS_PARAM
+#define SPARSE_INACTIVE(x, y) 0
+#define CELL_POS() ((int2)(get_global_id(0), get_global_id(1)))
+#define INNER_POS() CELL_POS()
+#define TILE_ORIGIN() ((int2)(get_group_id(0)*DIFFUSE_TILE_W, get_group_id(1)*DIFFUSE_TILE_H))
+#endif
+
+// Stencils shared by the image kernels and the buffer kernels of the ensemble ("ens_*"),
+// the callers only differ by how they read the neighbours (left, right, up, down)
+
+// Jacobi update of x - a*laplacian(x) = b
+inline float jacobi_value(float b, float l, float r, float u, float d, float a, float div) {
+	return (b + a*(l + r + u + d))/div;
+}
 
 __kernel void diffuse(	__read_only image2d_t img_in,
 						__write_only image2d_t img_out,
 						__read_only image2d_t previous_in,
-						float a, float div) {
-	const int xpos = get_global_id(0);
-	const int ypos = get_global_id(1);
+						float a, float div SPARSE_PARAM) {
+	const int2 pos = CELL_POS();
+	const int xpos = pos.x;
+	const int ypos = pos.y;
+	if (OUTSIDE(pos, get_image_dim(img_out))) {
+		return;
+	}
 	float4 dprev = read_imagef(previous_in, samplerA, (int2)(xpos,ypos));
 	float4 dl = read_imagef(img_in, samplerA, (int2)(xpos-1, ypos));
 	float4 dr = read_imagef(img_in, samplerA, (int2)(xpos+1, ypos));
 	float4 du = read_imagef(img_in, samplerA, (int2)(xpos, ypos-1));
 	float4 dd = read_imagef(img_in, samplerA, (int2)(xpos, ypos+1));
-	float val = (dprev.x + a*(dl.x + dr.x + du.x + dd.x))/div;
+	float val = jacobi_value(dprev.x, dl.x, dr.x, du.x, dd.x, a, div);
 	write_imagef(img_out, (int2)(xpos, ypos), (float4)(val,0,0,0));
 }
 
+// Tiled diffuse: a work group loads its tile plus a halo of DIFFUSE_FUSED cells in local memory
+// and runs up to DIFFUSE_FUSED Jacobi iterations there before writing the tile back
+#define DIFFUSE_LOCAL_W (DIFFUSE_TILE_W + 2*DIFFUSE_FUSED)
+#define DIFFUSE_LOCAL_H (DIFFUSE_TILE_H + 2*DIFFUSE_FUSED)
+
+__kernel __attribute__((reqd_work_group_size(DIFFUSE_TILE_W, DIFFUSE_TILE_H, 1)))
+void diffuse_tiled(__read_only image2d_t img_in,
+					__write_only image2d_t img_out,
+					__read_only image2d_t previous_in,
+					float a, float div, int iterations, int width, int height SPARSE_PARAM) {
+	__local float tile[2][DIFFUSE_LOCAL_H][DIFFUSE_LOCAL_W];
+	__local float prev[DIFFUSE_LOCAL_H][DIFFUSE_LOCAL_W];
+	const int lx = get_local_id(0);
+	const int ly = get_local_id(1);
+	// image position of the local cell (0,0)
+	const int2 corner = TILE_ORIGIN();
+	const int ox = corner.x - iterations;
+	const int oy = corner.y - iterations;
+	const int lw = DIFFUSE_TILE_W + 2*iterations;
+	const int lh = DIFFUSE_TILE_H + 2*iterations;
+	for (int j = ly; j < lh; j += DIFFUSE_TILE_H) {
+		for (int i = lx; i < lw; i += DIFFUSE_TILE_W) {
+			const int2 pos = (int2)(ox + i, oy + j);
+			tile[0][j][i] = read_imagef(img_in, samplerA, pos).x;
+			prev[j][i] = read_imagef(previous_in, samplerA, pos).x;
+		}
+	}
+	barrier(CLK_LOCAL_MEM_FENCE);
+	int cur = 0;
+	for (int k = 1; k <= iterations; ++k) {
+		// the halo shrinks by one cell per iteration, the cells outside the image stay at 0 like the sampler
+		for (int j = k + ly; j < lh - k; j += DIFFUSE_TILE_H) {
+			for (int i = k + lx; i < lw - k; i += DIFFUSE_TILE_W) {
+				const int x = ox + i;
+				const int y = oy + j;
+				float val = 0.0f;
+				if (x >= 0 && y >= 0 && x < width && y < height) {
+					val = jacobi_value(prev[j][i], tile[cur][j][i-1], tile[cur][j][i+1],
+						tile[cur][j-1][i], tile[cur][j+1][i], a, div);
+				}
+				tile[1-cur][j][i] = val;
+			}
+		}
+		barrier(CLK_LOCAL_MEM_FENCE);
+		cur = 1 - cur;
+	}
+	// the global size is rounded up to whole tiles
+	const int x = corner.x + lx;
+	const int y = corner.y + ly;
+	if (x < width && y < height) {
+		write_imagef(img_out, (int2)(x, y), (float4)(tile[cur][ly + iterations][lx + iterations], 0, 0, 0));
+	}
+}
+
+// position reached at -dt by the particle at "pos", not clamped: samplerA reads 0 outside the image
+// (FluidSolverCPU samples the same way)
+inline float2 backtrace(float2 velocity, int2 pos, float dt, int w, int h) {
+	const float2 dt0 = dt*(float2)(w, h);
+	return (float2)(pos.x, pos.y) - dt0*velocity.xy;
+}
+
+// bilinear interpolation at dpos of the values at the 4 corners around it, vi = dpos cast to int
+inline float bilinear_mix(float2 dpos, int2 vi, float v00, float v01, float v10, float v11) {
+	float4 s;
+	s.zw = dpos - (float2)(vi.x, vi.y); // s0 = s.x, t0 = s.y
+	s.xy = 1 - s.zw;  // s1 = s.z, t1 = s.w
+	return s.x*(s.y*v00 + s.w*v01)
+		+ s.z*(s.y*v10 + s.w*v11);
+}
+
+// bilinear interpolation of the 4 texels around dpos
+inline float bilinear(__read_only image2d_t img, float2 dpos) {
+	int2 vi = (int2)(dpos.x, dpos.y);// cast to int
+	return bilinear_mix(dpos, vi, read_imagef(img, samplerA, (int2)(vi.x, vi.y)).x,
+		read_imagef(img, samplerA, (int2)(vi.x, vi.y + 1)).x,
+		read_imagef(img, samplerA, (int2)(vi.x + 1, vi.y)).x,
+		read_imagef(img, samplerA, (int2)(vi.x + 1, vi.y + 1)).x);
+}
+
+// divergence from u at the left and right neighbours and v at the up and down ones, (hx, hy) = 1/grid size
+inline float divergence_value(float l, float r, float u, float d, float hx, float hy) {
+	return -0.5f*(hx*(r - l) + hy*(d - u));
+}
+
+// velocity minus the gradient of the pressures of the 4 neighbours
+inline float2 subtract_gradient(float2 velocity, float l, float r, float u, float d, int width, int height) {
+	return (float2)(velocity.x - 0.5f*(r - l) * width, velocity.y - 0.5f*(d - u) * height);
+}
+
+// minimum and maximum of the 4 texels around dpos
+inline float2 bilinear_range(__read_only image2d_t img, float2 dpos) {
+	int2 vi = (int2)(dpos.x, dpos.y);
+	float input00 = read_imagef(img, samplerA, (int2)(vi.x, vi.y)).x;
+	float input01 = read_imagef(img, samplerA, (int2)(vi.x, vi.y + 1)).x;
+	float input10 = read_imagef(img, samplerA, (int2)(vi.x + 1, vi.y)).x;
+	float input11 = read_imagef(img, samplerA, (int2)(vi.x + 1, vi.y + 1)).x;
+	return (float2)(fmin(fmin(input00, input01), fmin(input10, input11)), fmax(fmax(input00, input01), fmax(input10, input11)));
+}
+
 __kernel void advect(__read_only image2d_t img_in,
 	__write_only image2d_t img_out,
 	__read_only image2d_t u,
 	__read_only image2d_t v,
-	float dt, int w, int h) {
-	const int2 pos = (int2)(get_global_id(0), get_global_id(1));
+	float dt, int w, int h SPARSE_PARAM) {
+	const int2 pos = INNER_POS();
+	if (OUTSIDE(pos, get_image_dim(img_out) - 1)) {
+		return;
+	}
 
-	const float2 dt0 = dt*(float2)(w, h);
 	float4 inputU = read_imagef(u, samplerA, pos);
 	float4 inputV = read_imagef(v, samplerA, pos);
-	float2 velocity = (float2)(inputU.x, inputV.x);
-	float2 dpos = (float2)(pos.x, pos.y) - dt0*velocity.xy;
-	clamp(dpos.x, 0.5f, w + 0.5f);
-	clamp(dpos.y, 0.5f, h + 0.5f);
-	int2 vi = (int2)(dpos.x, dpos.y);// cast to int
-	float4 input00 = read_imagef(img_in, samplerA, (int2)(vi.x, vi.y));
-	float4 input01 = read_imagef(img_in, samplerA, (int2)(vi.x, vi.y + 1));
-	float4 input10 = read_imagef(img_in, samplerA, (int2)(vi.x + 1, vi.y));
-	float4 input11 = read_imagef(img_in, samplerA, (int2)(vi.x + 1, vi.y + 1));
-	float4 s;
-	s.zw = dpos - (float2)(vi.x, vi.y); // s0 = s.x, t0 = s.y
-	s.xy = 1 - s.zw;  // s1 = s.z, t1 = s.w
-	float value = s.x*(s.y*input00.x + s.w*input01.x)
-		+ s.z*(s.y*input10.x + s.w*input11.x);
-	write_imagef(img_out, pos, (float4)(value, 0, 0, 0));
+	float2 dpos = backtrace((float2)(inputU.x, inputV.x), pos, dt, w, h);
+	write_imagef(img_out, pos, (float4)(bilinear(img_in, dpos), 0, 0, 0));
+}
+
+// Last pass of the MacCormack (bfecc = 0) and BFECC (bfecc = 1) advections of FluidSolver: "ahead" is img_in
+// advected by "advect", "back" is ahead advected back (advect with -dt). MacCormack: ahead + (img_in - back)/2
+// at the cell, BFECC: img_in + (img_in - back)/2 advected again. The result is clamped to the 4 texels of img_in
+// around the backtrace, so the correction creates no new extremum
+__kernel void advect_correct(__read_only image2d_t img_in,
+	__read_only image2d_t ahead,
+	__read_only image2d_t back,
+	__write_only image2d_t img_out,
+	__read_only image2d_t u,
+	__read_only image2d_t v,
+	float dt, int w, int h, int bfecc SPARSE_PARAM) {
+	const int2 pos = INNER_POS();
+	if (OUTSIDE(pos, get_image_dim(img_out) - 1)) {
+		return;
+	}
+
+	float4 inputU = read_imagef(u, samplerA, pos);
+	float4 inputV = read_imagef(v, samplerA, pos);
+	float2 dpos = backtrace((float2)(inputU.x, inputV.x), pos, dt, w, h);
+	const float2 range = bilinear_range(img_in, dpos);
+	float value;
+	if (bfecc) {
+		// the advection is linear: the sample of img_in + (img_in - back)/2 is 1.5 sample(img_in) - 0.5 sample(back)
+		value = 1.5f*bilinear(img_in, dpos) - 0.5f*bilinear(back, dpos);
+	} else {
+		value = read_imagef(ahead, samplerA, pos).x + 0.5f*(read_imagef(img_in, samplerA, pos).x - read_imagef(back, samplerA, pos).x);
+	}
+	write_imagef(img_out, pos, (float4)(clamp(value, range.x, range.y), 0, 0, 0));
+}
+
+// Fused velocity step (FluidSolver with FUSED_VELOCITY_KERNELS): advection of both velocity components
+// from one backtrace, and the divergence of the advected velocity ("project1") in the same launch.
+// A work group advects its tile plus one cell of halo in local memory, the border cells of the image
+// are not advected and keep the value of the input (the "project2" before copied them unchanged).
+// Launched on the whole image rounded up to tiles, only the inner cells are written like "advect".
+#define ADVECT_LOCAL_W (DIFFUSE_TILE_W + 2)
+#define ADVECT_LOCAL_H (DIFFUSE_TILE_H + 2)
+
+__kernel __attribute__((reqd_work_group_size(DIFFUSE_TILE_W, DIFFUSE_TILE_H, 1)))
+void advect_velocity_divergence(__read_only image2d_t u_in,
+	__read_only image2d_t v_in,
+	__write_only image2d_t u_out,
+	__write_only image2d_t v_out,
+	__write_only image2d_t div_out,
+	float dt, int w, int h, float hx, float hy SPARSE_PARAM) {
+	__local float tile_u[ADVECT_LOCAL_H][ADVECT_LOCAL_W];
+	__local float tile_v[ADVECT_LOCAL_H][ADVECT_LOCAL_W];
+	const int lx = get_local_id(0);
+	const int ly = get_local_id(1);
+	const int2 corner = TILE_ORIGIN();
+	const int ox = corner.x - 1;
+	const int oy = corner.y - 1;
+	for (int j = ly; j < ADVECT_LOCAL_H; j += DIFFUSE_TILE_H) {
+		for (int i = lx; i < ADVECT_LOCAL_W; i += DIFFUSE_TILE_W) {
+			const int2 pos = (int2)(ox + i, oy + j);
+			float2 velocity = (float2)(read_imagef(u_in, samplerA, pos).x, read_imagef(v_in, samplerA, pos).x);
+			if (pos.x > 0 && pos.y > 0 && pos.x < w - 1 && pos.y < h - 1) {
+				const float2 dpos = backtrace(velocity, pos, dt, w, h);
+				velocity = (float2)(bilinear(u_in, dpos), bilinear(v_in, dpos));
+			}
+			tile_u[j][i] = velocity.x;
+			tile_v[j][i] = velocity.y;
+		}
+	}
+	barrier(CLK_LOCAL_MEM_FENCE);
+	const int x = corner.x + lx;
+	const int y = corner.y + ly;
+	if (x > 0 && y > 0 && x < w - 1 && y < h - 1) {
+		const int i = lx + 1;
+		const int j = ly + 1;
+		const float value = divergence_value(tile_u[j][i - 1], tile_u[j][i + 1], tile_v[j - 1][i], tile_v[j + 1][i], hx, hy);
+		write_imagef(u_out, (int2)(x, y), (float4)(tile_u[j][i], 0, 0, 0));
+		write_imagef(v_out, (int2)(x, y), (float4)(tile_v[j][i], 0, 0, 0));
+		write_imagef(div_out, (int2)(x, y), (float4)(value, 0, 0, 0));
+	}
+}
+
+// Gradient subtraction of "project2" fused with the advection of the density by the projected velocity:
+// the final velocity of the step is written and used at once, the density is advected on the inner cells only
+__kernel void project2_advect(__read_only image2d_t img_in,
+	__read_only image2d_t u_in,
+	__read_only image2d_t v_in,
+	__write_only image2d_t u_out,
+	__write_only image2d_t v_out,
+	__read_only image2d_t density_in,
+	__write_only image2d_t density_out,
+	float dt, int width, int height SPARSE_PARAM)
+{
+	const int2 pos = CELL_POS();
+	if (OUTSIDE(pos, (int2)(width, height))) {
+		return;
+	}
+
+	float u_val = read_imagef(u_in, samplerA, pos).x;
+	float v_val = read_imagef(v_in, samplerA, pos).x;
+	if (pos.x > 0 && pos.y > 0 && pos.x < width - 1 && pos.y < height - 1) {
+		float dr = read_imagef(img_in, samplerA, (int2)(pos.x + 1, pos.y)).x;
+		float dl = read_imagef(img_in, samplerA, (int2)(pos.x - 1, pos.y)).x;
+		float dd = read_imagef(img_in, samplerA, (int2)(pos.x, pos.y + 1)).x;
+		float du = read_imagef(img_in, samplerA, (int2)(pos.x, pos.y - 1)).x;
+
+		const float2 velocity = subtract_gradient((float2)(u_val, v_val), dl, dr, du, dd, width, height);
+		u_val = velocity.x;
+		v_val = velocity.y;
+		const float2 dpos = backtrace(velocity, pos, dt, width, height);
+		write_imagef(density_out, pos, (float4)(bilinear(density_in, dpos), 0, 0, 0));
+	}
+	write_imagef(u_out, pos, (float4)(u_val, 0, 0, 0));
+	write_imagef(v_out, pos, (float4)(v_val, 0, 0, 0));
 }
 
 __kernel void advect_circular(__read_only image2d_t img_in,
@@ -76,65 +349,502 @@ __kernel void advect_circular(__read_only image2d_t img_in,
 __kernel void project1(__write_only image2d_t img_out,
 	__read_only image2d_t u,
 	__read_only image2d_t v,
-	float hx, float hy) {
+	float hx, float hy SPARSE_PARAM) {
 
-	const int xpos = get_global_id(0);
-	const int ypos = get_global_id(1);
+	const int2 pos = INNER_POS();
+	const int xpos = pos.x;
+	const int ypos = pos.y;
+	if (OUTSIDE(pos, get_image_dim(img_out) - 1)) {
+		return;
+	}
 
 	float dl = read_imagef(u, samplerA, (int2)(xpos - 1, ypos)).x;
 	float dr = read_imagef(u, samplerA, (int2)(xpos + 1, ypos)).x;
 	float du = read_imagef(v, samplerA, (int2)(xpos, ypos - 1)).x;
 	float dd = read_imagef(v, samplerA, (int2)(xpos, ypos + 1)).x;
 
-	float value = -0.5f*(hx*(dr - dl) + hy*(dd - du));
+	float value = divergence_value(dl, dr, du, dd, hx, hy);
 
 	write_imagef(img_out, (int2)(xpos,ypos), (float4)(value, 0, 0, 0));
 }
 
 __kernel void project2(__read_only image2d_t img_in,
-	__global float* u,
-	__global float* v,
-	int width, int height)
+	__read_only image2d_t u_in,
+	__read_only image2d_t v_in,
+	__write_only image2d_t u_out,
+	__write_only image2d_t v_out,
+	int width, int height SPARSE_PARAM)
 {
 
-	const int xpos = get_global_id(0);
-	const int ypos = get_global_id(1);
+	const int2 pos = CELL_POS();
+	const int xpos = pos.x;
+	const int ypos = pos.y;
+	if (OUTSIDE(pos, (int2)(width, height))) {
+		return;
+	}
 
-	float dr = read_imagef(img_in, samplerA, (int2)(xpos + 1, ypos)).x;
-	float dl = read_imagef(img_in, samplerA, (int2)(xpos - 1, ypos)).x;
-	float dd = read_imagef(img_in, samplerA, (int2)(xpos, ypos + 1)).x;
-	float du = read_imagef(img_in, samplerA, (int2)(xpos, ypos - 1)).x;
+	float u_val = read_imagef(u_in, samplerA, (int2)(xpos, ypos)).x;
+	float v_val = read_imagef(v_in, samplerA, (int2)(xpos, ypos)).x;
+	// launched on the whole image: the border is copied as it is
+	if (xpos > 0 && ypos > 0 && xpos < width - 1 && ypos < height - 1) {
+		float dr = read_imagef(img_in, samplerA, (int2)(xpos + 1, ypos)).x;
+		float dl = read_imagef(img_in, samplerA, (int2)(xpos - 1, ypos)).x;
+		float dd = read_imagef(img_in, samplerA, (int2)(xpos, ypos + 1)).x;
+		float du = read_imagef(img_in, samplerA, (int2)(xpos, ypos - 1)).x;
 
-	float u_val = 0.5f*(dr - dl) * width;
-	float v_val = 0.5f*(dd - du) * height;
-	u[xpos + width*ypos] -= u_val;
-	v[xpos + width*ypos] -= v_val;
+		const float2 velocity = subtract_gradient((float2)(u_val, v_val), dl, dr, du, dd, width, height);
+		u_val = velocity.x;
+		v_val = velocity.y;
+	}
+	write_imagef(u_out, (int2)(xpos, ypos), (float4)(u_val, 0, 0, 0));
+	write_imagef(v_out, (int2)(xpos, ypos), (float4)(v_val, 0, 0, 0));
 }
 
 __kernel void reset(__write_only image2d_t img_out) {
-	write_imagef(img_out, (int2)(get_global_id(0), get_global_id(1)), (float4)(0, 0, 0, 0));
+	const int2 pos = (int2)(get_global_id(0), get_global_id(1));
+	if (OUTSIDE(pos, get_image_dim(img_out))) {
+		return;
+	}
+	write_imagef(img_out, pos, (float4)(0, 0, 0, 0));
+}
+
+// displayed color of a density
+inline uint4 density_color(float d) {
+	return (uint4)((int)(d*200.0f), (int)(d*56.0f), (int)(d*10.f), 255);
 }
 
-__kernel void floatToR(__read_only image2d_t img_in, __write_only image2d_t img_out) {
+// one work item per displayed pixel, (scale_x, scale_y) = grid size / display size:
+// the density is upscaled (or downscaled) with a bilinear filter, a scale of 1 reads the texels exactly
+__kernel void floatToR(__read_only image2d_t img_in, __write_only image2d_t img_out, float scale_x, float scale_y) {
 	const int2 pos = (int2)(get_global_id(0), get_global_id(1));
-	float4 v = read_imagef(img_in, samplerA, pos);
-	int r = (int)(v.x*200.0f);
-	int g = (int)(v.x*56.0f);
-	int b = (int)(v.x*10.f);
-	write_imageui(img_out, pos, (uint4)(r, g, b, 255));
+	if (OUTSIDE(pos, get_image_dim(img_out))) {
+		return;
+	}
+	const float2 coord = ((float2)(pos.x, pos.y) + 0.5f)*(float2)(scale_x, scale_y);
+	float4 v = read_imagef(img_in, samplerLinear, coord);
+	write_imageui(img_out, pos, density_color(v.x));
 }
 
-__kernel void addCircleValue(__read_only image2d_t img_in, 
-						__write_only image2d_t img_out,
-					int px, int py, float add, float radius) {
-	const int xpos = get_global_id(0);
-	const int ypos = get_global_id(1);
-	const float dx = (float)xpos - px;
-	const float dy = (float)ypos - py;
-	
-	if (dx*dx+dy*dy <= radius*radius) {
-		float4 value = read_imagef(img_in, samplerA, (int2)(xpos, ypos));
-		value.x += add;
-		write_imagef(img_out, (int2)(xpos, ypos), value);
-	}
-}
\ No newline at end of file
+// Sources of a step applied by one launch over their bounding box (FluidSolver::flush_splats):
+// 4 float4 per splat (see SplatBatch.hpp), the splats of a cell are added in the order of the calls.
+// With tile_size > 0 a cell only loops over the splats binned in its tile of the bounding box.
+inline float splat_weight(__global const float4* splat, int x, int y) {
+	const float4 shape = splat[0];// center, reach, falloff
+	const float4 box = splat[1];
+	if (x < box.x || y < box.y || x >= box.z || y >= box.w) {
+		return 0.0f;
+	}
+	const float dx = (float)x - shape.x;
+	const float dy = (float)y - shape.y;
+	const float d_sq = dx*dx + dy*dy;
+	const float r_sq = shape.z*shape.z;
+	if (d_sq > r_sq) {
+		return 0.0f;
+	}
+	return (shape.w > 0.0f) ? pow(1.0f - d_sq/r_sq, shape.w) : 1.0f;
+}
+
+// first and last splat tested by the cell pos of the bounding box
+inline uint2 splat_range(int2 pos, int nb_splats, __global const uint* tile_offsets, int tile_size, int tiles_x) {
+	if (tile_size > 0) {
+		const int tile = (pos.x - (int)get_global_offset(0))/tile_size + (pos.y - (int)get_global_offset(1))/tile_size*tiles_x;
+		return (uint2)(tile_offsets[tile], tile_offsets[tile + 1]);
+	}
+	return (uint2)(0, nb_splats);
+}
+
+// value (density, u, v) of the cell pos of the layer "layer" plus the splats of "range" covering it
+inline float3 add_splats(float3 value, int2 pos, int layer, __global const float4* splats, uint2 range,
+	__global const uint* tile_splats, int tile_size) {
+	for (uint k = range.x; k < range.y; ++k) {
+		__global const float4* splat = splats + 4*((tile_size > 0) ? tile_splats[k] : k);
+		const float4 amounts = splat[2];// layers, density, velocity flag
+		if (layer < amounts.x || layer >= amounts.y) {
+			continue;
+		}
+		const float weight = splat_weight(splat, pos.x, pos.y);
+		if (weight == 0.0f) {
+			continue;
+		}
+		const float4 velocity = splat[3];
+		value.x += amounts.z*weight;
+		if (amounts.w != 0.0f) {
+			value.y += velocity.x*weight;
+			value.z += velocity.y*weight;
+		}
+	}
+	return value;
+}
+
+__kernel void splat_sources(__read_only image2d_t density_in,
+	__write_only image2d_t density_box,
+	__read_only image2d_t u_in,
+	__write_only image2d_t u_box,
+	__read_only image2d_t v_in,
+	__write_only image2d_t v_box,
+	__global const float4* splats, int nb_splats,
+	__global const uint* tile_offsets, __global const uint* tile_splats, int tile_size, int tiles_x) {
+	const int2 pos = (int2)(get_global_id(0), get_global_id(1));
+	const uint2 range = splat_range(pos, nb_splats, tile_offsets, tile_size, tiles_x);
+	// images are not updated in place: every cell of the box is written in the staging images, from their
+	// corner, the host copies the box back
+	const int2 box = pos - (int2)(get_global_offset(0), get_global_offset(1));
+	float3 value = (float3)(read_imagef(density_in, samplerA, pos).x, read_imagef(u_in, samplerA, pos).x,
+		read_imagef(v_in, samplerA, pos).x);// density, u, v
+	value = add_splats(value, pos, 0, splats, range, tile_splats, tile_size);
+	write_imagef(density_box, box, (float4)(value.x, 0, 0, 0));
+	write_imagef(u_box, box, (float4)(value.y, 0, 0, 0));
+	write_imagef(v_box, box, (float4)(value.z, 0, 0, 0));
+}
+
+// Multigrid solver of the pressure equation 4p - (sum of the 4 neighbours) = b
+// the images read 0 outside (samplerA) so every level has p = 0 around the grid
+
+__kernel void mg_smooth(__read_only image2d_t p_in,
+	__write_only image2d_t p_out,
+	__read_only image2d_t b,
+	int color) {
+	// red-black Gauss-Seidel, ping-pong like relax_sor: the pass of a color copies the other cells,
+	// the red pass goes from the solution to the scratch image of the level and the black one back
+	const int2 pos = (int2)(get_global_id(0), get_global_id(1));
+	if (OUTSIDE(pos, get_image_dim(p_out))) {
+		return;
+	}
+	float value = read_imagef(p_in, samplerA, pos).x;
+	if (((pos.x + pos.y) & 1) == color) {
+		float sum = read_imagef(p_in, samplerA, (int2)(pos.x - 1, pos.y)).x
+			+ read_imagef(p_in, samplerA, (int2)(pos.x + 1, pos.y)).x
+			+ read_imagef(p_in, samplerA, (int2)(pos.x, pos.y - 1)).x
+			+ read_imagef(p_in, samplerA, (int2)(pos.x, pos.y + 1)).x;
+		value = (read_imagef(b, samplerA, pos).x + sum)*0.25f;
+	}
+	write_imagef(p_out, pos, (float4)(value, 0, 0, 0));
+}
+
+__kernel void mg_residual(__read_only image2d_t p,
+	__read_only image2d_t b,
+	__write_only image2d_t r) {
+	const int2 pos = (int2)(get_global_id(0), get_global_id(1));
+	if (OUTSIDE(pos, get_image_dim(r))) {
+		return;
+	}
+	float sum = read_imagef(p, samplerA, (int2)(pos.x - 1, pos.y)).x
+		+ read_imagef(p, samplerA, (int2)(pos.x + 1, pos.y)).x
+		+ read_imagef(p, samplerA, (int2)(pos.x, pos.y - 1)).x
+		+ read_imagef(p, samplerA, (int2)(pos.x, pos.y + 1)).x;
+	float value = read_imagef(b, samplerA, pos).x - (4.0f*read_imagef(p, samplerA, pos).x - sum);
+	write_imagef(r, pos, (float4)(value, 0, 0, 0));
+}
+
+__kernel void mg_restrict(__read_only image2d_t r_fine, __write_only image2d_t b_coarse) {
+	// the coarse right hand side is the sum of the 4 fine residuals (the grid spacing doubles)
+	const int2 pos = (int2)(get_global_id(0), get_global_id(1));
+	if (OUTSIDE(pos, get_image_dim(b_coarse))) {
+		return;
+	}
+	const int2 f = 2*pos;
+	float value = read_imagef(r_fine, samplerA, f).x
+		+ read_imagef(r_fine, samplerA, (int2)(f.x + 1, f.y)).x
+		+ read_imagef(r_fine, samplerA, (int2)(f.x, f.y + 1)).x
+		+ read_imagef(r_fine, samplerA, (int2)(f.x + 1, f.y + 1)).x;
+	write_imagef(b_coarse, pos, (float4)(value, 0, 0, 0));
+}
+
+__kernel void mg_prolongate(__read_only image2d_t p_coarse,
+	__read_only image2d_t p_in,
+	__write_only image2d_t p_out) {
+	// p_in plus the bilinear interpolation of the coarse correction, p_out is another image
+	const int2 pos = (int2)(get_global_id(0), get_global_id(1));
+	if (OUTSIDE(pos, get_image_dim(p_out))) {
+		return;
+	}
+	const float2 c = ((float2)(pos.x, pos.y) + 0.5f)*0.5f - 0.5f;// centre of the fine cell in coarse cells
+	const float2 c0 = floor(c);
+	const float2 t = c - c0;
+	const int2 i = (int2)((int)c0.x, (int)c0.y);
+	float value = (1.0f - t.x)*(1.0f - t.y)*read_imagef(p_coarse, samplerA, i).x
+		+ t.x*(1.0f - t.y)*read_imagef(p_coarse, samplerA, (int2)(i.x + 1, i.y)).x
+		+ (1.0f - t.x)*t.y*read_imagef(p_coarse, samplerA, (int2)(i.x, i.y + 1)).x
+		+ t.x*t.y*read_imagef(p_coarse, samplerA, (int2)(i.x + 1, i.y + 1)).x;
+	value += read_imagef(p_in, samplerA, pos).x;
+	write_imagef(p_out, pos, (float4)(value, 0, 0, 0));
+}
+
+__kernel void sum_squares_rows(__read_only image2d_t img, __global float* sums, int width) {
+	const int y = get_global_id(0);
+	if (y >= get_image_height(img)) {
+		return;
+	}
+	float sum = 0.0f;
+	for (int x = 0; x < width; ++x) {
+		float v = read_imagef(img, samplerA, (int2)(x, y)).x;
+		sum += v*v;
+	}
+	sums[y] = sum;
+}
+
+// Residual driven solves (FluidSolver::relax): red-black SOR of div*p - a*(sum of the 4 neighbours) = b
+// with the residual checked on the device every few sweeps. "state" holds two ints per solve
+// (converged flag, sweeps done), once the flag is set the remaining launches of the solve do nothing.
+// RELAX_GROUP: work-group size of relax_check, defined by the host (PressureSolver.hpp)
+
+__kernel void relax_reset(__global int* state, int max_sweeps) {
+	const int slot = get_global_id(0);
+	state[2*slot] = 0;
+	state[2*slot + 1] = max_sweeps;
+}
+
+__kernel void relax_sor(__read_only image2d_t p_in,
+	__write_only image2d_t p_out,
+	__read_only image2d_t b,
+	float a, float div, float omega, int color,
+	__global const int* state, int slot SPARSE_PARAM) {
+	// images cannot be updated in place: the pass of a color copies the other cells, the red pass
+	// goes from the solution to the temporary image and the black one back
+	const int2 pos = CELL_POS();
+	if (state[2*slot] || OUTSIDE(pos, get_image_dim(p_out))) {
+		return;
+	}
+	float value = read_imagef(p_in, samplerA, pos).x;
+	if (((pos.x + pos.y) & 1) == color) {
+		const float jacobi = jacobi_value(read_imagef(b, samplerA, pos).x,
+			read_imagef(p_in, samplerA, (int2)(pos.x - 1, pos.y)).x,
+			read_imagef(p_in, samplerA, (int2)(pos.x + 1, pos.y)).x,
+			read_imagef(p_in, samplerA, (int2)(pos.x, pos.y - 1)).x,
+			read_imagef(p_in, samplerA, (int2)(pos.x, pos.y + 1)).x, a, div);
+		value += omega*(jacobi - value);
+	}
+	write_imagef(p_out, pos, (float4)(value, 0, 0, 0));
+}
+
+__kernel void relax_residual_rows(__read_only image2d_t p,
+	__read_only image2d_t b,
+	float a, float div, __global float* sums, int width, int height,
+	__global const int* state, int slot SPARSE_FLAGS_PARAM) {
+	// one work item per row: sums[y] = |r|^2 and sums[height + y] = |b|^2 of the row,
+	// the cells out of the tiles of the solve (sparse tiles) are not solved and are skipped
+	const int y = get_global_id(0);
+	if (state[2*slot] || y >= height) {
+		return;
+	}
+	float r2 = 0.0f, b2 = 0.0f;
+	for (int x = 0; x < width; ++x) {
+		if (SPARSE_INACTIVE(x, y)) {
+			continue;
+		}
+		float sum = read_imagef(p, samplerA, (int2)(x - 1, y)).x
+			+ read_imagef(p, samplerA, (int2)(x + 1, y)).x
+			+ read_imagef(p, samplerA, (int2)(x, y - 1)).x
+			+ read_imagef(p, samplerA, (int2)(x, y + 1)).x;
+		float vb = read_imagef(b, samplerA, (int2)(x, y)).x;
+		float r = vb + a*sum - div*read_imagef(p, samplerA, (int2)(x, y)).x;
+		r2 += r*r;
+		b2 += vb*vb;
+	}
+	sums[y] = r2;
+	sums[height + y] = b2;
+}
+
+__kernel __attribute__((reqd_work_group_size(RELAX_GROUP, 1, 1)))
+void relax_check(__global const float* sums, int nb_rows, float tolerance, int sweeps,
+	__global int* state, int slot) {
+	// a single work group adds the rows and marks the solve as converged when |r| <= tolerance*|b|
+	__local float r2[RELAX_GROUP];
+	__local float b2[RELAX_GROUP];
+	if (state[2*slot]) {
+		return;
+	}
+	const int l = get_local_id(0);
+	float r = 0.0f, b = 0.0f;
+	for (int i = l; i < nb_rows; i += RELAX_GROUP) {
+		r += sums[i];
+		b += sums[nb_rows + i];
+	}
+	r2[l] = r;
+	b2[l] = b;
+	barrier(CLK_LOCAL_MEM_FENCE);
+	for (int s = RELAX_GROUP/2; s > 0; s >>= 1) {
+		if (l < s) {
+			r2[l] += r2[l + s];
+			b2[l] += b2[l + s];
+		}
+		barrier(CLK_LOCAL_MEM_FENCE);
+	}
+	if (l == 0 && r2[0] <= tolerance*tolerance*b2[0]) {
+		state[2*slot] = 1;
+		state[2*slot + 1] = sweeps;
+	}
+}
+
+#ifdef SPARSE_TILES
+// Maintenance of the sparse tiles (FluidSolver::update_tiles), at the beginning of every update
+
+__kernel void tile_occupancy(__read_only image2d_t density, __read_only image2d_t u, __read_only image2d_t v,
+	__global const uchar* tiles, __global uchar* occupied, float threshold) {
+	// one work item per tile: occupied if a cell holds density or velocity above the threshold,
+	// an inactive tile only holds 0 and is not read
+	const int tx = get_global_id(0);
+	const int ty = get_global_id(1);
+	const int tile = tx + ty*TILES_X;
+	int found = 0;
+	if (tiles[tile]) {
+		const int x1 = min((tx + 1)*DIFFUSE_TILE_W, GRID_WIDTH);
+		const int y1 = min((ty + 1)*DIFFUSE_TILE_H, GRID_HEIGHT);
+		for (int y = ty*DIFFUSE_TILE_H; y < y1 && !found; ++y) {
+			for (int x = tx*DIFFUSE_TILE_W; x < x1 && !found; ++x) {
+				const int2 pos = (int2)(x, y);
+				found = fabs(read_imagef(density, samplerA, pos).x) > threshold || fabs(read_imagef(u, samplerA, pos).x) > threshold
+					|| fabs(read_imagef(v, samplerA, pos).x) > threshold;
+			}
+		}
+	}
+	occupied[tile] = found;
+}
+
+// 1 if the tile or one of its 8 neighbours is flagged
+inline int tile_neighbourhood(__global const uchar* flags, int tx, int ty) {
+	for (int y = max(ty - 1, 0); y <= min(ty + 1, TILES_Y - 1); ++y) {
+		for (int x = max(tx - 1, 0); x <= min(tx + 1, TILES_X - 1); ++x) {
+			if (flags[x + y*TILES_X]) {
+				return 1;
+			}
+		}
+	}
+	return 0;
+}
+
+__kernel void tile_dilate(__global const uchar* occupied, __global uchar* tiles, __global uchar* retired) {
+	// active: the occupied tiles and their 8 neighbours (the content moves less than a tile per step),
+	// retired: the tiles that stop being active, their cells are reset by the host
+	const int tile = get_global_id(0) + get_global_id(1)*TILES_X;
+	const int active = tile_neighbourhood(occupied, get_global_id(0), get_global_id(1));
+	retired[tile] = tiles[tile] && !active;
+	tiles[tile] = active;
+}
+
+__kernel void tile_halo(__global const uchar* tiles, __global uchar* pressure_tiles, __global uchar* retired) {
+	// the pressure is solved on the active tiles and their 8 neighbours (0 beyond), "retired": the tiles
+	// leaving the pressure solve, their pressure is reset by the host
+	const int tile = get_global_id(0) + get_global_id(1)*TILES_X;
+	const int halo = tile_neighbourhood(tiles, get_global_id(0), get_global_id(1));
+	retired[tile] = pressure_tiles[tile] && !halo;
+	pressure_tiles[tile] = halo;
+}
+
+__kernel void tile_activate(__global uchar* flags) {
+	// launched on the box of tiles touched by the sources, or on every tile
+	flags[get_global_id(0) + get_global_id(1)*TILES_X] = 1;
+}
+
+__kernel void list_tiles(__global const uchar* flags, __global int* tile_list) {
+	// one work item per tile: the flagged ones are appended after tile_list[0], their count (0 before the launch)
+	const int tile = get_global_id(0);
+	if (flags[tile]) {
+		tile_list[1 + atomic_inc(tile_list)] = tile;
+	}
+}
+
+// "reset" over the cells of the listed tiles
+__kernel void reset_tiles(__write_only image2d_t img_out SPARSE_PARAM) {
+	const int2 pos = CELL_POS();
+	if (OUTSIDE(pos, get_image_dim(img_out))) {
+		return;
+	}
+	write_imagef(img_out, pos, (float4)(0, 0, 0, 0));
+}
+#endif
+
+// Ensemble mode (FluidEnsemble2D): K simulations of the same grid stored one after the other in buffers [K][h][w],
+// the dimension 2 of the NDRange is the member. The cells outside the grid read 0 like samplerA.
+inline float ens_read(__global const float* field, int x, int y, int w, int h) {
+	return (x >= 0 && y >= 0 && x < w && y < h) ? field[x + y*w] : 0.0f;
+}
+
+// coefficients (a, div) of the Jacobi iterations of each member:
+// the viscosity is used as it is (like FluidSolver::update), the density diffusion is scaled by dt and the grid size
+__kernel void ens_coefficients(__global const float2* params, __global float2* coef_visc, __global float2* coef_diff,
+	float dt, int w, int h) {
+	const int m = get_global_id(0);
+	const float visc = params[m].x;
+	const float a = dt*params[m].y*w*h;
+	coef_visc[m] = (float2)(visc, 1.0f + 4.0f*visc);
+	coef_diff[m] = (float2)(a, 1.0f + 4.0f*a);
+}
+
+// one Jacobi iteration of x - a*laplacian(x) = x0, pure ping-pong (x_in and x_out are different buffers)
+__kernel void ens_jacobi(__global const float* x_in, __global float* x_out, __global const float* x0,
+	__global const float2* coefs, int w, int h) {
+	const int x = get_global_id(0);
+	const int y = get_global_id(1);
+	const int m = get_global_id(2);
+	const size_t base = (size_t)m*w*h;
+	__global const float* in = x_in + base;
+	const float2 c = coefs[m];
+	x_out[base + x + y*w] = jacobi_value(x0[base + x + y*w], ens_read(in, x - 1, y, w, h), ens_read(in, x + 1, y, w, h),
+		ens_read(in, x, y - 1, w, h), ens_read(in, x, y + 1, w, h), c.x, c.y);
+}
+
+// same scheme as advect, launched on the inner cells
+__kernel void ens_advect(__global const float* d_in, __global float* d_out,
+	__global const float* u, __global const float* v, float dt, int w, int h) {
+	const int x = get_global_id(0);
+	const int y = get_global_id(1);
+	const size_t base = (size_t)get_global_id(2)*w*h;
+	__global const float* in = d_in + base;
+	const float2 dpos = backtrace((float2)(u[base + x + y*w], v[base + x + y*w]), (int2)(x, y), dt, w, h);
+	const int2 vi = (int2)(dpos.x, dpos.y);// cast to int
+	d_out[base + x + y*w] = bilinear_mix(dpos, vi, ens_read(in, vi.x, vi.y, w, h), ens_read(in, vi.x, vi.y + 1, w, h),
+		ens_read(in, vi.x + 1, vi.y, w, h), ens_read(in, vi.x + 1, vi.y + 1, w, h));
+}
+
+// divergence of the velocity, launched on the inner cells like project1
+__kernel void ens_project1(__global float* div, __global const float* u, __global const float* v,
+	float hx, float hy, int w, int h) {
+	const int x = get_global_id(0);
+	const int y = get_global_id(1);
+	const size_t base = (size_t)get_global_id(2)*w*h;
+	div[base + x + y*w] = divergence_value(ens_read(u + base, x - 1, y, w, h), ens_read(u + base, x + 1, y, w, h),
+		ens_read(v + base, x, y - 1, w, h), ens_read(v + base, x, y + 1, w, h), hx, hy);
+}
+
+// subtraction of the pressure gradient, launched on the whole grid: the border is copied as it is
+__kernel void ens_project2(__global const float* p, __global const float* u_in, __global const float* v_in,
+	__global float* u_out, __global float* v_out, int w, int h) {
+	const int x = get_global_id(0);
+	const int y = get_global_id(1);
+	const size_t i = (size_t)get_global_id(2)*w*h + x + y*w;
+	float2 velocity = (float2)(u_in[i], v_in[i]);
+	if (x > 0 && y > 0 && x < w - 1 && y < h - 1) {
+		velocity = subtract_gradient(velocity, p[i - 1], p[i + 1], p[i - w], p[i + w], w, h);
+	}
+	u_out[i] = velocity.x;
+	v_out[i] = velocity.y;
+}
+
+// sources of the ensemble (FluidEnsemble2D::flush_splats) like splat_sources, launched on the bounding box
+// of the batch and its members: the layers [z0, z1[ of a splat are the members receiving it.
+// Every work item owns its cell, the buffers are updated in place
+__kernel void ens_splat_sources(__global float* density, __global float* u, __global float* v,
+	__global const float4* splats, int nb_splats,
+	__global const uint* tile_offsets, __global const uint* tile_splats, int tile_size, int tiles_x, int w, int h) {
+	const int2 pos = (int2)(get_global_id(0), get_global_id(1));
+	const int m = get_global_id(2);
+	const size_t i = (size_t)m*w*h + pos.x + pos.y*w;
+	const uint2 range = splat_range(pos, nb_splats, tile_offsets, tile_size, tiles_x);
+	const float3 value = add_splats((float3)(density[i], u[i], v[i]), pos, m, splats, range, tile_splats, tile_size);
+	density[i] = value.x;
+	u[i] = value.y;
+	v[i] = value.z;
+}
+
+__kernel void ens_reset(__global float* field) {
+	field[get_global_id(0)] = 0.0f;
+}
+
+// mosaic of the members, "columns" members per row of the image, the cells left empty are black
+__kernel void ens_draw(__global const float* density, __write_only image2d_t img_out, int w, int h, int columns, int nb_members) {
+	const int2 pos = (int2)(get_global_id(0), get_global_id(1));
+	const int m = (pos.y / h)*columns + pos.x / w;
+	const float d = (m < nb_members) ? density[(size_t)m*w*h + (pos.x % w) + (pos.y % h)*w] : 0.0f;
+	write_imageui(img_out, pos, density_color(d));
+}
@@ -1,13 +1,17 @@
 #ifndef D3F_WRITER_H
 #define D3F_WRITER_H
 
-#include <fstream>
+#include <algorithm>
 #include <cstdint>
+#include <cstring>
+#include <fstream>
 #include <iostream>
 #include <limits>
+#include <string>
+#include <vector>
 
 /** Tell if we are on a little endian architecture */
-bool is_little_endian()
+inline bool is_little_endian()
 {
 	union {
 		uint16_t i;
@@ -18,12 +22,12 @@ bool is_little_endian()
 
 /** Write in the stream T the value in binary */
 template<typename T>
-std::ostream& binary_write(std::ostream& stream, const T& value){
+inline std::ostream& binary_write(std::ostream& stream, const T& value){
 	return stream.write(reinterpret_cast<const char*>(&value), sizeof(T));
 }
 
 /** Write an uint16_t in big endian */
-std::ostream& binary_write16big(std::ostream& stream, uint16_t v){
+inline std::ostream& binary_write16big(std::ostream& stream, uint16_t v){
 	if(is_little_endian()){
 		v = ((v>>8) & 0xFF) | ((v & 0xFF) << 8);
 	}
@@ -31,7 +35,7 @@ std::ostream& binary_write16big(std::ostream& stream, uint16_t v){
 }
 
 /** Write an uint32_t in big endian */
-std::ostream& binary_write32big(std::ostream& stream, uint32_t v){
+inline std::ostream& binary_write32big(std::ostream& stream, uint32_t v){
 	if(is_little_endian()){
 		v = (((v>>24) & 0xFF))  | (((v>>16) & 0xFF) << 8)  | (((v>>8) & 0xFF) << 16) | ((v & 0xFF) << 24);
 	}
@@ -39,49 +43,58 @@ std::ostream& binary_write32big(std::ostream& stream, uint32_t v){
 }
 
 /** Write an uint32_t in big endian if the input is in little indian */
-std::ostream& binary_write32big_unsafe(std::ostream& stream, uint32_t v){
+inline std::ostream& binary_write32big_unsafe(std::ostream& stream, uint32_t v){
 	v = (((v>>24) & 0xFF))  | (((v>>16) & 0xFF) << 8)  | (((v>>8) & 0xFF) << 16) | ((v & 0xFF) << 24);
 	return stream.write(reinterpret_cast<const char*>(&v), sizeof(v));
 }
 
 namespace D3fWriter
 {
+	/** Size in bytes of a df3 file of 32 bits densities */
+	inline size_t fileSize(const unsigned int width, const unsigned int height, const unsigned int depth)
+	{
+		return 6 + (size_t)width*height*depth * 4;
+	}
+
+	/** Encode a whole df3 file in "out" (fileSize bytes): the header, then the densities in big endian 32 bits
+	* The loop has no branch nor call so the compiler vectorizes the conversion and the byte swap */
+	inline void encode(const float* data, const unsigned int width, const unsigned int height, const unsigned int depth, uint8_t* out)
+	{
+		const uint16_t header[3] = { (uint16_t)width, (uint16_t)height, (uint16_t)depth };
+		for (int i = 0; i < 3; ++i) {
+			out[2 * i] = (uint8_t)(header[i] >> 8);
+			out[2 * i + 1] = (uint8_t)(header[i] & 0xFF);
+		}
+		const size_t volume = (size_t)width*height*depth;
+		const float max = (float)std::numeric_limits<uint32_t>::max();
+		uint32_t* values = reinterpret_cast<uint32_t*>(out + 6);
+		const bool swap = is_little_endian();
+		for (size_t e = 0; e < volume; ++e) {
+			// densities outside [0, 255] are clamped (their conversion to uint32_t is undefined)
+			const float d = std::min(std::max(data[e], 0.0f), 255.0f);
+			uint32_t v = (uint32_t)std::min(d / 255.0f*max, 4294967040.0f);
+			if (swap) {
+				v = (v >> 24) | ((v >> 8) & 0xFF00) | ((v << 8) & 0xFF0000) | (v << 24);
+			}
+			std::memcpy(values + e, &v, sizeof(v));
+		}
+	}
+
 	/** Write a df3 file (density map) 
 	* constitued by a header of three int16 (width x height x depth) 
-	* followed by the density for each cell in 8, 16 or 32 bits in the (x,y,z) order */
-	void exportdf3(const std::string & filename, const float* data, const unsigned int width, const unsigned int height, const unsigned int depth)
+	* followed by the density for each cell in 32 bits in the (x,y,z) order. Return false if the file cannot be written */
+	inline bool exportdf3(const std::string & filename, const float* data, const unsigned int width, const unsigned int height, const unsigned int depth)
 	{
-		const unsigned int wh = width*height;
-		const unsigned int volume = width*height*depth;
-
+		std::vector<uint8_t> bytes(fileSize(width, height, depth));
+		encode(data, width, height, depth, bytes.data());
 		std::ofstream out(filename.c_str(), std::ofstream::binary);
 		if (!out.good()) {
 			std::cout<<"cannot open "<<filename<<" =( "<<std::endl;
-			delete [] data;
-			out.close();
-		}
-		// Write the header
-		uint16_t w = width, h=height, d=depth;
-		binary_write16big(out,w);
-		binary_write16big(out,h);
-		binary_write16big(out,d);
-
-		// Write the content
-		if(is_little_endian()){
-			for (unsigned int e = 0; e < volume; ++e) {
-				const uint32_t val = (uint32_t)(data[e]/255.0f*std::numeric_limits<uint32_t>::max());
-				binary_write32big_unsafe(out,val);
-			}
-		} else {
-			for (unsigned int e = 0; e < volume; ++e) {
-				const uint32_t val = (uint32_t)(data[e]/255.0f*std::numeric_limits<uint32_t>::max());
-				binary_write(out,val);
-			}
+			return false;
 		}
-		out.close();
-
-		delete [] data;
+		out.write(reinterpret_cast<const char*>(bytes.data()), bytes.size());
+		return out.good();
 	}
 }
 
-#endif // !D3F_WRITER_H
\ No newline at end of file
+#endif // !D3F_WRITER_H
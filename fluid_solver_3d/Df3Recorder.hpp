@@ -0,0 +1,175 @@
+#ifndef DF3_RECORDER_H
+#define DF3_RECORDER_H
+
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <fstream>
+#include <iostream>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "D3fWriter.hpp"
+
+/** Recording of the density in .df3 files in the background
+* The frames go through a fixed pool of host buffers: acquire gives a free buffer, the solver fills it
+* (usually with a non-blocking read) and submits it with a function waiting for the fill.
+* A few writer threads take the frames in order, encode them in one contiguous block and write it
+* in a single call, then give the buffer back. When every buffer is in flight, acquire either waits
+* for a writer (Block) or drops the frame (Drop) so the simulation never slows down. */
+class Df3Recorder
+{
+public:
+	enum class Policy { Block, Drop };
+
+	Df3Recorder(unsigned int width, unsigned int height, unsigned int depth,
+		unsigned int nb_buffers, unsigned int nb_writers, Policy policy) :
+		width(width), height(height), depth(depth), policy(policy)
+	{
+		const size_t volume = (size_t)width*height*depth;
+		buffers.resize((nb_buffers < 1) ? 1 : nb_buffers, std::vector<float>(volume));
+		for (auto & buffer : buffers) {
+			free_buffers.push_back(buffer.data());
+		}
+		for (unsigned int i = 0; i < ((nb_writers < 1) ? 1 : nb_writers); ++i) {
+			writers.emplace_back(&Df3Recorder::writer, this);
+		}
+	}
+
+	/** Write the pending frames and print the statistics */
+	~Df3Recorder()
+	{
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			stop = true;
+		}
+		job_added.notify_all();
+		for (auto & thread : writers) {
+			thread.join();
+		}
+		printStats(std::cout);
+	}
+
+	Df3Recorder(const Df3Recorder &) = delete;
+	Df3Recorder & operator=(const Df3Recorder &) = delete;
+
+	/** Buffer of width*height*depth floats for the next frame, nullptr if the frame is dropped */
+	float* acquire()
+	{
+		std::unique_lock<std::mutex> lock(mutex);
+		if (free_buffers.empty()) {
+			if (policy == Policy::Drop) {
+				++dropped;
+				return nullptr;
+			}
+			buffer_freed.wait(lock, [this] { return !free_buffers.empty(); });
+		}
+		float* buffer = free_buffers.back();
+		free_buffers.pop_back();
+		return buffer;
+	}
+
+	/** Queue the frame of "buffer" (from acquire); a writer calls "ready" (if any) before reading the buffer */
+	void submit(float* buffer, const std::string & filename, std::function<void()> ready = nullptr)
+	{
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			if (written == 0 && jobs.empty()) {
+				start = std::chrono::steady_clock::now();
+			}
+			jobs.push_back({ buffer, filename, std::move(ready) });
+		}
+		job_added.notify_one();
+	}
+
+	unsigned long long framesWritten() const { std::lock_guard<std::mutex> lock(mutex); return written; }
+	unsigned long long framesDropped() const { std::lock_guard<std::mutex> lock(mutex); return dropped; }
+
+	/** Sustained write rate since the first submitted frame */
+	double megabytesPerSecond() const
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		const double seconds = std::chrono::duration<double>(last_write - start).count();
+		return (written > 0 && seconds > 0.0) ? bytes / (seconds*1e6) : 0.0;
+	}
+
+	void printStats(std::ostream & out) const
+	{
+		const double rate = megabytesPerSecond();
+		std::lock_guard<std::mutex> lock(mutex);
+		out << "DF3 recording: " << written << " frames written, " << dropped << " dropped, "
+			<< failed << " failed, " << rate << " MB/s" << std::endl;
+	}
+
+private:
+	struct Job
+	{
+		float* buffer;
+		std::string filename;
+		std::function<void()> ready;
+	};
+
+	void writer()
+	{
+		std::vector<uint8_t> file(D3fWriter::fileSize(width, height, depth));
+		std::unique_lock<std::mutex> lock(mutex);
+		for (;;) {
+			job_added.wait(lock, [this] { return stop || !jobs.empty(); });
+			if (jobs.empty()) {
+				return;
+			}
+			Job job = std::move(jobs.front());
+			jobs.pop_front();
+			lock.unlock();
+
+			if (job.ready) {
+				job.ready();
+			}
+			D3fWriter::encode(job.buffer, width, height, depth, file.data());
+			std::ofstream out(job.filename, std::ofstream::binary);
+			out.write(reinterpret_cast<const char*>(file.data()), file.size());
+			const bool success = out.good();
+			out.close();
+			if (!success) {
+				std::cout << "cannot write " << job.filename << std::endl;
+			}
+
+			lock.lock();
+			free_buffers.push_back(job.buffer);
+			if (success) {
+				++written;
+				bytes += file.size();
+			} else {
+				++failed;
+			}
+			last_write = std::chrono::steady_clock::now();
+			buffer_freed.notify_one();
+		}
+	}
+
+	const unsigned int width;
+	const unsigned int height;
+	const unsigned int depth;
+	const Policy policy;
+
+	std::vector<std::vector<float>> buffers;
+	std::vector<float*> free_buffers;
+	std::deque<Job> jobs;
+	std::vector<std::thread> writers;
+	mutable std::mutex mutex;
+	std::condition_variable job_added;
+	std::condition_variable buffer_freed;
+	bool stop = false;
+
+	unsigned long long written = 0;
+	unsigned long long dropped = 0;
+	unsigned long long failed = 0;
+	double bytes = 0.0;
+	std::chrono::steady_clock::time_point start;
+	std::chrono::steady_clock::time_point last_write;
+};
+
+#endif // !DF3_RECORDER_H
@@ -1,20 +1,25 @@
 #include "Fluid3D.h"
 
-#include "D3fWriter.hpp"
+#include "ProgramCache.hpp"
+#include "StateFile.hpp"
+#ifdef FLUID_EMBEDDED_KERNELS
+#include "core_cl_3d.h"
+#define CORE_CL_SOURCE core_cl_3d, sizeof(core_cl_3d)
+#else
+#define CORE_CL_SOURCE nullptr, 0
+#endif
 #include "config.hpp"
+#include <algorithm>
+#include <chrono>
+#include <cmath>
 #include <cstdint>
+#include <cstring>
 #include <iostream>
-#include <thread>
 
 using namespace std;
 
 static std::string getErrorStr(cl_int error);
 
-static constexpr float VISCO = 0.00001f;
-static constexpr float VISCO_DIV = 1.0f + 6.0f*VISCO;
-static constexpr float DIFF_DENSITY = 0.000001f;
-static constexpr unsigned int SOLVER_NB_ITERATIONS = 16;
-
 Fluid3D::Fluid3D(cl::Context ctx, cl::Device dev) : 
 		context(ctx), device(dev)
 {
@@ -39,39 +44,83 @@ Fluid3D::~Fluid3D()
 	queue.finish();
 }
 
-void Fluid3D::setDataImage(cl_uint8 * img)
+void Fluid3D::setDataImage(uint8_t * img)
 {
 	data_image = img;
 }
 
 void Fluid3D::updateImage()
 {
-	queue.enqueueNDRangeKernel(kernel_draw_img, origin_work2d, region_work2d, cl::NullRange);
-	queue.enqueueReadImage(image, CL_TRUE, origin2d, region2d, 0, 0, data_image);
+	flushSplats();
+	cl::Kernel & draw = drawKernel();
+	draw.setArg(1, image);
+	profiler.enqueueKernel(queue, draw, origin_work2d, region_work2d, cl::NullRange);
+	queue.enqueueReadImage(image, CL_TRUE, origin2d, region2d, 0, 0, data_image, nullptr, profiler.event());
+	profiler.record("readImage", width*height * 4);
+}
+
+const uint8_t* Fluid3D::latestImage()
+{
+	flushSplats();
+	if (!readback.isInitialized()) {
+		readback.init(context, device, width, height, READBACK_SLOTS);
+	}
+	vector<cl::Event> wait_list;
+	cl::Event drawn;
+	cl::Kernel & draw = drawKernel();
+	draw.setArg(1, readback.nextTarget(wait_list));
+	profiler.enqueueKernel(queue, draw, origin_work2d, region_work2d, cl::NullRange,
+		wait_list.empty() ? nullptr : &wait_list, &drawn);
+	readback.submit(queue, drawn);
+	return readback.latest();
 }
 
 bool Fluid3D::initialization()
 {
 	//cout << "Init" << endl;
-	queue = cl::CommandQueue(context, device);
+	queue = cl::CommandQueue(context, device, profiler.queueProperties());
 	
-	// load opencl source
-	ifstream cl_file("../core.cl");
-	if (!cl_file.good())
-	{
-		cout << "core.cl not found" << endl;
+	// load opencl source (embedded by CMake, else ../core.cl)
+	const string cl_string = ProgramCache::loadSource(CORE_CL_SOURCE, "../core.cl");
+
+	// the velocity layout timed by tuneWorkGroups, unless one was selected
+	tuner.load(device);
+	const int tuned_layout = tuner.choice(layoutChoice(), cl::NDRange(width, height, depth));
+	if (!velocity_layout_selected && tuned_layout >= 0) {
+		velocity_layout = (VelocityLayout)tuned_layout;
 	}
-	string cl_string(istreambuf_iterator<char>(cl_file), (istreambuf_iterator<char>()));
-	cl::Program::Sources source(1, make_pair(cl_string.c_str(), cl_string.length() + 1));
 
-	// create program and build it
-	program = cl::Program(context, source);
-	if (program.build({ device }) != CL_SUCCESS) {
-		cout << " Error building: " << program.getBuildInfo<CL_PROGRAM_BUILD_LOG>(device) << "\n";
+	// create program and build it, the velocity layout and the storage precision are compile time constants of the kernels
+	string options = "-D VELOCITY_LAYOUT=" + to_string((int)velocity_layout) + " -D VELOCITY_PLANE=" + to_string(volume)
+		+ " -D RELAX_GROUP=" + to_string(RELAX_GROUP);
+	if (storage_precision == StoragePrecision::Half) {
+		options += " -D FIELD_HALF";
+	}
+	if (sparse) {
+		bricks_x = (width + SPARSE_BRICK_SIZE - 1) / SPARSE_BRICK_SIZE;
+		bricks_y = (height + SPARSE_BRICK_SIZE - 1) / SPARSE_BRICK_SIZE;
+		bricks_z = (depth + SPARSE_BRICK_SIZE - 1) / SPARSE_BRICK_SIZE;
+		options += " -D SPARSE_BRICK=" + to_string(SPARSE_BRICK_SIZE) + " -D BRICKS_X=" + to_string(bricks_x)
+			+ " -D BRICKS_Y=" + to_string(bricks_y) + " -D BRICKS_Z=" + to_string(bricks_z) + " -D GRID_WIDTH=" + to_string(width)
+			+ " -D GRID_HEIGHT=" + to_string(height) + " -D GRID_DEPTH=" + to_string(depth);
+	}
+	if (!ProgramCache::build(context, device, cl_string, options, program)) {
 		return false;
 	} else {
 		cout << "Build sucessful" << endl;
 	}
+	tuner.setOptions(options);
+	// the kernels returning beyond their launch (core.cl), the tuner may pad them in the dimensions they check
+	for (const char* name : { "diffuse", "diffuse3D", "advect", "advect3D", "advectField3D", "advectCorrect",
+		"advectCorrect3D", "project1", "project2" }) {
+		tuner.setBounded(name, 3);
+	}
+	for (const char* name : { "drawScreen", "raymarchVolume", "mgSmooth", "mgResidual", "mgRestrict", "mgProlongate",
+		"relaxSor", "relaxSor3D", "relaxResidualRows", "relaxResidualRows3D" }) {
+		tuner.setBounded(name, 2);
+	}
+	tuner.setBounded("sumSquaresRows", 1);
+	profiler.setTuner(&tuner);
 
 	// ----
 	// init work region and origin
@@ -101,12 +150,12 @@ bool Fluid3D::initialization()
 	// Initialize memory
 	image =			cl::Image2D(context, CL_MEM_READ_WRITE, { CL_RGBA, CL_UNSIGNED_INT8 }, width, height, 0);
 	
-	density =		cl::Buffer(context, CL_MEM_READ_WRITE, volume * sizeof(float));
-	density2 =		cl::Buffer(context, CL_MEM_READ_WRITE, volume * sizeof(float));
-	velocity =		cl::Buffer(context, CL_MEM_READ_WRITE, volume * 3 * sizeof(float));
-	velocity2 =		cl::Buffer(context, CL_MEM_READ_WRITE, volume * 3 * sizeof(float));
-	tmp_project  =	cl::Buffer(context, CL_MEM_READ_WRITE, volume * sizeof(float));
-	tmp_project2 =	cl::Buffer(context, CL_MEM_READ_WRITE, volume * sizeof(float));
+	density =		cl::Buffer(context, CL_MEM_READ_WRITE, volume * fieldBytes());
+	density2 =		cl::Buffer(context, CL_MEM_READ_WRITE, volume * fieldBytes());
+	velocity =		cl::Buffer(context, CL_MEM_READ_WRITE, volume * velocityFloats() * fieldBytes());
+	velocity2 =		cl::Buffer(context, CL_MEM_READ_WRITE, volume * velocityFloats() * fieldBytes());
+	tmp_project  =	cl::Buffer(context, CL_MEM_READ_WRITE, volume * fieldBytes());
+	tmp_project2 =	cl::Buffer(context, CL_MEM_READ_WRITE, volume * fieldBytes());
 
 	// Create the kernels
 	kernel_diffuse   = cl::Kernel(program, "diffuse");
@@ -124,22 +173,25 @@ bool Fluid3D::initialization()
 	kernel_advect_density.setArg(4,height);
 	kernel_advect_density.setArg(5,depth);
 	kernel_advect_density.setArg(6,0.02f);
+	kernel_advect_density.setArg(7,0);
+	kernel_advect_density.setArg(8,depth + 0.5f);
 
 	kernel_draw_img  = cl::Kernel(program, "drawScreen");
 	kernel_draw_img.setArg(0, density);
 	kernel_draw_img.setArg(1, image);
 	kernel_draw_img.setArg(2, width);
 	kernel_draw_img.setArg(3, height);
+	kernel_raymarch = cl::Kernel(program, "raymarchVolume");
+	kernel_raymarch.setArg(0, density);
+	kernel_raymarch.setArg(2, width);
+	kernel_raymarch.setArg(3, height);
+	kernel_raymarch.setArg(4, depth);
 
-	kernel_addsource = cl::Kernel(program, "addSource");
-	kernel_addsource.setArg(0, density);
-	kernel_addsource.setArg(6, width);
-	kernel_addsource.setArg(7, height);
-
-	kernel_addsource3D = cl::Kernel(program, "addSource3D");
-	kernel_addsource3D.setArg(0, velocity);
-	kernel_addsource3D.setArg(7, width);
-	kernel_addsource3D.setArg(8, height);
+	kernel_splat = cl::Kernel(program, "splatSources");
+	kernel_splat.setArg(0, density);
+	kernel_splat.setArg(1, velocity);
+	kernel_splat.setArg(8, width);
+	kernel_splat.setArg(9, height);
 
 	kernel_reset_buffer = cl::Kernel(program, "resetBuffer");
 	kernel_reset_buffer.setArg(1, width);
@@ -167,6 +219,8 @@ bool Fluid3D::initialization()
 	kernel_advect_velocity.setArg(3,height);
 	kernel_advect_velocity.setArg(4,depth);
 	kernel_advect_velocity.setArg(5,0.02f);
+	kernel_advect_velocity.setArg(6,0);
+	kernel_advect_velocity.setArg(7,depth + 0.5f);
 
 	kernel_project1 = cl::Kernel(program, "project1");
 	kernel_project1.setArg(0, tmp_project);
@@ -205,6 +259,134 @@ bool Fluid3D::initialization()
 	kernel_diffuse_tmp.setArg(5, height);
 	kernel_diffuse_tmp.setArg(6, depth);
 
+	kernel_mg_smooth     = cl::Kernel(program, "mgSmooth");
+	kernel_mg_residual   = cl::Kernel(program, "mgResidual");
+	kernel_mg_restrict   = cl::Kernel(program, "mgRestrict");
+	kernel_mg_prolongate = cl::Kernel(program, "mgProlongate");
+	kernel_sum_squares   = cl::Kernel(program, "sumSquaresRows");
+
+	relax_state = cl::Buffer(context, CL_MEM_READ_WRITE, 2 * RELAX_SLOTS * sizeof(int));
+	relax_sums = cl::Buffer(context, CL_MEM_READ_WRITE, 2 * height*depth * sizeof(float));
+	kernel_relax_reset = cl::Kernel(program, "relaxReset");
+	kernel_relax_reset.setArg(0, relax_state);
+	kernel_relax_sor = cl::Kernel(program, "relaxSor");
+	kernel_relax_sor3D = cl::Kernel(program, "relaxSor3D");
+	for (auto kernel : { &kernel_relax_sor, &kernel_relax_sor3D }) {
+		kernel->setArg(6, width);
+		kernel->setArg(7, height);
+		kernel->setArg(8, relax_state);
+	}
+	kernel_relax_residual = cl::Kernel(program, "relaxResidualRows");
+	kernel_relax_residual3D = cl::Kernel(program, "relaxResidualRows3D");
+	for (auto kernel : { &kernel_relax_residual, &kernel_relax_residual3D }) {
+		kernel->setArg(4, relax_sums);
+		kernel->setArg(5, width);
+		kernel->setArg(6, height);
+		kernel->setArg(7, depth);
+		kernel->setArg(8, relax_state);
+	}
+	kernel_relax_check = cl::Kernel(program, "relaxCheck");
+	kernel_relax_check.setArg(0, relax_sums);
+	kernel_relax_check.setArg(1, height*depth);
+	kernel_relax_check.setArg(4, relax_state);
+
+	if (sparse) {
+		// the brick flags and the list of the active bricks are the last two arguments of the main kernels
+		bricks = cl::Buffer(context, CL_MEM_READ_WRITE, getNbBricks());
+		bricks_occupied = cl::Buffer(context, CL_MEM_READ_WRITE, getNbBricks());
+		bricks_retired = cl::Buffer(context, CL_MEM_READ_WRITE, getNbBricks());
+		brick_list = cl::Buffer(context, CL_MEM_READ_WRITE, (1 + getNbBricks()) * sizeof(cl_int));
+		bricks_pressure = cl::Buffer(context, CL_MEM_READ_WRITE, getNbBricks());
+		brick_list_pressure = cl::Buffer(context, CL_MEM_READ_WRITE, (1 + getNbBricks()) * sizeof(cl_int));
+		brick_list_retired = cl::Buffer(context, CL_MEM_READ_WRITE, (1 + getNbBricks()) * sizeof(cl_int));
+		const pair<cl::Kernel*, int> masked[] = { { &kernel_diffuse, 7 }, { &kernel_diffuse_tmp, 7 }, { &kernel_diffuse_v, 7 },
+			{ &kernel_advect_density, 9 }, { &kernel_advect_velocity, 8 },
+			{ &kernel_project1, 5 }, { &kernel_project1bis, 5 }, { &kernel_project2, 5 }, { &kernel_project2bis, 5 },
+			{ &kernel_relax_sor, 10 }, { &kernel_relax_sor3D, 10 }, { &kernel_relax_residual, 10 }, { &kernel_relax_residual3D, 10 } };
+		for (auto & kernel : masked) {
+			kernel.first->setArg(kernel.second, bricks);
+			kernel.first->setArg(kernel.second + 1, brick_list);
+		}
+		// the Jacobi pressure solve covers the halo (relax switches the bricks of its kernels per solve)
+		kernel_diffuse_tmp.setArg(7, bricks_pressure);
+		kernel_diffuse_tmp.setArg(8, brick_list_pressure);
+		kernel_brick_occupancy = cl::Kernel(program, "brickOccupancy");
+		kernel_brick_occupancy.setArg(0, density);
+		kernel_brick_occupancy.setArg(1, velocity);
+		kernel_brick_occupancy.setArg(2, bricks);
+		kernel_brick_occupancy.setArg(3, bricks_occupied);
+		kernel_brick_occupancy.setArg(4, width);
+		kernel_brick_occupancy.setArg(5, height);
+		kernel_brick_occupancy.setArg(6, depth);
+		kernel_brick_occupancy.setArg(7, SPARSE_THRESHOLD);
+		kernel_brick_dilate = cl::Kernel(program, "brickDilate");
+		kernel_brick_dilate.setArg(0, bricks_occupied);
+		kernel_brick_dilate.setArg(1, bricks);
+		kernel_brick_dilate.setArg(2, bricks_retired);
+		kernel_brick_clear = cl::Kernel(program, "brickClear");
+		kernel_brick_clear.setArg(0, density);
+		kernel_brick_clear.setArg(1, density2);
+		kernel_brick_clear.setArg(2, velocity);
+		kernel_brick_clear.setArg(3, velocity2);
+		kernel_brick_clear.setArg(4, tmp_project);
+		kernel_brick_clear.setArg(5, tmp_project2);
+		kernel_brick_clear.setArg(6, bricks_retired);
+		kernel_brick_clear.setArg(7, brick_list_retired);
+		kernel_brick_activate = cl::Kernel(program, "brickActivate");
+		kernel_brick_activate.setArg(0, bricks);
+		kernel_brick_list = cl::Kernel(program, "brickList");
+		kernel_brick_list.setArg(0, bricks);
+		kernel_brick_list.setArg(1, brick_list);
+		kernel_brick_halo = cl::Kernel(program, "brickHalo");
+		kernel_brick_halo.setArg(0, bricks);
+		kernel_brick_halo.setArg(1, bricks_pressure);
+		kernel_brick_halo.setArg(2, bricks_retired);
+		kernel_brick_list_pressure = cl::Kernel(program, "brickList");
+		kernel_brick_list_pressure.setArg(0, bricks_pressure);
+		kernel_brick_list_pressure.setArg(1, brick_list_pressure);
+		kernel_brick_list_retired = cl::Kernel(program, "brickList");
+		kernel_brick_list_retired.setArg(0, bricks_retired);
+		kernel_brick_list_retired.setArg(1, brick_list_retired);
+		kernel_reset_bricks = cl::Kernel(program, "resetBricks");
+		kernel_reset_bricks.setArg(0, tmp_project2);
+		kernel_reset_bricks.setArg(1, brick_list_pressure);
+	}
+
+	// nominal global memory traffic of a work item (reads + writes of values of f bytes), the padding of float4 included
+	const size_t f = fieldBytes();
+	const size_t vec = velocityFloats() * f;
+	profiler.setBytesPerItem("diffuse", 8 * f);
+	profiler.setBytesPerItem("diffuse3D", 8 * vec);
+	profiler.setBytesPerItem("advect", 9 * f + vec);
+	profiler.setBytesPerItem("advect3D", 10 * vec);
+	profiler.setBytesPerItem("advectField3D", 10 * vec);
+	profiler.setBytesPerItem("advectCorrect", 17 * f + vec);// BFECC: two samples of 8 values
+	profiler.setBytesPerItem("advectCorrect3D", 18 * vec);
+	profiler.setBytesPerItem("project1", 7 * f);
+	profiler.setBytesPerItem("project2", 6 * f + 2 * vec);
+	profiler.setBytesPerItem("resetBuffer", f);
+	profiler.setBytesPerItem("resetBuffer3D", vec);
+	profiler.setBytesPerItem("splatSources", 2 * f + 2 * vec);
+	profiler.setBytesPerItem("drawScreen", f + 4);
+	profiler.setBytesPerItem("raymarchVolume", 4 + f * (size_t)(max(width, max(height, depth)) / preview_camera.step));// a load per sample of the longest ray
+	profiler.setBytesPerItem("mgSmooth", 4 * f);// half of the cells are updated by a launch
+	profiler.setBytesPerItem("mgResidual", 9 * f);
+	profiler.setBytesPerItem("mgRestrict", 9 * f);
+	profiler.setBytesPerItem("mgProlongate", 10 * f);
+	profiler.setBytesPerItem("sumSquaresRows", width * f);
+	profiler.setBytesPerItem("relaxSor", 4 * f);// half of the cells are updated by a launch
+	profiler.setBytesPerItem("relaxSor3D", 4 * vec);
+	profiler.setBytesPerItem("relaxResidualRows", width * 2 * f);
+	profiler.setBytesPerItem("relaxResidualRows3D", width * 2 * vec);
+	profiler.setBytesPerItem("brickClear", 1 + 4 * f + 2 * vec);
+	profiler.setBytesPerItem("resetBricks", f);
+	profiler.setBytesPerItem("brickDilate", 29);
+	profiler.setBytesPerItem("brickActivate", 1);
+	multigridInit();
+	if (advection_scheme != AdvectionScheme::SemiLagrangian) {
+		advectionInit();
+	}
+
 	// reset all buffers to zero
 	reset();
 
@@ -215,6 +397,16 @@ void Fluid3D::update(float dtt)
 {
 	const float dt = (dtt < 0.02f) ? dtt : 0.02f;
 	const float a = dt*density_factor;
+	pressure_cycles = 0;
+	pressure_solves = 0;
+	flushSplats();
+	if (sparse) {
+		updateBricks();
+	}
+	if (relaxation.enabled) {
+		kernel_relax_reset.setArg(1, (int)relaxation.max_iterations);
+		profiler.enqueueKernel(queue, kernel_relax_reset, cl::NDRange(0), cl::NDRange(RELAX_SLOTS), cl::NullRange);
+	}
 	// velocity step ------------------
 	diffuseVelocity();
 	project1();
@@ -224,6 +416,10 @@ void Fluid3D::update(float dtt)
 	diffuseDensity(a, 1 + 6.0f*a);
 	advectDensity();
 
+	++step;
+	if (relaxation.enabled) {
+		pollIterations(true);
+	}
 	if (isSaving) {
 		++t;
 		exportDf3();
@@ -234,83 +430,538 @@ void Fluid3D::diffuseDensity(float a, float div)
 {
 	kernel_diffuse.setArg(2, a);
 	kernel_diffuse.setArg(3, div);
+	if (relaxation.enabled) {
+		relax(kernel_relax_sor, kernel_relax_residual, density2, density, a, div, RELAX_DENSITY);
+		return;
+	}
 	for (unsigned int k = 0; k < SOLVER_NB_ITERATIONS; ++k) {
-		queue.enqueueNDRangeKernel(kernel_diffuse, origin_work_center, region_work_center, cl::NullRange);
+		enqueueCells(kernel_diffuse);
 	}
 }
 
 void Fluid3D::diffuseVelocity()
 {
-
+	if (relaxation.enabled) {
+		relax(kernel_relax_sor3D, kernel_relax_residual3D, velocity2, velocity, VISCO, VISCO_DIV, RELAX_VELOCITY);
+		return;
+	}
 	for (unsigned int k = 0; k < SOLVER_NB_ITERATIONS; ++k) {
-		queue.enqueueNDRangeKernel(kernel_diffuse_v, origin_work_center, region_work_center, cl::NullRange);
+		enqueueCells(kernel_diffuse_v);
 	}
 }
 
 void Fluid3D::advectDensity()
 {
-	queue.enqueueNDRangeKernel(kernel_advect_density, origin_work_center, region_work_center, cl::NullRange);
+	if (advection_scheme == AdvectionScheme::SemiLagrangian) {
+		enqueueCells(kernel_advect_density);
+		return;
+	}
+	kernel_advect_correct.setArg(9, (int)(advection_scheme == AdvectionScheme::BFECC));
+	for (cl::Kernel* kernel : { &kernel_advect_ahead, &kernel_advect_back, &kernel_advect_correct }) {
+		enqueueCells(*kernel);
+	}
 }
 
 void Fluid3D::project1()
 {
-	queue.enqueueNDRangeKernel(kernel_project1, origin_work_center, region_work_center, cl::NullRange);
+	enqueueCells(kernel_project1);
 
-	kernel_reset_buffer.setArg(0, tmp_project2);
-	queue.enqueueNDRangeKernel(kernel_reset_buffer, origin_work, region_work, cl::NullRange);
-	for (unsigned int k = 0; k < SOLVER_NB_ITERATIONS; ++k) {
-		queue.enqueueNDRangeKernel(kernel_diffuse_tmp, origin_work_center, region_work_center, cl::NullRange);
-	}
-	queue.enqueueNDRangeKernel(kernel_project2, origin_work_center, region_work_center, cl::NullRange);
+	solvePressure();
+	enqueueCells(kernel_project2);
 }
 
 void Fluid3D::project2()
 {
-	queue.enqueueNDRangeKernel(kernel_project1bis, origin_work_center, region_work_center, cl::NullRange);
+	enqueueCells(kernel_project1bis);
 
-	kernel_reset_buffer.setArg(0, tmp_project2);
-	queue.enqueueNDRangeKernel(kernel_reset_buffer, origin_work, region_work, cl::NullRange);
-	for (unsigned int k = 0; k < SOLVER_NB_ITERATIONS; ++k) {
-		queue.enqueueNDRangeKernel(kernel_diffuse_tmp, origin_work_center, region_work_center, cl::NullRange);
+	solvePressure();
+	enqueueCells(kernel_project2bis);
+}
+
+void Fluid3D::solvePressure()
+{
+	// with sparse bricks the Jacobi solves only reset their bricks, tmp_project2 holds 0 beyond them (brickClear)
+	if (sparse && pressure_solver == PressureSolver::Jacobi) {
+		enqueueListed(kernel_reset_bricks, listed_pressure_bricks);
+	} else {
+		kernel_reset_buffer.setArg(0, tmp_project2);
+		profiler.enqueueKernel(queue, kernel_reset_buffer, origin_work, region_work, cl::NullRange);
+	}
+	if (pressure_solver == PressureSolver::Jacobi && relaxation.enabled) {
+		relax(kernel_relax_sor, kernel_relax_residual, tmp_project2, tmp_project, 1.0f, 6.0f,
+			RELAX_PRESSURE + min(pressure_solves++, 1u));
+		return;
+	}
+	if (pressure_solver == PressureSolver::Jacobi) {
+		for (unsigned int k = 0; k < SOLVER_NB_ITERATIONS; ++k) {
+			enqueueCells(kernel_diffuse_tmp, true);
+		}
+		return;
+	}
+	// the convergence test reads one float per row back: one sync per cycle
+	const float norm_b = sqrt(sumSquares(tmp_project, 0));
+	pressure_residual = 0.0f;
+	if (norm_b == 0.0f) {
+		return;
+	}
+	for (unsigned int cycle = 0; cycle < multigrid.max_cycles; ++cycle) {
+		vcycle(0);
+		++pressure_cycles;
+		multigridResidual(0);
+		pressure_residual = sqrt(sumSquares(levels[0].r, 0)) / norm_b;
+		if (pressure_residual <= multigrid.tolerance) {
+			break;
+		}
+	}
+}
+
+void Fluid3D::multigridInit()
+{
+	levels.clear();
+	levels.push_back({ width, height, depth, 1, 1, 1, 1.0f, 1.0f, 1.0f, tmp_project2, tmp_project,
+		cl::Buffer(context, CL_MEM_READ_WRITE, volume * fieldBytes()) });
+	// an axis is halved while its inner size is larger than the coarsest size (the depth often stays)
+	// the operator is integrated on the coarse cells: weight *= (fx*fy*fz)/f^2 and the right hand side is summed
+	while (true) {
+		const MultigridLevel & fine = levels.back();
+		MultigridLevel coarse = fine;
+		const unsigned int inner[3] = { fine.width - 2, fine.height - 2, fine.depth - 2 };
+		int f[3];
+		for (int i = 0; i < 3; ++i) {
+			f[i] = (inner[i] > multigrid.coarsest_size) ? 2 : 1;
+		}
+		if (f[0] == 1 && f[1] == 1 && f[2] == 1) {
+			break;
+		}
+		coarse.width  = (inner[0] + f[0] - 1) / f[0] + 2;
+		coarse.height = (inner[1] + f[1] - 1) / f[1] + 2;
+		coarse.depth  = (inner[2] + f[2] - 1) / f[2] + 2;
+		coarse.fx = f[0];
+		coarse.fy = f[1];
+		coarse.fz = f[2];
+		const float cells = (float)(f[0] * f[1] * f[2]);
+		coarse.wx = fine.wx*cells / (f[0] * f[0]);
+		coarse.wy = fine.wy*cells / (f[1] * f[1]);
+		coarse.wz = fine.wz*cells / (f[2] * f[2]);
+		const size_t size = (size_t)coarse.width*coarse.height*coarse.depth * fieldBytes();
+		coarse.p = cl::Buffer(context, CL_MEM_READ_WRITE, size);
+		coarse.b = cl::Buffer(context, CL_MEM_READ_WRITE, size);
+		coarse.r = cl::Buffer(context, CL_MEM_READ_WRITE, size);
+		levels.push_back(coarse);
+	}
+	// the kernels only write the inner cells but the norms read the boundary: start everything at zero
+	for (auto & level : levels) {
+		kernel_reset_buffer.setArg(1, level.width);
+		kernel_reset_buffer.setArg(2, level.height);
+		for (auto buffer : { &level.b, &level.r }) {
+			kernel_reset_buffer.setArg(0, *buffer);
+			profiler.enqueueKernel(queue, kernel_reset_buffer, origin_work, cl::NDRange(level.width, level.height, level.depth), cl::NullRange);
+		}
+	}
+	kernel_reset_buffer.setArg(1, width);
+	kernel_reset_buffer.setArg(2, height);
+	buffer_sums = cl::Buffer(context, CL_MEM_READ_WRITE, height*depth * sizeof(float));
+	sums.resize(height*depth);
+}
+
+void Fluid3D::setVelocityLayout(VelocityLayout layout)
+{
+	velocity_layout = layout;
+	velocity_layout_selected = true;
+}
+
+VelocityLayout Fluid3D::getVelocityLayout() const
+{
+	return velocity_layout;
+}
+
+unsigned int Fluid3D::velocityFloats() const
+{
+	return (velocity_layout == VelocityLayout::Float4) ? 4 : 3;
+}
+
+size_t Fluid3D::fieldBytes() const
+{
+	return (storage_precision == StoragePrecision::Half) ? sizeof(uint16_t) : sizeof(float);
+}
+
+void Fluid3D::setStoragePrecision(StoragePrecision precision)
+{
+	storage_precision = precision;
+}
+
+StoragePrecision Fluid3D::getStoragePrecision() const
+{
+	return storage_precision;
+}
+
+void Fluid3D::readField(const cl::Buffer & buffer, size_t count, float* out, std::vector<uint16_t> & staging, cl::Event* event)
+{
+	if (storage_precision == StoragePrecision::Float) {
+		queue.enqueueReadBuffer(buffer, CL_FALSE, 0, count * sizeof(float), out, nullptr, event);
+		return;
+	}
+	staging.resize(count);
+	queue.enqueueReadBuffer(buffer, CL_FALSE, 0, count * sizeof(uint16_t), staging.data(), nullptr, event);
+}
+
+void Fluid3D::widenField(float* out, const std::vector<uint16_t> & staging) const
+{
+	if (storage_precision == StoragePrecision::Half) {
+		HalfFloat::toFloats(staging.data(), out, staging.size());
+	}
+}
+
+void Fluid3D::writeField(cl::Buffer & buffer, size_t count, const float* in, std::vector<uint16_t> & staging)
+{
+	if (storage_precision == StoragePrecision::Float) {
+		queue.enqueueWriteBuffer(buffer, CL_FALSE, 0, count * sizeof(float), in);
+		return;
+	}
+	staging.resize(count);
+	HalfFloat::fromFloats(in, staging.data(), count);
+	queue.enqueueWriteBuffer(buffer, CL_FALSE, 0, count * sizeof(uint16_t), staging.data());
+}
+
+void Fluid3D::setPressureSolver(PressureSolver solver, const MultigridSettings & settings)
+{
+	const bool rebuild = settings.coarsest_size != multigrid.coarsest_size;
+	if (sparse && !levels.empty() && pressure_solver == PressureSolver::Multigrid && solver == PressureSolver::Jacobi) {
+		// the multigrid solves write the whole grid, the sparse Jacobi solves expect 0 beyond their bricks
+		kernel_reset_buffer.setArg(0, tmp_project2);
+		profiler.enqueueKernel(queue, kernel_reset_buffer, origin_work, region_work, cl::NullRange);
+	}
+	pressure_solver = solver;
+	multigrid = settings;
+	if (rebuild && !levels.empty()) {
+		multigridInit();
+	}
+}
+
+unsigned int Fluid3D::getPressureCycles() const
+{
+	return pressure_cycles;
+}
+
+float Fluid3D::getPressureResidual() const
+{
+	return pressure_residual;
+}
+
+void Fluid3D::setRelaxation(const RelaxationSettings & settings)
+{
+	relaxation = settings;
+	relaxation.check_interval = max(relaxation.check_interval, 1u);
+}
+
+SolverIterations Fluid3D::getSolverIterations()
+{
+	if (!relaxation.enabled) {
+		SolverIterations fixed;
+		fixed.velocity = SOLVER_NB_ITERATIONS;
+		fixed.pressure = (pressure_solver == PressureSolver::Jacobi) ? 2 * SOLVER_NB_ITERATIONS : 0;
+		fixed.density = SOLVER_NB_ITERATIONS;
+		return fixed;
+	}
+	pollIterations(false);
+	return solver_iterations;
+}
+
+void Fluid3D::pollIterations(bool start)
+{
+	if (relax_reading) {
+		if (relax_read.getInfo<CL_EVENT_COMMAND_EXECUTION_STATUS>() != CL_COMPLETE) {
+			return;// still in flight, relax_counts is busy: this update is not reported
+		}
+		relax_reading = false;
+		solver_iterations.velocity = relax_counts[2 * RELAX_VELOCITY + 1];
+		solver_iterations.pressure = (pressure_solver == PressureSolver::Jacobi)
+			? relax_counts[2 * RELAX_PRESSURE + 1] + relax_counts[2 * RELAX_PRESSURE + 3] : 0;
+		solver_iterations.density = relax_counts[2 * RELAX_DENSITY + 1];
+	}
+	if (start) {
+		queue.enqueueReadBuffer(relax_state, CL_FALSE, 0, sizeof(relax_counts), relax_counts, nullptr, &relax_read);
+		relax_reading = true;
+	}
+}
+
+void Fluid3D::relax(cl::Kernel & sor, cl::Kernel & residual, const cl::Buffer & p, const cl::Buffer & b, float a, float div, int slot)
+{
+	// every launch is enqueued up front, the checks only set the flag that turns the rest into no-ops
+	for (auto kernel : { &sor, &residual }) {
+		kernel->setArg(0, p);
+		kernel->setArg(1, b);
+		kernel->setArg(2, a);
+		kernel->setArg(3, div);
+		kernel->setArg(9, slot);
+	}
+	// with sparse bricks the pressure solves also cover the halo of the active bricks
+	const bool pressure = slot != RELAX_VELOCITY && slot != RELAX_DENSITY;
+	if (sparse) {
+		for (auto kernel : { &sor, &residual }) {
+			kernel->setArg(10, pressure ? bricks_pressure : bricks);
+			kernel->setArg(11, pressure ? brick_list_pressure : brick_list);
+		}
+	}
+	sor.setArg(4, relaxation.omega);
+	kernel_relax_check.setArg(2, relaxation.tolerance);
+	kernel_relax_check.setArg(5, slot);
+	for (unsigned int k = 1; k <= relaxation.max_iterations; ++k) {
+		for (int color = 0; color < 2; ++color) {
+			sor.setArg(5, color);
+			enqueueCells(sor, pressure);
+		}
+		if (k % relaxation.check_interval == 0 && k < relaxation.max_iterations) {
+			profiler.enqueueKernel(queue, residual, cl::NDRange(0, 0), cl::NDRange(height, depth), cl::NullRange);
+			kernel_relax_check.setArg(3, (int)k);
+			profiler.enqueueKernel(queue, kernel_relax_check, cl::NDRange(0), cl::NDRange(RELAX_GROUP), cl::NDRange(RELAX_GROUP));
+		}
 	}
-	queue.enqueueNDRangeKernel(kernel_project2bis, origin_work_center, region_work_center, cl::NullRange);
+}
+
+void Fluid3D::multigridSmooth(size_t level, unsigned int sweeps)
+{
+	const MultigridLevel & l = levels[level];
+	kernel_mg_smooth.setArg(0, l.p);
+	kernel_mg_smooth.setArg(1, l.b);
+	kernel_mg_smooth.setArg(2, l.wx);
+	kernel_mg_smooth.setArg(3, l.wy);
+	kernel_mg_smooth.setArg(4, l.wz);
+	kernel_mg_smooth.setArg(6, l.width);
+	kernel_mg_smooth.setArg(7, l.height);
+	const cl::NDRange center(l.width - 2, l.height - 2, l.depth - 2);
+	for (unsigned int k = 0; k < sweeps; ++k) {
+		for (int color = 0; color < 2; ++color) {
+			kernel_mg_smooth.setArg(5, color);
+			profiler.enqueueKernel(queue, kernel_mg_smooth, origin_work_center, center, cl::NullRange);
+		}
+	}
+}
+
+void Fluid3D::multigridResidual(size_t level)
+{
+	const MultigridLevel & l = levels[level];
+	kernel_mg_residual.setArg(0, l.r);
+	kernel_mg_residual.setArg(1, l.p);
+	kernel_mg_residual.setArg(2, l.b);
+	kernel_mg_residual.setArg(3, l.wx);
+	kernel_mg_residual.setArg(4, l.wy);
+	kernel_mg_residual.setArg(5, l.wz);
+	kernel_mg_residual.setArg(6, l.width);
+	kernel_mg_residual.setArg(7, l.height);
+	profiler.enqueueKernel(queue, kernel_mg_residual, origin_work_center, cl::NDRange(l.width - 2, l.height - 2, l.depth - 2), cl::NullRange);
+}
+
+void Fluid3D::vcycle(size_t level)
+{
+	if (level + 1 == levels.size()) {
+		multigridSmooth(level, multigrid.coarse_sweeps);
+		return;
+	}
+	const MultigridLevel & fine = levels[level];
+	const MultigridLevel & coarse = levels[level + 1];
+	multigridSmooth(level, multigrid.pre_smoothing);
+	multigridResidual(level);
+
+	kernel_mg_restrict.setArg(0, coarse.b);
+	kernel_mg_restrict.setArg(1, fine.r);
+	kernel_mg_restrict.setArg(2, fine.width);
+	kernel_mg_restrict.setArg(3, fine.height);
+	kernel_mg_restrict.setArg(4, fine.depth);
+	kernel_mg_restrict.setArg(5, coarse.width);
+	kernel_mg_restrict.setArg(6, coarse.height);
+	kernel_mg_restrict.setArg(7, coarse.fx);
+	kernel_mg_restrict.setArg(8, coarse.fy);
+	kernel_mg_restrict.setArg(9, coarse.fz);
+	const cl::NDRange coarse_center(coarse.width - 2, coarse.height - 2, coarse.depth - 2);
+	profiler.enqueueKernel(queue, kernel_mg_restrict, origin_work_center, coarse_center, cl::NullRange);
+	kernel_reset_buffer.setArg(0, coarse.p);
+	kernel_reset_buffer.setArg(1, coarse.width);
+	kernel_reset_buffer.setArg(2, coarse.height);
+	profiler.enqueueKernel(queue, kernel_reset_buffer, origin_work, cl::NDRange(coarse.width, coarse.height, coarse.depth), cl::NullRange);
+	kernel_reset_buffer.setArg(1, width);
+	kernel_reset_buffer.setArg(2, height);
+
+	vcycle(level + 1);
+
+	kernel_mg_prolongate.setArg(0, fine.p);
+	kernel_mg_prolongate.setArg(1, coarse.p);
+	kernel_mg_prolongate.setArg(2, fine.width);
+	kernel_mg_prolongate.setArg(3, fine.height);
+	kernel_mg_prolongate.setArg(4, coarse.width);
+	kernel_mg_prolongate.setArg(5, coarse.height);
+	kernel_mg_prolongate.setArg(6, coarse.fx);
+	kernel_mg_prolongate.setArg(7, coarse.fy);
+	kernel_mg_prolongate.setArg(8, coarse.fz);
+	profiler.enqueueKernel(queue, kernel_mg_prolongate, origin_work_center, cl::NDRange(fine.width - 2, fine.height - 2, fine.depth - 2), cl::NullRange);
+	multigridSmooth(level, multigrid.post_smoothing);
+}
+
+float Fluid3D::sumSquares(const cl::Buffer & buffer, size_t level)
+{
+	const MultigridLevel & l = levels[level];
+	kernel_sum_squares.setArg(0, buffer);
+	kernel_sum_squares.setArg(1, buffer_sums);
+	kernel_sum_squares.setArg(2, l.width);
+	kernel_sum_squares.setArg(3, l.height);
+	profiler.enqueueKernel(queue, kernel_sum_squares, cl::NDRange(0, 0), cl::NDRange(l.height, l.depth), cl::NullRange);
+	const size_t rows = (size_t)l.height*l.depth;
+	queue.enqueueReadBuffer(buffer_sums, CL_TRUE, 0, rows * sizeof(float), sums.data(), nullptr, profiler.event());
+	profiler.record("readSums", rows * sizeof(float));
+	double sum = 0.0;
+	for (size_t i = 0; i < rows; ++i) {
+		sum += sums[i];
+	}
+	return (float)sum;
 }
 
 void Fluid3D::advectVelocity()
 {
-	queue.enqueueNDRangeKernel(kernel_advect_velocity, origin_work_center, region_work_center, cl::NullRange);
+	if (advection_scheme == AdvectionScheme::SemiLagrangian) {
+		enqueueCells(kernel_advect_velocity);
+		return;
+	}
+	kernel_advect_correct3D.setArg(8, (int)(advection_scheme == AdvectionScheme::BFECC));
+	for (cl::Kernel* kernel : { &kernel_advect_ahead3D, &kernel_advect_back3D, &kernel_advect_correct3D }) {
+		enqueueCells(*kernel);
+	}
 }
 
-void Fluid3D::addPressure(int x, int y, int radius, float pressure)
+void Fluid3D::advectionInit()
 {
-	int z = depth/2;
+	advect_ahead = cl::Buffer(context, CL_MEM_READ_WRITE, volume * fieldBytes());
+	advect_back = cl::Buffer(context, CL_MEM_READ_WRITE, volume * fieldBytes());
+	advect_ahead3D = cl::Buffer(context, CL_MEM_READ_WRITE, volume * velocityFloats() * fieldBytes());
+	advect_back3D = cl::Buffer(context, CL_MEM_READ_WRITE, volume * velocityFloats() * fieldBytes());
+	// the passes only write the inner cells, the samples next to the edges read these zeros
+	for (auto buffer : { &advect_ahead, &advect_back }) {
+		kernel_reset_buffer.setArg(0, *buffer);
+		profiler.enqueueKernel(queue, kernel_reset_buffer, origin_work, region_work, cl::NullRange);
+	}
+	for (auto buffer : { &advect_ahead3D, &advect_back3D }) {
+		kernel_reset_buffer3D.setArg(0, *buffer);
+		profiler.enqueueKernel(queue, kernel_reset_buffer3D, origin_work, region_work, cl::NullRange);
+	}
 
-	kernel_addsource.setArg(1, x);
-	kernel_addsource.setArg(2, y);
-	kernel_addsource.setArg(3, z);
-	kernel_addsource.setArg(4, pressure);
-	kernel_addsource.setArg(5, (float)radius - 0.5f);
+	// density: density2 -> advect_ahead -> advect_back (-dt), then density
+	kernel_advect_ahead = cl::Kernel(program, "advect");
+	kernel_advect_ahead.setArg(0, advect_ahead);
+	kernel_advect_ahead.setArg(1, density2);
+	kernel_advect_back = cl::Kernel(program, "advect");
+	kernel_advect_back.setArg(0, advect_back);
+	kernel_advect_back.setArg(1, advect_ahead);
+	for (auto kernel : { &kernel_advect_ahead, &kernel_advect_back }) {
+		kernel->setArg(2, velocity);
+		kernel->setArg(3, width);
+		kernel->setArg(4, height);
+		kernel->setArg(5, depth);
+		kernel->setArg(6, (kernel == &kernel_advect_ahead) ? 0.02f : -0.02f);
+		kernel->setArg(7, 0);
+		kernel->setArg(8, depth + 0.5f);
+	}
+	kernel_advect_correct = cl::Kernel(program, "advectCorrect");
+	kernel_advect_correct.setArg(0, density);
+	kernel_advect_correct.setArg(1, density2);
+	kernel_advect_correct.setArg(2, advect_ahead);
+	kernel_advect_correct.setArg(3, advect_back);
+	kernel_advect_correct.setArg(4, velocity);
+	kernel_advect_correct.setArg(5, width);
+	kernel_advect_correct.setArg(6, height);
+	kernel_advect_correct.setArg(7, depth);
+	kernel_advect_correct.setArg(8, 0.02f);
 
-	const int bound_width  = (x + radius+1 < (int)width)  ? 2 * radius : (width-2)  - (x - radius);
-	const int bound_height = (y + radius+1 < (int)height) ? 2 * radius : (height-2) - (y - radius);
-	int bound_depth        = (z + radius+1 < (int)depth)  ? 2 * radius : (depth-2) - (z - radius);
-	bound_depth = (bound_depth+2 < (int)depth ) ? bound_depth : (int)depth-2;
-	const int bound_top  = (x - radius < 1) ? 1 : x - radius;
-	const int bound_left = (y - radius < 1) ? 1 : y - radius;
-	const int bound_up   = (z - radius < 1) ? 1 : z - radius;
-	queue.enqueueNDRangeKernel(kernel_addsource, cl::NDRange(bound_top, bound_left, bound_up), cl::NDRange(bound_width, bound_height, bound_depth), cl::NullRange);
+	// velocity: velocity2 -> advect_ahead3D -> advect_back3D (-dt, along velocity2), then velocity
+	kernel_advect_ahead3D = cl::Kernel(program, "advect3D");
+	kernel_advect_ahead3D.setArg(0, advect_ahead3D);
+	kernel_advect_ahead3D.setArg(1, velocity2);
+	kernel_advect_ahead3D.setArg(2, width);
+	kernel_advect_ahead3D.setArg(3, height);
+	kernel_advect_ahead3D.setArg(4, depth);
+	kernel_advect_ahead3D.setArg(5, 0.02f);
+	kernel_advect_ahead3D.setArg(6, 0);
+	kernel_advect_ahead3D.setArg(7, depth + 0.5f);
+	kernel_advect_back3D = cl::Kernel(program, "advectField3D");
+	kernel_advect_back3D.setArg(0, advect_back3D);
+	kernel_advect_back3D.setArg(1, advect_ahead3D);
+	kernel_advect_back3D.setArg(2, velocity2);
+	kernel_advect_back3D.setArg(3, width);
+	kernel_advect_back3D.setArg(4, height);
+	kernel_advect_back3D.setArg(5, depth);
+	kernel_advect_back3D.setArg(6, -0.02f);
+	kernel_advect_correct3D = cl::Kernel(program, "advectCorrect3D");
+	kernel_advect_correct3D.setArg(0, velocity);
+	kernel_advect_correct3D.setArg(1, velocity2);
+	kernel_advect_correct3D.setArg(2, advect_ahead3D);
+	kernel_advect_correct3D.setArg(3, advect_back3D);
+	kernel_advect_correct3D.setArg(4, width);
+	kernel_advect_correct3D.setArg(5, height);
+	kernel_advect_correct3D.setArg(6, depth);
+	kernel_advect_correct3D.setArg(7, 0.02f);
+
+	if (sparse) {
+		const pair<cl::Kernel*, int> masked[] = { { &kernel_advect_ahead, 9 }, { &kernel_advect_back, 9 }, { &kernel_advect_correct, 10 },
+			{ &kernel_advect_ahead3D, 8 }, { &kernel_advect_back3D, 7 }, { &kernel_advect_correct3D, 9 } };
+		for (auto & kernel : masked) {
+			kernel.first->setArg(kernel.second, bricks);
+			kernel.first->setArg(kernel.second + 1, brick_list);
+		}
+	}
+}
+
+void Fluid3D::setAdvectionScheme(AdvectionScheme scheme)
+{
+	advection_scheme = scheme;
+	// after initialization the buffers are made on first use
+	if (scheme != AdvectionScheme::SemiLagrangian && density() && !advect_ahead()) {
+		advectionInit();
+	}
+}
+
+AdvectionScheme Fluid3D::getAdvectionScheme() const
+{
+	return advection_scheme;
+}
+
+void Fluid3D::setPreview(PreviewMode mode, const PreviewCamera & camera)
+{
+	preview_mode = mode;
+	preview_camera = camera;
+}
+
+PreviewMode Fluid3D::getPreviewMode() const
+{
+	return preview_mode;
+}
+
+cl::Kernel & Fluid3D::drawKernel()
+{
+	if (preview_mode == PreviewMode::Slice) {
+		return kernel_draw_img;
+	}
+	cl_float4 eye = { { 0.0f } }, forward = { { 0.0f } }, right = { { 0.0f } }, up = { { 0.0f } };
+	preview_camera.basis(width, height, depth, eye.s, forward.s, right.s, up.s);
+	kernel_raymarch.setArg(5, eye);
+	kernel_raymarch.setArg(6, forward);
+	kernel_raymarch.setArg(7, right);
+	kernel_raymarch.setArg(8, up);
+	kernel_raymarch.setArg(9, preview_camera.absorption);
+	kernel_raymarch.setArg(10, max(preview_camera.step, 0.05f));
+	return kernel_raymarch;
+}
+
+void Fluid3D::addPressure(int x, int y, int radius, float pressure)
+{
+	addSplat(x, y, radius, pressure, 0.0f, 0.0f);
 }
 
 void Fluid3D::addVelocity(int x, int y, int deltax, int deltay, float intensity, int radius)
+{
+	addSplat(x, y, radius, 0.0f, deltax*intensity, deltay*intensity);
+}
+
+void Fluid3D::addSplat(int x, int y, int radius, float amount, float dx, float dy, float falloff)
 {
 	int z = depth/2;
-	
-	kernel_addsource3D.setArg(1, x);
-	kernel_addsource3D.setArg(2, y);
-	kernel_addsource3D.setArg(3, z);
-	kernel_addsource3D.setArg(4, deltax*intensity);
-	kernel_addsource3D.setArg(5, deltay*intensity);
-	kernel_addsource3D.setArg(6, (float)radius - 0.5f);
 
 	const int bound_width  = (x + radius+1 < (int)width)  ? 2 * radius : (width-2)  - (x - radius);
 	const int bound_height = (y + radius+1 < (int)height) ? 2 * radius : (height-2) - (y - radius);
@@ -318,44 +969,484 @@ void Fluid3D::addVelocity(int x, int y, int deltax, int deltay, float intensity,
 	bound_depth = (bound_depth+2 < (int)depth ) ? bound_depth : (int)depth-2;
 	const int bound_top  = (x - radius < 1) ? 1 : x - radius;
 	const int bound_left = (y - radius < 1) ? 1 : y - radius;
-	const int bound_up   = 1;//(z - radius < 1) ? 1 : z - radius;
-	queue.enqueueNDRangeKernel(kernel_addsource3D, cl::NDRange(bound_top, bound_left, bound_up), cl::NDRange(bound_width, bound_height, bound_depth), cl::NullRange);
+
+	Splat splat = {};
+	splat.x = (float)x;
+	splat.y = (float)y;
+	splat.reach = (float)radius - 0.5f;
+	splat.falloff = falloff;
+	splat.x0 = (float)bound_top;
+	splat.y0 = (float)bound_left;
+	splat.x1 = (float)(bound_top + bound_width);
+	splat.y1 = (float)(bound_left + bound_height);
+	// the density is added around the middle layer, the velocity from the bottom
+	if (amount != 0.0f) {
+		Splat source = splat;
+		const int bound_up = (z - radius < 1) ? 1 : z - radius;
+		source.z0 = (float)bound_up;
+		source.z1 = (float)(bound_up + bound_depth);
+		source.density = amount;
+		splats.add(source);
+	}
+	if (dx != 0.0f || dy != 0.0f) {
+		Splat source = splat;
+		source.z0 = 1.0f;
+		source.z1 = (float)(1 + bound_depth);
+		source.velocity = 1.0f;
+		source.dx = dx;
+		source.dy = dy;
+		splats.add(source);
+	}
+}
+
+void Fluid3D::flushSplats()
+{
+	if (splats.empty()) {
+		return;
+	}
+	const int x0 = splats.begin(0), y0 = splats.begin(1), z0 = splats.begin(2);
+	const int size_x = splats.end(0) - x0, size_y = splats.end(1) - y0, size_z = splats.end(2) - z0;
+	splats.upload(context, queue, SPLAT_BINNING_THRESHOLD, SPLAT_TILE_SIZE);
+	profiler.record("writeSplats", splats.uploadEvent(), splats.uploadedSize() * sizeof(Splat));
+	kernel_splat.setArg(2, splats.splatBuffer());
+	kernel_splat.setArg(3, splats.uploadedSize());
+	kernel_splat.setArg(4, splats.offsetBuffer());
+	kernel_splat.setArg(5, splats.indexBuffer());
+	kernel_splat.setArg(6, splats.tileSize());
+	kernel_splat.setArg(7, splats.tilesX());
+	profiler.enqueueKernel(queue, kernel_splat, cl::NDRange(x0, y0, z0), cl::NDRange(size_x, size_y, size_z), cl::NullRange);
+	activateBricks(x0, y0, z0, size_x, size_y, size_z);
+}
+
+void Fluid3D::setSparseBricks(bool enabled)
+{
+	sparse = enabled;
+}
+
+unsigned int Fluid3D::getNbBricks() const
+{
+	return bricks_x*bricks_y*bricks_z;
+}
+
+unsigned int Fluid3D::countActiveBricks()
+{
+	if (!sparse) {
+		return getNbBricks();
+	}
+	vector<uint8_t> flags(getNbBricks());
+	queue.enqueueReadBuffer(bricks, CL_TRUE, 0, flags.size(), flags.data());
+	return (unsigned int)std::count(flags.begin(), flags.end(), 1);
+}
+
+void Fluid3D::updateBricks()
+{
+	// occupancy of the active bricks, dilation and halo: the bricks leaving the active set or the pressure solve
+	// are flagged as retired
+	const cl::NDRange all_bricks(bricks_x, bricks_y, bricks_z);
+	const size_t brick_cells = (size_t)SPARSE_BRICK_SIZE*SPARSE_BRICK_SIZE*SPARSE_BRICK_SIZE;
+	profiler.setBytesPerItem("brickOccupancy", brick_cells * (fieldBytes() + velocityFloats() * fieldBytes()));
+	profiler.enqueueKernel(queue, kernel_brick_occupancy, cl::NDRange(0, 0, 0), all_bricks, cl::NullRange);
+	profiler.enqueueKernel(queue, kernel_brick_dilate, cl::NDRange(0, 0, 0), all_bricks, cl::NullRange);
+	profiler.enqueueKernel(queue, kernel_brick_halo, cl::NDRange(0, 0, 0), all_bricks, cl::NullRange);
+	// the active bricks, those of the pressure solve and the retired ones are listed in any order and their numbers
+	// are read back (one sync per update, OpenCL 1.2 has no indirect dispatch); the launches cover a multiple of 1/16
+	// of the bricks, so the tuner only sees a few global sizes, the work items past the list return
+	const unsigned int granule = std::max(1u, getNbBricks() / 16);
+	static const cl_int zero = 0;
+	const cl::Buffer* lists[3] = { &brick_list, &brick_list_pressure, &brick_list_retired };
+	cl::Kernel* listing[3] = { &kernel_brick_list, &kernel_brick_list_pressure, &kernel_brick_list_retired };
+	for (int i = 0; i < 3; ++i) {
+		queue.enqueueWriteBuffer(*lists[i], CL_FALSE, 0, sizeof(cl_int), &zero);
+		profiler.enqueueKernel(queue, *listing[i], cl::NDRange(0), cl::NDRange(getNbBricks()), cl::NullRange);
+		queue.enqueueReadBuffer(*lists[i], i == 2 ? CL_TRUE : CL_FALSE, 0, sizeof(cl_int), &brick_counts[i], nullptr, profiler.event());
+		profiler.record("readBrickCount", sizeof(cl_int));
+	}
+	listed_bricks = ((unsigned int)brick_counts[0] + granule - 1) / granule * granule;
+	listed_pressure_bricks = ((unsigned int)brick_counts[1] + granule - 1) / granule * granule;
+	// every cell of an inactive brick holds 0, what the kernels reading across its boundary expect, and the pressure
+	// is 0 beyond the bricks of the pressure solve, which only reset their own cells
+	enqueueListed(kernel_brick_clear, ((unsigned int)brick_counts[2] + granule - 1) / granule * granule);
+}
+
+void Fluid3D::enqueueCells(cl::Kernel & kernel, bool pressure)
+{
+	if (!sparse) {
+		profiler.enqueueKernel(queue, kernel, origin_work_center, region_work_center, cl::NullRange);
+	} else {
+		enqueueListed(kernel, pressure ? listed_pressure_bricks : listed_bricks);
+	}
+}
+
+void Fluid3D::enqueueListed(cl::Kernel & kernel, unsigned int listed)
+{
+	if (listed > 0) {
+		const size_t brick_cells = (size_t)SPARSE_BRICK_SIZE*SPARSE_BRICK_SIZE*SPARSE_BRICK_SIZE;
+		profiler.enqueueKernel(queue, kernel, cl::NDRange(0), cl::NDRange(listed * brick_cells), cl::NullRange);
+	}
+}
+
+void Fluid3D::activateAllBricks()
+{
+	if (!sparse) {
+		return;
+	}
+	// the fields were written on the whole grid: every brick is active and in the pressure solve, the next update
+	// retires and clears the empty ones
+	for (auto flags : { &bricks_pressure, &bricks }) {
+		kernel_brick_activate.setArg(0, *flags);
+		profiler.enqueueKernel(queue, kernel_brick_activate, cl::NDRange(0, 0, 0),
+			cl::NDRange(bricks_x, bricks_y, bricks_z), cl::NullRange);
+	}
+}
+
+void Fluid3D::activateBricks(int x0, int y0, int z0, int size_x, int size_y, int size_z)
+{
+	if (!sparse || size_x <= 0 || size_y <= 0 || size_z <= 0) {
+		return;
+	}
+	const int b0[3] = { x0 / (int)SPARSE_BRICK_SIZE, y0 / (int)SPARSE_BRICK_SIZE, z0 / (int)SPARSE_BRICK_SIZE };
+	const int b1[3] = { (x0 + size_x - 1) / (int)SPARSE_BRICK_SIZE, (y0 + size_y - 1) / (int)SPARSE_BRICK_SIZE,
+		(z0 + size_z - 1) / (int)SPARSE_BRICK_SIZE };
+	profiler.enqueueKernel(queue, kernel_brick_activate, cl::NDRange(b0[0], b0[1], b0[2]),
+		cl::NDRange(b1[0] - b0[0] + 1, b1[1] - b0[1] + 1, b1[2] - b0[2] + 1), cl::NullRange);
+}
+
+void Fluid3D::finish()
+{
+	queue.finish();
+}
+
+void Fluid3D::readDensity(std::vector<float> & out)
+{
+	flushSplats();
+	out.resize(volume);
+	vector<uint16_t> staging;
+	readField(density, volume, out.data(), staging, profiler.event());
+	profiler.record("readDensity", volume*fieldBytes());
+	queue.finish();
+	widenField(out.data(), staging);
 }
 
 void Fluid3D::save()
 {
 	isSaving = !isSaving;
 	count = 0;
+	// stopping writes the pending frames and prints the statistics
+	recorder.reset(isSaving ? new Df3Recorder(width, height, depth, DF3_BUFFERS, DF3_WRITERS,
+		DF3_DROP_FRAMES ? Df3Recorder::Policy::Drop : Df3Recorder::Policy::Block) : nullptr);
 }
 
 void Fluid3D::exportDf3()
 {
-	float* data = new float[volume];
-	queue.enqueueReadBuffer(density,CL_TRUE,0,volume*sizeof(float),data);
-	// data will be deleted by the thread
-	std::thread thread(&D3fWriter::exportdf3,"render"+std::to_string(count)+".df3",data, width,height, depth);
-	thread.detach();
+	float* data = recorder->acquire();
+	if (!data) {
+		return;
+	}
+	// the read is ordered before the next kernels, a writer waits for it
+	// (halves land in the first half of the buffer and the writer widens them)
+	cl::Event read;
+	queue.enqueueReadBuffer(density, CL_FALSE, 0, volume*fieldBytes(), data, nullptr, &read);
+	queue.flush();
+	profiler.record("exportDf3", read, volume*fieldBytes());
+	const bool half = storage_precision == StoragePrecision::Half;
+	const size_t cells = volume;
+	recorder->submit(data, "render" + std::to_string(count) + ".df3", [read, half, data, cells]() {
+		read.wait();
+		if (half) {
+			HalfFloat::widenInPlace(data, cells);
+		}
+	});
 	++count;
 }
 
+/** Fields of a 3D state file, the second buffers and the projection temporaries are the initial guesses of the next step */
+static const char* STATE_FIELDS[] = { "density", "density2", "velocity", "velocity2", "tmp_project", "tmp_project2" };
+
+/** Parameters saved with a 3D state, a state of other parameters is loaded with a warning */
+static StateFile::Info stateInfo(unsigned int width, unsigned int height, unsigned int depth, unsigned long long step)
+{
+	StateFile::Info info;
+	info.width = width;
+	info.height = height;
+	info.depth = depth;
+	info.step = step;
+	info.parameters[0] = VISCO;
+	info.parameters[1] = DIFF_DENSITY;
+	info.parameters[2] = (float)SOLVER_NB_ITERATIONS;
+	return info;
+}
+
+/** Open a state file and check that it matches the grid */
+static bool openState(StateFile::Mapping & state, const std::string & filename, const StateFile::Info & expected)
+{
+	if (!state.open(filename)) {
+		return false;
+	}
+	if (state.info().width != expected.width || state.info().height != expected.height || state.info().depth != expected.depth) {
+		std::cout << filename << ": state of a " << state.info().width << "x" << state.info().height << "x" << state.info().depth
+			<< " grid, the solver is " << expected.width << "x" << expected.height << "x" << expected.depth << std::endl;
+		return false;
+	}
+	if (std::memcmp(state.info().parameters, expected.parameters, sizeof(expected.parameters)) != 0) {
+		std::cout << "Warning: " << filename << " was saved with other fluid parameters" << std::endl;
+	}
+	return true;
+}
+
+/** Convert a velocity field from the layout of the device to the interleaved layout of the state files */
+static void velocityToAoS(const float* in, float* out, size_t volume, VelocityLayout layout)
+{
+	for (size_t i = 0; i < volume; ++i) {
+		for (size_t c = 0; c < 3; ++c) {
+			out[3 * i + c] = (layout == VelocityLayout::SoA) ? in[i + c*volume] : in[4 * i + c];
+		}
+	}
+}
+
+/** Convert an interleaved velocity field to the layout of the device */
+static void velocityFromAoS(const float* in, float* out, size_t volume, VelocityLayout layout)
+{
+	for (size_t i = 0; i < volume; ++i) {
+		for (size_t c = 0; c < 3; ++c) {
+			if (layout == VelocityLayout::SoA) {
+				out[i + c*volume] = in[3 * i + c];
+			} else {
+				out[4 * i + c] = in[3 * i + c];
+			}
+		}
+		if (layout == VelocityLayout::Float4) {
+			out[4 * i + 3] = 0.0f;
+		}
+	}
+}
+
+bool Fluid3D::saveState(const std::string & filename)
+{
+	flushSplats();
+	const cl::Buffer* buffers[] = { &density, &density2, &velocity, &velocity2, &tmp_project, &tmp_project2 };
+	const size_t sizes[] = { volume, volume, 3 * volume, 3 * volume, volume, volume };
+	vector<pair<string, size_t>> fields;
+	for (int i = 0; i < 6; ++i) {
+		fields.push_back({ STATE_FIELDS[i], sizes[i] * sizeof(float) });
+	}
+	StateFile::Writer writer(stateInfo(width, height, depth, step), fields);
+	// the state files hold floats and interleaved velocities: the velocity of the other layouts
+	// goes through a staging copy, the halves through a second one
+	const bool convert = velocity_layout != VelocityLayout::AoS;
+	vector<float> staging[2];
+	vector<uint16_t> halves[6];
+	for (int i = 0; i < 6; ++i) {
+		const bool is_velocity = i == 2 || i == 3;
+		if (convert && is_velocity) {
+			vector<float> & copy = staging[i - 2];
+			copy.resize((size_t)volume*velocityFloats());
+			readField(*buffers[i], copy.size(), copy.data(), halves[i]);
+		} else {
+			readField(*buffers[i], sizes[i], static_cast<float*>(writer.field(i)), halves[i]);
+		}
+	}
+	queue.finish();
+	for (int i = 0; i < 6; ++i) {
+		const bool is_velocity = i == 2 || i == 3;
+		widenField((convert && is_velocity) ? staging[i - 2].data() : static_cast<float*>(writer.field(i)), halves[i]);
+	}
+	if (convert) {
+		velocityToAoS(staging[0].data(), static_cast<float*>(writer.field(2)), volume, velocity_layout);
+		velocityToAoS(staging[1].data(), static_cast<float*>(writer.field(3)), volume, velocity_layout);
+	}
+	return writer.write(filename);
+}
+
+bool Fluid3D::loadState(const std::string & filename)
+{
+	splats.clear();
+	const auto start = chrono::steady_clock::now();
+	StateFile::Mapping state;
+	if (!openState(state, filename, stateInfo(width, height, depth, 0))) {
+		return false;
+	}
+	cl::Buffer* buffers[] = { &density, &density2, &velocity, &velocity2, &tmp_project, &tmp_project2 };
+	const size_t sizes[] = { volume, volume, 3 * volume, 3 * volume, volume, volume };
+	const void* data[6];
+	for (int i = 0; i < 6; ++i) {
+		data[i] = state.field(STATE_FIELDS[i], sizes[i] * sizeof(float));
+		if (!data[i]) {
+			return false;
+		}
+	}
+	// one upload per field straight from the mapped file, it must stay mapped until they complete
+	// (the velocity of the other layouts goes through a staging copy, the halves through a second one)
+	vector<float> staging[2];
+	vector<uint16_t> halves[6];
+	for (int i = 0; i < 6; ++i) {
+		const bool is_velocity = i == 2 || i == 3;
+		if (velocity_layout != VelocityLayout::AoS && is_velocity) {
+			vector<float> & copy = staging[i - 2];
+			copy.resize((size_t)volume*velocityFloats());
+			velocityFromAoS(static_cast<const float*>(data[i]), copy.data(), volume, velocity_layout);
+			writeField(*buffers[i], copy.size(), copy.data(), halves[i]);
+		} else {
+			writeField(*buffers[i], sizes[i], static_cast<const float*>(data[i]), halves[i]);
+		}
+	}
+	// the loaded fields may cover any brick
+	activateAllBricks();
+	queue.finish();
+	step = state.info().step;
+	cout << "State loaded (step " << step << ") in "
+		<< chrono::duration<double, milli>(chrono::steady_clock::now() - start).count() << " ms" << endl;
+	return true;
+}
+
+unsigned long long Fluid3D::getStep() const
+{
+	return step;
+}
+
 void Fluid3D::reset()
 {
+	splats.clear();
 
 	{
 		cl::Buffer* data[] = { &density, &density2 };
 		for (auto & buffer : data) {
 			kernel_reset_buffer.setArg(0, *buffer);
-			queue.enqueueNDRangeKernel(kernel_reset_buffer,origin_work, region_work, cl::NullRange);
+			profiler.enqueueKernel(queue, kernel_reset_buffer,origin_work, region_work, cl::NullRange);
 		}
 	}
 	{
 		cl::Buffer* data[] = { &velocity, &velocity2 };
 		for (auto & buffer : data) {
 			kernel_reset_buffer3D.setArg(0, *buffer);
-			queue.enqueueNDRangeKernel(kernel_reset_buffer3D, origin_work, region_work, cl::NullRange);
+			profiler.enqueueKernel(queue, kernel_reset_buffer3D, origin_work, region_work, cl::NullRange);
 		}
 	}
+	// every brick starts active, the empty ones retire at the next update
+	activateAllBricks();
 	count = 0;
+	step = 0;
+}
+
+KernelProfiler & Fluid3D::getProfiler()
+{
+	return profiler;
+}
+
+WorkGroupTuner & Fluid3D::getTuner()
+{
+	return tuner;
+}
+
+void Fluid3D::tuneWorkGroups(unsigned int steps)
+{
+	cout << "Tuning the work-group sizes of the " << width << "x" << height << "x" << depth << " grid" << endl;
+	// the candidates run the kernels on the live fields many times: the state is saved first and restored after
+	// (in the layout of the device, no conversion)
+	flushSplats();
+	cl::Buffer* buffers[] = { &density, &density2, &velocity, &velocity2, &tmp_project, &tmp_project2 };
+	const size_t sizes[] = { volume, volume, (size_t)volume*velocityFloats(), (size_t)volume*velocityFloats(), volume, volume };
+	vector<float> saved[6];
+	vector<uint16_t> halves[6];
+	for (int i = 0; i < 6; ++i) {
+		saved[i].resize(sizes[i]);
+		readField(*buffers[i], sizes[i], saved[i].data(), halves[i]);
+	}
+	queue.finish();
+	for (int i = 0; i < 6; ++i) {
+		widenField(saved[i].data(), halves[i]);
+	}
+	const unsigned long long saved_step = step;
+	const int saved_count = count;
+
+	tuneLaunches(steps);
+
+	// the velocity layouts: the same updates from empty fields on a solver of each other layout (one at a time,
+	// its launches tuned first), the fastest is the layout of the next initializations which do not select one
+	auto time_updates = [steps](Fluid3D & solver) {
+		solver.reset();
+		solver.queue.finish();
+		const auto start = chrono::steady_clock::now();
+		solver.sourceUpdates(steps);
+		solver.queue.finish();
+		return chrono::duration<double, milli>(chrono::steady_clock::now() - start).count() / max(steps, 1u);
+	};
+	int best = (int)velocity_layout;
+	double best_ms = time_updates(*this);
+	vector<pair<int, double>> timings = { { best, best_ms } };
+	for (int layout = 0; layout < 3; ++layout) {
+		if (layout == (int)velocity_layout) {
+			continue;
+		}
+		Fluid3D other(context, device, width, height, depth);
+		other.setVelocityLayout((VelocityLayout)layout);
+		other.setStoragePrecision(storage_precision);
+		other.setSparseBricks(sparse);
+		other.setPressureSolver(pressure_solver, multigrid);
+		other.setRelaxation(relaxation);
+		other.setAdvectionScheme(advection_scheme);
+		other.setPreview(preview_mode, preview_camera);
+		if (!other.initialization()) {
+			continue;
+		}
+		other.tuneLaunches(steps);
+		const double ms = time_updates(other);
+		timings.push_back({ layout, ms });
+		if (ms < best_ms) {
+			best = layout;
+			best_ms = ms;
+		}
+	}
+	const char* names[] = { "aos", "soa", "float4" };
+	cout << "  " << layoutChoice() << ":";
+	for (auto & timing : timings) {
+		cout << " " << names[timing.first] << " " << timing.second << " ms";
+	}
+	cout << ", " << names[best] << " kept" << endl;
+	// the other solvers wrote their launches in the tuning file
+	tuner.load(device);
+	tuner.setChoice(layoutChoice(), region_work, best, best_ms);
+	tuner.save();
+
+	for (int i = 0; i < 6; ++i) {
+		writeField(*buffers[i], sizes[i], saved[i].data(), halves[i]);
+	}
+	// the restored fields may cover any brick, and "image" shows them again
+	activateAllBricks();
+	cl::Kernel & draw = drawKernel();
+	draw.setArg(1, image);
+	profiler.enqueueKernel(queue, draw, origin_work2d, region_work2d, cl::NullRange);
+	queue.finish();
+	step = saved_step;
+	count = saved_count;
+}
+
+void Fluid3D::sourceUpdates(unsigned int steps)
+{
+	const int radius = max(2, (int)width / 20);
+	for (unsigned int i = 0; i < steps; ++i) {
+		// a source on every step, so the launches of an interaction are tuned too
+		addPressure(width / 2, height / 2, radius, 1.0f);
+		addVelocity(width / 2, height / 2, 1, -1, 0.01f, radius);
+		update(SIMULATION_DT);
+	}
+}
+
+void Fluid3D::tuneLaunches(unsigned int steps)
+{
+	tuner.setTuning(true);
+	sourceUpdates(steps);
+	// the display kernel is tuned on "image" (the launch of latestImage), the readback slots keep their frames
+	cl::Kernel & draw = drawKernel();
+	draw.setArg(1, image);
+	profiler.enqueueKernel(queue, draw, origin_work2d, region_work2d, cl::NullRange);
+	queue.finish();
+	tuner.setTuning(false);
+	tuner.save();
+}
+
+std::string Fluid3D::layoutChoice() const
+{
+	return (storage_precision == StoragePrecision::Half) ? "velocityLayoutHalf" : "velocityLayout";
 }
 
 unsigned int Fluid3D::getWidth() const
@@ -2,29 +2,96 @@
 #define FLUID3D_H
 
 #include <fstream>
+#include <memory>
+#ifndef __CL_ENABLE_EXCEPTIONS
 #define __CL_ENABLE_EXCEPTIONS
+#endif
 #include <CL/cl.hpp>
 
-class Fluid3D
+#include "AdvectionScheme.hpp"
+#include "Df3Recorder.hpp"
+#include "Fluid3DBase.h"
+#include "FrameReadback.hpp"
+#include "HalfFloat.hpp"
+#include "KernelProfiler.hpp"
+#include "PressureSolver.hpp"
+#include "SplatBatch.hpp"
+#include "VolumePreview.hpp"
+#include "WorkGroupTuner.hpp"
+
+/** Memory layout of the velocity buffers on the device
+* AoS: x,y,z interleaved (the layout of the state files and of the CPU engine), SoA: three planes,
+* Float4: x,y,z,0 (aligned vector loads, 33% more memory) */
+enum class VelocityLayout { AoS, SoA, Float4 };
+
+/** OpenCL implementation of the 3D solver */
+class Fluid3D : public Fluid3DBase
 {
 public:
 	Fluid3D(cl::Context ctx, cl::Device dev);
 	Fluid3D(cl::Context context, cl::Device device, unsigned int width, unsigned int height, unsigned int depth);
 	virtual ~Fluid3D();
 	void setSize(unsigned int width, unsigned int height, unsigned int depth);
-	/** Return true if complete sucess */
-	bool initialization();
-	void update(float dt);
-	void updateImage();
-	void setDataImage(cl_uint8 * img);
-	unsigned int getWidth() const;
-	unsigned int getHeight() const;
-	unsigned int getDepth() const;
-	void reset();
-	void save();
-	void addPressure(int posx, int posy, int radius, float pressure);
-	void addVelocity(int posx, int posy, int deltax, int deltay, float intensity, int radius);
-	
+	bool initialization() override;
+	void update(float dt) override;
+	void updateImage() override;
+	const uint8_t* latestImage() override;
+	void setDataImage(uint8_t * img) override;
+	unsigned int getWidth() const override;
+	unsigned int getHeight() const override;
+	unsigned int getDepth() const override;
+	void reset() override;
+	void finish() override;
+	void save() override;
+	void addPressure(int posx, int posy, int radius, float pressure) override;
+	void addVelocity(int posx, int posy, int deltax, int deltay, float intensity, int radius) override;
+	/** Queue a disc of density and/or velocity (dx, dy), applied with the other splats at the next update:
+	* falloff 0 adds the same amount everywhere, else the amount is scaled by (1 - d^2/reach^2)^falloff */
+	void addSplat(int posx, int posy, int radius, float amount, float dx, float dy, float falloff = 0.0f);
+	void readDensity(std::vector<float> & out) override;
+	bool saveState(const std::string & filename) override;
+	bool loadState(const std::string & filename) override;
+	unsigned long long getStep() const override;
+	/** Device timings of the enqueued commands, enable it before initialization */
+	KernelProfiler & getProfiler();
+	/** Local sizes of the launches, loaded from the tuning file of the device by initialization */
+	WorkGroupTuner & getTuner();
+	/** After initialization: time the local sizes of every launch of "steps" updates and of the image, then
+	* the updates of each velocity layout (the next initializations take the fastest unless one is selected),
+	* write the tuning file of the device and restore the fields */
+	void tuneWorkGroups(unsigned int steps);
+	/** Select the layout of the velocity (the one timed by tuneWorkGroups if any, else AoS), before initialization:
+	* the kernels are specialized for it */
+	void setVelocityLayout(VelocityLayout layout);
+	VelocityLayout getVelocityLayout() const;
+	/** Precision of the field buffers (float by default), before initialization: halves (vload_half/vstore_half)
+	* halve the memory and the traffic of every kernel, the arithmetic stays in float */
+	void setStoragePrecision(StoragePrecision precision);
+	StoragePrecision getStoragePrecision() const;
+	/** Track the bricks of SPARSE_BRICK_SIZE^3 cells holding density or velocity (off by default), before initialization:
+	* the main kernels only run on the active bricks, so the work and the memory traffic follow the occupied volume */
+	void setSparseBricks(bool enabled);
+	/** Active bricks and number of bricks, blocking */
+	unsigned int countActiveBricks();
+	unsigned int getNbBricks() const;
+	/** Select the solver of the pressure equation (Jacobi by default) */
+	void setPressureSolver(PressureSolver solver, const MultigridSettings & settings = MultigridSettings());
+	/** Multigrid V-cycles done by the last update (both projections) */
+	unsigned int getPressureCycles() const;
+	/** Relative residual |r|/|b| reached by the last multigrid solve */
+	float getPressureResidual() const;
+	/** Stop the diffusions and the Jacobi pressure solves on their residual (off by default) */
+	void setRelaxation(const RelaxationSettings & settings);
+	/** Sweeps of the solves of the latest update whose counts reached the host: with the relaxation
+	* they are read back without waiting, so they may lag the updates by a step */
+	SolverIterations getSolverIterations();
+	/** Select the advection scheme (semi-Lagrangian by default); MacCormack and BFECC allocate two scalar
+	* and two velocity buffers on first use and run three launches per advected field */
+	void setAdvectionScheme(AdvectionScheme scheme);
+	AdvectionScheme getAdvectionScheme() const;
+	/** Select the image of updateImage / latestImage (the slice by default) and the camera of the volume preview */
+	void setPreview(PreviewMode mode, const PreviewCamera & camera = PreviewCamera());
+	PreviewMode getPreviewMode() const;
 
 private:
 	void diffuseDensity(float a, float div);
@@ -35,7 +102,53 @@ private:
 	void advectDensity();
 	void project1();
 	void project();
+	/** Buffers and kernels of the higher order advections */
+	void advectionInit();
+	/** Kernel drawing the image of the preview mode, its camera set */
+	cl::Kernel & drawKernel();
+	/** Red-black SOR sweeps ("sor" and "residual" kernels of a scalar or a velocity field) on the inner cells
+	* until the residual reaches the tolerance, "slot" is the state of the solve */
+	void relax(cl::Kernel & sor, cl::Kernel & residual, const cl::Buffer & p, const cl::Buffer & b, float a, float div, int slot);
+	/** Copy the counts of a finished read of relax_state in solver_iterations, then start a new read if "start" */
+	void pollIterations(bool start);
+	/** Solve the pressure equation: tmp_project2 from the divergence in tmp_project */
+	void solvePressure();
+	void multigridInit();
+	void multigridSmooth(size_t level, unsigned int sweeps);
+	void multigridResidual(size_t level);
+	void vcycle(size_t level);
+	/** Sum of the squares of a buffer of the size of a level, blocking */
+	float sumSquares(const cl::Buffer & buffer, size_t level);
 	void exportDf3();
+	/** "steps" updates with a source in the middle of the grid */
+	void sourceUpdates(unsigned int steps);
+	/** Tuning mode during "steps" updates and a drawing of the image, then write the tuning file */
+	void tuneLaunches(unsigned int steps);
+	/** Name of the choice of the velocity layout in the tuning file, per precision */
+	std::string layoutChoice() const;
+	/** Retire the empty bricks, activate their neighbours and list the active bricks, at the beginning of an update */
+	void updateBricks();
+	/** Launch a main kernel over the inner cells, or over the cells of the listed bricks (sparse bricks): the active
+	* ones, or for the pressure solve the active ones and their halo */
+	void enqueueCells(cl::Kernel & kernel, bool pressure = false);
+	/** Launch a sparse kernel in 1D over the cells of "listed" bricks of its list */
+	void enqueueListed(cl::Kernel & kernel, unsigned int listed);
+	/** Apply the queued splats by a single launch over their bounding box and activate its bricks */
+	void flushSplats();
+	/** Activate the bricks of the cells [x0, x0 + size_x[ x ... (a source) */
+	void activateBricks(int x0, int y0, int z0, int size_x, int size_y, int size_z);
+	/** Activate every brick and put it in the pressure solve, after the fields were written on the whole grid */
+	void activateAllBricks();
+	/** Values stored per cell by the velocity buffers */
+	unsigned int velocityFloats() const;
+	/** Bytes of a stored value */
+	size_t fieldBytes() const;
+	/** Enqueue the read of "count" values of a field buffer in "out", "staging" holds the halves
+	* to widen with widenField once the read completed */
+	void readField(const cl::Buffer & buffer, size_t count, float* out, std::vector<uint16_t> & staging, cl::Event* event = nullptr);
+	void widenField(float* out, const std::vector<uint16_t> & staging) const;
+	/** Enqueue the upload of "count" values, "in" (or "staging" for the halves) must stay valid until it completes */
+	void writeField(cl::Buffer & buffer, size_t count, const float* in, std::vector<uint16_t> & staging);
 
 	unsigned int width;
 	unsigned int height;
@@ -50,6 +163,10 @@ private:
 	cl::Context context;
 	cl::CommandQueue queue;
 	cl::Program program;
+	KernelProfiler profiler;
+	FrameReadback readback;// staging images of latestImage
+	SplatBatch splats;// sources added since the last update
+	WorkGroupTuner tuner;
 	// region work
 	cl::size_t<3> origin;
 	cl::size_t<3> region;
@@ -68,17 +185,43 @@ private:
 	cl::Kernel kernel_diffuse_v;
 	cl::Kernel kernel_advect_density;
 	cl::Kernel kernel_advect_velocity;
+	cl::Kernel kernel_advect_ahead;// higher order advections: forward, back and correction passes
+	cl::Kernel kernel_advect_back;
+	cl::Kernel kernel_advect_correct;
+	cl::Kernel kernel_advect_ahead3D;
+	cl::Kernel kernel_advect_back3D;
+	cl::Kernel kernel_advect_correct3D;
 	cl::Kernel kernel_project1;
 	cl::Kernel kernel_project2;
 	cl::Kernel kernel_project1bis;
 	cl::Kernel kernel_project2bis;
 	cl::Kernel kernel_reset_buffer;
 	cl::Kernel kernel_reset_buffer3D;
-	cl::Kernel kernel_addsource;
-	cl::Kernel kernel_addsource3D;
+	cl::Kernel kernel_splat;
 	cl::Kernel kernel_draw_img;
+	cl::Kernel kernel_raymarch;
+	cl::Kernel kernel_mg_smooth;
+	cl::Kernel kernel_mg_residual;
+	cl::Kernel kernel_mg_restrict;
+	cl::Kernel kernel_mg_prolongate;
+	cl::Kernel kernel_sum_squares;
+	cl::Kernel kernel_relax_reset;
+	cl::Kernel kernel_relax_sor;
+	cl::Kernel kernel_relax_sor3D;
+	cl::Kernel kernel_relax_residual;
+	cl::Kernel kernel_relax_residual3D;
+	cl::Kernel kernel_relax_check;
+	cl::Kernel kernel_brick_occupancy;
+	cl::Kernel kernel_brick_dilate;
+	cl::Kernel kernel_brick_clear;
+	cl::Kernel kernel_brick_activate;
+	cl::Kernel kernel_brick_list;
+	cl::Kernel kernel_brick_halo;
+	cl::Kernel kernel_brick_list_pressure;
+	cl::Kernel kernel_brick_list_retired;
+	cl::Kernel kernel_reset_bricks;
 	// gpu memory structures
-	cl_uint8* data_image;// pointer on the sfml image memory
+	uint8_t* data_image;// pointer on the sfml image memory
 	cl::Image2D image;
 	cl::Buffer  density;
 	cl::Buffer  density2;
@@ -86,7 +229,60 @@ private:
 	cl::Buffer velocity2;
 	cl::Buffer tmp_project;
 	cl::Buffer tmp_project2;
+	// passes of the higher order advections, their edges stay at 0 like the edges of the fields
+	AdvectionScheme advection_scheme = AdvectionScheme::SemiLagrangian;
+	cl::Buffer advect_ahead;
+	cl::Buffer advect_back;
+	cl::Buffer advect_ahead3D;
+	cl::Buffer advect_back3D;
+	PreviewMode preview_mode = PreviewMode::Slice;
+	PreviewCamera preview_camera;
+	// multigrid hierarchy, level 0 is (tmp_project2, tmp_project) on the full grid
+	struct MultigridLevel
+	{
+		unsigned int width, height, depth;
+		int fx, fy, fz;// coarsening factors from the finer level (1 or 2)
+		float wx, wy, wz;// weights of the operator
+		cl::Buffer p;// solution
+		cl::Buffer b;// right hand side
+		cl::Buffer r;// residual
+	};
+	std::vector<MultigridLevel> levels;
+	cl::Buffer buffer_sums;
+	std::vector<float> sums;
+	VelocityLayout velocity_layout = VelocityLayout::AoS;
+	bool velocity_layout_selected = false;// by setVelocityLayout, else the tuned one
+	StoragePrecision storage_precision = StoragePrecision::Float;
+	// sparse bricks, one flag per brick
+	bool sparse = false;
+	unsigned int bricks_x = 0, bricks_y = 0, bricks_z = 0;
+	cl::Buffer bricks;// active
+	cl::Buffer bricks_occupied;
+	cl::Buffer bricks_retired;
+	cl::Buffer brick_list;// count, then the indices of the active bricks
+	unsigned int listed_bricks = 0;// bricks covered by the 1D launches, the listed ones rounded up
+	cl::Buffer bricks_pressure;// active bricks and their halo, for the pressure solve
+	cl::Buffer brick_list_pressure;
+	unsigned int listed_pressure_bricks = 0;
+	cl::Buffer brick_list_retired;// bricks leaving the active set (flag bit 0) or the pressure solve (bit 1)
+	cl_int brick_counts[3] = { 0, 0, 0 };// read back from the three lists
+	PressureSolver pressure_solver = PressureSolver::Jacobi;
+	MultigridSettings multigrid;
+	unsigned int pressure_cycles = 0;
+	float pressure_residual = 0.0f;
+	// residual driven solves, one slot of relax_state (converged flag, sweeps) per solve of an update
+	enum RelaxSlot { RELAX_VELOCITY, RELAX_PRESSURE, RELAX_DENSITY = RELAX_PRESSURE + 2, RELAX_SLOTS };
+	RelaxationSettings relaxation;
+	cl::Buffer relax_state;
+	cl::Buffer relax_sums;// |r|^2 then |b|^2 of each (y,z) row
+	int relax_counts[2 * RELAX_SLOTS];// destination of the asynchronous read of relax_state
+	cl::Event relax_read;
+	bool relax_reading = false;
+	unsigned int pressure_solves = 0;// projections of the current update
+	SolverIterations solver_iterations;
 
+	std::unique_ptr<Df3Recorder> recorder;// alive while recording
+	unsigned long long step = 0;
 	int count = 0;
 	int t;
 	bool isSaving = false;
@@ -0,0 +1,46 @@
+#ifndef FLUID3D_BASE_H
+#define FLUID3D_BASE_H
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+/** Engines able to run the 3D simulation, selected at startup */
+enum class Backend3D { OpenCL, CPU, Cluster, OutOfCore };
+
+/** Interface of the 3D solver, implemented by the OpenCL solver (Fluid3D), by its multi-device
+* version (Fluid3DCluster), by its version streaming the grid from host memory (Fluid3DOutOfCore)
+* and by the native multithreaded engine (Fluid3DCPU) */
+class Fluid3DBase
+{
+public:
+	virtual ~Fluid3DBase() {}
+	/** Return true if complete sucess */
+	virtual bool initialization() = 0;
+	virtual void update(float dt) = 0;
+	virtual void updateImage() = 0;
+	/** Non-blocking display path: start drawing the current state and return the newest completed frame
+	* (width*height RGBA pixels), nullptr if no frame completed since the last call. Valid until the next call */
+	virtual const uint8_t* latestImage() = 0;
+	virtual void setDataImage(uint8_t * img) = 0;
+	virtual unsigned int getWidth() const = 0;
+	virtual unsigned int getHeight() const = 0;
+	virtual unsigned int getDepth() const = 0;
+	virtual void reset() = 0;
+	/** Block until every queued work is completed */
+	virtual void finish() = 0;
+	/** Start or stop the record of the density in .df3 files */
+	virtual void save() = 0;
+	virtual void addPressure(int posx, int posy, int radius, float pressure) = 0;
+	virtual void addVelocity(int posx, int posy, int deltax, int deltay, float intensity, int radius) = 0;
+	/** Copy the density field in "out" (width*height*depth floats, x first) */
+	virtual void readDensity(std::vector<float> & out) = 0;
+	/** Write every field needed to resume the simulation in "filename" (see StateFile.hpp) */
+	virtual bool saveState(const std::string & filename) = 0;
+	/** Resume a simulation written by saveState, false if the file does not match this grid */
+	virtual bool loadState(const std::string & filename) = 0;
+	/** Number of updates since the initialization, restored by loadState */
+	virtual unsigned long long getStep() const = 0;
+};
+
+#endif
@@ -0,0 +1,386 @@
+#include "Fluid3DCPU.h"
+
+#include "SimdStencil.hpp"
+#include "StateFile.hpp"
+#include "config.hpp"
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+#include <iostream>
+
+using namespace std;
+
+/** Fluid3D sets the time step of the advection kernels once to 0.02 */
+static constexpr float ADVECT_DT = 0.02f;
+
+/** Conversion of the kernel drawScreen: the uchar channels saturate like write_imageui */
+static inline uint8_t saturate(int value)
+{
+	return ((unsigned int)value > 255u) ? 255 : (uint8_t)value;
+}
+
+Fluid3DCPU::Fluid3DCPU(unsigned int w, unsigned int h, unsigned int d, unsigned int nb_threads) :
+	width(w), height(h), depth(d), pool(nb_threads), data_image(nullptr)
+{
+	volume = width*height*depth;
+
+	density_factor = DIFF_DENSITY*volume;
+}
+
+Fluid3DCPU::~Fluid3DCPU()
+{
+}
+
+bool Fluid3DCPU::initialization()
+{
+	Field* scalars[] = { &density, &density2, &tmp_project, &tmp_project2, &scratch };
+	for (auto field : scalars) {
+		field->assign(volume, 0.0f);
+	}
+	Field* vectors[] = { &velocity, &velocity2, &scratch3 };
+	for (auto field : vectors) {
+		field->assign(3 * (size_t)volume, 0.0f);
+	}
+	cout << "Using CPU engine: " << pool.size() << " threads, " << SimdStencil::instructionSet() << endl;
+	return true;
+}
+
+template<typename F>
+void Fluid3DCPU::forEachRow(const F & fn)
+{
+	const int inner_height = height - 2;
+	const int wh = width*height;
+	pool.parallelFor(0, inner_height*(depth - 2), [&](int row_begin, int row_end) {
+		for (int row = row_begin; row < row_end; ++row) {
+			const int y = 1 + row % inner_height;
+			const int z = 1 + row / inner_height;
+			fn(1 + y*width + z*wh, y, z);
+		}
+	});
+}
+
+void Fluid3DCPU::update(float dtt)
+{
+	const float dt = (dtt < 0.02f) ? dtt : 0.02f;
+	const float a = dt*density_factor;
+	// velocity step ------------------
+	diffuse(velocity2, velocity, scratch3, 3, VISCO, VISCO_DIV);
+	project(velocity2);
+	advectVelocity();
+	project(velocity);
+	// density step -------------------
+	diffuse(density2, density, scratch, 1, a, 1 + 6.0f*a);
+	advectDensity();
+
+	++step;
+	if (isSaving) {
+		exportDf3();
+	}
+}
+
+void Fluid3DCPU::diffuse(Field & field, const Field & source, Field & second, unsigned int components, float a, float div)
+{
+	// the interleaved components are independent: the row is processed as components*(width-2) floats
+	const int c = components;
+	const int n = c*(width - 2);
+	const int sx = c, sy = c*width, sz = c*width*height;
+	for (unsigned int k = 0; k < SOLVER_NB_ITERATIONS; ++k) {
+		const Field & in = field;
+		forEachRow([&](int index, int, int) {
+			const int i = c*index;
+			SimdStencil::jacobi6(&second[i], &source[i], &in[i - sx], &in[i + sx], &in[i - sy], &in[i + sy],
+				&in[i - sz], &in[i + sz], n, a, div);
+		});
+		// the border cells are never written, they stay at zero in both buffers
+		field.swap(second);
+	}
+}
+
+void Fluid3DCPU::project(Field & field)
+{
+	const int wh = width*height;
+	const float hx = 1.0f / width;
+	const float hy = 1.0f / height;
+	const float hz = 1.0f / depth;
+	forEachRow([&](int index, int, int) {
+		for (int i = index; i < index + (int)width - 2; ++i) {
+			const float dr = field[3 * (i + 1)];
+			const float dl = field[3 * (i - 1)];
+			const float dd = field[3 * (i + width) + 1];
+			const float du = field[3 * (i - width) + 1];
+			const float dt = field[3 * (i + wh) + 2];
+			const float db = field[3 * (i - wh) + 2];
+			tmp_project[i] = -0.5f*(hx*(dr - dl) + hy*(dd - du) + hz*(dt - db));
+		}
+	});
+
+	fill(tmp_project2.begin(), tmp_project2.end(), 0.0f);
+	diffuse(tmp_project2, tmp_project, scratch, 1, 1.0f, 6.0f);
+
+	forEachRow([&](int index, int, int) {
+		for (int i = index; i < index + (int)width - 2; ++i) {
+			field[3 * i + 0] -= 0.5f*(tmp_project2[i + 1] - tmp_project2[i - 1]) * width;
+			field[3 * i + 1] -= 0.5f*(tmp_project2[i + width] - tmp_project2[i - width]) * height;
+			field[3 * i + 2] -= 0.5f*(tmp_project2[i + wh] - tmp_project2[i - wh]) * depth;
+		}
+	});
+}
+
+/** Trilinear sample of "field" (components interleaved) at the back traced position of the cell (x,y,z)
+* The position is kept one cell inside the grid: the kernels clamp it to [0.5, size+0.5]
+* and may read past the end of the buffer there. */
+template<int C>
+static inline void backtrace(const float* field, const float* velocity, int x, int y, int z,
+	int width, int height, int depth, float* out)
+{
+	const int wh = width*height;
+	const int index = x + y*width + z*wh;
+	const float px = min(max(x - ADVECT_DT*width*velocity[3 * index + 0], 0.5f), width - 1.5f);
+	const float py = min(max(y - ADVECT_DT*height*velocity[3 * index + 1], 0.5f), height - 1.5f);
+	const float pz = min(max(z - ADVECT_DT*depth*velocity[3 * index + 2], 0.5f), depth - 1.5f);
+	const int vx = (int)px, vy = (int)py, vz = (int)pz;
+	const float rx = px - vx, ry = py - vy, rz = pz - vz;
+	const float ox = 1.0f - rx, oy = 1.0f - ry, oz = 1.0f - rz;
+	const int i000 = vx + vy*width + vz*wh;
+	for (int c = 0; c < C; ++c) {
+		const float* f = field + c;
+		out[c] =
+			  ox*oy*oz*f[C*i000]
+			+ ox*ry*oz*f[C*(i000 + width)]
+			+ rx*oy*oz*f[C*(i000 + 1)]
+			+ rx*ry*oz*f[C*(i000 + 1 + width)]
+			+ ox*oy*rz*f[C*(i000 + wh)]
+			+ ox*ry*rz*f[C*(i000 + width + wh)]
+			+ rx*oy*rz*f[C*(i000 + 1 + wh)]
+			+ rx*ry*rz*f[C*(i000 + 1 + width + wh)];
+	}
+}
+
+void Fluid3DCPU::advectDensity()
+{
+	forEachRow([&](int index, int y, int z) {
+		for (int x = 1; x < (int)width - 1; ++x) {
+			backtrace<1>(density2.data(), velocity.data(), x, y, z, width, height, depth, &density[index + x - 1]);
+		}
+	});
+}
+
+void Fluid3DCPU::advectVelocity()
+{
+	forEachRow([&](int index, int y, int z) {
+		for (int x = 1; x < (int)width - 1; ++x) {
+			backtrace<3>(velocity2.data(), velocity2.data(), x, y, z, width, height, depth, &velocity[3 * (index + x - 1)]);
+		}
+	});
+}
+
+void Fluid3DCPU::addPressure(int x, int y, int radius, float pressure)
+{
+	// same region as the OpenCL launch, clipped to the grid
+	const int z = depth / 2;
+	const int bound_width  = (x + radius+1 < (int)width)  ? 2 * radius : (width-2)  - (x - radius);
+	const int bound_height = (y + radius+1 < (int)height) ? 2 * radius : (height-2) - (y - radius);
+	int bound_depth        = (z + radius+1 < (int)depth)  ? 2 * radius : (depth-2) - (z - radius);
+	bound_depth = (bound_depth+2 < (int)depth ) ? bound_depth : (int)depth-2;
+	const int bound_top  = (x - radius < 1) ? 1 : x - radius;
+	const int bound_left = (y - radius < 1) ? 1 : y - radius;
+	const int bound_up   = (z - radius < 1) ? 1 : z - radius;
+	const float r = (float)radius - 0.5f;
+	for (int k = bound_up; k < min(bound_up + bound_depth, (int)depth); ++k) {
+		for (int j = bound_left; j < min(bound_left + bound_height, (int)height); ++j) {
+			for (int i = bound_top; i < min(bound_top + bound_width, (int)width); ++i) {
+				const float dx = (float)i - x;
+				const float dy = (float)j - y;
+				if (dx*dx + dy*dy <= r*r) {
+					density[i + j*width + k*width*height] += pressure;
+				}
+			}
+		}
+	}
+}
+
+void Fluid3DCPU::addVelocity(int x, int y, int deltax, int deltay, float intensity, int radius)
+{
+	const int z = depth / 2;
+	const int bound_width  = (x + radius+1 < (int)width)  ? 2 * radius : (width-2)  - (x - radius);
+	const int bound_height = (y + radius+1 < (int)height) ? 2 * radius : (height-2) - (y - radius);
+	int bound_depth        = (z + radius+1 < (int)depth)  ? 2 * radius : (depth-2) - (z - radius);
+	bound_depth = (bound_depth+2 < (int)depth ) ? bound_depth : (int)depth-2;
+	const int bound_top  = (x - radius < 1) ? 1 : x - radius;
+	const int bound_left = (y - radius < 1) ? 1 : y - radius;
+	const int bound_up   = 1;
+	const float r = (float)radius - 0.5f;
+	for (int k = bound_up; k < min(bound_up + bound_depth, (int)depth); ++k) {
+		for (int j = bound_left; j < min(bound_left + bound_height, (int)height); ++j) {
+			for (int i = bound_top; i < min(bound_top + bound_width, (int)width); ++i) {
+				const float dx = (float)i - x;
+				const float dy = (float)j - y;
+				if (dx*dx + dy*dy <= r*r) {
+					const int index = i + j*width + k*width*height;
+					velocity[3 * index] += deltax*intensity;
+					velocity[3 * index + 1] += deltay*intensity;
+					velocity[3 * index + 2] = 0;
+				}
+			}
+		}
+	}
+}
+
+void Fluid3DCPU::setDataImage(uint8_t * img)
+{
+	data_image = img;
+}
+
+void Fluid3DCPU::updateImage()
+{
+	// slice z = 1 like drawScreen
+	const float* slice = density.data() + width*height;
+	pool.parallelFor(0, height, [&](int y_begin, int y_end) {
+		for (int y = y_begin; y < y_end; ++y) {
+			uint8_t* pixel = data_image + 4 * (size_t)y*width;
+			for (unsigned int x = 0; x < width; ++x, pixel += 4) {
+				const float v = slice[x + y*width];
+				pixel[0] = saturate((int)(v*200.0f));
+				pixel[1] = saturate((int)(v*56.0f));
+				pixel[2] = saturate((int)(v*10.f));
+				pixel[3] = 255;
+			}
+		}
+	});
+}
+
+const uint8_t* Fluid3DCPU::latestImage()
+{
+	// the fields are in host memory, the conversion is the only work
+	updateImage();
+	return data_image;
+}
+
+/** Same file as Fluid3D::saveState (the layout of the fields is the same) */
+static const char* STATE_FIELDS[] = { "density", "density2", "velocity", "velocity2", "tmp_project", "tmp_project2" };
+
+static StateFile::Info stateInfo(unsigned int width, unsigned int height, unsigned int depth, unsigned long long step)
+{
+	StateFile::Info info;
+	info.width = width;
+	info.height = height;
+	info.depth = depth;
+	info.step = step;
+	info.parameters[0] = VISCO;
+	info.parameters[1] = DIFF_DENSITY;
+	info.parameters[2] = (float)SOLVER_NB_ITERATIONS;
+	return info;
+}
+
+/** Open a state file and check that it matches the grid */
+static bool openState(StateFile::Mapping & state, const std::string & filename, const StateFile::Info & expected)
+{
+	if (!state.open(filename)) {
+		return false;
+	}
+	if (state.info().width != expected.width || state.info().height != expected.height || state.info().depth != expected.depth) {
+		std::cout << filename << ": state of a " << state.info().width << "x" << state.info().height << "x" << state.info().depth
+			<< " grid, the solver is " << expected.width << "x" << expected.height << "x" << expected.depth << std::endl;
+		return false;
+	}
+	if (std::memcmp(state.info().parameters, expected.parameters, sizeof(expected.parameters)) != 0) {
+		std::cout << "Warning: " << filename << " was saved with other fluid parameters" << std::endl;
+	}
+	return true;
+}
+
+bool Fluid3DCPU::saveState(const std::string & filename)
+{
+	const Field* state_fields[] = { &density, &density2, &velocity, &velocity2, &tmp_project, &tmp_project2 };
+	vector<pair<string, size_t>> fields;
+	for (int i = 0; i < 6; ++i) {
+		fields.push_back({ STATE_FIELDS[i], state_fields[i]->size() * sizeof(float) });
+	}
+	StateFile::Writer writer(stateInfo(width, height, depth, step), fields);
+	for (int i = 0; i < 6; ++i) {
+		copy(state_fields[i]->begin(), state_fields[i]->end(), static_cast<float*>(writer.field(i)));
+	}
+	return writer.write(filename);
+}
+
+bool Fluid3DCPU::loadState(const std::string & filename)
+{
+	const auto start = chrono::steady_clock::now();
+	StateFile::Mapping state;
+	if (!openState(state, filename, stateInfo(width, height, depth, 0))) {
+		return false;
+	}
+	Field* state_fields[] = { &density, &density2, &velocity, &velocity2, &tmp_project, &tmp_project2 };
+	const float* data[6];
+	for (int i = 0; i < 6; ++i) {
+		data[i] = static_cast<const float*>(state.field(STATE_FIELDS[i], state_fields[i]->size() * sizeof(float)));
+		if (!data[i]) {
+			return false;
+		}
+	}
+	for (int i = 0; i < 6; ++i) {
+		copy_n(data[i], state_fields[i]->size(), state_fields[i]->begin());
+	}
+	step = state.info().step;
+	cout << "State loaded (step " << step << ") in "
+		<< chrono::duration<double, milli>(chrono::steady_clock::now() - start).count() << " ms" << endl;
+	return true;
+}
+
+unsigned long long Fluid3DCPU::getStep() const
+{
+	return step;
+}
+
+void Fluid3DCPU::reset()
+{
+	Field* fields[] = { &density, &density2, &velocity, &velocity2 };
+	for (auto field : fields) {
+		fill(field->begin(), field->end(), 0.0f);
+	}
+	count = 0;
+	step = 0;
+}
+
+void Fluid3DCPU::finish()
+{
+	// every call is synchronous
+}
+
+void Fluid3DCPU::save()
+{
+	isSaving = !isSaving;
+	count = 0;
+	// stopping writes the pending frames and prints the statistics
+	recorder.reset(isSaving ? new Df3Recorder(width, height, depth, DF3_BUFFERS, DF3_WRITERS,
+		DF3_DROP_FRAMES ? Df3Recorder::Policy::Drop : Df3Recorder::Policy::Block) : nullptr);
+}
+
+void Fluid3DCPU::exportDf3()
+{
+	float* data = recorder->acquire();
+	if (!data) {
+		return;
+	}
+	copy(density.begin(), density.end(), data);
+	recorder->submit(data, "render" + std::to_string(count) + ".df3");
+	++count;
+}
+
+void Fluid3DCPU::readDensity(std::vector<float> & out)
+{
+	out = density;
+}
+
+unsigned int Fluid3DCPU::getWidth() const
+{
+	return width;
+}
+unsigned int Fluid3DCPU::getHeight() const
+{
+	return height;
+}
+unsigned int Fluid3DCPU::getDepth() const
+{
+	return depth;
+}
@@ -0,0 +1,72 @@
+#ifndef FLUID3D_CPU_H
+#define FLUID3D_CPU_H
+
+#include <memory>
+#include <vector>
+
+#include "Df3Recorder.hpp"
+#include "Fluid3DBase.h"
+#include "ThreadPool.hpp"
+
+/** Native implementation of the 3D solver for the machines without a usable OpenCL driver
+* It follows the kernels of core.cl step by step with the same buffer layout
+* (x first, velocity interleaved by 3). The (y,z) rows are split between the threads
+* of a pool and the stencils are vectorized (see SimdStencil.hpp). */
+class Fluid3DCPU : public Fluid3DBase
+{
+public:
+	/** nb_threads = 0 uses every hardware thread */
+	explicit Fluid3DCPU(unsigned int width, unsigned int height, unsigned int depth, unsigned int nb_threads = 0);
+	virtual ~Fluid3DCPU();
+	bool initialization() override;
+	void update(float dt) override;
+	void updateImage() override;
+	const uint8_t* latestImage() override;
+	void setDataImage(uint8_t * img) override;
+	unsigned int getWidth() const override;
+	unsigned int getHeight() const override;
+	unsigned int getDepth() const override;
+	void reset() override;
+	void finish() override;
+	void save() override;
+	void addPressure(int posx, int posy, int radius, float pressure) override;
+	void addVelocity(int posx, int posy, int deltax, int deltay, float intensity, int radius) override;
+	void readDensity(std::vector<float> & out) override;
+	bool saveState(const std::string & filename) override;
+	bool loadState(const std::string & filename) override;
+	unsigned long long getStep() const override;
+
+private:
+	typedef std::vector<float> Field;
+	/** Call fn(index of the first inner cell of the row, y, z) on every inner row, split between the threads */
+	template<typename F> void forEachRow(const F & fn);
+	void diffuse(Field & field, const Field & source, Field & scratch, unsigned int components, float a, float div);
+	void project(Field & field);
+	void advectDensity();
+	void advectVelocity();
+	void exportDf3();
+
+	unsigned int width;
+	unsigned int height;
+	unsigned int depth;
+	unsigned int volume;
+	float density_factor;
+
+	ThreadPool pool;
+	uint8_t* data_image;// pointer on the sfml image memory
+	Field density;
+	Field density2;
+	Field velocity;
+	Field velocity2;
+	Field tmp_project;
+	Field tmp_project2;
+	Field scratch;// second buffer of the Jacobi iterations on scalar fields
+	Field scratch3;// second buffer of the Jacobi iterations on velocity fields
+
+	std::unique_ptr<Df3Recorder> recorder;// alive while recording
+	unsigned long long step = 0;
+	int count = 0;
+	bool isSaving = false;
+};
+
+#endif
@@ -0,0 +1,571 @@
+#include "Fluid3DCluster.h"
+
+#include "PressureSolver.hpp"
+#include "ProgramCache.hpp"
+#include "StateFile.hpp"
+#ifdef FLUID_EMBEDDED_KERNELS
+#include "core_cl_3d.h"
+#define CORE_CL_SOURCE core_cl_3d, sizeof(core_cl_3d)
+#else
+#define CORE_CL_SOURCE nullptr, 0
+#endif
+#include "config.hpp"
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+#include <iostream>
+
+using namespace std;
+
+/** Layers exchanged with each neighbour */
+static const unsigned int GHOST = (CLUSTER_GHOST_LAYERS < 1) ? 1 : CLUSTER_GHOST_LAYERS;
+
+Fluid3DCluster::Fluid3DCluster(cl::Context ctx, const std::vector<cl::Device> & devices, unsigned int w, unsigned int h, unsigned int d) :
+	width(w), height(h), depth(d), context(ctx)
+{
+	volume = width*height*depth;
+	density_factor = DIFF_DENSITY*volume;
+	slabs.resize(devices.size());
+	for (size_t i = 0; i < devices.size(); ++i) {
+		slabs[i].device = devices[i];
+	}
+}
+
+Fluid3DCluster::~Fluid3DCluster()
+{
+	finish();
+}
+
+bool Fluid3DCluster::initialization()
+{
+	const unsigned int nb_slabs = (unsigned int)slabs.size();
+	// a slab must hold its edges on both sides and the layer 1 drawn on the screen must be in the first one
+	if (nb_slabs == 0 || depth / nb_slabs < max(2 * GHOST, 2u)) {
+		cout << "Cannot split a depth of " << depth << " in " << nb_slabs << " slabs of at least "
+			<< max(2 * GHOST, 2u) << " layers" << endl;
+		return false;
+	}
+	// load opencl source (embedded by CMake, else ../core.cl)
+	const string cl_string = ProgramCache::loadSource(CORE_CL_SOURCE, "../core.cl");
+	for (unsigned int i = 0; i < nb_slabs; ++i) {
+		Slab & slab = slabs[i];
+		slab.z_begin = i*depth / nb_slabs;
+		slab.z_end = (i + 1)*depth / nb_slabs;
+		slab.lower = i > 0;
+		slab.upper = i + 1 < nb_slabs;
+		slab.base = slab.z_begin - (slab.lower ? GHOST : 0);
+		slab.layers = slab.z_end + (slab.upper ? GHOST : 0) - slab.base;
+		if (!slabInit(slab, cl_string)) {
+			return false;
+		}
+		cout << "Slab " << i << ": layers " << slab.z_begin << " to " << slab.z_end - 1 << " on "
+			<< slab.device.getInfo<CL_DEVICE_NAME>() << endl;
+	}
+	image = cl::Image2D(context, CL_MEM_READ_WRITE, { CL_RGBA, CL_UNSIGNED_INT8 }, width, height, 0);
+
+	// nominal global memory traffic of a work item (reads + writes of floats)
+	profiler.setBytesPerItem("diffuse", 32);
+	profiler.setBytesPerItem("diffuse3D", 96);
+	profiler.setBytesPerItem("advect", 48);
+	profiler.setBytesPerItem("advect3D", 120);
+	profiler.setBytesPerItem("project1", 28);
+	profiler.setBytesPerItem("project2", 48);
+	profiler.setBytesPerItem("resetBuffer", 4);
+	profiler.setBytesPerItem("resetBuffer3D", 12);
+	profiler.setBytesPerItem("addSource", 8);
+	profiler.setBytesPerItem("addSource3D", 24);
+	profiler.setBytesPerItem("drawScreen", 8);
+
+	// reset all buffers to zero
+	reset();
+	return true;
+}
+
+bool Fluid3DCluster::slabInit(Slab & slab, const std::string & source)
+{
+	slab.queue = cl::CommandQueue(context, slab.device, profiler.queueProperties());
+	slab.transfer = cl::CommandQueue(context, slab.device, profiler.queueProperties());
+	// one program per device: the sub-devices of a device share the cache entry
+	if (!ProgramCache::build(context, slab.device, source, "-D RELAX_GROUP=" + to_string(RELAX_GROUP), slab.program)) {
+		return false;
+	}
+
+	const size_t local_volume = (size_t)width*height*slab.layers;
+	slab.density      = cl::Buffer(context, CL_MEM_READ_WRITE, local_volume * sizeof(float));
+	slab.density2     = cl::Buffer(context, CL_MEM_READ_WRITE, local_volume * sizeof(float));
+	slab.velocity     = cl::Buffer(context, CL_MEM_READ_WRITE, local_volume * 3 * sizeof(float));
+	slab.velocity2    = cl::Buffer(context, CL_MEM_READ_WRITE, local_volume * 3 * sizeof(float));
+	slab.tmp_project  = cl::Buffer(context, CL_MEM_READ_WRITE, local_volume * sizeof(float));
+	slab.tmp_project2 = cl::Buffer(context, CL_MEM_READ_WRITE, local_volume * sizeof(float));
+
+	// same arguments as Fluid3D, the physical scales use the global depth
+	const int z_offset = (int)slab.base;
+	const float z_limit = slab.layers - 1.001f;// the trilinear sample reads the layer above
+
+	slab.diffuse = cl::Kernel(slab.program, "diffuse");
+	slab.diffuse.setArg(0, slab.density2);
+	slab.diffuse.setArg(1, slab.density);
+	slab.diffuse.setArg(4, width);
+	slab.diffuse.setArg(5, height);
+	slab.diffuse.setArg(6, depth);
+
+	slab.diffuse_v = cl::Kernel(slab.program, "diffuse3D");
+	slab.diffuse_v.setArg(0, slab.velocity2);
+	slab.diffuse_v.setArg(1, slab.velocity);
+	slab.diffuse_v.setArg(2, VISCO);
+	slab.diffuse_v.setArg(3, VISCO_DIV);
+	slab.diffuse_v.setArg(4, width);
+	slab.diffuse_v.setArg(5, height);
+	slab.diffuse_v.setArg(6, depth);
+
+	slab.diffuse_tmp = cl::Kernel(slab.program, "diffuse");
+	slab.diffuse_tmp.setArg(0, slab.tmp_project2);
+	slab.diffuse_tmp.setArg(1, slab.tmp_project);
+	slab.diffuse_tmp.setArg(2, 1.0f);
+	slab.diffuse_tmp.setArg(3, 6.0f);
+	slab.diffuse_tmp.setArg(4, width);
+	slab.diffuse_tmp.setArg(5, height);
+	slab.diffuse_tmp.setArg(6, depth);
+
+	slab.advect_density = cl::Kernel(slab.program, "advect");
+	slab.advect_density.setArg(0, slab.density);
+	slab.advect_density.setArg(1, slab.density2);
+	slab.advect_density.setArg(2, slab.velocity);
+	slab.advect_density.setArg(3, width);
+	slab.advect_density.setArg(4, height);
+	slab.advect_density.setArg(5, depth);
+	slab.advect_density.setArg(6, 0.02f);
+	slab.advect_density.setArg(7, z_offset);
+	slab.advect_density.setArg(8, z_limit);
+
+	slab.advect_velocity = cl::Kernel(slab.program, "advect3D");
+	slab.advect_velocity.setArg(0, slab.velocity);
+	slab.advect_velocity.setArg(1, slab.velocity2);
+	slab.advect_velocity.setArg(2, width);
+	slab.advect_velocity.setArg(3, height);
+	slab.advect_velocity.setArg(4, depth);
+	slab.advect_velocity.setArg(5, 0.02f);
+	slab.advect_velocity.setArg(6, z_offset);
+	slab.advect_velocity.setArg(7, z_limit);
+
+	cl::Kernel* projections[] = { &slab.project1, &slab.project2, &slab.project1bis, &slab.project2bis };
+	const cl::Buffer* projected[] = { &slab.velocity2, &slab.velocity2, &slab.velocity, &slab.velocity };
+	for (int i = 0; i < 4; ++i) {
+		*projections[i] = cl::Kernel(slab.program, (i % 2 == 0) ? "project1" : "project2");
+		projections[i]->setArg(0, (i % 2 == 0) ? slab.tmp_project : slab.tmp_project2);
+		projections[i]->setArg(1, *projected[i]);
+		projections[i]->setArg(2, width);
+		projections[i]->setArg(3, height);
+		projections[i]->setArg(4, depth);
+	}
+
+	slab.reset_buffer = cl::Kernel(slab.program, "resetBuffer");
+	slab.reset_buffer.setArg(1, width);
+	slab.reset_buffer.setArg(2, height);
+
+	slab.reset_buffer3D = cl::Kernel(slab.program, "resetBuffer3D");
+	slab.reset_buffer3D.setArg(1, width);
+	slab.reset_buffer3D.setArg(2, height);
+
+	slab.addsource = cl::Kernel(slab.program, "addSource");
+	slab.addsource.setArg(0, slab.density);
+	slab.addsource.setArg(6, width);
+	slab.addsource.setArg(7, height);
+
+	slab.addsource3D = cl::Kernel(slab.program, "addSource3D");
+	slab.addsource3D.setArg(0, slab.velocity);
+	slab.addsource3D.setArg(7, width);
+	slab.addsource3D.setArg(8, height);
+
+	slab.draw_img = cl::Kernel(slab.program, "drawScreen");
+	slab.draw_img.setArg(0, slab.density);
+	slab.draw_img.setArg(2, width);
+	slab.draw_img.setArg(3, height);
+	return true;
+}
+
+size_t Fluid3DCluster::layerOffset(const Slab & slab, unsigned int z, unsigned int components) const
+{
+	return (size_t)(z - slab.base)*width*height*components * sizeof(float);
+}
+
+void Fluid3DCluster::run(Slab & slab, SlabKernel kernel, unsigned int z_first, unsigned int nb_layers, cl::Event* event)
+{
+	if (nb_layers == 0) {
+		return;
+	}
+	profiler.enqueueKernel(slab.queue, slab.*kernel, cl::NDRange(1, 1, z_first - slab.base), cl::NDRange(width - 2, height - 2, nb_layers),
+		cl::NullRange, slab.pending.empty() ? nullptr : &slab.pending, event);
+	// the queue is in order: the following commands are behind this one
+	slab.pending.clear();
+}
+
+void Fluid3DCluster::runAll(Slab & slab, SlabKernel kernel)
+{
+	profiler.enqueueKernel(slab.queue, slab.*kernel, cl::NDRange(0, 0, 0), cl::NDRange(width, height, slab.layers),
+		cl::NullRange, slab.pending.empty() ? nullptr : &slab.pending);
+	slab.pending.clear();
+}
+
+void Fluid3DCluster::sweep(SlabKernel kernel, SlabField field, unsigned int components, unsigned int iterations)
+{
+	vector<cl::Event> edges(slabs.size());
+	for (unsigned int k = 0; k < iterations; ++k) {
+		for (size_t i = 0; i < slabs.size(); ++i) {
+			Slab & slab = slabs[i];
+			unsigned int inner_begin = max(slab.z_begin, 1u);
+			unsigned int inner_end = min(slab.z_end, depth - 1);
+			if (field && slab.lower) {
+				run(slab, kernel, slab.z_begin, GHOST, &edges[i]);
+				inner_begin = slab.z_begin + GHOST;
+			}
+			if (field && slab.upper) {
+				run(slab, kernel, slab.z_end - GHOST, GHOST, &edges[i]);
+				inner_end = slab.z_end - GHOST;
+			}
+			run(slab, kernel, inner_begin, (inner_end > inner_begin) ? inner_end - inner_begin : 0);
+			slab.queue.flush();
+		}
+		if (field) {
+			exchange(field, components, edges);
+		}
+	}
+}
+
+void Fluid3DCluster::exchange(SlabField field, unsigned int components, const std::vector<cl::Event> & edges)
+{
+	// a copy waits for the edges of both slabs: the sender has computed the layers and the receiver
+	// has finished reading its ghost layers (the interior launches never read the ghost layers of the field they write)
+	const size_t bytes = (size_t)GHOST*width*height*components * sizeof(float);
+	for (size_t i = 0; i < slabs.size(); ++i) {
+		Slab & slab = slabs[i];
+		for (int side = 0; side < 2; ++side) {
+			if ((side == 0) ? !slab.lower : !slab.upper) {
+				continue;
+			}
+			const size_t j = (side == 0) ? i - 1 : i + 1;
+			Slab & neighbour = slabs[j];
+			const unsigned int z = (side == 0) ? slab.z_begin : slab.z_end - GHOST;
+			const vector<cl::Event> wait_list = { edges[i], edges[j] };
+			cl::Event copied;
+			slab.transfer.enqueueCopyBuffer(slab.*field, neighbour.*field, layerOffset(slab, z, components),
+				layerOffset(neighbour, z, components), bytes, &wait_list, &copied);
+			profiler.record("haloExchange", copied, bytes);
+			// the sender must not overwrite the layers nor the receiver read them before the end of the copy
+			slab.pending.push_back(copied);
+			neighbour.pending.push_back(copied);
+		}
+		slab.transfer.flush();
+	}
+}
+
+void Fluid3DCluster::update(float dtt)
+{
+	const float dt = (dtt < 0.02f) ? dtt : 0.02f;
+	const float a = dt*density_factor;
+	for (auto & slab : slabs) {
+		slab.diffuse.setArg(2, a);
+		slab.diffuse.setArg(3, 1 + 6.0f*a);
+	}
+	// velocity step ------------------
+	sweep(&Slab::diffuse_v, &Slab::velocity2, 3, SOLVER_NB_ITERATIONS);
+	sweep(&Slab::project1, nullptr, 1);// the divergence is only read at its own cell
+	solvePressure();
+	sweep(&Slab::project2, &Slab::velocity2, 3);
+	sweep(&Slab::advect_velocity, &Slab::velocity, 3);
+	sweep(&Slab::project1bis, nullptr, 1);
+	solvePressure();
+	sweep(&Slab::project2bis, &Slab::velocity, 3);
+	// density step -------------------
+	sweep(&Slab::diffuse, &Slab::density2, 1, SOLVER_NB_ITERATIONS);
+	sweep(&Slab::advect_density, &Slab::density, 1);
+
+	++step;
+	if (isSaving) {
+		exportDf3();
+	}
+}
+
+void Fluid3DCluster::solvePressure()
+{
+	for (auto & slab : slabs) {
+		slab.reset_buffer.setArg(0, slab.tmp_project2);
+		runAll(slab, &Slab::reset_buffer);
+	}
+	sweep(&Slab::diffuse_tmp, &Slab::tmp_project2, 1, SOLVER_NB_ITERATIONS);
+}
+
+void Fluid3DCluster::addSource(SlabKernel kernel, int x0, int y0, int z0, int size_x, int size_y, int size_z)
+{
+	if (size_x <= 0 || size_y <= 0) {
+		return;
+	}
+	for (auto & slab : slabs) {
+		// the ghost layers receive the source too, so they stay equal to the layers of the neighbour
+		const int first = max(z0, (int)slab.base);
+		const int last = min(z0 + size_z, (int)(slab.base + slab.layers));
+		if (last <= first) {
+			continue;
+		}
+		profiler.enqueueKernel(slab.queue, slab.*kernel, cl::NDRange(x0, y0, first - slab.base), cl::NDRange(size_x, size_y, last - first),
+			cl::NullRange, slab.pending.empty() ? nullptr : &slab.pending);
+		slab.pending.clear();
+	}
+}
+
+void Fluid3DCluster::addPressure(int x, int y, int radius, float pressure)
+{
+	const int z = depth / 2;
+	// same box as Fluid3D::addPressure
+	const int bound_width  = (x + radius + 1 < (int)width)  ? 2 * radius : (width - 2)  - (x - radius);
+	const int bound_height = (y + radius + 1 < (int)height) ? 2 * radius : (height - 2) - (y - radius);
+	int bound_depth        = (z + radius + 1 < (int)depth)  ? 2 * radius : (depth - 2)  - (z - radius);
+	bound_depth = (bound_depth + 2 < (int)depth) ? bound_depth : (int)depth - 2;
+	const int bound_top  = (x - radius < 1) ? 1 : x - radius;
+	const int bound_left = (y - radius < 1) ? 1 : y - radius;
+	const int bound_up   = (z - radius < 1) ? 1 : z - radius;
+	for (auto & slab : slabs) {
+		slab.addsource.setArg(1, x);
+		slab.addsource.setArg(2, y);
+		slab.addsource.setArg(3, z - (int)slab.base);
+		slab.addsource.setArg(4, pressure);
+		slab.addsource.setArg(5, (float)radius - 0.5f);
+	}
+	addSource(&Slab::addsource, bound_top, bound_left, bound_up, bound_width, bound_height, bound_depth);
+}
+
+void Fluid3DCluster::addVelocity(int x, int y, int deltax, int deltay, float intensity, int radius)
+{
+	const int z = depth / 2;
+	// same box as Fluid3D::addVelocity
+	const int bound_width  = (x + radius + 1 < (int)width)  ? 2 * radius : (width - 2)  - (x - radius);
+	const int bound_height = (y + radius + 1 < (int)height) ? 2 * radius : (height - 2) - (y - radius);
+	int bound_depth        = (z + radius + 1 < (int)depth)  ? 2 * radius : (depth - 2)  - (z - radius);
+	bound_depth = (bound_depth + 2 < (int)depth) ? bound_depth : (int)depth - 2;
+	const int bound_top  = (x - radius < 1) ? 1 : x - radius;
+	const int bound_left = (y - radius < 1) ? 1 : y - radius;
+	const int bound_up   = 1;
+	for (auto & slab : slabs) {
+		slab.addsource3D.setArg(1, x);
+		slab.addsource3D.setArg(2, y);
+		slab.addsource3D.setArg(3, z - (int)slab.base);
+		slab.addsource3D.setArg(4, deltax*intensity);
+		slab.addsource3D.setArg(5, deltay*intensity);
+		slab.addsource3D.setArg(6, (float)radius - 0.5f);
+	}
+	addSource(&Slab::addsource3D, bound_top, bound_left, bound_up, bound_width, bound_height, bound_depth);
+}
+
+void Fluid3DCluster::setDataImage(uint8_t * img)
+{
+	data_image = img;
+}
+
+void Fluid3DCluster::updateImage()
+{
+	Slab & slab = slabs[0];
+	slab.draw_img.setArg(1, image);
+	profiler.enqueueKernel(slab.queue, slab.draw_img, cl::NDRange(0, 0), cl::NDRange(width, height), cl::NullRange,
+		slab.pending.empty() ? nullptr : &slab.pending);
+	slab.pending.clear();
+	cl::size_t<3> origin, region;
+	origin[0] = 0; origin[1] = 0; origin[2] = 0;
+	region[0] = width; region[1] = height; region[2] = 1;
+	slab.queue.enqueueReadImage(image, CL_TRUE, origin, region, 0, 0, data_image, nullptr, profiler.event());
+	profiler.record("readImage", width*height * 4);
+}
+
+const uint8_t* Fluid3DCluster::latestImage()
+{
+	Slab & slab = slabs[0];
+	if (!readback.isInitialized()) {
+		readback.init(context, slab.device, width, height, READBACK_SLOTS);
+	}
+	vector<cl::Event> wait_list;
+	cl::Event drawn;
+	slab.draw_img.setArg(1, readback.nextTarget(wait_list));
+	wait_list.insert(wait_list.end(), slab.pending.begin(), slab.pending.end());
+	slab.pending.clear();
+	profiler.enqueueKernel(slab.queue, slab.draw_img, cl::NDRange(0, 0), cl::NDRange(width, height), cl::NullRange,
+		wait_list.empty() ? nullptr : &wait_list, &drawn);
+	readback.submit(slab.queue, drawn);
+	return readback.latest();
+}
+
+void Fluid3DCluster::readOwned(SlabField field, unsigned int components, float* out, std::vector<cl::Event> & events)
+{
+	for (auto & slab : slabs) {
+		const size_t layer = (size_t)width*height*components;
+		cl::Event read;
+		slab.queue.enqueueReadBuffer(slab.*field, CL_FALSE, layerOffset(slab, slab.z_begin, components),
+			(slab.z_end - slab.z_begin)*layer * sizeof(float), out + slab.z_begin*layer,
+			slab.pending.empty() ? nullptr : &slab.pending, &read);
+		slab.pending.clear();
+		slab.queue.flush();
+		events.push_back(read);
+	}
+}
+
+void Fluid3DCluster::readDensity(std::vector<float> & out)
+{
+	out.resize(volume);
+	vector<cl::Event> events;
+	readOwned(&Slab::density, 1, out.data(), events);
+	cl::Event::waitForEvents(events);
+}
+
+void Fluid3DCluster::finish()
+{
+	for (auto & slab : slabs) {
+		slab.queue.finish();
+		slab.transfer.finish();
+		slab.pending.clear();
+	}
+}
+
+void Fluid3DCluster::save()
+{
+	isSaving = !isSaving;
+	count = 0;
+	// stopping writes the pending frames and prints the statistics
+	recorder.reset(isSaving ? new Df3Recorder(width, height, depth, DF3_BUFFERS, DF3_WRITERS,
+		DF3_DROP_FRAMES ? Df3Recorder::Policy::Drop : Df3Recorder::Policy::Block) : nullptr);
+}
+
+void Fluid3DCluster::exportDf3()
+{
+	float* data = recorder->acquire();
+	if (!data) {
+		return;
+	}
+	// one read per slab, a writer waits for all of them
+	vector<cl::Event> reads;
+	readOwned(&Slab::density, 1, data, reads);
+	recorder->submit(data, "render" + std::to_string(count) + ".df3", [reads]() { cl::Event::waitForEvents(reads); });
+	++count;
+}
+
+/** Same file as Fluid3D::saveState, the slabs write their own layers */
+static const char* STATE_FIELDS[] = { "density", "density2", "velocity", "velocity2", "tmp_project", "tmp_project2" };
+
+static StateFile::Info stateInfo(unsigned int width, unsigned int height, unsigned int depth, unsigned long long step)
+{
+	StateFile::Info info;
+	info.width = width;
+	info.height = height;
+	info.depth = depth;
+	info.step = step;
+	info.parameters[0] = VISCO;
+	info.parameters[1] = DIFF_DENSITY;
+	info.parameters[2] = (float)SOLVER_NB_ITERATIONS;
+	return info;
+}
+
+/** Open a state file and check that it matches the grid */
+static bool openState(StateFile::Mapping & state, const std::string & filename, const StateFile::Info & expected)
+{
+	if (!state.open(filename)) {
+		return false;
+	}
+	if (state.info().width != expected.width || state.info().height != expected.height || state.info().depth != expected.depth) {
+		std::cout << filename << ": state of a " << state.info().width << "x" << state.info().height << "x" << state.info().depth
+			<< " grid, the solver is " << expected.width << "x" << expected.height << "x" << expected.depth << std::endl;
+		return false;
+	}
+	if (std::memcmp(state.info().parameters, expected.parameters, sizeof(expected.parameters)) != 0) {
+		std::cout << "Warning: " << filename << " was saved with other fluid parameters" << std::endl;
+	}
+	return true;
+}
+
+bool Fluid3DCluster::saveState(const std::string & filename)
+{
+	const SlabField buffers[] = { &Slab::density, &Slab::density2, &Slab::velocity, &Slab::velocity2, &Slab::tmp_project, &Slab::tmp_project2 };
+	const unsigned int components[] = { 1, 1, 3, 3, 1, 1 };
+	vector<pair<string, size_t>> fields;
+	for (int i = 0; i < 6; ++i) {
+		fields.push_back({ STATE_FIELDS[i], (size_t)volume*components[i] * sizeof(float) });
+	}
+	StateFile::Writer writer(stateInfo(width, height, depth, step), fields);
+	vector<cl::Event> reads;
+	for (int i = 0; i < 6; ++i) {
+		readOwned(buffers[i], components[i], static_cast<float*>(writer.field(i)), reads);
+	}
+	cl::Event::waitForEvents(reads);
+	return writer.write(filename);
+}
+
+bool Fluid3DCluster::loadState(const std::string & filename)
+{
+	const auto start = chrono::steady_clock::now();
+	StateFile::Mapping state;
+	if (!openState(state, filename, stateInfo(width, height, depth, 0))) {
+		return false;
+	}
+	const SlabField buffers[] = { &Slab::density, &Slab::density2, &Slab::velocity, &Slab::velocity2, &Slab::tmp_project, &Slab::tmp_project2 };
+	const unsigned int components[] = { 1, 1, 3, 3, 1, 1 };
+	const float* data[6];
+	for (int i = 0; i < 6; ++i) {
+		data[i] = static_cast<const float*>(state.field(STATE_FIELDS[i], (size_t)volume*components[i] * sizeof(float)));
+		if (!data[i]) {
+			return false;
+		}
+	}
+	// a slab and its ghost layers are contiguous layers of the file: one upload per field and slab
+	finish();
+	for (auto & slab : slabs) {
+		for (int i = 0; i < 6; ++i) {
+			const size_t layer = (size_t)width*height*components[i];
+			slab.queue.enqueueWriteBuffer(slab.*buffers[i], CL_FALSE, 0, slab.layers*layer * sizeof(float), data[i] + slab.base*layer);
+		}
+	}
+	finish();
+	step = state.info().step;
+	cout << "State loaded (step " << step << ") in "
+		<< chrono::duration<double, milli>(chrono::steady_clock::now() - start).count() << " ms" << endl;
+	return true;
+}
+
+unsigned long long Fluid3DCluster::getStep() const
+{
+	return step;
+}
+
+void Fluid3DCluster::reset()
+{
+	for (auto & slab : slabs) {
+		for (auto buffer : { &slab.density, &slab.density2, &slab.tmp_project, &slab.tmp_project2 }) {
+			slab.reset_buffer.setArg(0, *buffer);
+			runAll(slab, &Slab::reset_buffer);
+		}
+		for (auto buffer : { &slab.velocity, &slab.velocity2 }) {
+			slab.reset_buffer3D.setArg(0, *buffer);
+			runAll(slab, &Slab::reset_buffer3D);
+		}
+	}
+	count = 0;
+	step = 0;
+}
+
+KernelProfiler & Fluid3DCluster::getProfiler()
+{
+	return profiler;
+}
+
+unsigned int Fluid3DCluster::getNbSlabs() const
+{
+	return (unsigned int)slabs.size();
+}
+
+unsigned int Fluid3DCluster::getWidth() const
+{
+	return width;
+}
+unsigned int Fluid3DCluster::getHeight() const
+{
+	return height;
+}
+unsigned int Fluid3DCluster::getDepth() const
+{
+	return depth;
+}
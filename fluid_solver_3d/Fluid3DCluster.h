@@ -0,0 +1,121 @@
+#ifndef FLUID3D_CLUSTER_H
+#define FLUID3D_CLUSTER_H
+
+#include <memory>
+#include <vector>
+#ifndef __CL_ENABLE_EXCEPTIONS
+#define __CL_ENABLE_EXCEPTIONS
+#endif
+#include <CL/cl.hpp>
+
+#include "Df3Recorder.hpp"
+#include "Fluid3DBase.h"
+#include "FrameReadback.hpp"
+#include "KernelProfiler.hpp"
+
+/** OpenCL implementation of the 3D solver split across several devices of one context
+* The grid is cut in z-slabs, one per device (GPUs, CPU sub-devices...). A slab holds its layers
+* plus CLUSTER_GHOST_LAYERS copies of the layers of each neighbour, refreshed after every Jacobi
+* sweep, projection and advection: the layers next to a neighbour are computed first, copied on
+* a transfer queue while the interior of the slab is computed, and the next command of a slab
+* waits for the copies in and out of it. Same kernels and same scheme as Fluid3D, Jacobi pressure only. */
+class Fluid3DCluster : public Fluid3DBase
+{
+public:
+	Fluid3DCluster(cl::Context context, const std::vector<cl::Device> & devices, unsigned int width, unsigned int height, unsigned int depth);
+	virtual ~Fluid3DCluster();
+	bool initialization() override;
+	void update(float dt) override;
+	void updateImage() override;
+	const uint8_t* latestImage() override;
+	void setDataImage(uint8_t * img) override;
+	unsigned int getWidth() const override;
+	unsigned int getHeight() const override;
+	unsigned int getDepth() const override;
+	void reset() override;
+	void finish() override;
+	void save() override;
+	void addPressure(int posx, int posy, int radius, float pressure) override;
+	void addVelocity(int posx, int posy, int deltax, int deltay, float intensity, int radius) override;
+	void readDensity(std::vector<float> & out) override;
+	bool saveState(const std::string & filename) override;
+	bool loadState(const std::string & filename) override;
+	unsigned long long getStep() const override;
+	/** Device timings of the enqueued commands (halo copies included), enable it before initialization */
+	KernelProfiler & getProfiler();
+	unsigned int getNbSlabs() const;
+
+private:
+	/** Part of the grid computed by one device */
+	struct Slab
+	{
+		cl::Device device;
+		cl::CommandQueue queue;
+		cl::CommandQueue transfer;// halo copies from this slab
+		cl::Program program;
+		unsigned int z_begin, z_end;// layers owned, global z
+		unsigned int base;// global z of the local layer 0
+		unsigned int layers;// local layers, ghost layers included
+		bool lower, upper;// neighbours
+		std::vector<cl::Event> pending;// copies the next command of the queue must wait for
+		cl::Buffer density;
+		cl::Buffer density2;
+		cl::Buffer velocity;
+		cl::Buffer velocity2;
+		cl::Buffer tmp_project;
+		cl::Buffer tmp_project2;
+		cl::Kernel diffuse;
+		cl::Kernel diffuse_v;
+		cl::Kernel diffuse_tmp;
+		cl::Kernel advect_density;
+		cl::Kernel advect_velocity;
+		cl::Kernel project1;
+		cl::Kernel project2;
+		cl::Kernel project1bis;
+		cl::Kernel project2bis;
+		cl::Kernel reset_buffer;
+		cl::Kernel reset_buffer3D;
+		cl::Kernel addsource;
+		cl::Kernel addsource3D;
+		cl::Kernel draw_img;
+	};
+	typedef cl::Kernel Slab::*SlabKernel;
+	typedef cl::Buffer Slab::*SlabField;
+
+	bool slabInit(Slab & slab, const std::string & source);
+	/** Launch a kernel of a slab on the inner cells of the global layers [z_first, z_first + nb_layers[ */
+	void run(Slab & slab, SlabKernel kernel, unsigned int z_first, unsigned int nb_layers, cl::Event* event = nullptr);
+	/** Launch a kernel of a slab on its whole local buffer, ghost layers included */
+	void runAll(Slab & slab, SlabKernel kernel);
+	/** Launch "kernel" "iterations" times on every slab, each time refreshing the ghost layers of "field" */
+	void sweep(SlabKernel kernel, SlabField field, unsigned int components, unsigned int iterations = 1);
+	/** Copy the layers next to each neighbour to its ghost layers, "edges" are the events of the edge launches */
+	void exchange(SlabField field, unsigned int components, const std::vector<cl::Event> & edges);
+	/** Launch a source kernel on the cells of the global box present in every slab (ghost layers included) */
+	void addSource(SlabKernel kernel, int x0, int y0, int z0, int size_x, int size_y, int size_z);
+	/** Enqueue the reads of the layers owned by every slab in "out" (global layout), one event per slab */
+	void readOwned(SlabField field, unsigned int components, float* out, std::vector<cl::Event> & events);
+	void solvePressure();
+	void exportDf3();
+	size_t layerOffset(const Slab & slab, unsigned int z, unsigned int components) const;
+
+	unsigned int width;
+	unsigned int height;
+	unsigned int depth;
+	unsigned int volume;
+	float density_factor;
+
+	cl::Context context;
+	std::vector<Slab> slabs;
+	KernelProfiler profiler;
+	FrameReadback readback;// staging images of latestImage, drawn by the slab holding the layer 1
+	uint8_t* data_image = nullptr;// pointer on the sfml image memory
+	cl::Image2D image;
+
+	std::unique_ptr<Df3Recorder> recorder;// alive while recording
+	unsigned long long step = 0;
+	int count = 0;
+	bool isSaving = false;
+};
+
+#endif
@@ -0,0 +1,623 @@
+#include "Fluid3DOutOfCore.h"
+
+#include "PressureSolver.hpp"
+#include "ProgramCache.hpp"
+#include "StateFile.hpp"
+#ifdef FLUID_EMBEDDED_KERNELS
+#include "core_cl_3d.h"
+#define CORE_CL_SOURCE core_cl_3d, sizeof(core_cl_3d)
+#else
+#define CORE_CL_SOURCE nullptr, 0
+#endif
+#include "config.hpp"
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+#include <iostream>
+
+using namespace std;
+
+/** Halo loaded around a slab, and layers an advection reads beyond the cell it updates */
+static const unsigned int HALO = (OOC_HALO_LAYERS < 1) ? 1 : OOC_HALO_LAYERS;
+static const unsigned int ADVECT_REACH = (OOC_ADVECT_LAYERS < 1) ? 1 : (OOC_ADVECT_LAYERS > HALO) ? HALO : OOC_ADVECT_LAYERS;
+static const unsigned int NB_SLOTS = (OOC_SLOTS < 2) ? 2 : OOC_SLOTS;
+
+static unsigned int bit(unsigned int field)
+{
+	return 1u << field;
+}
+
+Fluid3DOutOfCore::Fluid3DOutOfCore(cl::Context ctx, cl::Device dev, unsigned int w, unsigned int h, unsigned int d, unsigned int layers) :
+	width(w), height(h), depth(d), slab_layers(layers), context(ctx), device(dev)
+{
+	volume = width*height*depth;
+	density_factor = DIFF_DENSITY*volume;
+	nb_slabs = 0;
+}
+
+Fluid3DOutOfCore::~Fluid3DOutOfCore()
+{
+	finish();
+	if (slots.empty()) {
+		return;
+	}
+	for (auto & field : host) {
+		if (field.pinned()) {
+			slots[0].queue.enqueueUnmapMemObject(field.pinned, field.data);
+		}
+	}
+	slots[0].queue.finish();
+}
+
+bool Fluid3DOutOfCore::initialization()
+{
+	// a slab only reads the halo of its direct neighbours
+	if (slab_layers < HALO || depth < 3) {
+		cout << "Cannot stream a depth of " << depth << " in slabs of " << slab_layers << " layers (at least "
+			<< HALO << ", the halo)" << endl;
+		return false;
+	}
+	nb_slabs = (depth + slab_layers - 1) / slab_layers;
+	// load opencl source (embedded by CMake, else ../core.cl)
+	const string cl_string = ProgramCache::loadSource(CORE_CL_SOURCE, "../core.cl");
+	if (!ProgramCache::build(context, device, cl_string, "-D RELAX_GROUP=" + to_string(RELAX_GROUP), program)) {
+		return false;
+	}
+	slots.resize(min(NB_SLOTS, nb_slabs));
+	for (auto & slot : slots) {
+		if (!slotInit(slot)) {
+			return false;
+		}
+	}
+
+	// the fields are mapped once for the lifetime of the solver, the transfers read and write the mapping
+	const size_t max_alloc = device.getInfo<CL_DEVICE_MAX_MEM_ALLOC_SIZE>();
+	bool pinned = true;
+	for (int f = 0; f < NB_FIELDS; ++f) {
+		HostField & field = host[f];
+		const size_t bytes = (size_t)volume*components((Field)f) * sizeof(float);
+		if (bytes <= max_alloc) {
+			try {
+				field.pinned = cl::Buffer(context, CL_MEM_READ_WRITE | CL_MEM_ALLOC_HOST_PTR, bytes);
+				field.data = static_cast<float*>(slots[0].queue.enqueueMapBuffer(field.pinned, CL_TRUE,
+					CL_MAP_READ | CL_MAP_WRITE, 0, bytes));
+			} catch (cl::Error &) {
+				field.pinned = cl::Buffer();
+				field.data = nullptr;
+			}
+		}
+		if (!field.data) {
+			// pageable memory: the driver copies the transfers through its own staging buffers
+			field.fallback.resize(bytes / sizeof(float));
+			field.data = field.fallback.data();
+			pinned = false;
+		}
+	}
+
+	// an update in the order of Fluid3D::update, the masks tell which fields a stage streams
+	const unsigned int n = SOLVER_NB_ITERATIONS;
+	// velocity step ------------------
+	for (unsigned int k = 0; k < n; ++k) {
+		addPass(&Slot::diffuse_v, 1, bit(Velocity) | bit(Velocity2), bit(Velocity2));
+	}
+	addPass(&Slot::project1, 1, bit(Velocity2), bit(Pressure));
+	addPass(&Slot::reset_pressure, 0, 0, bit(Pressure2), true);
+	for (unsigned int k = 0; k < n; ++k) {
+		addPass(&Slot::diffuse_tmp, 1, bit(Pressure) | bit(Pressure2), bit(Pressure2));
+	}
+	addPass(&Slot::project2, 1, bit(Pressure2) | bit(Velocity2), bit(Velocity2));
+	addPass(&Slot::advect_velocity, ADVECT_REACH, bit(Velocity2), bit(Velocity));
+	addPass(&Slot::project1bis, 1, bit(Velocity), bit(Pressure));
+	addPass(&Slot::reset_pressure, 0, 0, bit(Pressure2), true);
+	for (unsigned int k = 0; k < n; ++k) {
+		addPass(&Slot::diffuse_tmp, 1, bit(Pressure) | bit(Pressure2), bit(Pressure2));
+	}
+	addPass(&Slot::project2bis, 1, bit(Pressure2) | bit(Velocity), bit(Velocity));
+	// density step -------------------
+	for (unsigned int k = 0; k < n; ++k) {
+		addPass(&Slot::diffuse, 1, bit(Density) | bit(Density2), bit(Density2));
+	}
+	addPass(&Slot::advect_density, ADVECT_REACH, bit(Density2) | bit(Velocity), bit(Density));
+	planStages();
+	uploaded.resize(nb_slabs);
+	downloaded.resize(nb_slabs);
+
+	const size_t slot_layers = min(depth, slab_layers + 2 * HALO);
+	cout << "Out-of-core: " << nb_slabs << " slabs of " << slab_layers << " layers, " << stages.size()
+		<< " stages per update, " << slots.size() * slot_layers*width*height * 10 * sizeof(float) / (1024 * 1024)
+		<< " MB on the device, " << (pinned ? "pinned" : "pageable") << " host memory" << endl;
+
+	// nominal global memory traffic of a work item (reads + writes of floats)
+	profiler.setBytesPerItem("diffuse", 32);
+	profiler.setBytesPerItem("diffuse3D", 96);
+	profiler.setBytesPerItem("advect", 48);
+	profiler.setBytesPerItem("advect3D", 120);
+	profiler.setBytesPerItem("project1", 28);
+	profiler.setBytesPerItem("project2", 48);
+	profiler.setBytesPerItem("resetBuffer", 4);
+
+	// reset all fields to zero
+	reset();
+	return true;
+}
+
+bool Fluid3DOutOfCore::slotInit(Slot & slot)
+{
+	slot.queue = cl::CommandQueue(context, device, profiler.queueProperties());
+	// a slab and the halo on both sides, the whole grid when it is thinner
+	const size_t local_volume = (size_t)width*height*min(depth, slab_layers + 2 * HALO);
+	for (int f = 0; f < NB_FIELDS; ++f) {
+		slot.fields[f] = cl::Buffer(context, CL_MEM_READ_WRITE, local_volume*components((Field)f) * sizeof(float));
+	}
+
+	// same arguments as Fluid3D, the physical scales use the global depth; the advections get the
+	// layers of their slab in compute
+	slot.diffuse = cl::Kernel(program, "diffuse");
+	slot.diffuse.setArg(0, slot.fields[Density2]);
+	slot.diffuse.setArg(1, slot.fields[Density]);
+	slot.diffuse.setArg(4, width);
+	slot.diffuse.setArg(5, height);
+	slot.diffuse.setArg(6, depth);
+
+	slot.diffuse_v = cl::Kernel(program, "diffuse3D");
+	slot.diffuse_v.setArg(0, slot.fields[Velocity2]);
+	slot.diffuse_v.setArg(1, slot.fields[Velocity]);
+	slot.diffuse_v.setArg(2, VISCO);
+	slot.diffuse_v.setArg(3, VISCO_DIV);
+	slot.diffuse_v.setArg(4, width);
+	slot.diffuse_v.setArg(5, height);
+	slot.diffuse_v.setArg(6, depth);
+
+	slot.diffuse_tmp = cl::Kernel(program, "diffuse");
+	slot.diffuse_tmp.setArg(0, slot.fields[Pressure2]);
+	slot.diffuse_tmp.setArg(1, slot.fields[Pressure]);
+	slot.diffuse_tmp.setArg(2, 1.0f);
+	slot.diffuse_tmp.setArg(3, 6.0f);
+	slot.diffuse_tmp.setArg(4, width);
+	slot.diffuse_tmp.setArg(5, height);
+	slot.diffuse_tmp.setArg(6, depth);
+
+	slot.advect_density = cl::Kernel(program, "advect");
+	slot.advect_density.setArg(0, slot.fields[Density]);
+	slot.advect_density.setArg(1, slot.fields[Density2]);
+	slot.advect_density.setArg(2, slot.fields[Velocity]);
+	slot.advect_density.setArg(3, width);
+	slot.advect_density.setArg(4, height);
+	slot.advect_density.setArg(5, depth);
+	slot.advect_density.setArg(6, 0.02f);
+
+	slot.advect_velocity = cl::Kernel(program, "advect3D");
+	slot.advect_velocity.setArg(0, slot.fields[Velocity]);
+	slot.advect_velocity.setArg(1, slot.fields[Velocity2]);
+	slot.advect_velocity.setArg(2, width);
+	slot.advect_velocity.setArg(3, height);
+	slot.advect_velocity.setArg(4, depth);
+	slot.advect_velocity.setArg(5, 0.02f);
+
+	cl::Kernel* projections[] = { &slot.project1, &slot.project2, &slot.project1bis, &slot.project2bis };
+	const Field projected[] = { Velocity2, Velocity2, Velocity, Velocity };
+	for (int i = 0; i < 4; ++i) {
+		*projections[i] = cl::Kernel(program, (i % 2 == 0) ? "project1" : "project2");
+		projections[i]->setArg(0, slot.fields[(i % 2 == 0) ? Pressure : Pressure2]);
+		projections[i]->setArg(1, slot.fields[projected[i]]);
+		projections[i]->setArg(2, width);
+		projections[i]->setArg(3, height);
+		projections[i]->setArg(4, depth);
+	}
+
+	slot.reset_pressure = cl::Kernel(program, "resetBuffer");
+	slot.reset_pressure.setArg(0, slot.fields[Pressure2]);
+	slot.reset_pressure.setArg(1, width);
+	slot.reset_pressure.setArg(2, height);
+	return true;
+}
+
+size_t Fluid3DOutOfCore::components(Field field) const
+{
+	return (field == Velocity || field == Velocity2) ? 3 : 1;
+}
+
+size_t Fluid3DOutOfCore::layerFloats(Field field) const
+{
+	return (size_t)width*height*components(field);
+}
+
+void Fluid3DOutOfCore::addPass(SlotKernel kernel, unsigned int reach, unsigned int reads, unsigned int writes, bool whole)
+{
+	passes.push_back({ kernel, reach, reads, writes, whole });
+}
+
+void Fluid3DOutOfCore::planStages()
+{
+	// a stage takes the passes in order while their reaches add up within the halo: every pass shrinks
+	// the layers still exact by its reach, the owned layers must stay exact until the last one
+	stages.clear();
+	unsigned int touched = 0;// fields already on the device in the current stage
+	for (size_t i = 0; i < passes.size(); ++i) {
+		const Pass & pass = passes[i];
+		if (stages.empty() || stages.back().reach + pass.reach > HALO) {
+			stages.push_back({ i, i, 0, 0, 0 });
+			touched = 0;
+		}
+		Stage & stage = stages.back();
+		// the cells a pass does not write keep the uploaded values, except after a reset of the whole slab
+		const unsigned int fresh = (pass.reads | pass.writes) & ~touched;
+		stage.uploads |= pass.whole ? (fresh & pass.reads) : fresh;
+		stage.downloads |= pass.writes;
+		stage.reach += pass.reach;
+		stage.last = i + 1;
+		touched |= pass.reads | pass.writes;
+	}
+}
+
+/** Events of "events" at the slabs [first, last] of the grid that were enqueued */
+static vector<cl::Event> enqueued(const vector<cl::Event> & events, int first, int last)
+{
+	vector<cl::Event> result;
+	for (int s = max(first, 0); s <= min(last, (int)events.size() - 1); ++s) {
+		if (events[s]()) {
+			result.push_back(events[s]);
+		}
+	}
+	return result;
+}
+
+void Fluid3DOutOfCore::runStage(const Stage & stage)
+{
+	auto upload = [&](unsigned int s) {
+		Slot & slot = slots[s % slots.size()];
+		const unsigned int z0 = s*slab_layers;
+		const unsigned int z1 = min(depth, z0 + slab_layers);
+		const unsigned int base = z0 - min(z0, stage.reach);
+		const unsigned int end = min(depth, z1 + stage.reach);
+		// the halo comes from the layers the neighbours wrote back in the previous stage
+		vector<cl::Event> wait_list = enqueued(downloaded, (int)s - 1, (int)s + 1);
+		cl::Event last;
+		for (int f = 0; f < NB_FIELDS; ++f) {
+			if (!(stage.uploads & bit(f))) {
+				continue;
+			}
+			const size_t layer = layerFloats((Field)f);
+			const size_t bytes = (end - base)*layer * sizeof(float);
+			slot.queue.enqueueWriteBuffer(slot.fields[f], CL_FALSE, 0, bytes, host[f].data + base*layer,
+				wait_list.empty() ? nullptr : &wait_list, &last);
+			wait_list.clear();
+			profiler.record("slabUpload", last, bytes);
+		}
+		uploaded[s] = last;
+		slot.queue.flush();
+	};
+	auto computeAndDownload = [&](unsigned int s) {
+		Slot & slot = slots[s % slots.size()];
+		const unsigned int z0 = s*slab_layers;
+		const unsigned int z1 = min(depth, z0 + slab_layers);
+		const unsigned int base = z0 - min(z0, stage.reach);
+		const unsigned int end = min(depth, z1 + stage.reach);
+		compute(slot, stage, base, end);
+		// the owned layers overwrite the halo the neighbours uploaded, once both uploads are done
+		vector<cl::Event> wait_list = enqueued(uploaded, (int)s - 1, (int)s + 1);
+		cl::Event last;
+		for (int f = 0; f < NB_FIELDS; ++f) {
+			if (!(stage.downloads & bit(f))) {
+				continue;
+			}
+			const size_t layer = layerFloats((Field)f);
+			const size_t bytes = (z1 - z0)*layer * sizeof(float);
+			slot.queue.enqueueReadBuffer(slot.fields[f], CL_FALSE, (z0 - base)*layer * sizeof(float), bytes,
+				host[f].data + z0*layer, wait_list.empty() ? nullptr : &wait_list, &last);
+			wait_list.clear();
+			profiler.record("slabDownload", last, bytes);
+		}
+		downloaded[s] = last;
+		slot.queue.flush();
+	};
+	// the upload of a slab is enqueued before the compute of the previous one, so with two slots the
+	// copy engine and the compute units work on adjacent slabs at the same time
+	upload(0);
+	for (unsigned int s = 1; s < nb_slabs; ++s) {
+		upload(s);
+		computeAndDownload(s - 1);
+	}
+	computeAndDownload(nb_slabs - 1);
+}
+
+void Fluid3DOutOfCore::compute(Slot & slot, const Stage & stage, unsigned int base, unsigned int end)
+{
+	const int z_offset = (int)base;
+	const float z_limit = (end - base) - 1.001f;// the trilinear sample reads the layer above
+	slot.advect_density.setArg(7, z_offset);
+	slot.advect_density.setArg(8, z_limit);
+	slot.advect_velocity.setArg(6, z_offset);
+	slot.advect_velocity.setArg(7, z_limit);
+	// [lo, hi[: layers still exact, the grid edges stay exact as they do not depend on a neighbour
+	unsigned int lo = base;
+	unsigned int hi = end;
+	for (size_t i = stage.first; i < stage.last; ++i) {
+		const Pass & pass = passes[i];
+		if (pass.whole) {
+			profiler.enqueueKernel(slot.queue, slot.*pass.kernel, cl::NDRange(0, 0, 0), cl::NDRange(width, height, end - base),
+				cl::NullRange);
+			continue;
+		}
+		lo = (lo == 0) ? 0 : lo + pass.reach;
+		hi = (hi == depth) ? depth : hi - pass.reach;
+		const unsigned int first = max(lo, 1u);
+		const unsigned int last = min(hi, depth - 1);
+		if (last > first) {
+			profiler.enqueueKernel(slot.queue, slot.*pass.kernel, cl::NDRange(1, 1, first - base),
+				cl::NDRange(width - 2, height - 2, last - first), cl::NullRange);
+		}
+	}
+}
+
+void Fluid3DOutOfCore::sync()
+{
+	for (auto & slot : slots) {
+		slot.queue.finish();
+	}
+}
+
+void Fluid3DOutOfCore::update(float dtt)
+{
+	const float dt = (dtt < 0.02f) ? dtt : 0.02f;
+	const float a = dt*density_factor;
+	for (auto & slot : slots) {
+		slot.diffuse.setArg(2, a);
+		slot.diffuse.setArg(3, 1 + 6.0f*a);
+	}
+	applySources();
+	for (const Stage & stage : stages) {
+		runStage(stage);
+	}
+
+	++step;
+	if (isSaving) {
+		exportDf3();
+	}
+}
+
+void Fluid3DOutOfCore::applySources()
+{
+	if (sources.empty()) {
+		return;
+	}
+	sync();
+	for (const Source & source : sources) {
+		const float reach = (float)source.radius - 0.5f;
+		const int* box = source.box;
+		for (int z = box[2]; z < box[2] + box[5]; ++z) {
+			for (int y = box[1]; y < box[1] + box[4]; ++y) {
+				for (int x = box[0]; x < box[0] + box[3]; ++x) {
+					// a column of discs, like the addSource kernels
+					const float dx = (float)x - source.x;
+					const float dy = (float)y - source.y;
+					if (dx*dx + dy*dy > reach*reach) {
+						continue;
+					}
+					const size_t index = x + (size_t)y*width + (size_t)z*width*height;
+					if (source.velocity) {
+						float* v = host[Velocity].data + 3 * index;
+						v[0] += source.dx;
+						v[1] += source.dy;
+						v[2] = 0;
+					} else {
+						host[Density].data[index] += source.density;
+					}
+				}
+			}
+		}
+	}
+	sources.clear();
+}
+
+void Fluid3DOutOfCore::addPressure(int x, int y, int radius, float pressure)
+{
+	const int z = depth / 2;
+	// same box as Fluid3D::addPressure
+	const int bound_width  = (x + radius + 1 < (int)width)  ? 2 * radius : (width - 2)  - (x - radius);
+	const int bound_height = (y + radius + 1 < (int)height) ? 2 * radius : (height - 2) - (y - radius);
+	int bound_depth        = (z + radius + 1 < (int)depth)  ? 2 * radius : (depth - 2)  - (z - radius);
+	bound_depth = (bound_depth + 2 < (int)depth) ? bound_depth : (int)depth - 2;
+	const int bound_top  = (x - radius < 1) ? 1 : x - radius;
+	const int bound_left = (y - radius < 1) ? 1 : y - radius;
+	const int bound_up   = (z - radius < 1) ? 1 : z - radius;
+	if (bound_width <= 0 || bound_height <= 0) {
+		return;
+	}
+	sources.push_back({ x, y, radius, { bound_top, bound_left, bound_up, bound_width, bound_height, bound_depth },
+		pressure, 0.0f, 0.0f, false });
+}
+
+void Fluid3DOutOfCore::addVelocity(int x, int y, int deltax, int deltay, float intensity, int radius)
+{
+	const int z = depth / 2;
+	// same box as Fluid3D::addVelocity
+	const int bound_width  = (x + radius + 1 < (int)width)  ? 2 * radius : (width - 2)  - (x - radius);
+	const int bound_height = (y + radius + 1 < (int)height) ? 2 * radius : (height - 2) - (y - radius);
+	int bound_depth        = (z + radius + 1 < (int)depth)  ? 2 * radius : (depth - 2)  - (z - radius);
+	bound_depth = (bound_depth + 2 < (int)depth) ? bound_depth : (int)depth - 2;
+	const int bound_top  = (x - radius < 1) ? 1 : x - radius;
+	const int bound_left = (y - radius < 1) ? 1 : y - radius;
+	const int bound_up   = 1;
+	if (bound_width <= 0 || bound_height <= 0) {
+		return;
+	}
+	sources.push_back({ x, y, radius, { bound_top, bound_left, bound_up, bound_width, bound_height, bound_depth },
+		0.0f, deltax*intensity, deltay*intensity, true });
+}
+
+void Fluid3DOutOfCore::setDataImage(uint8_t * img)
+{
+	data_image = img;
+}
+
+void Fluid3DOutOfCore::drawImage(uint8_t* pixels)
+{
+	// same colours as the drawScreen kernel, from the layer 1 already in host memory
+	const float* layer = host[Density].data + (size_t)width*height;
+	for (size_t i = 0; i < (size_t)width*height; ++i) {
+		const float v = layer[i];
+		pixels[4 * i + 0] = (uint8_t)min(max((int)(v*200.0f), 0), 255);
+		pixels[4 * i + 1] = (uint8_t)min(max((int)(v*56.0f), 0), 255);
+		pixels[4 * i + 2] = (uint8_t)min(max((int)(v*10.0f), 0), 255);
+		pixels[4 * i + 3] = 255;
+	}
+}
+
+void Fluid3DOutOfCore::updateImage()
+{
+	sync();
+	drawImage(data_image);
+}
+
+const uint8_t* Fluid3DOutOfCore::latestImage()
+{
+	sync();
+	frame.resize((size_t)width*height * 4);
+	drawImage(frame.data());
+	return frame.data();
+}
+
+void Fluid3DOutOfCore::readDensity(std::vector<float> & out)
+{
+	sync();
+	out.assign(host[Density].data, host[Density].data + volume);
+}
+
+void Fluid3DOutOfCore::finish()
+{
+	sync();
+}
+
+void Fluid3DOutOfCore::save()
+{
+	isSaving = !isSaving;
+	count = 0;
+	// stopping writes the pending frames and prints the statistics
+	recorder.reset(isSaving ? new Df3Recorder(width, height, depth, DF3_BUFFERS, DF3_WRITERS,
+		DF3_DROP_FRAMES ? Df3Recorder::Policy::Drop : Df3Recorder::Policy::Block) : nullptr);
+}
+
+void Fluid3DOutOfCore::exportDf3()
+{
+	float* data = recorder->acquire();
+	if (!data) {
+		return;
+	}
+	sync();
+	memcpy(data, host[Density].data, (size_t)volume * sizeof(float));
+	recorder->submit(data, "render" + std::to_string(count) + ".df3");
+	++count;
+}
+
+/** Same file as Fluid3D::saveState, written from the host fields */
+static const char* STATE_FIELDS[] = { "density", "density2", "velocity", "velocity2", "tmp_project", "tmp_project2" };
+
+static StateFile::Info stateInfo(unsigned int width, unsigned int height, unsigned int depth, unsigned long long step)
+{
+	StateFile::Info info;
+	info.width = width;
+	info.height = height;
+	info.depth = depth;
+	info.step = step;
+	info.parameters[0] = VISCO;
+	info.parameters[1] = DIFF_DENSITY;
+	info.parameters[2] = (float)SOLVER_NB_ITERATIONS;
+	return info;
+}
+
+/** Open a state file and check that it matches the grid */
+static bool openState(StateFile::Mapping & state, const std::string & filename, const StateFile::Info & expected)
+{
+	if (!state.open(filename)) {
+		return false;
+	}
+	if (state.info().width != expected.width || state.info().height != expected.height || state.info().depth != expected.depth) {
+		std::cout << filename << ": state of a " << state.info().width << "x" << state.info().height << "x" << state.info().depth
+			<< " grid, the solver is " << expected.width << "x" << expected.height << "x" << expected.depth << std::endl;
+		return false;
+	}
+	if (std::memcmp(state.info().parameters, expected.parameters, sizeof(expected.parameters)) != 0) {
+		std::cout << "Warning: " << filename << " was saved with other fluid parameters" << std::endl;
+	}
+	return true;
+}
+
+bool Fluid3DOutOfCore::saveState(const std::string & filename)
+{
+	applySources();
+	sync();
+	vector<pair<string, size_t>> fields;
+	for (int f = 0; f < NB_FIELDS; ++f) {
+		fields.push_back({ STATE_FIELDS[f], (size_t)volume*components((Field)f) * sizeof(float) });
+	}
+	StateFile::Writer writer(stateInfo(width, height, depth, step), fields);
+	for (int f = 0; f < NB_FIELDS; ++f) {
+		memcpy(writer.field(f), host[f].data, fields[f].second);
+	}
+	return writer.write(filename);
+}
+
+bool Fluid3DOutOfCore::loadState(const std::string & filename)
+{
+	const auto start = chrono::steady_clock::now();
+	StateFile::Mapping state;
+	if (!openState(state, filename, stateInfo(width, height, depth, 0))) {
+		return false;
+	}
+	const void* data[NB_FIELDS];
+	for (int f = 0; f < NB_FIELDS; ++f) {
+		data[f] = state.field(STATE_FIELDS[f], (size_t)volume*components((Field)f) * sizeof(float));
+		if (!data[f]) {
+			return false;
+		}
+	}
+	sync();
+	for (int f = 0; f < NB_FIELDS; ++f) {
+		memcpy(host[f].data, data[f], (size_t)volume*components((Field)f) * sizeof(float));
+	}
+	sources.clear();
+	step = state.info().step;
+	cout << "State loaded (step " << step << ") in "
+		<< chrono::duration<double, milli>(chrono::steady_clock::now() - start).count() << " ms" << endl;
+	return true;
+}
+
+unsigned long long Fluid3DOutOfCore::getStep() const
+{
+	return step;
+}
+
+void Fluid3DOutOfCore::reset()
+{
+	sync();
+	for (int f = 0; f < NB_FIELDS; ++f) {
+		fill(host[f].data, host[f].data + (size_t)volume*components((Field)f), 0.0f);
+	}
+	sources.clear();
+	count = 0;
+	step = 0;
+}
+
+KernelProfiler & Fluid3DOutOfCore::getProfiler()
+{
+	return profiler;
+}
+
+unsigned int Fluid3DOutOfCore::getNbStages() const
+{
+	return (unsigned int)stages.size();
+}
+
+unsigned int Fluid3DOutOfCore::getWidth() const
+{
+	return width;
+}
+unsigned int Fluid3DOutOfCore::getHeight() const
+{
+	return height;
+}
+unsigned int Fluid3DOutOfCore::getDepth() const
+{
+	return depth;
+}
@@ -0,0 +1,155 @@
+#ifndef FLUID3D_OUT_OF_CORE_H
+#define FLUID3D_OUT_OF_CORE_H
+
+#include <memory>
+#include <vector>
+#ifndef __CL_ENABLE_EXCEPTIONS
+#define __CL_ENABLE_EXCEPTIONS
+#endif
+#include <CL/cl.hpp>
+
+#include "Df3Recorder.hpp"
+#include "Fluid3DBase.h"
+#include "KernelProfiler.hpp"
+
+/** OpenCL implementation of the 3D solver for grids larger than the memory of the device
+* The six fields stay in host memory (pinned when the driver allows it) and the device only holds
+* OOC_SLOTS slots of a z-slab plus its halo. An update is a list of passes (the launches of Fluid3D)
+* grouped in stages whose z reach fits in OOC_HALO_LAYERS: for each stage every slab is uploaded with
+* as many layers of its neighbours as the stage reaches, runs all the passes of the stage (each one
+* on the layers still exact) and only its own layers are downloaded. The slabs alternate between the
+* slots, each with its own queue, so the upload of a slab, the compute of the previous one and the
+* download of the one before overlap. Same kernels and scheme as Fluid3D, Jacobi pressure only. */
+class Fluid3DOutOfCore : public Fluid3DBase
+{
+public:
+	/** "slab_layers": layers owned by a slab (at least OOC_HALO_LAYERS) */
+	Fluid3DOutOfCore(cl::Context context, cl::Device device, unsigned int width, unsigned int height, unsigned int depth,
+		unsigned int slab_layers);
+	virtual ~Fluid3DOutOfCore();
+	bool initialization() override;
+	void update(float dt) override;
+	void updateImage() override;
+	const uint8_t* latestImage() override;
+	void setDataImage(uint8_t * img) override;
+	unsigned int getWidth() const override;
+	unsigned int getHeight() const override;
+	unsigned int getDepth() const override;
+	void reset() override;
+	void finish() override;
+	void save() override;
+	void addPressure(int posx, int posy, int radius, float pressure) override;
+	void addVelocity(int posx, int posy, int deltax, int deltay, float intensity, int radius) override;
+	void readDensity(std::vector<float> & out) override;
+	bool saveState(const std::string & filename) override;
+	bool loadState(const std::string & filename) override;
+	unsigned long long getStep() const override;
+	/** Device timings of the enqueued commands (slab transfers included), enable it before initialization */
+	KernelProfiler & getProfiler();
+	/** Stages of an update, each one streaming the whole grid through the device */
+	unsigned int getNbStages() const;
+
+private:
+	enum Field { Density, Density2, Velocity, Velocity2, Pressure, Pressure2, NB_FIELDS };
+
+	/** Field in host memory, mapped from a CL_MEM_ALLOC_HOST_PTR buffer or in a vector */
+	struct HostField
+	{
+		cl::Buffer pinned;
+		std::vector<float> fallback;
+		float* data = nullptr;
+	};
+
+	/** Device buffers of a slab and its halo, with their own queue */
+	struct Slot
+	{
+		cl::CommandQueue queue;
+		cl::Buffer fields[NB_FIELDS];
+		cl::Kernel diffuse;
+		cl::Kernel diffuse_v;
+		cl::Kernel diffuse_tmp;
+		cl::Kernel advect_density;
+		cl::Kernel advect_velocity;
+		cl::Kernel project1;
+		cl::Kernel project2;
+		cl::Kernel project1bis;
+		cl::Kernel project2bis;
+		cl::Kernel reset_pressure;
+	};
+	typedef cl::Kernel Slot::*SlotKernel;
+
+	/** Launch of an update on a slab */
+	struct Pass
+	{
+		SlotKernel kernel;
+		unsigned int reach;// layers of the neighbours read in z
+		unsigned int reads;// masks of fields
+		unsigned int writes;
+		bool whole;// every cell of the slab (a reset), else the inner cells still exact
+	};
+
+	/** Passes [first, last[ run on a slab before it is written back */
+	struct Stage
+	{
+		size_t first, last;
+		unsigned int reach;// halo loaded
+		unsigned int uploads;// masks of fields
+		unsigned int downloads;
+	};
+
+	bool slotInit(Slot & slot);
+	void addPass(SlotKernel kernel, unsigned int reach, unsigned int reads, unsigned int writes, bool whole = false);
+	/** Group the passes in stages of at most OOC_HALO_LAYERS layers of reach */
+	void planStages();
+	/** Stream every slab through the device for one stage */
+	void runStage(const Stage & stage);
+	/** Enqueue the passes of a stage on a slab loaded in [base, end[ */
+	void compute(Slot & slot, const Stage & stage, unsigned int base, unsigned int end);
+	/** Wait for the transfers: the host fields are up to date and no longer read by the device */
+	void sync();
+	/** Sources queued by addPressure/addVelocity, added to the host fields before the next stage */
+	void applySources();
+	void drawImage(uint8_t* pixels);
+	void exportDf3();
+	size_t components(Field field) const;
+	size_t layerFloats(Field field) const;
+
+	unsigned int width;
+	unsigned int height;
+	unsigned int depth;
+	unsigned int volume;
+	unsigned int slab_layers;
+	unsigned int nb_slabs;
+	float density_factor;
+
+	cl::Context context;
+	cl::Device device;
+	cl::Program program;
+	KernelProfiler profiler;
+	std::vector<Slot> slots;
+	HostField host[NB_FIELDS];
+	std::vector<Pass> passes;
+	std::vector<Stage> stages;
+	std::vector<cl::Event> uploaded;// last upload of every slab in the current stage
+	std::vector<cl::Event> downloaded;// last download of every slab in the last stage
+
+	/** Disc of density or velocity, applied like the addSource kernels */
+	struct Source
+	{
+		int x, y, radius;
+		int box[6];// x0, y0, z0, size_x, size_y, size_z
+		float density;
+		float dx, dy;
+		bool velocity;
+	};
+	std::vector<Source> sources;
+
+	uint8_t* data_image = nullptr;// pointer on the sfml image memory
+	std::vector<uint8_t> frame;// latestImage
+	std::unique_ptr<Df3Recorder> recorder;// alive while recording
+	unsigned long long step = 0;
+	int count = 0;
+	bool isSaving = false;
+};
+
+#endif
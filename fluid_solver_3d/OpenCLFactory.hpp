@@ -3,6 +3,7 @@
 
 #include "config.hpp"
 
+#include <algorithm>
 #include <fstream>
 #include <vector>
 #include <iostream>
@@ -23,7 +24,7 @@ namespace OpenCLFactory
 			cout << " No platforms found. Check OpenCL installation!\n";
 			exit(1);
 		}
-		auto id_platform = PLATFORM;
+		size_t id_platform = PLATFORM;
 		if (id_platform >= all_platforms.size()) {
 			cout << " Warning: Default platform used (Wrong configuration)\n";
 			id_platform = 0;
@@ -47,6 +48,65 @@ namespace OpenCLFactory
 	}
 
 
+	/** Create one context holding every device of the platform, for Fluid3DCluster
+	* A CPU device is split in "cpu_partitions" sub-devices of equal compute units (1 keeps it whole),
+	* so each slab of the grid gets its own cores and its own queue */
+	std::pair<std::vector<cl::Device>, cl::Context> createClusterContext(unsigned int cpu_partitions)
+	{
+		using namespace std;
+		vector<cl::Platform> all_platforms;
+		cl::Platform::get(&all_platforms);
+		if (all_platforms.size() == 0) {
+			cout << " No platforms found. Check OpenCL installation!\n";
+			exit(1);
+		}
+		size_t id_platform = PLATFORM;
+		if (id_platform >= all_platforms.size()) {
+			cout << " Warning: Default platform used (Wrong configuration)\n";
+			id_platform = 0;
+		}
+		auto default_platform = all_platforms[id_platform];
+		cout << "Using platform: " << default_platform.getInfo<CL_PLATFORM_NAME>() << "\n";
+		vector<cl::Device> all_devices;
+		default_platform.getDevices(CL_DEVICE_TYPE_ALL, &all_devices);
+		if (all_devices.size() == 0) {
+			cout << " No devices found. Check OpenCL installation!\n";
+			exit(1);
+		}
+		vector<cl::Device> devices;
+		for (auto & device : all_devices) {
+			const cl_uint units = device.getInfo<CL_DEVICE_MAX_COMPUTE_UNITS>();
+			if (cpu_partitions > 1 && device.getInfo<CL_DEVICE_TYPE>() == CL_DEVICE_TYPE_CPU && units >= cpu_partitions) {
+				const cl_device_partition_property properties[] = { CL_DEVICE_PARTITION_EQUALLY, (cl_device_partition_property)(units / cpu_partitions), 0 };
+				vector<cl::Device> sub_devices;
+				cl_int error = CL_SUCCESS;
+#ifdef __CL_ENABLE_EXCEPTIONS
+				try {
+					error = device.createSubDevices(properties, &sub_devices);
+				} catch (cl::Error & e) {
+					error = e.err();
+				}
+#else
+				error = device.createSubDevices(properties, &sub_devices);
+#endif
+				if (error == CL_SUCCESS && !sub_devices.empty()) {
+					// an uneven split leaves a smaller last sub-device: keep the equal ones
+					sub_devices.resize(min<size_t>(sub_devices.size(), cpu_partitions));
+					cout << "Using device: " << device.getInfo<CL_DEVICE_NAME>() << " (" << sub_devices.size() << " sub-devices of "
+						<< units / cpu_partitions << " compute units)\n";
+					devices.insert(devices.end(), sub_devices.begin(), sub_devices.end());
+					continue;
+				}
+				cout << " Warning: " << device.getInfo<CL_DEVICE_NAME>() << " cannot be partitioned, used whole\n";
+			}
+			cout << "Using device: " << device.getInfo<CL_DEVICE_NAME>() << "\n";
+			devices.push_back(device);
+		}
+
+		auto context = cl::Context(devices);
+		return pair<vector<cl::Device>, cl::Context>(devices, context);
+	}
+
 	std::string getErrorStr(cl_int error)
 	{
 		switch(error){
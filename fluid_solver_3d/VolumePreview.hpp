@@ -0,0 +1,46 @@
+#ifndef VOLUME_PREVIEW_H
+#define VOLUME_PREVIEW_H
+
+#include <algorithm>
+#include <cmath>
+
+/** Image drawn by Fluid3D::updateImage / latestImage: the density of the layer z = 1, or the whole density
+* volume ray-marched on the device (only the RGBA frame leaves the device, no .df3 export needed) */
+enum class PreviewMode { Slice, Volume };
+
+/** Orbit camera of the volume preview, looking at the center of the grid, and the optical properties of the smoke
+* The grid is seen like the slice when yaw and pitch are 0: x to the right, y downward, looking along +z */
+struct PreviewCamera
+{
+	float yaw = 0.5f;// radians around the y axis
+	float pitch = 0.35f;// radians, positive looks at the grid from above (from the small y)
+	float distance = 1.5f;// from the center, in largest sides of the grid
+	float fov = 0.9f;// vertical field of view in radians
+	float absorption = 1.0f;// extinction per unit of density and per cell crossed
+	float step = 0.5f;// between two samples of a ray, in cells
+
+	/** Eye and vectors from the eye to the center, the right edge and the top edge of the image, in cells */
+	void basis(unsigned int width, unsigned int height, unsigned int depth, float eye[3], float forward[3],
+		float right[3], float up[3]) const
+	{
+		const float side = (float)std::max(width, std::max(height, depth));
+		forward[0] = std::sin(yaw)*std::cos(pitch);
+		forward[1] = std::sin(pitch);
+		forward[2] = std::cos(yaw)*std::cos(pitch);
+		eye[0] = 0.5f*width - distance*side*forward[0];
+		eye[1] = 0.5f*height - distance*side*forward[1];
+		eye[2] = 0.5f*depth - distance*side*forward[2];
+		// right = forward x (0, -1, 0) (horizontal), up = right x forward (toward the small y), |pitch| < pi/2
+		const float norm = std::sqrt(forward[0] * forward[0] + forward[2] * forward[2]);
+		const float half_height = std::tan(0.5f*fov);
+		const float half_width = half_height*width / height;
+		right[0] = forward[2] / norm*half_width;
+		right[1] = 0.0f;
+		right[2] = -forward[0] / norm*half_width;
+		up[0] = std::sin(pitch)*std::sin(yaw)*half_height;
+		up[1] = -std::cos(pitch)*half_height;
+		up[2] = std::sin(pitch)*std::cos(yaw)*half_height;
+	}
+};
+
+#endif // !VOLUME_PREVIEW_H
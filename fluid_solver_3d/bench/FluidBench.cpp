@@ -0,0 +1,876 @@
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <memory>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "Fluid3D.h"
+#include "Fluid3DCPU.h"
+#include "Fluid3DCluster.h"
+#include "Fluid3DOutOfCore.h"
+#include "FluidEnsemble2D.h"
+#include "FluidSolver.h"
+#include "FluidSolverCPU.h"
+#include "InputTrace.hpp"
+#include "OpenCLFactory.hpp"
+
+/** Headless benchmark of the 2D and 3D solvers
+* Drives "update" from a scripted emitter schedule without any window nor per-frame readback
+* and reports the throughput of the solver. */
+
+using namespace std;
+
+/** An emitter injects density and velocity at a fixed place between the steps [start, stop[
+* Positions and radius are given relatively to the grid size so the same schedule works at any resolution */
+struct Emitter
+{
+	int start;
+	int stop;
+	float x, y;
+	float radius;
+	float density;
+	float dx, dy;
+};
+
+/** Common entry points of the 2D and 3D solvers used by the benchmark */
+class BenchSolver
+{
+public:
+	virtual ~BenchSolver() {}
+	virtual void addPressure(int x, int y, int radius, float intensity) = 0;
+	virtual void addVelocity(int x, int y, float dx, float dy, float force, int radius) = 0;
+	virtual void reset() = 0;
+	virtual void update(float dt) = 0;
+	virtual void finish() = 0;
+	virtual void readDensity(vector<float> & out) = 0;
+	/** Return false if the engine only has the Jacobi pressure solver */
+	virtual bool setPressureSolver(PressureSolver solver, const MultigridSettings & /*settings*/) { return solver == PressureSolver::Jacobi; }
+	/** Multigrid cycles done by the last update */
+	virtual unsigned int pressureCycles() const { return 0; }
+	/** Return false if the engine has no residual driven solves */
+	virtual bool setRelaxation(const RelaxationSettings & settings) { return !settings.enabled; }
+	/** Sweeps of the latest update reported by the engine, false if it does not count them */
+	virtual bool solverIterations(SolverIterations & /*out*/) { return false; }
+	/** Fraction of the grid the engine currently computes (sparse tiles or bricks), blocking */
+	virtual double activeFraction() { return 1.0; }
+	/** Device timings, nullptr for the CPU engines */
+	virtual KernelProfiler* profiler() { return nullptr; }
+	/** Time the work-group sizes of the launches and write the tuning file, false if the engine has none */
+	virtual bool tuneWorkGroups(unsigned int /*steps*/) { return false; }
+	/** Launches of the engine with a tuned work-group size (loaded or just timed) */
+	virtual size_t tunedLaunches() { return 0; }
+	/** Return false if the engine only has the semi-Lagrangian advection */
+	virtual bool setAdvection(AdvectionScheme scheme) { return scheme == AdvectionScheme::SemiLagrangian; }
+	unsigned int width = 0;
+	unsigned int height = 0;
+	unsigned int depth = 1;
+};
+
+/** Same scale as the mouse in the interactive applications */
+constexpr float VELOCITY_FORCE = 0.01f;
+
+class Bench2D : public BenchSolver
+{
+public:
+	/** w = 0 keeps the grid of Config.h */
+	Bench2D(bool cpu, unsigned int nb_threads, int w, int h, bool profile, StoragePrecision precision = StoragePrecision::Float,
+		bool sparse = false)
+	{
+		if (cpu) {
+			fluid.reset(w > 0 ? new FluidSolverCPU(w, h, nb_threads) : new FluidSolverCPU(nb_threads));
+		} else {
+			opencl = (w > 0) ? new FluidSolver(w, h) : new FluidSolver();
+			opencl->get_profiler().setEnabled(profile);
+			opencl->set_storage_precision(precision);
+			opencl->set_sparse_tiles(sparse);
+			fluid.reset(opencl);
+		}
+		fluid->initialization();
+		width = fluid->get_width();
+		height = fluid->get_height();
+	}
+	void addPressure(int x, int y, int radius, float intensity) override { fluid->add_pressure(x, y, radius, intensity); }
+	void addVelocity(int x, int y, float dx, float dy, float force, int radius) override { fluid->add_velocity(x, y, dx, dy, force, radius); }
+	void reset() override { fluid->reset(); }
+	void update(float dt) override { fluid->update(dt); }
+	void finish() override { fluid->finish(); }
+	void readDensity(vector<float> & out) override { fluid->read_density(out); }
+	bool setPressureSolver(PressureSolver solver, const MultigridSettings & settings) override
+	{
+		if (!opencl) {
+			return BenchSolver::setPressureSolver(solver, settings);
+		}
+		opencl->set_pressure_solver(solver, settings);
+		return true;
+	}
+	unsigned int pressureCycles() const override { return opencl ? opencl->get_pressure_cycles() : 0; }
+	double activeFraction() override { return opencl ? (double)opencl->count_active_tiles() / opencl->get_nb_tiles() : 1.0; }
+	bool setRelaxation(const RelaxationSettings & settings) override
+	{
+		if (!opencl) {
+			return BenchSolver::setRelaxation(settings);
+		}
+		opencl->set_relaxation(settings);
+		return true;
+	}
+	bool solverIterations(SolverIterations & out) override
+	{
+		if (opencl) {
+			out = opencl->get_solver_iterations();
+		}
+		return opencl != nullptr;
+	}
+	KernelProfiler* profiler() override { return opencl ? &opencl->get_profiler() : nullptr; }
+	bool tuneWorkGroups(unsigned int steps) override
+	{
+		if (opencl) {
+			opencl->tune_work_groups(steps);
+		}
+		return opencl != nullptr;
+	}
+	size_t tunedLaunches() override { return opencl ? opencl->get_tuner().size() : 0; }
+	bool setAdvection(AdvectionScheme scheme) override
+	{
+		if (!opencl) {
+			return BenchSolver::setAdvection(scheme);
+		}
+		opencl->set_advection_scheme(scheme);
+		return true;
+	}
+private:
+	unique_ptr<FluidSolverBase> fluid;
+	FluidSolver* opencl = nullptr;
+};
+
+class Bench3D : public BenchSolver
+{
+public:
+	/** cluster: split the grid between the OpenCL devices, a CPU device in "partitions" sub-devices
+	* out_of_core: keep the grid in host memory and stream it through the device in slabs */
+	Bench3D(bool cpu, unsigned int nb_threads, unsigned int w, unsigned int h, unsigned int d, bool profile,
+		bool cluster = false, unsigned int partitions = 1, VelocityLayout layout = VelocityLayout::AoS,
+		StoragePrecision precision = StoragePrecision::Float, bool sparse = false, bool out_of_core = false)
+	{
+		if (cpu) {
+			fluid.reset(new Fluid3DCPU(w, h, d, nb_threads));
+		} else if (out_of_core) {
+			auto device_context = OpenCLFactory::createContext();
+			Fluid3DOutOfCore* engine = new Fluid3DOutOfCore(device_context.second, device_context.first, w, h, d, OOC_SLAB_LAYERS);
+			engine->getProfiler().setEnabled(profile);
+			cluster_profiler = &engine->getProfiler();
+			fluid.reset(engine);
+		} else if (cluster) {
+			auto devices_context = OpenCLFactory::createClusterContext(partitions);
+			Fluid3DCluster* engine = new Fluid3DCluster(devices_context.second, devices_context.first, w, h, d);
+			engine->getProfiler().setEnabled(profile);
+			cluster_profiler = &engine->getProfiler();
+			fluid.reset(engine);
+		} else {
+			auto device_context = OpenCLFactory::createContext();
+			opencl = new Fluid3D(device_context.second, device_context.first, w, h, d);
+			opencl->getProfiler().setEnabled(profile);
+			opencl->setVelocityLayout(layout);
+			opencl->setStoragePrecision(precision);
+			opencl->setSparseBricks(sparse);
+			fluid.reset(opencl);
+		}
+		width = w;
+		height = h;
+		depth = d;
+		if (!fluid->initialization()) {
+			exit(1);
+		}
+	}
+	void addPressure(int x, int y, int radius, float intensity) override { fluid->addPressure(x, y, radius, intensity); }
+	void addVelocity(int x, int y, float dx, float dy, float force, int radius) override { fluid->addVelocity(x, y, (int)dx, (int)dy, force, radius); }
+	void reset() override { fluid->reset(); }
+	void update(float dt) override { fluid->update(dt); }
+	void finish() override { fluid->finish(); }
+	void readDensity(vector<float> & out) override { fluid->readDensity(out); }
+	bool setPressureSolver(PressureSolver solver, const MultigridSettings & settings) override
+	{
+		if (!opencl) {
+			return BenchSolver::setPressureSolver(solver, settings);
+		}
+		opencl->setPressureSolver(solver, settings);
+		return true;
+	}
+	unsigned int pressureCycles() const override { return opencl ? opencl->getPressureCycles() : 0; }
+	bool setRelaxation(const RelaxationSettings & settings) override
+	{
+		if (!opencl) {
+			return BenchSolver::setRelaxation(settings);
+		}
+		opencl->setRelaxation(settings);
+		return true;
+	}
+	bool solverIterations(SolverIterations & out) override
+	{
+		if (opencl) {
+			out = opencl->getSolverIterations();
+		}
+		return opencl != nullptr;
+	}
+	double activeFraction() override { return opencl ? (double)opencl->countActiveBricks() / opencl->getNbBricks() : 1.0; }
+	KernelProfiler* profiler() override { return opencl ? &opencl->getProfiler() : cluster_profiler; }
+	bool tuneWorkGroups(unsigned int steps) override
+	{
+		if (opencl) {
+			opencl->tuneWorkGroups(steps);
+		}
+		return opencl != nullptr;
+	}
+	size_t tunedLaunches() override { return opencl ? opencl->getTuner().size() : 0; }
+	bool setAdvection(AdvectionScheme scheme) override
+	{
+		if (!opencl) {
+			return BenchSolver::setAdvection(scheme);
+		}
+		opencl->setAdvectionScheme(scheme);
+		return true;
+	}
+private:
+	unique_ptr<Fluid3DBase> fluid;
+	Fluid3D* opencl = nullptr;
+	KernelProfiler* cluster_profiler = nullptr;// engines other than Fluid3D
+};
+
+/** K 2D simulations updated together, the emitters feed every member
+* Member m uses (m+1) times the viscosity and the diffusion of config.hpp, a typical parameter sweep */
+class BenchEnsemble : public BenchSolver
+{
+public:
+	BenchEnsemble(unsigned int w, unsigned int h, unsigned int nb_members, bool profile)
+	{
+		vector<FluidEnsemble2D::MemberParameters> members(nb_members);
+		for (unsigned int m = 0; m < nb_members; ++m) {
+			members[m] = { VISCO*(m + 1), DIFF_DENSITY*(m + 1) };
+		}
+		fluid.reset(new FluidEnsemble2D(w, h, members));
+		fluid->get_profiler().setEnabled(profile);
+		fluid->initialization();
+		width = w;
+		height = h;
+		depth = nb_members;
+	}
+	void addPressure(int x, int y, int radius, float intensity) override { fluid->add_pressure(FluidEnsemble2D::ALL_MEMBERS, x, y, radius, intensity); }
+	void addVelocity(int x, int y, float dx, float dy, float force, int radius) override { fluid->add_velocity(FluidEnsemble2D::ALL_MEMBERS, x, y, dx, dy, force, radius); }
+	void reset() override { fluid->reset(); }
+	void update(float dt) override { fluid->update(dt); }
+	void finish() override { fluid->finish(); }
+	void readDensity(vector<float> & out) override { fluid->read_densities(out); }
+	KernelProfiler* profiler() override { return &fluid->get_profiler(); }
+private:
+	unique_ptr<FluidEnsemble2D> fluid;
+};
+
+/** Default scene: a plume rising from the bottom pushed by two lateral jets */
+static vector<Emitter> defaultSchedule()
+{
+	return {
+		//start stop  x      y      radius density dx      dy
+		{ 0,    -1,   0.50f, 0.85f, 0.03f, 0.2f,   0.0f,   -10.0f },
+		{ 50,   -1,   0.15f, 0.50f, 0.02f, 0.1f,   15.0f,  0.0f },
+		{ 150,  -1,   0.85f, 0.30f, 0.02f, 0.1f,   -15.0f, 5.0f },
+	};
+}
+
+/** Read an emitter schedule, one emitter per line:
+* "emitter <start> <stop> <x> <y> <radius> <density> <dx> <dy>", stop < 0 means forever, '#' starts a comment */
+static bool loadSchedule(const string & filename, vector<Emitter> & schedule)
+{
+	ifstream in(filename);
+	if (!in.good()) {
+		cout << "cannot open " << filename << endl;
+		return false;
+	}
+	schedule.clear();
+	string line;
+	int line_number = 0;
+	while (getline(in, line)) {
+		++line_number;
+		line = line.substr(0, line.find('#'));
+		istringstream tokens(line);
+		string keyword;
+		if (!(tokens >> keyword)) {
+			continue;
+		}
+		Emitter e;
+		if (keyword != "emitter" || !(tokens >> e.start >> e.stop >> e.x >> e.y >> e.radius >> e.density >> e.dx >> e.dy)) {
+			cout << filename << ":" << line_number << ": invalid emitter" << endl;
+			return false;
+		}
+		schedule.push_back(e);
+	}
+	return true;
+}
+
+/** Inputs of the emitters active at "step", converted to the grid of the solver */
+static void scheduleInputs(const BenchSolver & solver, const vector<Emitter> & schedule, int step, float dt, vector<InputCommand> & out)
+{
+	const float size = (float)min(solver.width, solver.height);
+	for (const Emitter & e : schedule) {
+		if (step < e.start || (e.stop >= 0 && step >= e.stop)) {
+			continue;
+		}
+		InputCommand command{ InputCommand::Pressure };
+		command.x = (int)(e.x*solver.width);
+		command.y = (int)(e.y*solver.height);
+		command.radius = max(1, (int)(e.radius*size));
+		if (e.density != 0.0f) {
+			command.intensity = e.density*dt*50.0f;
+			out.push_back(command);
+		}
+		if (e.dx != 0.0f || e.dy != 0.0f) {
+			command.type = InputCommand::Velocity;
+			command.dx = e.dx;
+			command.dy = e.dy;
+			command.force = VELOCITY_FORCE;
+			out.push_back(command);
+		}
+	}
+}
+
+/** The state files and the .df3 records of a trace are not replayed by the benchmark */
+static void applyInput(BenchSolver & solver, const InputCommand & command)
+{
+	switch (command.type) {
+	case InputCommand::Pressure:
+		solver.addPressure(command.x, command.y, command.radius, command.intensity);
+		break;
+	case InputCommand::Velocity:
+		solver.addVelocity(command.x, command.y, command.dx, command.dy, command.force, command.radius);
+		break;
+	case InputCommand::Reset:
+		solver.reset();
+		break;
+	default:
+		break;
+	}
+}
+
+/** Detail kept in a density field: RMS of its gradient over RMS of the density, the gradient taken by central
+* differences in each layer (x and y) and scaled to a domain of size 1, so grids of different resolutions compare.
+* A diffusive advection smooths the plumes and lowers it; 0 for an empty field */
+static double densityDetail(const vector<float> & density, unsigned int w, unsigned int h, unsigned int layers)
+{
+	double gradient = 0.0, energy = 0.0;
+	for (unsigned int z = 0; z < layers; ++z) {
+		const float* layer = density.data() + (size_t)z*w*h;
+		for (unsigned int y = 1; y + 1 < h; ++y) {
+			for (unsigned int x = 1; x + 1 < w; ++x) {
+				const size_t i = x + (size_t)y*w;
+				const double gx = 0.5*(layer[i + 1] - layer[i - 1])*w;
+				const double gy = 0.5*(layer[i + w] - layer[i - w])*h;
+				gradient += gx*gx + gy*gy;
+				energy += (double)layer[i] * layer[i];
+			}
+		}
+	}
+	return (energy > 0.0) ? sqrt(gradient / energy) : 0.0;
+}
+
+static double percentile(const vector<double> & sorted, double p)
+{
+	if (sorted.empty()) {
+		return 0.0;
+	}
+	const size_t index = (size_t)(p*(sorted.size() - 1) + 0.5);
+	return sorted[min(index, sorted.size() - 1)];
+}
+
+static void usage()
+{
+	cout << "usage: fluid_bench [options]\n"
+		<< "  --solver 2d|3d|ensemble  solver to benchmark (default 3d), ensemble: K 2D simulations at once (OpenCL only)\n"
+		<< "  --backend opencl|cpu|cluster|outofcore  engine running the solver (default opencl), cluster: the 3D grid\n"
+		<< "                        split in z-slabs between every OpenCL device of the platform, outofcore: the 3D grid\n"
+		<< "                        kept in host memory and streamed through the device in z-slabs (see config.hpp)\n"
+		<< "  --partitions N        sub-devices made from a CPU device by the cluster engine (default: config.hpp)\n"
+		<< "  --threads N           threads of the CPU engine (default: all)\n"
+		<< "  --size WxHxD          grid resolution, WxH for the 2D solvers (default: Config.h / config.hpp, 256x256 for ensemble)\n"
+		<< "  --members K           simulations of the ensemble (default 16)\n"
+		<< "  --layout aos|soa|float4  layout of the 3D velocity on the device (default aos, OpenCL engine only)\n"
+		<< "  --precision float|half   storage of the fields on the device (default float, OpenCL engine only)\n"
+		<< "  --sparse              only compute the tiles (2D) or bricks (3D) holding density or velocity (OpenCL engines only)\n"
+		<< "  --tune                time the work-group sizes of every launch first and write the tuning file of the device\n"
+		<< "  --steps N             number of measured steps (default 500)\n"
+		<< "  --warmup N            number of steps run before measuring (default 20)\n"
+		<< "  --dt S                time step given to update (default 0.016)\n"
+		<< "  --script FILE         emitter schedule (see loadSchedule)\n"
+		<< "  --trace FILE          replay the inputs recorded by an application (--record) instead of the schedule:\n"
+		<< "                        its grid, time step and number of steps, no warmup\n"
+		<< "  --record-trace FILE   write the inputs of the run (warmup included) in the trace FILE\n"
+		<< "  --pipelined           do not wait for the device after each step (throughput only,\n"
+		<< "                        the per step times then only measure the enqueue)\n"
+		<< "  --pressure jacobi|multigrid  solver of the pressure equation (default jacobi, multigrid: OpenCL only)\n"
+		<< "  --mg-tolerance T      residual reduction targeted by the multigrid solver (default 1e-3)\n"
+		<< "  --relax T             red-black SOR solves stopped when |r| <= T*|b| (OpenCL engines, default off)\n"
+		<< "  --relax-max N         sweeps of a residual driven solve at most (default 64)\n"
+		<< "  --omega W             over-relaxation factor of the residual driven solves (default 1.7)\n"
+		<< "  --profile FILE        write the device time of every kernel in FILE (.csv or .json), OpenCL only\n"
+		<< "  --validate            run the schedule on the OpenCL and the CPU engines and compare the densities\n"
+		<< "                        (with --precision half: on the OpenCL engine in half and in float)\n"
+		<< "  --tolerance T         largest accepted difference relative to the peak density (default 0.05)\n"
+		<< "  --advection semi|maccormack|bfecc  advection scheme (default semi, others: OpenCL engines of 2D and 3D)\n"
+		<< "  --compare-advection   run the schedule with each advection scheme, the higher order ones at half resolution,\n"
+		<< "                        and compare the detail per ms\n";
+}
+
+/** Parameters given on the command line */
+struct BenchOptions
+{
+	string solver_name = "3d";
+	bool cpu = false;
+	bool cluster = false;
+	bool out_of_core = false;
+	unsigned int partitions = CLUSTER_CPU_PARTITIONS;
+	VelocityLayout layout = VelocityLayout::AoS;
+	string layout_name = "aos";
+	StoragePrecision precision = StoragePrecision::Float;
+	bool sparse = false;
+	bool tune = false;
+	unsigned int threads = 0;
+	unsigned int w = DEFAULT_WIDTH, h = DEFAULT_HEIGHT, d = DEFAULT_DEPTH;
+	bool custom_size = false;
+	unsigned int members = 16;
+	int steps = 500;
+	int warmup = 20;
+	float dt = 0.016f;
+	bool sync_each_step = true;
+	bool validate = false;
+	float tolerance = 0.05f;
+	PressureSolver pressure = PressureSolver::Jacobi;
+	MultigridSettings multigrid;
+	RelaxationSettings relaxation;
+	AdvectionScheme advection = AdvectionScheme::SemiLagrangian;
+	bool compare_advection = false;
+	string profile_file;
+	vector<Emitter> schedule = defaultSchedule();
+	shared_ptr<InputTrace::Player> trace;// replaces the schedule
+	string record_file;
+};
+
+/** Apply the inputs of a step: the events of the trace, else the emitters of the schedule, logged in "recorder".
+* The positions and radii of the trace are scaled by "trace_scale" (a grid of another resolution than the recorded one) */
+static void applyInputs(BenchSolver & solver, const BenchOptions & options, int step, InputTrace::Recorder* recorder = nullptr,
+	float trace_scale = 1.0f)
+{
+	vector<InputCommand> commands;
+	if (options.trace) {
+		options.trace->apply(step, [&](const InputCommand & command) { commands.push_back(command); });
+		for (InputCommand & command : commands) {
+			command.x = (int)(command.x*trace_scale);
+			command.y = (int)(command.y*trace_scale);
+			command.radius = max(1, (int)(command.radius*trace_scale));
+		}
+	} else {
+		scheduleInputs(solver, options.schedule, step, options.dt, commands);
+	}
+	for (const InputCommand & command : commands) {
+		if (recorder) {
+			recorder->record(step, command);
+		}
+		applyInput(solver, command);
+	}
+}
+
+static unique_ptr<BenchSolver> createSolver(const BenchOptions & options, bool cpu)
+{
+	unique_ptr<BenchSolver> solver;
+	if (options.solver_name == "ensemble") {
+		const unsigned int w = options.custom_size ? options.w : 256, h = options.custom_size ? options.h : 256;
+		solver.reset(new BenchEnsemble(w, h, options.members, !options.profile_file.empty()));
+	} else if (options.solver_name == "2d") {
+		const int w = options.custom_size ? (int)options.w : 0;
+		solver.reset(new Bench2D(cpu, options.threads, w, (int)options.h, !options.profile_file.empty(), options.precision,
+			options.sparse));
+	} else {
+		solver.reset(new Bench3D(cpu, options.threads, options.w, options.h, options.d, !options.profile_file.empty(),
+			options.cluster, options.partitions, options.layout, options.precision, options.sparse,
+			options.out_of_core));
+	}
+	if (!solver->setPressureSolver(options.pressure, options.multigrid)) {
+		cout << "Warning: this engine only has the Jacobi pressure solver, --pressure ignored\n";
+	}
+	if (!solver->setRelaxation(options.relaxation)) {
+		cout << "Warning: this engine only has fixed iteration counts, --relax ignored\n";
+	}
+	if (!solver->setAdvection(options.advection)) {
+		cout << "Warning: this engine only has the semi-Lagrangian advection, --advection ignored\n";
+	}
+	// after the solver settings, so the launches they select are tuned
+	if (options.tune && !solver->tuneWorkGroups(WORK_GROUP_TUNING_STEPS)) {
+		cout << "Warning: only the OpenCL engines of the 2D and 3D solvers are tuned, --tune ignored\n";
+	}
+	return solver;
+}
+
+/** Run the schedule on both engines and compare the density fields
+* (in half precision the reference is the OpenCL engine in float: the loss of quality of the storage) */
+static int validate(const BenchOptions & options)
+{
+	const bool half = options.precision == StoragePrecision::Half;
+	BenchOptions second_options = options;
+	second_options.precision = StoragePrecision::Float;
+	vector<float> reference, native;
+	{
+		unique_ptr<BenchSolver> solver = createSolver(options, false);
+		for (int step = 0; step < options.steps; ++step) {
+			applyInputs(*solver, options, step);
+			solver->update(options.dt);
+		}
+		solver->readDensity(reference);
+	}
+	{
+		unique_ptr<BenchSolver> solver = createSolver(second_options, !half);
+		for (int step = 0; step < options.steps; ++step) {
+			applyInputs(*solver, options, step);
+			solver->update(options.dt);
+		}
+		solver->readDensity(native);
+	}
+	if (reference.size() != native.size() || reference.empty()) {
+		cout << "validation failed: the fields have different sizes" << endl;
+		return 1;
+	}
+	double max_error = 0.0, sum_sq = 0.0, peak = 0.0;
+	for (size_t i = 0; i < reference.size(); ++i) {
+		const double error = fabs((double)reference[i] - native[i]);
+		max_error = max(max_error, error);
+		sum_sq += error*error;
+		peak = max(peak, fabs((double)reference[i]));
+	}
+	const double rms = sqrt(sum_sq / reference.size());
+	const double relative = (peak > 0.0) ? max_error / peak : max_error;
+	const bool pass = relative <= options.tolerance;
+	cout << (half ? "half vs float " : "") << "validation after " << options.steps << " steps: max error " << max_error << ", rms " << rms
+		<< ", peak density " << peak << ", relative " << relative << (pass ? " PASS" : " FAIL") << endl;
+	return pass ? 0 : 1;
+}
+
+/** Run the schedule with each advection scheme and report the detail of the final density per ms of step
+* (run the semi-Lagrangian scheme at full resolution and the others at half to compare equal quality) */
+static int compareAdvection(const BenchOptions & options)
+{
+	const AdvectionScheme schemes[] = { AdvectionScheme::SemiLagrangian, AdvectionScheme::MacCormack, AdvectionScheme::BFECC };
+	unsigned int full_w = 0, full_h = 0, full_d = 0;
+	for (AdvectionScheme scheme : schemes) {
+		BenchOptions scheme_options = options;
+		scheme_options.advection = scheme;
+		if (scheme != AdvectionScheme::SemiLagrangian) {
+			// every side halved from the grid of the semi-Lagrangian run (the first one)
+			scheme_options.custom_size = true;
+			scheme_options.w = max(full_w / 2, 4u);
+			scheme_options.h = max(full_h / 2, 4u);
+			scheme_options.d = max(full_d / 2, 4u);
+		}
+		unique_ptr<BenchSolver> solver = createSolver(scheme_options, options.cpu);
+		if (scheme == AdvectionScheme::SemiLagrangian) {
+			full_w = solver->width;
+			full_h = solver->height;
+			full_d = solver->depth;
+		}
+		const float trace_scale = (float)solver->width / full_w;
+		for (int step = 0; step < options.warmup; ++step) {
+			applyInputs(*solver, options, step, nullptr, trace_scale);
+			solver->update(options.dt);
+		}
+		solver->finish();
+		double total_ms = 0.0;
+		for (int step = 0; step < options.steps; ++step) {
+			const auto step_start = chrono::steady_clock::now();
+			applyInputs(*solver, options, options.warmup + step, nullptr, trace_scale);
+			solver->update(options.dt);
+			solver->finish();
+			total_ms += chrono::duration<double, milli>(chrono::steady_clock::now() - step_start).count();
+		}
+		vector<float> density;
+		solver->readDensity(density);
+		const double mean_ms = total_ms / options.steps;
+		const double detail = densityDetail(density, solver->width, solver->height, solver->depth);
+		cout << advectionSchemeName(scheme) << " (" << solver->width << "x" << solver->height << "x" << solver->depth << "): "
+			<< mean_ms << " ms/step, detail " << detail << ", " << detail / mean_ms << " detail per ms\n";
+		cout << "RESULT solver=" << options.solver_name << " size=" << solver->width << "x" << solver->height << "x" << solver->depth
+			<< " cells=" << (long long)solver->width*solver->height*solver->depth
+			<< " steps=" << options.steps << " advection=" << advectionSchemeName(scheme) << " ms_mean=" << mean_ms
+			<< " detail=" << detail << " detail_per_ms=" << detail / mean_ms << endl;
+	}
+	return 0;
+}
+
+/** Entry point of the benchmark */
+int main(int argc, char** argv)
+{
+	BenchOptions options;
+	for (int i = 1; i < argc; ++i) {
+		const string arg = argv[i];
+		const bool has_value = i + 1 < argc;
+		if (arg == "--solver" && has_value) {
+			options.solver_name = argv[++i];
+		} else if (arg == "--backend" && has_value) {
+			const string name = argv[++i];
+			options.cpu = name == "cpu";
+			options.cluster = name == "cluster";
+			options.out_of_core = name == "outofcore";
+		} else if (arg == "--threads" && has_value) {
+			options.threads = (unsigned int)atoi(argv[++i]);
+		} else if (arg == "--size" && has_value) {
+			if (sscanf(argv[++i], "%ux%ux%u", &options.w, &options.h, &options.d) < 2) {
+				usage();
+				return 1;
+			}
+			options.custom_size = true;
+		} else if (arg == "--members" && has_value) {
+			options.members = (unsigned int)atoi(argv[++i]);
+		} else if (arg == "--partitions" && has_value) {
+			options.partitions = (unsigned int)atoi(argv[++i]);
+		} else if (arg == "--layout" && has_value) {
+			options.layout_name = argv[++i];
+			if (options.layout_name != "aos" && options.layout_name != "soa" && options.layout_name != "float4") {
+				usage();
+				return 1;
+			}
+			options.layout = (options.layout_name == "soa") ? VelocityLayout::SoA
+				: (options.layout_name == "float4") ? VelocityLayout::Float4 : VelocityLayout::AoS;
+		} else if (arg == "--steps" && has_value) {
+			options.steps = atoi(argv[++i]);
+		} else if (arg == "--warmup" && has_value) {
+			options.warmup = atoi(argv[++i]);
+		} else if (arg == "--dt" && has_value) {
+			options.dt = (float)atof(argv[++i]);
+		} else if (arg == "--script" && has_value) {
+			if (!loadSchedule(argv[++i], options.schedule)) {
+				return 1;
+			}
+		} else if (arg == "--trace" && has_value) {
+			options.trace = make_shared<InputTrace::Player>();
+			if (!options.trace->open(argv[++i])) {
+				return 1;
+			}
+		} else if (arg == "--record-trace" && has_value) {
+			options.record_file = argv[++i];
+		} else if (arg == "--pipelined") {
+			options.sync_each_step = false;
+		} else if (arg == "--precision" && has_value) {
+			const string name = argv[++i];
+			if (name != "float" && name != "half") {
+				usage();
+				return 1;
+			}
+			options.precision = (name == "half") ? StoragePrecision::Half : StoragePrecision::Float;
+		} else if (arg == "--sparse") {
+			options.sparse = true;
+		} else if (arg == "--tune") {
+			options.tune = true;
+		} else if (arg == "--pressure" && has_value) {
+			const string name = argv[++i];
+			if (name != "jacobi" && name != "multigrid") {
+				usage();
+				return 1;
+			}
+			options.pressure = (name == "multigrid") ? PressureSolver::Multigrid : PressureSolver::Jacobi;
+		} else if (arg == "--mg-tolerance" && has_value) {
+			options.multigrid.tolerance = (float)atof(argv[++i]);
+		} else if (arg == "--relax" && has_value) {
+			options.relaxation.enabled = true;
+			options.relaxation.tolerance = (float)atof(argv[++i]);
+		} else if (arg == "--relax-max" && has_value) {
+			options.relaxation.max_iterations = (unsigned int)atoi(argv[++i]);
+		} else if (arg == "--omega" && has_value) {
+			options.relaxation.omega = (float)atof(argv[++i]);
+		} else if (arg == "--profile" && has_value) {
+			options.profile_file = argv[++i];
+		} else if (arg == "--validate") {
+			options.validate = true;
+		} else if (arg == "--tolerance" && has_value) {
+			options.tolerance = (float)atof(argv[++i]);
+		} else if (arg == "--advection" && has_value) {
+			if (!parseAdvectionScheme(argv[++i], options.advection)) {
+				usage();
+				return 1;
+			}
+		} else if (arg == "--compare-advection") {
+			options.compare_advection = true;
+		} else {
+			usage();
+			return (arg == "--help") ? 0 : 1;
+		}
+	}
+	if (options.trace) {
+		// the trace holds the coordinates of its grid and the index of the update of every input
+		const InputTrace::Header & header = options.trace->header();
+		options.w = header.width;
+		options.h = header.height;
+		if (header.depth > 1) {
+			options.d = header.depth;
+		}
+		options.custom_size = true;
+		options.steps = (int)header.nb_steps;
+		options.dt = header.dt;
+		options.warmup = 0;
+	}
+	if (options.steps <= 0 || options.w < 3 || options.h < 3 || options.d < 3
+		|| (options.solver_name != "2d" && options.solver_name != "3d" && options.solver_name != "ensemble")
+		|| options.members < 1) {
+		usage();
+		return 1;
+	}
+	const bool ensemble = options.solver_name == "ensemble";
+	if ((options.cluster || options.out_of_core) && options.solver_name != "3d") {
+		cout << "the cluster and out-of-core engines only run the 3D solver\n";
+		return 1;
+	}
+	if (ensemble && (options.cpu || options.validate)) {
+		cout << "the ensemble solver only has an OpenCL engine, --backend cpu and --validate are not supported\n";
+		return 1;
+	}
+	if (options.precision == StoragePrecision::Half && (ensemble || options.cpu || options.cluster || options.out_of_core)) {
+		cout << "Warning: only the OpenCL engines of the 2D and 3D solvers store halves, --precision ignored\n";
+	}
+	if (options.sparse && (ensemble || options.cpu || options.cluster || options.out_of_core)) {
+		cout << "Warning: only the OpenCL engines of the 2D and 3D solvers skip the empty tiles and bricks, --sparse ignored\n";
+	}
+
+	try {
+		if (options.validate) {
+			return validate(options);
+		}
+		if (options.compare_advection) {
+			return compareAdvection(options);
+		}
+		unique_ptr<BenchSolver> solver = createSolver(options, options.cpu);
+		const int steps = options.steps;
+		const float dt = options.dt;
+
+		InputTrace::Recorder recorder;
+		if (!options.record_file.empty() && !recorder.open(options.record_file, solver->width, solver->height, solver->depth, dt)) {
+			return 1;
+		}
+		InputTrace::Recorder* recording = recorder.isOpen() ? &recorder : nullptr;
+		for (int step = 0; step < options.warmup; ++step) {
+			applyInputs(*solver, options, step, recording);
+			solver->update(dt);
+		}
+		solver->finish();
+		KernelProfiler* profiler = solver->profiler();
+		if (profiler) {
+			// the warmup steps are not part of the profile
+			profiler->clear();
+		} else if (!options.profile_file.empty()) {
+			cout << "Warning: --profile needs the OpenCL engine\n";
+		}
+
+		vector<double> step_ms;
+		step_ms.reserve(steps);
+		unsigned long long pressure_cycles = 0;
+		SolverIterations iterations, total_iterations;
+		bool counted = false;
+		const auto start = chrono::steady_clock::now();
+		for (int step = 0; step < steps; ++step) {
+			const auto step_start = chrono::steady_clock::now();
+			applyInputs(*solver, options, options.warmup + step, recording);
+			solver->update(dt);
+			if (options.sync_each_step) {
+				solver->finish();
+			}
+			step_ms.push_back(chrono::duration<double, milli>(chrono::steady_clock::now() - step_start).count());
+			pressure_cycles += solver->pressureCycles();
+			if (solver->solverIterations(iterations)) {
+				// with --pipelined the counts lag the updates and a step may repeat the previous one
+				counted = true;
+				total_iterations.velocity += iterations.velocity;
+				total_iterations.pressure += iterations.pressure;
+				total_iterations.density += iterations.density;
+			}
+			if (profiler) {
+				profiler->endFrame();
+			}
+		}
+		solver->finish();
+		const double total_s = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+		recorder.close(options.warmup + steps);
+		// the same trace on the same build and device gives the same hash
+		vector<float> final_density;
+		solver->readDensity(final_density);
+		char density_hash[17];
+		snprintf(density_hash, sizeof(density_hash), "%016llx", (unsigned long long)InputTrace::checksum(final_density));
+		const double detail = densityDetail(final_density, solver->width, solver->height, solver->depth);
+
+		const double cells = (double)solver->width*solver->height*solver->depth;
+		const double steps_per_s = steps / total_s;
+		sort(step_ms.begin(), step_ms.end());
+		double mean_ms = 0.0;
+		for (double ms : step_ms) {
+			mean_ms += ms;
+		}
+		mean_ms /= step_ms.size();
+
+		const string backend_name = options.cpu ? "cpu" : options.cluster ? "cluster" : options.out_of_core ? "outofcore" : "opencl";
+		cout << "solver " << options.solver_name << " (" << backend_name << "), grid " << solver->width << "x" << solver->height;
+		if (options.solver_name == "3d") {
+			cout << "x" << solver->depth;
+		} else if (ensemble) {
+			cout << " x " << solver->depth << " members";
+		}
+		cout << " (" << (long long)cells << " cells), " << steps << " steps"
+			<< (options.sync_each_step ? "" : ", pipelined") << "\n";
+		cout << "steps/s:  " << steps_per_s << "\n";
+		cout << "ms/step:  mean " << mean_ms
+			<< "  p50 " << percentile(step_ms, 0.50)
+			<< "  p90 " << percentile(step_ms, 0.90)
+			<< "  p99 " << percentile(step_ms, 0.99)
+			<< "  max " << step_ms.back() << "\n";
+		cout << "cells/s:  " << cells*steps_per_s << "\n";
+		const bool multigrid = options.pressure == PressureSolver::Multigrid && !options.cpu && !options.cluster && !options.out_of_core;
+		const double cycles_per_step = (double)pressure_cycles / steps;
+		if (multigrid) {
+			cout << "pressure: multigrid, " << cycles_per_step << " V-cycles/step (2 solves)\n";
+		}
+		const double sweeps_per_step = (double)(total_iterations.velocity + total_iterations.pressure + total_iterations.density) / steps;
+		if (counted) {
+			cout << "sweeps/step: velocity " << (double)total_iterations.velocity / steps
+				<< "  pressure " << (double)total_iterations.pressure / steps
+				<< "  density " << (double)total_iterations.density / steps
+				<< (options.relaxation.enabled ? " (residual driven)" : " (fixed)") << "\n";
+		}
+		cout << "detail:   " << detail << " (" << advectionSchemeName(options.advection) << " advection), "
+			<< detail / mean_ms << " per ms of step\n";
+		cout << "density hash: " << density_hash << (options.trace ? " (trace)" : "") << "\n";
+		const size_t tuned = solver->tunedLaunches();
+		if (tuned > 0) {
+			cout << "work-groups: " << tuned << " tuned launches in the tuning file of the device\n";
+		}
+		const double active = solver->activeFraction();
+		if (active < 1.0) {
+			cout << "active bricks: " << active*100.0 << "% of the grid after the last step\n";
+		}
+		// single line summary easy to grep in regression logs
+		cout << "RESULT solver=" << options.solver_name << " backend=" << backend_name << " cells=" << (long long)cells
+			<< " steps=" << steps << " steps_per_s=" << steps_per_s << " ms_p50=" << percentile(step_ms, 0.50)
+			<< " ms_p99=" << percentile(step_ms, 0.99) << " cells_per_s=" << cells*steps_per_s
+			<< " pressure=" << (multigrid ? "multigrid" : "jacobi") << " cycles_per_step=" << cycles_per_step
+			<< " layout=" << options.layout_name
+			<< " precision=" << (options.precision == StoragePrecision::Half ? "half" : "float") << " relax=" << (options.relaxation.enabled ? options.relaxation.tolerance : 0.0f)
+			<< " sweeps_per_step=" << sweeps_per_step << " sparse=" << (options.sparse ? 1 : 0) << " active=" << active
+			<< " density_hash=" << density_hash << " tuned=" << tuned
+			<< " advection=" << advectionSchemeName(options.advection) << " detail=" << detail << endl;
+		if (profiler) {
+			profiler->print(cout);
+			if (!profiler->write(options.profile_file)) {
+				return 1;
+			}
+		}
+	} catch (cl::Error & e) {
+		cout << "OpenCL error: " << e.what() << " (" << OpenCLFactory::getErrorStr(e.err()) << ")" << endl;
+		return 1;
+	}
+	return 0;
+}
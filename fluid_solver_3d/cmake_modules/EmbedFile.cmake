@@ -0,0 +1,16 @@
+# Write the content of INPUT in the header OUTPUT as an array of bytes named NAME
+# usage: cmake -DINPUT=<file> -DOUTPUT=<header> -DNAME=<symbol> -P EmbedFile.cmake
+file(READ "${INPUT}" content HEX)
+string(REGEX REPLACE "([0-9a-f][0-9a-f])" "0x\\1," content "${content}")
+# 16 bytes per line (no {n} quantifier in the CMake regular expressions)
+set(line "")
+foreach(i RANGE 15)
+	set(line "${line}0x[0-9a-f][0-9a-f],")
+endforeach()
+string(REGEX REPLACE "(${line})" "\\1\n\t" content "${content}")
+file(WRITE "${OUTPUT}"
+	"// Generated from ${INPUT} by EmbedFile.cmake, do not edit\n"
+	"#ifndef ${NAME}_EMBEDDED_H\n"
+	"#define ${NAME}_EMBEDDED_H\n\n"
+	"static const unsigned char ${NAME}[] = {\n\t${content}\n};\n\n"
+	"#endif\n")
@@ -11,4 +11,53 @@ constexpr unsigned int DEFAULT_DEPTH = 10;
 
 constexpr auto PLATFORM = 0;
 
+/** Fluid properties */
+constexpr float VISCO = 0.00001f;
+constexpr float VISCO_DIV = 1.0f + 6.0f*VISCO;
+constexpr float DIFF_DENSITY = 0.000001f;
+constexpr unsigned int SOLVER_NB_ITERATIONS = 16;
+
+/** Staging images of the asynchronous frame readback (>= 2) */
+constexpr unsigned int READBACK_SLOTS = 3;
+
+/** Recording of the .df3 files: host buffers in flight, writer threads,
+* and what to do when every buffer is busy (true: drop the frame, false: wait for a writer) */
+constexpr unsigned int DF3_BUFFERS = 4;
+constexpr unsigned int DF3_WRITERS = 2;
+constexpr bool DF3_DROP_FRAMES = false;
+
+/** Threads of the CPU engine (--cpu), 0 = every hardware thread */
+constexpr unsigned int CPU_THREADS = 0;
+
+/** Simulation thread of the application: fixed time step of the solver and steps run at most
+* between two frames (beyond, the simulated time slows down) */
+constexpr float SIMULATION_DT = 1.0f / 60.0f;
+constexpr unsigned int SIMULATION_MAX_SUBSTEPS = 4;
+
+/** Work-group tuning (--tune): updates run while the local sizes of their launches are timed */
+constexpr unsigned int WORK_GROUP_TUNING_STEPS = 3;
+
+/** Multi-device engine (--cluster): layers copied from each neighbouring slab (>= 1, the advection
+* cannot trace further in z across a slab boundary), and sub-devices made from a CPU device (1 = whole) */
+constexpr unsigned int CLUSTER_GHOST_LAYERS = 2;
+constexpr unsigned int CLUSTER_CPU_PARTITIONS = 2;
+
+/** Out-of-core engine (--out-of-core): layers owned by a slab streamed through the device, halo layers loaded
+* around it (the z reach of the passes run before the slab is written back, >= 1), layers an advection is
+* assumed to trace back in z (<= the halo), and slabs resident on the device (>= 2, transfers overlap the compute) */
+constexpr unsigned int OOC_SLAB_LAYERS = 16;
+constexpr unsigned int OOC_HALO_LAYERS = 8;
+constexpr unsigned int OOC_ADVECT_LAYERS = 2;
+constexpr unsigned int OOC_SLOTS = 2;
+
+/** Sparse bricks (--sparse): edge of a brick in cells, and the density and velocity below which a brick is empty
+* (it is then skipped by the kernels and its cells are cleared once its neighbours are empty too) */
+constexpr unsigned int SPARSE_BRICK_SIZE = 8;
+constexpr float SPARSE_THRESHOLD = 1e-4f;
+
+/** Sources queued between two updates: above this number of splats they are binned by square tiles
+* of SPLAT_TILE_SIZE cells, so a cell only loops over the splats of its tile */
+constexpr int SPLAT_BINNING_THRESHOLD = 32;
+constexpr int SPLAT_TILE_SIZE = 16;
+
 #endif // !CONFIG_H
\ No newline at end of file
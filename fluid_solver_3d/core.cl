@@ -1,45 +1,141 @@
-__kernel void diffuse(__global float* dest, __global float* source, float a, float div, int width, int height, int depth)
+// Storage of the fields, chosen by Fluid3D with -D FIELD_HALF: 16 bits halves read and written
+// with vload_half/vstore_half, the arithmetic stays in float (sums and solver states are floats/ints)
+#ifdef FIELD_HALF
+#define FIELD half
+#define LOAD(f, i) vload_half((i), (f))
+#define STORE(f, i, value) vstore_half((value), (i), (f))
+#define FIELD_LOAD3(i, f) vload_half3((i), (f))
+#define FIELD_STORE3(value, i, f) vstore_half3((value), (i), (f))
+#define FIELD_LOAD4(i, f) vload_half4((i), (f))
+#define FIELD_STORE4(value, i, f) vstore_half4((value), (i), (f))
+#else
+#define FIELD float
+#define LOAD(f, i) ((f)[(i)])
+#define STORE(f, i, value) ((f)[(i)] = (value))
+#define FIELD_LOAD3(i, f) vload3((i), (f))
+#define FIELD_STORE3(value, i, f) vstore3((value), (i), (f))
+#define FIELD_LOAD4(i, f) vload4((i), (f))
+#define FIELD_STORE4(value, i, f) vstore4((value), (i), (f))
+#endif
+
+// Layout of the velocity buffers, chosen by Fluid3D with -D VELOCITY_LAYOUT=n
+// 0: interleaved x,y,z (default), 1: three planes of VELOCITY_PLANE values, 2: 4 values padded with a 0
+#ifndef VELOCITY_LAYOUT
+#define VELOCITY_LAYOUT 0
+#endif
+#if VELOCITY_LAYOUT == 1
+#define VEL_LOAD(v, i) ((float3)(LOAD(v, (i)), LOAD(v, (i) + VELOCITY_PLANE), LOAD(v, (i) + 2*VELOCITY_PLANE)))
+#define VEL_STORE(v, i, value) { const float3 vel_ = (value); STORE(v, (i), vel_.x); STORE(v, (i) + VELOCITY_PLANE, vel_.y); STORE(v, (i) + 2*VELOCITY_PLANE, vel_.z); }
+#define VEL_COMPONENT(v, i, c) LOAD(v, (i) + (c)*VELOCITY_PLANE)
+#elif VELOCITY_LAYOUT == 2
+#define VEL_LOAD(v, i) (FIELD_LOAD4((i), (v)).xyz)
+#define VEL_STORE(v, i, value) FIELD_STORE4((float4)((value), 0.0f), (i), (v))
+#define VEL_COMPONENT(v, i, c) LOAD(v, 4*(i) + (c))
+#else
+#define VEL_LOAD(v, i) FIELD_LOAD3((i), (v))
+#define VEL_STORE(v, i, value) FIELD_STORE3((value), (i), (v))
+#define VEL_COMPONENT(v, i, c) LOAD(v, 3*(i) + (c))
+#endif
+
+// Sparse bricks, chosen by Fluid3D with -D SPARSE_BRICK=n -D BRICKS_X/Y/Z -D GRID_WIDTH/HEIGHT/DEPTH: the grid is cut
+// in bricks of n^3 cells. The main kernels take the active flags of the bricks and the list of the active bricks
+// (brickList) as last arguments, and are launched in 1D over the cells of the listed bricks (CELL_POS): the cells
+// of an inactive brick hold 0 and get no work item. Without SPARSE_BRICK, CELL_POS is the 3D global id
+#ifdef SPARSE_BRICK
+#define SPARSE_PARAM , __global const uchar* bricks, __global const int* brick_list
+#define BRICK_INDEX(x, y, z) ((x)/SPARSE_BRICK + ((y)/SPARSE_BRICK + ((z)/SPARSE_BRICK)*BRICKS_Y)*BRICKS_X)
+#define BRICK_CELLS (SPARSE_BRICK*SPARSE_BRICK*SPARSE_BRICK)
+#define SPARSE_INACTIVE(x, y, z) (!bricks[BRICK_INDEX(x, y, z)])
+#define CELL_POS() sparseCell(brick_list)
+
+int3 listedCell(__global const int* brick_list)
 {
-	const int x = get_global_id(0);
-	const int y = get_global_id(1);
-	const int z = get_global_id(2);
+	// work item i: cell i % n^3 of the brick brick_list[1 + i / n^3] (brick_list[0] bricks are listed),
+	// the work items past the list get the position (width, height, depth)
+	const int i = get_global_id(0);
+	const int slot = i / BRICK_CELLS;
+	if (slot >= brick_list[0]) {
+		return (int3)(GRID_WIDTH, GRID_HEIGHT, GRID_DEPTH);
+	}
+	const int brick = brick_list[1 + slot];
+	const int cell = i - slot*BRICK_CELLS;
+	return (int3)(brick % BRICKS_X, (brick / BRICKS_X) % BRICKS_Y, brick / (BRICKS_X*BRICKS_Y))*SPARSE_BRICK
+		+ (int3)(cell % SPARSE_BRICK, (cell / SPARSE_BRICK) % SPARSE_BRICK, cell / (SPARSE_BRICK*SPARSE_BRICK));
+}
+
+int3 sparseCell(__global const int* brick_list)
+{
+	// listedCell, the cells off the inner cells also get the position (width, height, depth) and return
+	const int3 pos = listedCell(brick_list);
+	if (pos.x < 1 || pos.y < 1 || pos.z < 1 || pos.x >= GRID_WIDTH - 1 || pos.y >= GRID_HEIGHT - 1 || pos.z >= GRID_DEPTH - 1) {
+		return (int3)(GRID_WIDTH, GRID_HEIGHT, GRID_DEPTH);
+	}
+	return pos;
+}
+
+// the bricks on the far sides of the grid may stick out of it
+#define OUTSIDE_GRID(pos) ((pos).x >= GRID_WIDTH || (pos).y >= GRID_HEIGHT || (pos).z >= GRID_DEPTH)
+#define GRID_INDEX(pos) ((pos).x + ((pos).y + (pos).z*GRID_HEIGHT)*GRID_WIDTH)
+#else
+#define SPARSE_PARAM
+#define SPARSE_INACTIVE(x, y, z) 0
+#define CELL_POS() ((int3)(get_global_id(0), get_global_id(1), get_global_id(2)))
+#endif
+
+// The tuner may round the launches of the kernels checking their bounds up to a multiple of their work-group size
+// (WorkGroupTuner::setBounded): the work items beyond the inner cells of the grid of the launch return
+#define OUTSIDE_INNER(x, y, z) ((x) >= width - 1 || (y) >= height - 1 || (z) >= depth - 1)
+
+__kernel void diffuse(__global FIELD* dest, __global FIELD* source, float a, float div, int width, int height, int depth SPARSE_PARAM)
+{
+	const int3 pos = CELL_POS();
+	const int x = pos.x;
+	const int y = pos.y;
+	const int z = pos.z;
+	if (OUTSIDE_INNER(x, y, z)) {
+		return;
+	}
 	int wh = width*height;
 	int index = x + y*width + z*wh;
 	//if(x > 0 && x+1 < width && y > 0 && y+1 < height && z > 0 && z+1 < depth){
-		float val = (source[index] 
-		        + a*(dest[index-1]+dest[index+1]
-					+dest[index-width]+dest[index+width]
-					+dest[index-wh]+dest[index+wh]))/div;
-		dest[index] = val;
+		float val = (LOAD(source, index) 
+		        + a*(LOAD(dest, index-1)+LOAD(dest, index+1)
+					+LOAD(dest, index-width)+LOAD(dest, index+width)
+					+LOAD(dest, index-wh)+LOAD(dest, index+wh)))/div;
+		STORE(dest, index, val);
 	//}
 }
 
-__kernel void diffuse3D(__global float* field, __global float* source, float a, float div, int width, int height, int depth)
+__kernel void diffuse3D(__global FIELD* field, __global FIELD* source, float a, float div, int width, int height, int depth SPARSE_PARAM)
 {
-	const int x = get_global_id(0);
-	const int y = get_global_id(1);
-	const int z = get_global_id(2);
+	const int3 pos = CELL_POS();
+	const int x = pos.x;
+	const int y = pos.y;
+	const int z = pos.z;
+	if (OUTSIDE_INNER(x, y, z)) {
+		return;
+	}
 	int wh = width*height;
 	int vindex = x + y*width + z*wh;
 	//if(x > 0 && x+1 < width && y > 0 && y+1 < height && z > 0 && z+1 < depth){
-		for(int i=0;i<3;++i){
-			int index = 3*vindex+i;
-			float val = (source[index] + 
-					a*(  field[3*(vindex-1)+i]+field[3*(vindex+1)+i]
-						+field[3*(vindex-width)+i]+field[3*(vindex+width)+i]
-						+field[3*(vindex-wh)+i]+field[3*(vindex+wh)+i]))/div;
-			field[index] = val;
-		}
+		float3 val = (VEL_LOAD(source, vindex) +
+				a*(  VEL_LOAD(field, vindex-1)+VEL_LOAD(field, vindex+1)
+					+VEL_LOAD(field, vindex-width)+VEL_LOAD(field, vindex+width)
+					+VEL_LOAD(field, vindex-wh)+VEL_LOAD(field, vindex+wh)))/div;
+		VEL_STORE(field, vindex, val);
 	//}
 }
 
-__kernel void drawScreen(__global float* field, __write_only image2d_t img_out, int width, int height)
+__kernel void drawScreen(__global FIELD* field, __write_only image2d_t img_out, int width, int height)
 {
 	const int2 ipos = (int2)(get_global_id(0), get_global_id(1));
+	if (ipos.x >= width || ipos.y >= height) {
+		return;
+	}
 	const int4 pos = (int4)(get_global_id(0), get_global_id(1), 1,0);
 	const int4 pos2 = (int4)(get_global_id(0), get_global_id(1), 1,0);
-	float v = field[pos.x+pos.y*width+pos.z*width*height];
-	float v2 = field[pos.x+pos.y*width+pos2.z*width*height];
+	float v = LOAD(field, pos.x+pos.y*width+pos.z*width*height);
+	float v2 = LOAD(field, pos.x+pos.y*width+pos2.z*width*height);
 	int r = (int)(v*200.0f);
 	int g = (int)(v*56.0f);
 	int b = (int)(v*10.f);
@@ -49,13 +145,14 @@ __kernel void drawScreen(__global float* field, __write_only image2d_t img_out,
 	write_imageui(img_out, ipos, (uint4)(r, g, b, 255));
 }
 
-__kernel void drawScreen2(__global float* field, __write_only image2d_t img_out, int width, int height)
+__kernel void drawScreen2(__global FIELD* field, __write_only image2d_t img_out, int width, int height)
 {
 	const int2 ipos = (int2)(get_global_id(0), get_global_id(1));
 	const int4 pos = (int4)(get_global_id(0), get_global_id(1), 1,0);
-	float v1 = field[3*(pos.x+pos.y*width+pos.z*width*height)];
-	float v2 = field[3*(pos.x+pos.y*width+pos.z*width*height)+1];
-	float v3 = field[3*(pos.x+pos.y*width+pos.z*width*height)+2];
+	float3 v = VEL_LOAD(field, pos.x+pos.y*width+pos.z*width*height);
+	float v1 = v.x;
+	float v2 = v.y;
+	float v3 = v.z;
 	//float4 v2 = read_imagef(img_in, samplerA, pos2);
 	int r = (int)(fabs(v1)*100.0f);
 	int g = (int)(fabs(v2)*100.0f);
@@ -66,7 +163,7 @@ __kernel void drawScreen2(__global float* field, __write_only image2d_t img_out,
 	write_imageui(img_out, ipos, (uint4)(r, g, b, 255));
 }
 
-__kernel void addSource(__global float* field, int px, int py, int pz, float add, float radius, int width, int height)
+__kernel void addSource(__global FIELD* field, int px, int py, int pz, float add, float radius, int width, int height)
 {
 	const int xpos = get_global_id(0);
 	const int ypos = get_global_id(1);
@@ -78,11 +175,11 @@ __kernel void addSource(__global float* field, int px, int py, int pz, float add
 	if (d_sq <= radius*radius) {
 		float value = add;//*(1.0-sqrt(d_sq)/radius);
 		int index = xpos+ypos*width+zpos*width*height;
-		field[index] += value;
+		STORE(field, index, LOAD(field, index) + value);
 	}
 }
 
-__kernel void addSource3D(__global float* field, int px, int py, int pz, float add_x, float add_y, float radius, int width, int height)
+__kernel void addSource3D(__global FIELD* field, int px, int py, int pz, float add_x, float add_y, float radius, int width, int height)
 {
 	const int xpos = get_global_id(0);
 	const int ypos = get_global_id(1);
@@ -92,59 +189,128 @@ __kernel void addSource3D(__global float* field, int px, int py, int pz, float a
 	const float dz = (float)zpos - pz;
 	const float d_sq = dx*dx+dy*dy;//+dz*dz;
 	if (d_sq <= radius*radius) {
-		float3 value = (float3)(add_x,add_y,0);//*(1.0-sqrt(d_sq)/radius);
 		int index = xpos+ypos*width+zpos*width*height;
-		field[3*index  ] += value.x;
-		field[3*index+1] += value.y;
-		field[3*index+2] = 0;
+		float3 value = VEL_LOAD(field, index);
+		value.x += add_x;//*(1.0-sqrt(d_sq)/radius);
+		value.y += add_y;
+		value.z = 0;
+		VEL_STORE(field, index, value);
+	}
+}
+
+// splats: 4 float4 each (center, reach, falloff / box x0, y0, x1, y1 / layers z0, z1, density, velocity flag / dx, dy)
+// tile_size > 0: the cell only loops over the splats of its tile of the launched box (tile_offsets, tile_splats)
+__kernel void splatSources(__global FIELD* density, __global FIELD* velocity,
+		__global const float4* splats, int nb_splats,
+		__global const uint* tile_offsets, __global const uint* tile_splats, int tile_size, int tiles_x,
+		int width, int height)
+{
+	const int xpos = get_global_id(0);
+	const int ypos = get_global_id(1);
+	const int zpos = get_global_id(2);
+	uint first = 0;
+	uint last = nb_splats;
+	if (tile_size > 0) {
+		const int tile = (xpos - (int)get_global_offset(0))/tile_size + (ypos - (int)get_global_offset(1))/tile_size*tiles_x;
+		first = tile_offsets[tile];
+		last = tile_offsets[tile + 1];
+	}
+	const int index = xpos+ypos*width+zpos*width*height;
+	bool density_touched = false;
+	bool velocity_touched = false;
+	float d = 0.0f;
+	float3 v = (float3)(0.0f, 0.0f, 0.0f);
+	for (uint k = first; k < last; ++k) {
+		__global const float4* splat = splats + 4*((tile_size > 0) ? tile_splats[k] : k);
+		const float4 shape = splat[0];
+		const float4 box = splat[1];
+		const float4 amounts = splat[2];
+		if (xpos < box.x || ypos < box.y || xpos >= box.z || ypos >= box.w || zpos < amounts.x || zpos >= amounts.y) {
+			continue;
+		}
+		const float dx = (float)xpos - shape.x;
+		const float dy = (float)ypos - shape.y;
+		const float d_sq = dx*dx + dy*dy;// a column of discs, like addSource
+		const float r_sq = shape.z*shape.z;
+		if (d_sq > r_sq) {
+			continue;
+		}
+		const float weight = (shape.w > 0.0f) ? pow(1.0f - d_sq/r_sq, shape.w) : 1.0f;
+		if (amounts.z != 0.0f) {
+			if (!density_touched) {
+				d = LOAD(density, index);
+				density_touched = true;
+			}
+			d += amounts.z*weight;
+		}
+		if (amounts.w != 0.0f) {
+			if (!velocity_touched) {
+				v = VEL_LOAD(velocity, index);
+				velocity_touched = true;
+			}
+			v.x += splat[3].x*weight;
+			v.y += splat[3].y*weight;
+			v.z = 0;
+		}
+	}
+	// the cells out of every splat are not written
+	if (density_touched) {
+		STORE(density, index, d);
+	}
+	if (velocity_touched) {
+		VEL_STORE(velocity, index, v);
 	}
 }
 
-__kernel void resetBuffer(__global float* field, int width, int height)
+__kernel void resetBuffer(__global FIELD* field, int width, int height)
 {
 	const int x = get_global_id(0);
 	const int y = get_global_id(1);
 	const int z = get_global_id(2);
 	int index = x + y*width + z*width*height;
-	field[index] = 0.0f;
+	STORE(field, index, 0.0f);
 }
 
-__kernel void resetBuffer3D(__global float* field, int width, int height)
+__kernel void resetBuffer3D(__global FIELD* field, int width, int height)
 {
 	const int x = get_global_id(0);
 	const int y = get_global_id(1);
 	const int z = get_global_id(2);
 	int index = x + y*width + z*width*height;
-	for(int i=0;i<3;++i){
-		field[3*index+i] = 0.0f;
-	}
+	VEL_STORE(field, index, (float3)(0.0f, 0.0f, 0.0f));
 }
 
-__kernel void advect(__global float* density_out, __global float* density, __global float* velocity,
-		int width, int height, int depth, float dt)
+// position reached at -dt by the particle at "pos", in the local layers of the buffers:
+// z_offset: global layer of the layer 0 of the buffers, z_limit: largest local z the back trace may reach
+// (a slab of Fluid3DCluster only holds its layers and its ghost layers, the single grid passes 0 and depth + 0.5)
+inline float3 backtrace3D(float3 velocity, int3 pos, float dt, int width, int height, int depth, int z_offset, float z_limit)
 {
-	const int3 pos = (int3)(get_global_id(0), get_global_id(1), get_global_id(2));
 	const float3 dt0 = dt*(float3)(width, height, depth);
-	const int wh = width*height;
-	const int index = pos.x + pos.y*width + pos.z*wh;
-	float3 vvv = (float3)(velocity[3*index],velocity[3*index+1],velocity[3*index+2]);
-	float3 dpos = (float3)(pos.x, pos.y, pos.z) - dt0*vvv;
+	float3 dpos = (float3)(pos.x, pos.y, pos.z + z_offset) - dt0*velocity;
 	dpos.x = clamp(dpos.x, 0.5f, width + 0.5f);
 	dpos.y = clamp(dpos.y, 0.5f, height + 0.5f);
-	dpos.z = clamp(dpos.z, 0.5f, depth + 0.5f);
+	dpos.z = clamp(clamp(dpos.z, 0.5f, depth + 0.5f) - z_offset, 0.0f, z_limit);
+	return dpos;
+}
+
+// trilinear interpolation of the 8 values around dpos, "range" receives their minimum and maximum
+inline float trilinear(__global FIELD* field, float3 dpos, int width, int wh, float2* range)
+{
 	int3 vi = (int3)(dpos.x, dpos.y, dpos.z);// integer final position
-	float input000 = density[vi.x+ vi.y*width+ vi.z*wh];
-	float input010 = density[vi.x+ (vi.y+1)*width+ vi.z*wh];
-	float input100 = density[vi.x+1 + vi.y*width+ vi.z*wh];
-	float input110 = density[vi.x+1 + (vi.y+1)*width+ vi.z*wh];
-	float input001 = density[vi.x+ vi.y*width+ (vi.z+1)*wh];
-	float input011 = density[vi.x+ (vi.y+1)*width+ (vi.z+1)*wh];
-	float input101 = density[vi.x+1 + vi.y*width+ (vi.z+1)*wh];
-	float input111 = density[vi.x+1 + (vi.y+1)*width+ (vi.z+1)*wh];
-	
+	float input000 = LOAD(field, vi.x+ vi.y*width+ vi.z*wh);
+	float input010 = LOAD(field, vi.x+ (vi.y+1)*width+ vi.z*wh);
+	float input100 = LOAD(field, vi.x+1 + vi.y*width+ vi.z*wh);
+	float input110 = LOAD(field, vi.x+1 + (vi.y+1)*width+ vi.z*wh);
+	float input001 = LOAD(field, vi.x+ vi.y*width+ (vi.z+1)*wh);
+	float input011 = LOAD(field, vi.x+ (vi.y+1)*width+ (vi.z+1)*wh);
+	float input101 = LOAD(field, vi.x+1 + vi.y*width+ (vi.z+1)*wh);
+	float input111 = LOAD(field, vi.x+1 + (vi.y+1)*width+ (vi.z+1)*wh);
+	range->x = fmin(fmin(fmin(input000, input010), fmin(input100, input110)), fmin(fmin(input001, input011), fmin(input101, input111)));
+	range->y = fmax(fmax(fmax(input000, input010), fmax(input100, input110)), fmax(fmax(input001, input011), fmax(input101, input111)));
+
 	float3 rest = dpos - (float3)(vi.x, vi.y, vi.z);
 	float3 org = (float3)(1.0f,1.0f,1.0f) - rest; 
-	float value = 
+	return
 		  org.x *org.y *org.z *input000
 		+ org.x *rest.y*org.z *input010
 		+ rest.x*org.y *org.z *input100
@@ -153,92 +319,618 @@ __kernel void advect(__global float* density_out, __global float* density, __glo
 		+ org.x *rest.y*rest.z*input011
 		+ rest.x*org.y *rest.z*input101
 		+ rest.x*rest.y*rest.z*input111;
-	density_out[pos.x+pos.y*width+pos.z*wh] = value;
 }
 
-__kernel void advect3D(__global float* velocity_out, __global float* velocity,
-		int width, int height, int depth, float dt)
+// trilinear interpolation of a velocity field, one gather of the 8 neighbours for the 3 components
+inline float3 trilinear3(__global FIELD* field, float3 dpos, int width, int wh, float3* lo, float3* hi)
 {
-	const int3 pos = (int3)(get_global_id(0), get_global_id(1), get_global_id(2));
-	const float3 dt0 = dt*(float3)(width, height, depth);
-	const int wh = width*height;
-	const int index = pos.x + pos.y*width + pos.z*wh;
-	float3 vvv = (float3)(velocity[3*index],velocity[3*index+1],velocity[3*index+2]);
-	float3 dpos = (float3)(pos.x, pos.y, pos.z) - dt0*vvv;
-	dpos.x = clamp(dpos.x, 0.5f, width + 0.5f);
-	dpos.y = clamp(dpos.y, 0.5f, height + 0.5f);
-	dpos.z = clamp(dpos.z, 0.5f, depth + 0.5f);
 	int3 vi = (int3)(dpos.x, dpos.y, dpos.z);// integer final position
 	
 	float3 rest = dpos - (float3)(vi.x, vi.y, vi.z);
 	float3 org = (float3)(1.0f,1.0f,1.0f) - rest;
 	
-	for(int i=0;i<3;++i){
-		float input000 = velocity[3*(vi.x   + vi.y*width     + vi.z*wh)+i];
-		float input010 = velocity[3*(vi.x   + (vi.y+1)*width + vi.z*wh)+i];
-		float input100 = velocity[3*(vi.x+1 + vi.y*width     + vi.z*wh)+i];
-		float input110 = velocity[3*(vi.x+1 + (vi.y+1)*width + vi.z*wh)+i];
-		float input001 = velocity[3*(vi.x   + vi.y*width     + (vi.z+1)*wh)+i];
-		float input011 = velocity[3*(vi.x   + (vi.y+1)*width + (vi.z+1)*wh)+i];
-		float input101 = velocity[3*(vi.x+1 + vi.y*width     + (vi.z+1)*wh)+i];
-		float input111 = velocity[3*(vi.x+1 + (vi.y+1)*width + (vi.z+1)*wh)+i];
-		
-
-		float value = 
-			  org.x *org.y *org.z *input000
-			+ org.x *rest.y*org.z *input010
-			+ rest.x*org.y *org.z *input100
-			+ rest.x*rest.y*org.z *input110
-			+ org.x *org.y *rest.z*input001
-			+ org.x *rest.y*rest.z*input011
-			+ rest.x*org.y *rest.z*input101
-			+ rest.x*rest.y*rest.z*input111;
-		velocity_out[3*index+i] = value;
-	}
-}
-
-__kernel void project1(__global float* out,
-	__global float* velocity, int width, int height, int depth) {
+	float3 input000 = VEL_LOAD(field, vi.x   + vi.y*width     + vi.z*wh);
+	float3 input010 = VEL_LOAD(field, vi.x   + (vi.y+1)*width + vi.z*wh);
+	float3 input100 = VEL_LOAD(field, vi.x+1 + vi.y*width     + vi.z*wh);
+	float3 input110 = VEL_LOAD(field, vi.x+1 + (vi.y+1)*width + vi.z*wh);
+	float3 input001 = VEL_LOAD(field, vi.x   + vi.y*width     + (vi.z+1)*wh);
+	float3 input011 = VEL_LOAD(field, vi.x   + (vi.y+1)*width + (vi.z+1)*wh);
+	float3 input101 = VEL_LOAD(field, vi.x+1 + vi.y*width     + (vi.z+1)*wh);
+	float3 input111 = VEL_LOAD(field, vi.x+1 + (vi.y+1)*width + (vi.z+1)*wh);
+	*lo = fmin(fmin(fmin(input000, input010), fmin(input100, input110)), fmin(fmin(input001, input011), fmin(input101, input111)));
+	*hi = fmax(fmax(fmax(input000, input010), fmax(input100, input110)), fmax(fmax(input001, input011), fmax(input101, input111)));
 
-	const int xpos = get_global_id(0);
-	const int ypos = get_global_id(1);
-	const int zpos = get_global_id(2);
+	return
+		  org.x *org.y *org.z *input000
+		+ org.x *rest.y*org.z *input010
+		+ rest.x*org.y *org.z *input100
+		+ rest.x*rest.y*org.z *input110
+		+ org.x *org.y *rest.z*input001
+		+ org.x *rest.y*rest.z*input011
+		+ rest.x*org.y *rest.z*input101
+		+ rest.x*rest.y*rest.z*input111;
+}
+
+__kernel void advect(__global FIELD* density_out, __global FIELD* density, __global FIELD* velocity,
+		int width, int height, int depth, float dt, int z_offset, float z_limit SPARSE_PARAM)
+{
+	const int3 pos = CELL_POS();
+	if (OUTSIDE_INNER(pos.x, pos.y, pos.z)) {
+		return;
+	}
+	const int wh = width*height;
+	const int index = pos.x + pos.y*width + pos.z*wh;
+	float3 vvv = VEL_LOAD(velocity, index);
+	float3 dpos = backtrace3D(vvv, pos, dt, width, height, depth, z_offset, z_limit);
+	float2 range;
+	STORE(density_out, index, trilinear(density, dpos, width, wh, &range));
+}
+
+__kernel void advect3D(__global FIELD* velocity_out, __global FIELD* velocity,
+		int width, int height, int depth, float dt, int z_offset, float z_limit SPARSE_PARAM)
+{
+	const int3 pos = CELL_POS();
+	if (OUTSIDE_INNER(pos.x, pos.y, pos.z)) {
+		return;
+	}
+	const int wh = width*height;
+	const int index = pos.x + pos.y*width + pos.z*wh;
+	float3 vvv = VEL_LOAD(velocity, index);
+	float3 dpos = backtrace3D(vvv, pos, dt, width, height, depth, z_offset, z_limit);
+	float3 lo, hi;
+	VEL_STORE(velocity_out, index, trilinear3(velocity, dpos, width, wh, &lo, &hi));
+}
+
+// Higher order advections of Fluid3D (MacCormack and BFECC), three launches on the single grid:
+// "ahead" = advect(field) by advect/advect3D, "back" = ahead advected with -dt (advect, advectField3D)
+// then advectCorrect/advectCorrect3D. bfecc = 0 (MacCormack): ahead + (field - back)/2 at the cell,
+// bfecc = 1: field + (field - back)/2 advected again. Either result is clamped to the 8 values of "field"
+// around the backtrace, so the correction creates no new extremum (and stays stable)
+
+// velocity field "field" advected along "velocity" (advect3D advects a velocity along itself)
+__kernel void advectField3D(__global FIELD* field_out, __global FIELD* field, __global FIELD* velocity,
+		int width, int height, int depth, float dt SPARSE_PARAM)
+{
+	const int3 pos = CELL_POS();
+	if (OUTSIDE_INNER(pos.x, pos.y, pos.z)) {
+		return;
+	}
+	const int wh = width*height;
+	const int index = pos.x + pos.y*width + pos.z*wh;
+	float3 dpos = backtrace3D(VEL_LOAD(velocity, index), pos, dt, width, height, depth, 0, depth + 0.5f);
+	float3 lo, hi;
+	VEL_STORE(field_out, index, trilinear3(field, dpos, width, wh, &lo, &hi));
+}
+
+__kernel void advectCorrect(__global FIELD* density_out, __global FIELD* density, __global FIELD* ahead, __global FIELD* back,
+		__global FIELD* velocity, int width, int height, int depth, float dt, int bfecc SPARSE_PARAM)
+{
+	const int3 pos = CELL_POS();
+	if (OUTSIDE_INNER(pos.x, pos.y, pos.z)) {
+		return;
+	}
+	const int wh = width*height;
+	const int index = pos.x + pos.y*width + pos.z*wh;
+	float3 dpos = backtrace3D(VEL_LOAD(velocity, index), pos, dt, width, height, depth, 0, depth + 0.5f);
+	float2 range, unused;
+	const float value = trilinear(density, dpos, width, wh, &range);
+	float corrected;
+	if (bfecc) {
+		// the advection is linear: the sample of field + (field - back)/2 is 1.5 sample(field) - 0.5 sample(back)
+		corrected = 1.5f*value - 0.5f*trilinear(back, dpos, width, wh, &unused);
+	} else {
+		corrected = LOAD(ahead, index) + 0.5f*(LOAD(density, index) - LOAD(back, index));
+	}
+	STORE(density_out, index, clamp(corrected, range.x, range.y));
+}
+
+__kernel void advectCorrect3D(__global FIELD* velocity_out, __global FIELD* velocity, __global FIELD* ahead, __global FIELD* back,
+		int width, int height, int depth, float dt, int bfecc SPARSE_PARAM)
+{
+	const int3 pos = CELL_POS();
+	if (OUTSIDE_INNER(pos.x, pos.y, pos.z)) {
+		return;
+	}
+	const int wh = width*height;
+	const int index = pos.x + pos.y*width + pos.z*wh;
+	const float3 vvv = VEL_LOAD(velocity, index);
+	float3 dpos = backtrace3D(vvv, pos, dt, width, height, depth, 0, depth + 0.5f);
+	float3 lo, hi, unused_lo, unused_hi;
+	const float3 value = trilinear3(velocity, dpos, width, wh, &lo, &hi);
+	float3 corrected;
+	if (bfecc) {
+		corrected = 1.5f*value - 0.5f*trilinear3(back, dpos, width, wh, &unused_lo, &unused_hi);
+	} else {
+		corrected = VEL_LOAD(ahead, index) + 0.5f*(vvv - VEL_LOAD(back, index));
+	}
+	VEL_STORE(velocity_out, index, clamp(corrected, lo, hi));
+}
+
+// Volume preview (Fluid3D with PreviewMode::Volume): one ray per pixel through the density, camera of
+// PreviewCamera::basis in cells. A sample of density d absorbs 1 - exp(-absorption*d*step) of the light coming
+// from behind and emits the colour drawScreen gives to d, so an opaque region looks like the slice
+__kernel void raymarchVolume(__global FIELD* field, __write_only image2d_t img_out, int width, int height, int depth,
+	float4 eye, float4 forward, float4 right, float4 up, float absorption, float step)
+{
+	const int2 ipos = (int2)(get_global_id(0), get_global_id(1));
+	const int2 size = get_image_dim(img_out);
+	if (ipos.x >= size.x || ipos.y >= size.y) {
+		return;
+	}
+	const float2 ndc = (float2)((ipos.x + 0.5f)*2.0f/size.x - 1.0f, 1.0f - (ipos.y + 0.5f)*2.0f/size.y);
+	const float3 dir = normalize(forward.xyz + ndc.x*right.xyz + ndc.y*up.xyz);
+	// entry and exit of the box of the inner cells, the edges of the fields hold 0
+	const float3 lo = (float3)(1.0f, 1.0f, 1.0f);
+	const float3 hi = (float3)(width - 2.0f, height - 2.0f, depth - 2.0f);
+	const float3 inv = 1.0f/copysign(fmax(fabs(dir), 1e-6f), dir);
+	const float3 t0 = (lo - eye.xyz)*inv;
+	const float3 t1 = (hi - eye.xyz)*inv;
+	const float3 tmin = fmin(t0, t1);
+	const float3 tmax = fmax(t0, t1);
+	const float t_near = fmax(fmax(fmax(tmin.x, tmin.y), tmin.z), 0.0f);
+	const float t_far = fmin(fmin(tmax.x, tmax.y), tmax.z);
+	const int samples = (int)((t_far - t_near)/step);
+
+	const int wh = width*height;
+	float3 colour = (float3)(0.0f, 0.0f, 0.0f);
+	float transmittance = 1.0f;
+	float2 range;
+	// front to back, stopped once the rest of the ray is hidden
+	for (int i = 0; i < samples && transmittance > 0.01f; ++i) {
+		const float3 p = clamp(eye.xyz + (t_near + (i + 0.5f)*step)*dir, lo, hi);
+		const float d = fmax(trilinear(field, p, width, wh, &range), 0.0f);
+		const float alpha = 1.0f - exp(-absorption*d*step);
+		colour += transmittance*alpha*fmin(d*(float3)(200.0f, 56.0f, 10.0f), 255.0f);
+		transmittance *= 1.0f - alpha;
+	}
+	write_imageui(img_out, ipos, (uint4)(convert_uint3_sat(colour), 255u));
+}
+
+__kernel void project1(__global FIELD* out,
+	__global FIELD* velocity, int width, int height, int depth SPARSE_PARAM) {
+
+	const int3 pos = CELL_POS();
+	const int xpos = pos.x;
+	const int ypos = pos.y;
+	const int zpos = pos.z;
+	if (OUTSIDE_INNER(xpos, ypos, zpos)) {
+		return;
+	}
 	const int wh = width*height;
 	const int index = xpos + ypos*width + zpos*wh;
 	const float hx = 1.0f/width;
 	const float hy = 1.0f/height;
 	const float hz = 1.0f/depth;
 	
-	float dr = velocity[3*(index+1)];
-	float dl = velocity[3*(index-1)];
-	float dd = velocity[3*(index+width)+1];
-	float du = velocity[3*(index-width)+1];
-	float dt = velocity[3*(index+wh)+2];
-	float db = velocity[3*(index-wh)+2];
+	float dr = VEL_COMPONENT(velocity, index+1, 0);
+	float dl = VEL_COMPONENT(velocity, index-1, 0);
+	float dd = VEL_COMPONENT(velocity, index+width, 1);
+	float du = VEL_COMPONENT(velocity, index-width, 1);
+	float dt = VEL_COMPONENT(velocity, index+wh, 2);
+	float db = VEL_COMPONENT(velocity, index-wh, 2);
 
 	float value = -0.5f*(hx*(dr - dl) + hy*(dd - du) + hz*(dt - db));
 
-	out[xpos + ypos*width + zpos*wh] = value;
+	STORE(out, xpos + ypos*width + zpos*wh, value);
 }
 
-__kernel void project2(__global float* in,
-	__global float* velocity, int width, int height, int depth)
+__kernel void project2(__global FIELD* in,
+	__global FIELD* velocity, int width, int height, int depth SPARSE_PARAM)
 {
-	const int xpos = get_global_id(0);
-	const int ypos = get_global_id(1);
-	const int zpos = get_global_id(2);
+	const int3 pos = CELL_POS();
+	const int xpos = pos.x;
+	const int ypos = pos.y;
+	const int zpos = pos.z;
+	if (OUTSIDE_INNER(xpos, ypos, zpos)) {
+		return;
+	}
 
 	const int wh = width*height;
 	const int index = xpos + ypos*width + zpos*wh;
 	
-	float dr = in[index+1];
-	float dl = in[index-1];
-	float dd = in[index+width];
-	float du = in[index-width];
-	float dt = in[index+wh];
-	float db = in[index-wh];
+	float dr = LOAD(in, index+1);
+	float dl = LOAD(in, index-1);
+	float dd = LOAD(in, index+width);
+	float du = LOAD(in, index-width);
+	float dt = LOAD(in, index+wh);
+	float db = LOAD(in, index-wh);
+
+	float3 v = VEL_LOAD(velocity, index);
+	v.x -= 0.5f*(dr - dl) * width;
+	v.y -= 0.5f*(dd - du) * height;
+	v.z -= 0.5f*(dt - db) * depth;
+	VEL_STORE(velocity, index, v);
+}
+
+// Multigrid solver of the pressure equation
+// wx*(2p - p[x-1] - p[x+1]) + wy*(...) + wz*(...) = b, the boundary cells hold p = 0
+// the weights are 1 on the full grid and grow on the coarse levels (see Fluid3D::multigridInit)
+
+__kernel void mgSmooth(__global FIELD* p, __global FIELD* b, float wx, float wy, float wz, int color,
+		int width, int height)
+{
+	// red-black Gauss-Seidel, a launch only updates the cells of one color
+	const int x = get_global_id(0);
+	const int y = get_global_id(1);
+	const int z = get_global_id(2);
+	if (((x + y + z) & 1) != color || x >= width - 1 || y >= height - 1) {
+		return;
+	}
+	int wh = width*height;
+	int index = x + y*width + z*wh;
+	STORE(p, index, (LOAD(b, index)
+			+ wx*(LOAD(p, index-1) + LOAD(p, index+1))
+			+ wy*(LOAD(p, index-width) + LOAD(p, index+width))
+			+ wz*(LOAD(p, index-wh) + LOAD(p, index+wh)))/(2.0f*(wx + wy + wz)));
+}
+
+__kernel void mgResidual(__global FIELD* r, __global FIELD* p, __global FIELD* b, float wx, float wy, float wz,
+		int width, int height)
+{
+	const int x = get_global_id(0);
+	const int y = get_global_id(1);
+	const int z = get_global_id(2);
+	if (x >= width - 1 || y >= height - 1) {
+		return;
+	}
+	int wh = width*height;
+	int index = x + y*width + z*wh;
+	float ap = wx*(2.0f*LOAD(p, index) - LOAD(p, index-1) - LOAD(p, index+1))
+			 + wy*(2.0f*LOAD(p, index) - LOAD(p, index-width) - LOAD(p, index+width))
+			 + wz*(2.0f*LOAD(p, index) - LOAD(p, index-wh) - LOAD(p, index+wh));
+	STORE(r, index, LOAD(b, index) - ap);
+}
+
+__kernel void mgRestrict(__global FIELD* b_coarse, __global FIELD* r_fine,
+		int width, int height, int depth, int coarse_width, int coarse_height, int fx, int fy, int fz)
+{
+	// the coarse right hand side is the sum of the fine residuals of the children
+	const int x = get_global_id(0);
+	const int y = get_global_id(1);
+	const int z = get_global_id(2);
+	if (x >= coarse_width - 1 || y >= coarse_height - 1) {
+		return;
+	}
+	float sum = 0.0f;
+	for (int k = 0; k < fz; ++k) {
+		int zf = 1 + (z-1)*fz + k;
+		for (int j = 0; j < fy; ++j) {
+			int yf = 1 + (y-1)*fy + j;
+			for (int i = 0; i < fx; ++i) {
+				int xf = 1 + (x-1)*fx + i;
+				if (xf < width-1 && yf < height-1 && zf < depth-1) {
+					sum += LOAD(r_fine, xf + yf*width + zf*width*height);
+				}
+			}
+		}
+	}
+	STORE(b_coarse, x + y*coarse_width + z*coarse_width*coarse_height, sum);
+}
+
+// position of the fine cell i in the coarse cells: first cell i0 and weight t of the cell i0+1
+inline void mgAxis(int i, int f, int* i0, float* t)
+{
+	if (f == 1) {
+		*i0 = i;
+		*t = 0.0f;
+	} else {
+		float c = 0.5f*(i-1) + 0.75f;
+		float c0 = floor(c);
+		*i0 = (int)c0;
+		*t = c - c0;
+	}
+}
 
-	velocity[3*index+0] -= 0.5f*(dr - dl) * width;
-	velocity[3*index+1] -= 0.5f*(dd - du) * height;
-	velocity[3*index+2] -= 0.5f*(dt - db) * depth;
+__kernel void mgProlongate(__global FIELD* p, __global FIELD* p_coarse,
+		int width, int height, int coarse_width, int coarse_height, int fx, int fy, int fz)
+{
+	// trilinear interpolation of the coarse correction
+	const int x = get_global_id(0);
+	const int y = get_global_id(1);
+	const int z = get_global_id(2);
+	if (x >= width - 1 || y >= height - 1) {
+		return;
+	}
+	int x0, y0, z0;
+	float tx, ty, tz;
+	mgAxis(x, fx, &x0, &tx);
+	mgAxis(y, fy, &y0, &ty);
+	mgAxis(z, fz, &z0, &tz);
+	int cwh = coarse_width*coarse_height;
+	int c = x0 + y0*coarse_width + z0*cwh;
+	float v0 = (1.0f-ty)*((1.0f-tx)*LOAD(p_coarse, c) + tx*LOAD(p_coarse, c+1))
+			 + ty*((1.0f-tx)*LOAD(p_coarse, c+coarse_width) + tx*LOAD(p_coarse, c+coarse_width+1));
+	c += cwh;
+	float v1 = (1.0f-ty)*((1.0f-tx)*LOAD(p_coarse, c) + tx*LOAD(p_coarse, c+1))
+			 + ty*((1.0f-tx)*LOAD(p_coarse, c+coarse_width) + tx*LOAD(p_coarse, c+coarse_width+1));
+	const int index = x + y*width + z*width*height;
+	STORE(p, index, LOAD(p, index) + (1.0f-tz)*v0 + tz*v1);
+}
+
+__kernel void sumSquaresRows(__global FIELD* field, __global float* sums, int width, int height)
+{
+	// one work item per (y,z) row
+	const int y = get_global_id(0);
+	const int z = get_global_id(1);
+	if (y >= height) {
+		return;
+	}
+	int row = y + z*height;
+	float sum = 0.0f;
+	for (int x = 0; x < width; ++x) {
+		float v = LOAD(field, x + row*width);
+		sum += v*v;
+	}
+	sums[row] = sum;
+}
+
+// Residual driven solves (Fluid3D::relax): red-black SOR of div*p - a*(sum of the 6 neighbours) = b on the
+// inner cells, the residual is checked on the device every few sweeps. "state" holds two ints per solve
+// (converged flag, sweeps done), once the flag is set the remaining launches of the solve do nothing.
+// RELAX_GROUP: work-group size of relaxCheck, defined by the host (PressureSolver.hpp)
+
+__kernel void relaxReset(__global int* state, int max_sweeps)
+{
+	const int slot = get_global_id(0);
+	state[2*slot] = 0;
+	state[2*slot + 1] = max_sweeps;
+}
+
+__kernel void relaxSor(__global FIELD* p, __global FIELD* b, float a, float div, float omega, int color,
+		int width, int height, __global const int* state, int slot SPARSE_PARAM)
+{
+	if (state[2*slot]) {
+		return;
+	}
+	const int3 pos = CELL_POS();
+	const int x = pos.x;
+	const int y = pos.y;
+	const int z = pos.z;
+	if (((x + y + z) & 1) != color || x >= width - 1 || y >= height - 1) {
+		return;
+	}
+	int wh = width*height;
+	int index = x + y*width + z*wh;
+	float sum = LOAD(p, index-1) + LOAD(p, index+1) + LOAD(p, index-width) + LOAD(p, index+width) + LOAD(p, index-wh) + LOAD(p, index+wh);
+	float v = LOAD(p, index);
+	STORE(p, index, v + omega*((LOAD(b, index) + a*sum)/div - v));
+}
+
+__kernel void relaxSor3D(__global FIELD* field, __global FIELD* source, float a, float div, float omega, int color,
+		int width, int height, __global const int* state, int slot SPARSE_PARAM)
+{
+	if (state[2*slot]) {
+		return;
+	}
+	const int3 pos = CELL_POS();
+	const int x = pos.x;
+	const int y = pos.y;
+	const int z = pos.z;
+	if (((x + y + z) & 1) != color || x >= width - 1 || y >= height - 1) {
+		return;
+	}
+	int wh = width*height;
+	int vindex = x + y*width + z*wh;
+	float3 sum = VEL_LOAD(field, vindex-1) + VEL_LOAD(field, vindex+1)
+			+ VEL_LOAD(field, vindex-width) + VEL_LOAD(field, vindex+width)
+			+ VEL_LOAD(field, vindex-wh) + VEL_LOAD(field, vindex+wh);
+	float3 v = VEL_LOAD(field, vindex);
+	VEL_STORE(field, vindex, v + omega*((VEL_LOAD(source, vindex) + a*sum)/div - v));
+}
+
+__kernel void relaxResidualRows(__global FIELD* p, __global FIELD* b, float a, float div, __global float* sums,
+		int width, int height, int depth, __global const int* state, int slot SPARSE_PARAM)
+{
+	// one work item per (y,z) row: sums[row] = |r|^2 and sums[height*depth + row] = |b|^2 of its inner cells
+	if (state[2*slot]) {
+		return;
+	}
+	const int y = get_global_id(0);
+	const int z = get_global_id(1);
+	if (y >= height || z >= depth) {
+		return;
+	}
+	int wh = width*height;
+	int row = y + z*height;
+	float r2 = 0.0f, b2 = 0.0f;
+	if (y > 0 && y + 1 < height && z > 0 && z + 1 < depth) {
+		for (int x = 1; x + 1 < width; ++x) {
+			if (SPARSE_INACTIVE(x, y, z)) {
+				continue;
+			}
+			int index = x + row*width;
+			float sum = LOAD(p, index-1) + LOAD(p, index+1) + LOAD(p, index-width) + LOAD(p, index+width) + LOAD(p, index-wh) + LOAD(p, index+wh);
+			float vb = LOAD(b, index);
+			float r = vb + a*sum - div*LOAD(p, index);
+			r2 += r*r;
+			b2 += vb*vb;
+		}
+	}
+	sums[row] = r2;
+	sums[height*depth + row] = b2;
+}
+
+__kernel void relaxResidualRows3D(__global FIELD* field, __global FIELD* source, float a, float div, __global float* sums,
+		int width, int height, int depth, __global const int* state, int slot SPARSE_PARAM)
+{
+	if (state[2*slot]) {
+		return;
+	}
+	const int y = get_global_id(0);
+	const int z = get_global_id(1);
+	if (y >= height || z >= depth) {
+		return;
+	}
+	int wh = width*height;
+	int row = y + z*height;
+	float r2 = 0.0f, b2 = 0.0f;
+	if (y > 0 && y + 1 < height && z > 0 && z + 1 < depth) {
+		for (int x = 1; x + 1 < width; ++x) {
+			if (SPARSE_INACTIVE(x, y, z)) {
+				continue;
+			}
+			int vindex = x + row*width;
+			float3 sum = VEL_LOAD(field, vindex-1) + VEL_LOAD(field, vindex+1)
+					+ VEL_LOAD(field, vindex-width) + VEL_LOAD(field, vindex+width)
+					+ VEL_LOAD(field, vindex-wh) + VEL_LOAD(field, vindex+wh);
+			float3 vb = VEL_LOAD(source, vindex);
+			float3 r = vb + a*sum - div*VEL_LOAD(field, vindex);
+			r2 += dot(r, r);
+			b2 += dot(vb, vb);
+		}
+	}
+	sums[row] = r2;
+	sums[height*depth + row] = b2;
+}
+
+__kernel __attribute__((reqd_work_group_size(RELAX_GROUP, 1, 1)))
+void relaxCheck(__global float* sums, int nb_rows, float tolerance, int sweeps, __global int* state, int slot)
+{
+	// a single work group adds the rows and marks the solve as converged when |r| <= tolerance*|b|
+	__local float r2[RELAX_GROUP];
+	__local float b2[RELAX_GROUP];
+	if (state[2*slot]) {
+		return;
+	}
+	const int l = get_local_id(0);
+	float r = 0.0f, b = 0.0f;
+	for (int i = l; i < nb_rows; i += RELAX_GROUP) {
+		r += sums[i];
+		b += sums[nb_rows + i];
+	}
+	r2[l] = r;
+	b2[l] = b;
+	barrier(CLK_LOCAL_MEM_FENCE);
+	for (int s = RELAX_GROUP/2; s > 0; s >>= 1) {
+		if (l < s) {
+			r2[l] += r2[l + s];
+			b2[l] += b2[l + s];
+		}
+		barrier(CLK_LOCAL_MEM_FENCE);
+	}
+	if (l == 0 && r2[0] <= tolerance*tolerance*b2[0]) {
+		state[2*slot] = 1;
+		state[2*slot + 1] = sweeps;
+	}
+}
+
+#ifdef SPARSE_BRICK
+// Maintenance of the active bricks (Fluid3D::updateBricks), at the beginning of every update
+
+__kernel void brickOccupancy(__global FIELD* density, __global FIELD* velocity, __global const uchar* bricks,
+		__global uchar* occupied, int width, int height, int depth, float threshold)
+{
+	// one work item per brick: occupied if a cell holds density or velocity above the threshold,
+	// an inactive brick only holds 0 and is not read
+	const int bx = get_global_id(0);
+	const int by = get_global_id(1);
+	const int bz = get_global_id(2);
+	const int brick = bx + (by + bz*BRICKS_Y)*BRICKS_X;
+	int found = 0;
+	if (bricks[brick]) {
+		const int x1 = min((bx + 1)*SPARSE_BRICK, width);
+		const int y1 = min((by + 1)*SPARSE_BRICK, height);
+		const int z1 = min((bz + 1)*SPARSE_BRICK, depth);
+		for (int z = bz*SPARSE_BRICK; z < z1 && !found; ++z) {
+			for (int y = by*SPARSE_BRICK; y < y1 && !found; ++y) {
+				for (int x = bx*SPARSE_BRICK; x < x1 && !found; ++x) {
+					int index = x + (y + z*height)*width;
+					float3 v = fabs(VEL_LOAD(velocity, index));
+					found = fabs(LOAD(density, index)) > threshold || max(v.x, max(v.y, v.z)) > threshold;
+				}
+			}
+		}
+	}
+	occupied[brick] = found;
+}
+
+int brickNeighbourhood(__global const uchar* flags, int bx, int by, int bz)
+{
+	// 1 if the brick or one of its 26 neighbours is flagged
+	int found = 0;
+	for (int z = max(bz - 1, 0); z <= min(bz + 1, BRICKS_Z - 1); ++z) {
+		for (int y = max(by - 1, 0); y <= min(by + 1, BRICKS_Y - 1); ++y) {
+			for (int x = max(bx - 1, 0); x <= min(bx + 1, BRICKS_X - 1); ++x) {
+				found |= flags[x + (y + z*BRICKS_Y)*BRICKS_X];
+			}
+		}
+	}
+	return found;
+}
+
+__kernel void brickDilate(__global const uchar* occupied, __global uchar* bricks, __global uchar* retired)
+{
+	// active: the occupied bricks and their 26 neighbours (the content moves less than a brick per step),
+	// retired (bit 0): the bricks that stop being active, their cells are cleared by brickClear
+	const int bx = get_global_id(0);
+	const int by = get_global_id(1);
+	const int bz = get_global_id(2);
+	const int brick = bx + (by + bz*BRICKS_Y)*BRICKS_X;
+	const int active = brickNeighbourhood(occupied, bx, by, bz);
+	retired[brick] = bricks[brick] && !active;
+	bricks[brick] = active;
+}
+
+__kernel void brickHalo(__global const uchar* bricks, __global uchar* pressure_bricks, __global uchar* retired)
+{
+	// the pressure is solved on the active bricks and their 26 neighbours: the inactive cells (divergence 0) around
+	// the active ones carry the pressure, which is only held at 0 one brick away from them.
+	// Bit 1 of the retired flags: the bricks leaving the pressure solve, their pressure is cleared by brickClear
+	const int bx = get_global_id(0);
+	const int by = get_global_id(1);
+	const int bz = get_global_id(2);
+	const int brick = bx + (by + bz*BRICKS_Y)*BRICKS_X;
+	const int halo = brickNeighbourhood(bricks, bx, by, bz);
+	retired[brick] |= (pressure_bricks[brick] && !halo) << 1;
+	pressure_bricks[brick] = halo;
+}
+
+__kernel void brickClear(__global FIELD* density, __global FIELD* density2, __global FIELD* velocity,
+		__global FIELD* velocity2, __global FIELD* divergence, __global FIELD* pressure, __global const uchar* retired,
+		__global const int* retired_list)
+{
+	// launched over the cells of the listed retired bricks: the remaining values of a brick leaving the active set
+	// (below the threshold, bit 0) are set to 0, as well as the pressure of a brick leaving the pressure solve (bit 1)
+	const int3 pos = listedCell(retired_list);
+	if (OUTSIDE_GRID(pos)) {
+		return;
+	}
+	const uchar flags = retired[BRICK_INDEX(pos.x, pos.y, pos.z)];
+	const int index = GRID_INDEX(pos);
+	if (flags & 1) {
+		STORE(density, index, 0.0f);
+		STORE(density2, index, 0.0f);
+		STORE(divergence, index, 0.0f);
+		VEL_STORE(velocity, index, (float3)(0.0f, 0.0f, 0.0f));
+		VEL_STORE(velocity2, index, (float3)(0.0f, 0.0f, 0.0f));
+	}
+	if (flags & 2) {
+		STORE(pressure, index, 0.0f);
+	}
+}
+
+__kernel void resetBricks(__global FIELD* field, __global const int* brick_list)
+{
+	// resetBuffer over the cells of the listed bricks, their boundary cells included
+	const int3 pos = listedCell(brick_list);
+	if (OUTSIDE_GRID(pos)) {
+		return;
+	}
+	STORE(field, GRID_INDEX(pos), 0.0f);
+}
+
+__kernel void brickActivate(__global uchar* bricks)
+{
+	// launched on the box of bricks touched by a source
+	bricks[get_global_id(0) + (get_global_id(1) + get_global_id(2)*BRICKS_Y)*BRICKS_X] = 1;
+}
+
+__kernel void brickList(__global const uchar* bricks, __global int* brick_list)
+{
+	// one work item per brick: the active ones are appended after brick_list[0], their count (0 before the launch)
+	const int brick = get_global_id(0);
+	if (bricks[brick]) {
+		brick_list[1 + atomic_inc(brick_list)] = brick;
+	}
 }
+#endif
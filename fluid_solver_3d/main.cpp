@@ -1,21 +1,125 @@
+#include <cstring>
 #include <iostream>
+#include <memory>
+#include <mutex>
+#include <string>
 #include <SFML/Graphics.hpp>
 
 #include "OpenCLFactory.hpp"
 #include "Fluid3D.h"
+#include "Fluid3DCPU.h"
+#include "Fluid3DCluster.h"
+#include "Fluid3DOutOfCore.h"
+#include "InputTrace.hpp"
+#include "SimulationThread.hpp"
 #include "main.h"
 
 const bool FULLSCREEN = false;
 
 using namespace std;
 
-/** Entry point of the application*/
-int main() {
-	
-	auto device_context = OpenCLFactory::createContext();
-	cl::Device & device = device_context.first;
-	cl::Context & context = device_context.second;
-	Fluid3D fluid(context, device);
+/** Entry point of the application
+* --cpu runs the native engine instead of OpenCL
+* --cluster splits the grid between every OpenCL device (and CPU sub-devices, see config.hpp)
+* --out-of-core keeps the grid in host memory and streams it through the device in slabs (see config.hpp)
+* --profile FILE writes the device time of every kernel in FILE (.csv or .json) at exit
+* --state FILE resumes the simulation saved in FILE (S saves the simulation in FILE, L reloads it)
+* --record FILE writes every input in the trace FILE, --replay FILE runs the inputs of a trace
+* --tune times the work-group sizes of the kernels at startup and writes them in the tuning file of the device
+* --advection semi|maccormack|bfecc selects the advection scheme of the OpenCL solver (default semi)
+* V switches the image between the slice z = 1 and the volume ray-marched on the device (OpenCL solver),
+* whose camera orbits with the arrows and zooms with +/- (keypad) or PageUp/PageDown
+* The solver runs on its own thread (see SimulationThread.hpp), this thread only handles the window */
+int main(int argc, char** argv) {
+	Backend3D backend = Backend3D::OpenCL;
+	string profile_file;
+	string state_file = "fluid.state";
+	bool resume = false;
+	string record_file;
+	string replay_file;
+	bool tune = false;
+	AdvectionScheme advection = AdvectionScheme::SemiLagrangian;
+	for (int i = 1; i < argc; ++i) {
+		if (string(argv[i]) == "--cpu") {
+			backend = Backend3D::CPU;
+		} else if (string(argv[i]) == "--cluster") {
+			backend = Backend3D::Cluster;
+		} else if (string(argv[i]) == "--out-of-core") {
+			backend = Backend3D::OutOfCore;
+		} else if (string(argv[i]) == "--profile" && i + 1 < argc) {
+			profile_file = argv[++i];
+		} else if (string(argv[i]) == "--state" && i + 1 < argc) {
+			state_file = argv[++i];
+			resume = true;
+		} else if (string(argv[i]) == "--record" && i + 1 < argc) {
+			record_file = argv[++i];
+		} else if (string(argv[i]) == "--replay" && i + 1 < argc) {
+			replay_file = argv[++i];
+		} else if (string(argv[i]) == "--tune") {
+			tune = true;
+		} else if (string(argv[i]) == "--advection" && i + 1 < argc) {
+			if (!parseAdvectionScheme(argv[++i], advection)) {
+				cout << "Unknown advection scheme, expected semi, maccormack or bfecc" << endl;
+				return 1;
+			}
+		}
+	}
+	// a replay runs with the time step of the recording, the live input is ignored
+	InputTrace::Player player;
+	float simulation_dt = SIMULATION_DT;
+	if (!replay_file.empty()) {
+		if (!player.open(replay_file)) {
+			return 1;
+		}
+		const InputTrace::Header & header = player.header();
+		if (header.width != DEFAULT_WIDTH || header.height != DEFAULT_HEIGHT || header.depth != DEFAULT_DEPTH) {
+			cout << "The trace was recorded on a " << header.width << "x" << header.height << "x" << header.depth
+				<< " grid, see config.hpp" << endl;
+			return 1;
+		}
+		simulation_dt = header.dt;
+	}
+	InputTrace::Recorder recorder;
+	if (!record_file.empty() && !recorder.open(record_file, DEFAULT_WIDTH, DEFAULT_HEIGHT, DEFAULT_DEPTH, simulation_dt)) {
+		return 1;
+	}
+
+	unique_ptr<Fluid3DBase> fluid_ptr;
+	KernelProfiler* profiler = nullptr;// OpenCL engines only
+	Fluid3D* opencl_fluid = nullptr;// tuning and volume preview
+	if (backend == Backend3D::CPU) {
+		fluid_ptr.reset(new Fluid3DCPU(DEFAULT_WIDTH, DEFAULT_HEIGHT, DEFAULT_DEPTH, CPU_THREADS));
+		if (!profile_file.empty()) {
+			cout << "Warning: --profile needs the OpenCL solver" << endl;
+		}
+	} else if (backend == Backend3D::OpenCL) {
+		auto device_context = OpenCLFactory::createContext();
+		cl::Device & device = device_context.first;
+		cl::Context & context = device_context.second;
+		Fluid3D* opencl_solver = new Fluid3D(context, device);
+		opencl_solver->setAdvectionScheme(advection);
+		profiler = &opencl_solver->getProfiler();
+		opencl_fluid = opencl_solver;
+		fluid_ptr.reset(opencl_solver);
+	} else if (backend == Backend3D::OutOfCore) {
+		auto device_context = OpenCLFactory::createContext();
+		Fluid3DOutOfCore* streamed = new Fluid3DOutOfCore(device_context.second, device_context.first,
+			DEFAULT_WIDTH, DEFAULT_HEIGHT, DEFAULT_DEPTH, OOC_SLAB_LAYERS);
+		profiler = &streamed->getProfiler();
+		fluid_ptr.reset(streamed);
+	} else {
+		auto devices_context = OpenCLFactory::createClusterContext(CLUSTER_CPU_PARTITIONS);
+		Fluid3DCluster* cluster = new Fluid3DCluster(devices_context.second, devices_context.first, DEFAULT_WIDTH, DEFAULT_HEIGHT, DEFAULT_DEPTH);
+		profiler = &cluster->getProfiler();
+		fluid_ptr.reset(cluster);
+	}
+	if (profiler) {
+		profiler->setEnabled(!profile_file.empty());
+	}
+	if (!opencl_fluid && advection != AdvectionScheme::SemiLagrangian) {
+		cout << "Warning: --advection needs the OpenCL solver" << endl;
+	}
+	Fluid3DBase & fluid = *fluid_ptr;
 	
 	
 	// constants:
@@ -23,6 +127,8 @@ int main() {
 	constexpr float velocity_add = 0.01f;
 	constexpr float mouse_wheel_increment = 1.0f;
 	constexpr float mouse_pressure_increment = 10.0f;
+	constexpr float orbit_speed = 1.5f;// radians per second
+	constexpr float zoom_speed = 1.0f;// distances per second
 
 	// sfml init
 	constexpr auto window_style = (!FULLSCREEN) ? sf::Style::Default : sf::Style::Fullscreen;
@@ -38,9 +144,84 @@ int main() {
 	sprite.setPosition(0, 0);
 
 	// fluid simulation solver init
-	fluid.initialization();
-	cl_uint8* pixelData = (cl_uint8*)image.getPixelsPtr();
-	fluid.setDataImage(pixelData);
+	if (!fluid.initialization()) {
+		return 1;
+	}
+	if (tune) {
+		if (opencl_fluid) {
+			opencl_fluid->tuneWorkGroups(WORK_GROUP_TUNING_STEPS);
+		} else {
+			cout << "Warning: --tune needs the OpenCL solver" << endl;
+		}
+	}
+	if (resume) {
+		fluid.loadState(state_file);
+	}
+
+	// from here the solver is only used by the simulation thread
+	unsigned long long steps = 0;// updates run by the simulation thread
+	auto apply = [&](const InputCommand & command) {
+		recorder.record(steps, command);
+		switch (command.type) {
+		case InputCommand::Pressure:
+			fluid.addPressure(command.x, command.y, command.radius, command.intensity);
+			break;
+		case InputCommand::Velocity:
+			fluid.addVelocity(command.x, command.y, (int)command.dx, (int)command.dy, command.force, command.radius);
+			break;
+		case InputCommand::Reset:
+			fluid.reset();
+			break;
+		case InputCommand::SaveState:
+			fluid.saveState(state_file);
+			break;
+		case InputCommand::LoadState:
+			fluid.loadState(state_file);
+			break;
+		case InputCommand::Record:
+			fluid.save();
+			break;
+		}
+	};
+	SimulationThread::Callbacks callbacks;
+	callbacks.apply = [&](const InputCommand & command) {
+		if (replay_file.empty()) {
+			apply(command);
+		}
+	};
+	callbacks.step = [&](float dt) {
+		if (!replay_file.empty()) {
+			if (steps == player.header().nb_steps) {
+				cout << "Replay finished (" << steps << " steps)" << endl;
+			}
+			player.apply(steps, apply);
+		}
+		fluid.update(dt);
+		++steps;
+	};
+	// view of the window, read by the simulation thread when it draws
+	mutex preview_mutex;
+	PreviewMode preview_mode = PreviewMode::Slice;
+	PreviewCamera camera;
+	callbacks.draw = [&](uint8_t* pixels) {
+		if (opencl_fluid) {
+			lock_guard<mutex> lock(preview_mutex);
+			opencl_fluid->setPreview(preview_mode, camera);
+		}
+		// the frame is drawn and transferred in the background, the newest completed one is published:
+		// the device queue is not drained (the readback only waits when all its slots are in flight)
+		const uint8_t* frame = fluid.latestImage();
+		if (profiler) {
+			profiler->endFrame();
+		}
+		if (!frame) {
+			return false;
+		}
+		memcpy(pixels, frame, (size_t)fluid.getWidth()*fluid.getHeight() * 4);
+		return true;
+	};
+	SimulationThread simulation((size_t)fluid.getWidth()*fluid.getHeight() * 4, simulation_dt, SIMULATION_MAX_SUBSTEPS, callbacks);
+	simulation.start();
 
 	// other variables
 	sf::Clock deltaClock;
@@ -63,10 +244,24 @@ int main() {
 					window.close();
 				}
 				if (event.key.code == sf::Keyboard::Space) {
-					fluid.reset();
+					simulation.post({ InputCommand::Reset });
+				}
+				if (event.key.code == sf::Keyboard::S) {
+					simulation.post({ InputCommand::SaveState });
+				}
+				if (event.key.code == sf::Keyboard::L) {
+					simulation.post({ InputCommand::LoadState });
 				}
 				if (event.key.code == sf::Keyboard::D) {
-					fluid.save();
+					simulation.post({ InputCommand::Record });
+				}
+				if (event.key.code == sf::Keyboard::V) {
+					if (opencl_fluid) {
+						lock_guard<mutex> lock(preview_mutex);
+						preview_mode = (preview_mode == PreviewMode::Slice) ? PreviewMode::Volume : PreviewMode::Slice;
+					} else {
+						cout << "The volume preview needs the OpenCL solver" << endl;
+					}
 				}
 			}
 			if (event.type == sf::Event::MouseWheelMoved) {
@@ -76,23 +271,52 @@ int main() {
 				sf::Vector2f pos = window.mapPixelToCoords(sf::Mouse::getPosition(window));
 				sf::Vector2f delta = pos - pos0;
 				if(delta.x < 100.f && delta.y < 100.f) {
-					fluid.addVelocity((int)pos.x, (int)pos.y, (int)delta.x, (int)delta.y, velocity_add, (int)radius);
+					InputCommand command{ InputCommand::Velocity };
+					command.x = (int)pos.x;
+					command.y = (int)pos.y;
+					command.radius = (int)radius;
+					command.dx = delta.x;
+					command.dy = delta.y;
+					command.force = velocity_add;
+					simulation.post(command);
 				}
 				pos0 = window.mapPixelToCoords(sf::Mouse::getPosition(window));
 			}
 		}
 		if (sf::Mouse::isButtonPressed(sf::Mouse::Left)) {
 			sf::Vector2f pos = window.mapPixelToCoords(sf::Mouse::getPosition(window));
-			fluid.addPressure((int)pos.x, (int)pos.y, (int)radius, mouse_pressure_increment*dt);
+			InputCommand command{ InputCommand::Pressure };
+			command.x = (int)pos.x;
+			command.y = (int)pos.y;
+			command.radius = (int)radius;
+			command.intensity = mouse_pressure_increment*dt;
+			simulation.post(command);
 		}
-		// update the simulation
-		fluid.update(dt);
-		fluid.updateImage();
+		if (preview_mode == PreviewMode::Volume) {
+			lock_guard<mutex> lock(preview_mutex);
+			const float orbit = orbit_speed*dt;
+			camera.yaw += orbit*(sf::Keyboard::isKeyPressed(sf::Keyboard::Right) - sf::Keyboard::isKeyPressed(sf::Keyboard::Left));
+			camera.pitch += orbit*(sf::Keyboard::isKeyPressed(sf::Keyboard::Down) - sf::Keyboard::isKeyPressed(sf::Keyboard::Up));
+			camera.pitch = max(-1.5f, min(1.5f, camera.pitch));
+			const bool closer = sf::Keyboard::isKeyPressed(sf::Keyboard::Add) || sf::Keyboard::isKeyPressed(sf::Keyboard::PageUp);
+			const bool further = sf::Keyboard::isKeyPressed(sf::Keyboard::Subtract) || sf::Keyboard::isKeyPressed(sf::Keyboard::PageDown);
+			camera.distance = max(0.2f, camera.distance + zoom_speed*dt*(further - closer));
+		}
+		// newest frame published by the simulation thread, if any since the last display
+		const uint8_t* pixels = simulation.latestFrame();
 		// display 
-		texture.update(image);
+		if (pixels) {
+			texture.update(pixels);
+		}
 		window.clear(sf::Color::Black);
 		window.draw(sprite);
 		window.display();
 	}
+	simulation.stop();
+	recorder.close(steps);
+	if (profiler && !profile_file.empty()) {
+		profiler->print(cout);
+		profiler->write(profile_file);
+	}
 	return 0;
 }
\ No newline at end of file